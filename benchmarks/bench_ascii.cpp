@@ -0,0 +1,134 @@
+/* Compare the EOL conversion used by ASCII transfers with the
+ * byte-by-byte loop it replaced.
+ *
+ * Usage: bench_ascii [size] [average-line-length] [rounds]
+ *
+ * Both directions are measured: local text to CRLF (RETR), and
+ * CRLF to local text (STOR).
+ */
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <wfde/wfde.h>
+#include "WfdeEolConverter.h"
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+namespace {
+
+using clock_t_ = chrono::steady_clock;
+
+// The loop from WfdeAsciiFile before the EolConverter
+size_t LegacyConvert(const vector<char>& src, string& dst, const string& eol)
+{
+    dst.clear();
+    for(const auto ch : src) {
+        if (ch == '\r')
+            continue;
+        if (ch == '\n') {
+            dst += eol;
+        } else {
+            dst += ch;
+        }
+    }
+    return dst.size();
+}
+
+vector<char> MakeText(size_t size, size_t lineLength, bool crlf)
+{
+    mt19937 rnd(42);
+    uniform_int_distribution<int> chars(' ', '~');
+    uniform_int_distribution<size_t> lines(1, lineLength * 2);
+
+    vector<char> text;
+    text.reserve(size);
+    while(text.size() < size) {
+        for(auto len = lines(rnd); len && (text.size() < size); --len) {
+            text.push_back(static_cast<char>(chars(rnd)));
+        }
+        if (crlf) {
+            text.push_back('\r');
+        }
+        text.push_back('\n');
+    }
+    return text;
+}
+
+template <typename FnT>
+double Measure(size_t bytes, unsigned rounds, FnT fn)
+{
+    const auto start = clock_t_::now();
+    for(unsigned i = 0; i < rounds; ++i) {
+        fn();
+    }
+    const auto elapsed = chrono::duration<double>(clock_t_::now() - start).count();
+    return (static_cast<double>(bytes) * rounds) / (1024 * 1024) / elapsed;
+}
+
+void Run(const char *name, const vector<char>& text, const string& eol,
+         unsigned rounds)
+{
+    string legacy_out;
+    size_t legacy_len = 0;
+    const auto legacy = Measure(text.size(), rounds, [&] {
+        legacy_len = LegacyConvert(text, legacy_out, eol);
+    });
+
+    cout << left << setw(12) << name << setw(10) << "legacy"
+        << right << fixed << setprecision(1) << setw(12) << legacy
+        << " MB/s" << endl;
+
+    for(const auto impl : {EolConverter::Implementation::SCALAR,
+                           EolConverter::Implementation::SSE2,
+                           EolConverter::Implementation::AVX2}) {
+        if (!EolConverter::IsSupported(impl)) {
+            continue;
+        }
+
+        const EolConverter converter(eol, impl);
+        vector<char> out(text.size() * converter.GetMaxExpansion());
+        size_t len = 0;
+        const auto speed = Measure(text.size(), rounds, [&] {
+            len = converter.Convert(text.data(), text.size(), out.data());
+        });
+
+        const bool ok = (len == legacy_len)
+            && equal(legacy_out.begin(), legacy_out.end(), out.begin());
+
+        cout << left << setw(12) << name << setw(10)
+            << EolConverter::GetName(impl)
+            << right << fixed << setprecision(1) << setw(12) << speed
+            << " MB/s  x" << setprecision(1) << (speed / legacy)
+            << (ok ? "" : "  OUTPUT DIFFERS!") << endl;
+    }
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    const auto size = argc > 1
+        ? TransferOptions::ParseSize(argv[1]) : (1024ULL * 1024 * 64);
+    const auto line_length = argc > 2 ? stoul(argv[2]) : 80;
+    const auto rounds = argc > 3 ? static_cast<unsigned>(stoul(argv[3])) : 5;
+
+    cout << "Converting " << size << " bytes with average line length "
+        << line_length << ", " << rounds << " rounds. Best implementation: "
+        << EolConverter::GetName(EolConverter::GetBestImplementation())
+        << endl;
+
+    Run("to CRLF", MakeText(static_cast<size_t>(size), line_length, false),
+        "\r\n", rounds);
+    Run("from CRLF", MakeText(static_cast<size_t>(size), line_length, true),
+        "\n", rounds);
+
+    return 0;
+}
@@ -0,0 +1,140 @@
+/* Compare the File backends on the same set of files.
+ *
+ * Usage: bench_file_backends [directory] [number-of-files] [file-size]
+ *
+ * The files are written trough each backend, and then read back. Before
+ * each read pass we ask the kernel to drop the files from the page-cache,
+ * so the reads are not just memory copies.
+ */
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <vector>
+
+#ifndef WIN32
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
+#include <wfde/wfde.h>
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+
+namespace {
+
+using clock_t_ = chrono::steady_clock;
+
+void DropFromCache(const boost::filesystem::path& path)
+{
+#ifdef __linux__
+    const auto fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+#endif
+}
+
+double WriteFiles(const vector<boost::filesystem::path>& files,
+                  std::uint64_t fileSize, const TransferOptions& opts)
+{
+    const auto start = clock_t_::now();
+
+    for(const auto& path : files) {
+        auto file = CreateDiskFile(path, File::FileOperation::WRITE, opts);
+        for(std::uint64_t written = 0; written < fileSize;) {
+            auto buffer = file->Write();
+            auto len = min<std::uint64_t>(boost::asio::buffer_size(buffer),
+                                          fileSize - written);
+            memset(boost::asio::buffer_cast<char *>(buffer),
+                   static_cast<int>(written & 0xff), static_cast<size_t>(len));
+            file->SetBytesWritten(static_cast<size_t>(len));
+            written += len;
+        }
+        file->Close();
+    }
+
+    return chrono::duration<double>(clock_t_::now() - start).count();
+}
+
+double ReadFiles(const vector<boost::filesystem::path>& files,
+                 const TransferOptions& opts, std::uint64_t& checksum)
+{
+    for(const auto& path : files) {
+        DropFromCache(path);
+    }
+
+    const auto start = clock_t_::now();
+
+    for(const auto& path : files) {
+        auto file = CreateDiskFile(path, File::FileOperation::READ, opts);
+        while(!file->IsEof()) {
+            auto buffer = file->Read(0);
+            const auto len = boost::asio::buffer_size(buffer);
+            if (len) {
+                // Touch the data, like a socket write would
+                checksum += boost::asio::buffer_cast<const unsigned char *>(buffer)[len - 1];
+            }
+        }
+        file->Close();
+    }
+
+    return chrono::duration<double>(clock_t_::now() - start).count();
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    const boost::filesystem::path dir = argc > 1 ? argv[1] : "bench-files";
+    const auto num_files = argc > 2 ? stoul(argv[2]) : 8;
+    const auto file_size = argc > 3
+        ? TransferOptions::ParseSize(argv[3]) : (1024ULL * 1024 * 64);
+
+    boost::filesystem::create_directories(dir);
+
+    vector<boost::filesystem::path> files;
+    for(size_t i = 0; i < num_files; ++i) {
+        files.push_back(dir / ("bench-" + to_string(i) + ".dat"));
+    }
+
+    const double mb = static_cast<double>(file_size * num_files) / (1024 * 1024);
+
+    cout << "Files: " << num_files << " x " << file_size << " bytes in "
+        << dir << endl;
+    cout << left << setw(10) << "backend"
+        << right << setw(14) << "write MB/s"
+        << setw(14) << "read MB/s" << endl;
+
+    for(const auto backend : {TransferOptions::Backend::MMAP,
+                              TransferOptions::Backend::PREAD,
+                              TransferOptions::Backend::DIRECT}) {
+        TransferOptions opts;
+        opts.backend = backend;
+
+        try {
+            std::uint64_t checksum = 0;
+            const auto wtime = WriteFiles(files, file_size, opts);
+            const auto rtime = ReadFiles(files, opts, checksum);
+
+            cout << left << setw(10) << backend
+                << right << fixed << setprecision(1)
+                << setw(14) << (mb / wtime)
+                << setw(14) << (mb / rtime)
+                << "  (" << checksum << ')' << endl;
+        } catch(const std::exception& ex) {
+            cout << left << setw(10) << backend << " failed: " << ex.what() << endl;
+        }
+    }
+
+    for(const auto& path : files) {
+        boost::filesystem::remove(path);
+    }
+
+    return 0;
+}
@@ -0,0 +1,161 @@
+/* Measure how many control-channel commands one core can dispatch,
+ * with the shared command table, and with the per-session map,
+ * locale and regex lookup it replaced.
+ *
+ * Usage: bench_ftp_dispatch [commands]
+ *
+ * Only the dispatch is measured: finding the command, checking its
+ * traits and validating the parameters. The commands are not executed.
+ */
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <locale>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <wfde/wfde.h>
+#include <wfde/ftp_protocol.h>
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+
+namespace {
+
+using clock_t_ = chrono::steady_clock;
+
+// What scripted clients send all day
+const vector<string> requests = {
+    "NOOP",
+    "SIZE /pub/releases/archive-2024-01-17.tar.gz",
+    "MDTM /pub/releases/archive-2024-01-17.tar.gz",
+    "CWD /pub/releases",
+    "TYPE I",
+    "PWD",
+    "REST 1048576",
+    "mdtm readme.txt",
+    "XSHA256 /pub/releases/archive-2024-01-17.tar.gz"
+};
+
+// The checks the session does before calling the command
+bool IsAllowed(const FtpCmd& cmd)
+{
+    return !cmd.MustNotBeLoggedIn() && !cmd.MustBeInTransfer()
+        && !cmd.MustHaveEncryption();
+}
+
+/*! Like WfdeFtpSession::GetFtpCommand() and OnCommand() */
+bool Dispatch(const FtpCmdTable& table, const string& request)
+{
+    size_t len = 0;
+    for(; len < request.size(); ++len) {
+        const auto ch = request[len] | 0x20;
+        const bool is_digit = (request[len] >= '0') && (request[len] <= '9');
+        if (!((ch >= 'a') && (ch <= 'z')) && !(len && is_digit)) {
+            break;
+        }
+    }
+
+    const boost::string_ref req(request);
+    auto cmd = table.Find(req.substr(0, len));
+    if (!cmd || !IsAllowed(*cmd)) {
+        return false;
+    }
+
+    auto param = req.substr(len);
+    while(!param.empty() && (param.front() == ' ')) {
+        param.remove_prefix(1);
+    }
+
+    string buffer;
+    FtpCmd::match_t match;
+    return cmd->MatchParam(param, buffer, match);
+}
+
+/*! The lookup before the command table */
+bool LegacyDispatch(const unordered_map<string, FtpCmd&>& commands,
+                    const string& request)
+{
+    locale loc;
+    string cmd_name;
+    for(auto ch = request.begin()
+        ; (ch != request.end())
+            && (isalpha(*ch, loc) || (!cmd_name.empty() && isdigit(*ch, loc)))
+        ; ++ch) {
+        cmd_name += toupper(*ch, loc);
+    }
+
+    auto it = commands.find(cmd_name);
+    if (it == commands.end()) {
+        return false;
+    }
+
+    auto& cmd = it->second;
+    if (!IsAllowed(cmd)) {
+        return false;
+    }
+
+    string curr_cmd_name = cmd_name;
+    boost::string_ref param(request);
+    param.remove_prefix(curr_cmd_name.size());
+    while(!param.empty() && (param.front() == ' ')) {
+        param.remove_prefix(1);
+    }
+
+    const string buffer(param.data(), param.size());
+    FtpCmd::match_t match;
+    return !cmd.CanHaveParams()
+        || boost::regex_match(buffer, match, cmd.GetRegex());
+}
+
+template <typename FnT>
+double Measure(size_t commands, FnT fn)
+{
+    size_t ok = 0;
+    const auto start = clock_t_::now();
+    for(size_t i = 0; i < commands; ++i) {
+        ok += fn(requests[i % requests.size()]) ? 1 : 0;
+    }
+    const auto elapsed = chrono::duration<double>(clock_t_::now() - start).count();
+
+    if (ok != commands) {
+        cerr << (commands - ok) << " commands were rejected!" << endl;
+    }
+    return static_cast<double>(commands) / elapsed;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    const size_t commands = argc > 1 ? stoul(argv[1]) : 2000000;
+
+    const auto& table = GetDefaultFtpCommands();
+
+    const auto legacy = Measure(commands, [&](const string& request) {
+        // Each session used to get its own copy of the map
+        static const unordered_map<string, FtpCmd&> map = [&] {
+            unordered_map<string, FtpCmd&> m;
+            for(auto cmd : table.GetCommands()) {
+                m.emplace(cmd->GetName(), *cmd);
+            }
+            return m;
+        }();
+        return LegacyDispatch(map, request);
+    });
+
+    const auto current = Measure(commands, [&](const string& request) {
+        return Dispatch(table, request);
+    });
+
+    cout << "Dispatching " << commands << " commands on one core" << endl
+        << left << setw(10) << "legacy" << right << fixed << setprecision(0)
+        << setw(14) << legacy << " commands/s" << endl
+        << left << setw(10) << "table" << right << setw(14) << current
+        << " commands/s  x" << setprecision(1) << (current / legacy) << endl;
+
+    return 0;
+}
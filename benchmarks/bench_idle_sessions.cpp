@@ -0,0 +1,135 @@
+/* Measure the memory each idle session costs in coroutine stacks.
+ *
+ * Usage: bench_idle_sessions [sessions] [stack-size] [stack-in-use]
+ *
+ * Each session is a coroutine that uses some of it's stack, like the
+ * call chain down to the socket read in ProcessCommands(), and then
+ * waits. We compare the stacks boost::asio::spawn() allocates by
+ * default with the WfdeStackPool, at the default and the given size.
+ *
+ * Each run is done in a child process, so they start out equal. The
+ * other memory a session uses, like the socket and the input buffer,
+ * is not included.
+ */
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include <alloca.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/context/fiber.hpp>
+#include <boost/context/fixedsize_stack.hpp>
+
+#include <wfde/wfde.h>
+#include "WfdeStackPool.h"
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+namespace {
+
+using clock_t_ = chrono::steady_clock;
+using fiber_t = boost::context::fiber;
+
+size_t GetRss()
+{
+    size_t pages = 0, resident = 0;
+    ifstream("/proc/self/statm") >> pages >> resident;
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+template <typename StackAllocT>
+void Run(const string& name, size_t sessions, size_t inUse,
+         function<StackAllocT ()> allocator)
+{
+    const auto start = clock_t_::now();
+
+    vector<fiber_t> fibers;
+    fibers.reserve(sessions);
+    const auto base_rss = GetRss();
+
+    try {
+        for(size_t i = 0; i < sessions; ++i) {
+            fibers.emplace_back(std::allocator_arg, allocator(),
+                                [inUse](fiber_t&& caller) {
+                auto frame = static_cast<volatile char *>(alloca(inUse));
+                for(size_t offset = 0; offset < inUse; offset += 256) {
+                    frame[offset] = 1;
+                }
+                caller = std::move(caller).resume(); // Idle
+                return std::move(caller);
+            });
+            fibers.back() = std::move(fibers.back()).resume();
+        }
+    } catch(const std::exception& ex) {
+        cout << name << ": Failed after " << fibers.size()
+            << " sessions: " << ex.what() << endl;
+    }
+
+    const auto elapsed = chrono::duration<double>(clock_t_::now() - start).count();
+    const auto count = max<size_t>(fibers.size(), 1);
+
+    cout << left << setw(16) << name << right << setw(8) << fibers.size()
+        << " sessions " << fixed << setprecision(1)
+        << setw(8) << ((GetRss() - base_rss) / 1024.0 / count) << " KB RSS/session "
+        << setprecision(0) << setw(8) << (count / elapsed) << " sessions/s"
+        << endl;
+
+    for(auto& fiber : fibers) {
+        fiber = std::move(fiber).resume();
+    }
+}
+
+void InChild(function<void ()> fn)
+{
+    const auto pid = fork();
+    if (pid == 0) {
+        fn();
+        _exit(0);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    const size_t sessions = argc > 1 ? stoul(argv[1]) : 100000;
+    const size_t stack_size = argc > 2
+        ? TransferOptions::ParseSize(argv[2]) : 1024 * 32;
+    const size_t in_use = argc > 3
+        ? TransferOptions::ParseSize(argv[3]) : 1024 * 6;
+
+    cout << sessions << " idle sessions, each using " << in_use
+        << " bytes of stack" << endl;
+
+    InChild([&] {
+        Run<boost::context::fixedsize_stack>("spawn default", sessions,
+            in_use, [] { return boost::context::fixedsize_stack{}; });
+    });
+
+    InChild([&] {
+        auto& pool = WfdeStackPool::Get(TransferOptions{}.control_stack_size);
+        Run<WfdeStackPool::Allocator>("pool default", sessions, in_use,
+            [&pool] { return pool.GetAllocator(); });
+    });
+
+    InChild([&] {
+        auto& pool = WfdeStackPool::Get(stack_size);
+        Run<WfdeStackPool::Allocator>("pool "s + to_string(pool.GetStackSize() / 1024) + "K",
+            sessions, in_use, [&pool] { return pool.GetAllocator(); });
+    });
+
+    return 0;
+}
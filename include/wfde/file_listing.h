@@ -35,8 +35,9 @@ namespace file_listing {
 template <typename formatT>
 class Formatter {
 public:
-    Formatter(char *buffer, const char *end, const FtpState& state)
-    : buffer_{buffer}, cur_{buffer}, end_{end}, format_{state}
+    Formatter(char *buffer, const char *end, Session& session,
+              const FtpState& state)
+    : buffer_{buffer}, cur_{buffer}, end_{end}, format_{session, state}
     {}
 
     // Print the entry or return -1 if there is not enough buffer-space.
@@ -78,8 +79,10 @@ public:
     DirLister(const Path& path, Session& session, const FtpState& state)
     : current_path_{&path}, session_{session}
     , fli_(path)
-    , formatter_(buffer_.data(), buffer_.data() + buffer_.size(), state)
+    , formatter_(buffer_.data(), buffer_.data() + buffer_.size(), session,
+                 state)
     , show_hidden_{state.list_hidden_files && path.CanSeeHiddenFiles()}
+    , compressed_cache_{session.GetHost().GetCompressedCache()}
     {
         decltype(session_.GetVpaths("")) vpaths;
 
@@ -130,7 +133,8 @@ public:
               bool /*Just to get a different signature */)
     : current_path_{&path}, session_{session}
     , fli_{path, path.GetVirtualPath()}
-    , formatter_(buffer_.data(), buffer_.data() + buffer_.size(), state)
+    , formatter_(buffer_.data(), buffer_.data() + buffer_.size(), session,
+                 state)
     {
     }
 
@@ -163,6 +167,12 @@ public:
             }
 
             bytes_used_ += bytes;
+
+#ifndef WIN32
+            if (compressed_cache_ && !fli_.IsVirtual() && !fli_.IsDirectory()) {
+                AddCompressedVariant();
+            }
+#endif
         }
 
         LOG_TRACE2_FN << "End of listing. This batch was "
@@ -188,6 +198,32 @@ public:
     Formatter<FormatT>& GetFormatter() { return formatter_; }
 
 private:
+#ifndef WIN32
+    // List "name.gz" after the real entries if we have a compressed copy
+    void AddCompressedVariant() {
+        const auto& orig = fli_.GetStat();
+        const auto variant = compressed_cache_->Peek(FileId::FromStat(orig));
+        if (variant.empty()) {
+            return;
+        }
+
+        const auto name = fli_.GetName().to_string()
+            + CompressedCache::GetSuffix();
+        if (boost::filesystem::exists(current_path_->GetPhysPath() / name)) {
+            return; // A real file wins
+        }
+
+        struct stat st{};
+        if (stat(variant.c_str(), &st)) {
+            return; // Evicted
+        }
+
+        st.st_mode = orig.st_mode;
+        st.st_mtim = orig.st_mtim;
+        fli_.AddVirtualPath(name, st);
+    }
+#endif
+
     const Path *current_path_ = nullptr;
     Session& session_;
     size_t bytes_used_ = 0; // Bytes used in the current batch
@@ -196,6 +232,7 @@ private:
     std::array<char, 1024 * 16> buffer_;
     Formatter<FormatT> formatter_;
     const bool show_hidden_ = false;
+    CompressedCache *compressed_cache_ = nullptr;
 };
 
 
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <iosfwd>
+#include <ostream>
+#include <streambuf>
+#include <vector>
+#include <cstdint>
 #include <unordered_map>
 #include <future>
 
@@ -55,36 +59,86 @@ enum class FtpReplyCodes
 
 const std::pair<int, std::string>& Resolve(const FtpReplyCodes& code);
 
-/*! Simple class for FTP replies */
+/*! Append a reply to a buffer, as it is sent to the client
+ *
+ * "NNN message\r\n", or "NNN-message\r\nNNN END\r\n" for multi-line
+ * replies. If the message is empty, the standard text for the code is
+ * used. Nothing is allocated if the buffer has the capacity.
+ */
+void FormatReply(std::string& buffer, FtpReplyCodes code,
+                 const boost::string_ref& message, bool multiLine);
+
+/*! Stream buffer that appends to a std::string
+ *
+ * Unlike std::stringbuf, it writes to a string we own, so the
+ * string's capacity is reused from one reply to the next.
+ */
+class FtpReplyStreamBuf : public std::streambuf
+{
+public:
+    explicit FtpReplyStreamBuf(std::string& buffer) : buffer_(buffer) {}
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            buffer_.push_back(traits_type::to_char_type(ch));
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char_type *s, std::streamsize n) override {
+        buffer_.append(s, static_cast<std::size_t>(n));
+        return n;
+    }
+
+private:
+    std::string& buffer_;
+};
+
+/*! Simple class for FTP replies
+ *
+ * The message is formatted directly into a buffer, normally owned
+ * by the session, so that replies don't allocate memory.
+ */
 class FtpReply
 {
 public:
     typedef std::shared_ptr<FtpReply> ptr_t;
 
-    FtpReply() = default;
+    FtpReply() : FtpReply(own_buffer_) {}
+
+    /*! Format the message into buffer. The buffer is cleared. */
+    explicit FtpReply(std::string& buffer)
+    : buffer_(buffer), streambuf_(buffer), message_(&streambuf_)
+    {
+        buffer_.clear();
+    }
 
-    std::ostringstream& Reply(FtpReplyCodes code, const bool endSession = false)
+    FtpReply(const FtpReply&) = delete;
+    FtpReply& operator = (const FtpReply&) = delete;
+
+    std::ostream& Reply(FtpReplyCodes code, const bool endSession = false)
     {
-        WAR_ASSERT(!has_replied_ && message_.str().empty() && "We already have replied!");
+        WAR_ASSERT(!has_replied_ && buffer_.empty() && "We already have replied!");
         code_ = code;
         do_end_session_ = endSession;
         have_reply_ = true;
         return message_;
     }
 
-    std::ostringstream& VerboseReply(FtpReplyCodes code)
+    std::ostream& VerboseReply(FtpReplyCodes code)
     {
-        WAR_ASSERT(!has_replied_ && message_.str().empty() && "We already have replied!");
+        WAR_ASSERT(!has_replied_ && buffer_.empty() && "We already have replied!");
         code_ = code;
         have_reply_ = true;
         multi_line_ = true;
         return message_;
     }
 
-
-    std::pair<FtpReplyCodes, const std::string> GetReply() {
+    /*! The code and the message. The message refers to the buffer. */
+    std::pair<FtpReplyCodes, boost::string_ref> GetReply() {
         has_replied_ = true;
-        return std::make_pair(code_, message_.str());
+        return std::make_pair(code_, boost::string_ref(buffer_));
     }
 
     bool HasReplied() const { return has_replied_; }
@@ -96,7 +150,10 @@ public:
     bool IsMultiline() const { return multi_line_; }
 
 private:
-    std::ostringstream message_;
+    std::string own_buffer_; // Only used without a buffer from the caller
+    std::string& buffer_;
+    FtpReplyStreamBuf streambuf_;
+    std::ostream message_;
     bool has_replied_ = false;
     FtpReplyCodes code_ = FtpReplyCodes::RC_SERVICE_NOT_AVAILABLE;
     bool do_end_session_ = false;
@@ -114,6 +171,12 @@ public:
         TYPE,
         UNIQUE,
         PERM,
+        // Cached digests. Only listed for files where we know them.
+        X_CRC32,
+        X_MD5,
+        X_SHA1,
+        X_SHA256,
+        X_SHA512,
     };
 
     /*! Return a bitmap representing the Facts
@@ -130,7 +193,7 @@ public:
     }
 
     bool IsEnabled(const Facts fact) const noexcept {
-        return (fact_bits_ & (1 << static_cast<int>(fact))) == 1;
+        return (fact_bits_ & (1 << static_cast<int>(fact))) != 0;
     }
 
     void Enable(const std::string& name) {
@@ -158,6 +221,18 @@ public:
 
     void DisableAll() noexcept { fact_bits_ = 0; }
 
+    /*! Returns true if the fact is a digest, and sets algorithm */
+    static bool IsDigest(const Facts fact,
+                         HashEngine::Algorithm& algorithm) noexcept {
+        if (fact < Facts::X_CRC32) {
+            return false;
+        }
+
+        algorithm = static_cast<HashEngine::Algorithm>(
+            static_cast<int>(fact) - static_cast<int>(Facts::X_CRC32));
+        return true;
+    }
+
 private:
     uint32_t fact_bits_ = 0b0000000000010111;
     static const std::vector<std::string> fact_names_;
@@ -188,6 +263,7 @@ struct FtpState
 {
     enum class Initiation { NONE, PORT, PASV };
     enum class Type { ASCII, BIN };
+    enum class Mode { STREAM, DEFLATE };
     enum Transfer { NONE, INCOMING, OUTGOING };
 
     bool IsInTransfer() const { return transfer != Transfer::NONE; }
@@ -215,7 +291,7 @@ struct FtpState
     void ResetTransfer() {
         transfer = Transfer::NONE;
         initiation = Initiation::NONE;
-        allo = rest = 0;
+        allo = rest = rang_end = 0;
         override_as_binary_ = false;
         pasv.reset();
         list_hidden_files = false;
@@ -232,10 +308,14 @@ struct FtpState
     Transfer transfer = Transfer::NONE;
     Initiation initiation = Initiation::NONE;
     Type ttype = Type::ASCII;
+    Mode mode = Mode::STREAM;
+    int deflate_level = 6; // For MODE Z, set with OPTS MODE Z LEVEL n
+    HashEngine::Algorithm hash_algorithm = HashEngine::Algorithm::SHA256;
     std::string addr;
     std::string requested_path_;
     boost::asio::ip::tcp::endpoint port_endpoint;
-    std::uint64_t rest = 0;
+    std::uint64_t rest = 0; // Also the start of a RANG
+    std::uint64_t rang_end = 0; // One past the end of a RANG, 0 if none
     std::uint64_t allo = 0;
     bool abort_pending = false;
     std::string rnfr_;
@@ -265,14 +345,40 @@ struct FtpState
 class FtpCmd
 {
 public:
-    using ftp_commands_t = std::unordered_map<std::string, FtpCmd&>;
     using match_t = boost::smatch;
     using param_t = boost::string_ref;
+    using traits_t = unsigned;
+
+    /*! Static properties of a command, checked before OnCmd() is called */
+    enum Traits : traits_t {
+        NO_TRAITS = 0,
+        LOGGED_IN = 1 << 0, ///< MustBeLoggedIn()
+        NOT_LOGGED_IN = 1 << 1, ///< MustNotBeLoggedIn()
+        IN_TRANSFER = 1 << 2, ///< MustBeInTransfer()
+        NOT_IN_TRANSFER = 1 << 3, ///< MustNotBeInTransfer()
+        POST_OR_PASV = 1 << 4, ///< NeedPostOrPasv()
+        ENCRYPTED = 1 << 5, ///< MustHaveEncryption()
+        PLAINTEXT_OK = 1 << 6 ///< Not MustHaveEncryptionIfEnforced()
+    };
+
+    /*! How the parameters are validated.
+     *
+     * The syntax used by most commands is recognized when the command
+     * is constructed, and checked by hand. The rest use the regex.
+     */
+    enum class ParamSyntax {
+        NONE, ///< No syntax. The parameters are not checked
+        ANY, ///< (.*)
+        NOT_EMPTY, ///< (.+)
+        NUMBER, ///< (\d+)
+        REGEX
+    };
 
-    FtpCmd(const std::string& name, const std::string help = "",
-           const std::string& syntax = "", const std::string& feat = "")
+    FtpCmd(const std::string& name, const traits_t traits = NO_TRAITS,
+           const std::string help = "", const std::string& syntax = "",
+           const std::string& feat = "")
     : regex_(syntax, boost::regex::icase), help_(help), name_(name)
-    , feat_(feat)
+    , feat_(feat), traits_{traits}, param_syntax_{ParseParamSyntax(syntax)}
     {}
 
     virtual ~FtpCmd() {}
@@ -284,7 +390,7 @@ public:
     const std::string& GetHelp() const { return help_; }
 
     const bool CanHaveParams() const {
-        return regex_.size() > 0;
+        return param_syntax_ != ParamSyntax::NONE;
     }
 
     const std::string& GetFeat() const { return feat_; }
@@ -292,28 +398,46 @@ public:
     /*! Get the regex for the command. */
     const boost::regex& GetRegex() const { return regex_; }
 
+    traits_t GetTraits() const noexcept { return traits_; }
+
+    ParamSyntax GetParamSyntax() const noexcept { return param_syntax_; }
+
+    /*! Validate the parameters
+     *
+     * \param param The parameters
+     * \param buffer Holds a copy of the parameters for the regex, if
+     *      the syntax needs one. Must outlive the match.
+     * \param match The sub-matches from the regex, if the syntax needs one.
+     *
+     * \return true if the parameters are valid
+     */
+    bool MatchParam(const param_t& param, std::string& buffer,
+                    match_t& match) const;
+
     /*! Returs true if the command requires the client to be logged on */
-    virtual bool MustBeLoggedIn() const { return false; }
+    bool MustBeLoggedIn() const noexcept { return traits_ & LOGGED_IN; }
 
     /*!  true if the command requires the client NOT to be logged on */
-    virtual bool MustNotBeLoggedIn() const { return false; }
+    bool MustNotBeLoggedIn() const noexcept { return traits_ & NOT_LOGGED_IN; }
 
     /*! Returs true if the command requires the client to be transferring a file */
-    virtual bool MustBeInTransfer() const { return false; }
+    bool MustBeInTransfer() const noexcept { return traits_ & IN_TRANSFER; }
 
     /*! Returs true if the command requires the client to NOT to be transffering a file */
-    virtual bool MustNotBeInTransfer() const { return false; }
+    bool MustNotBeInTransfer() const noexcept { return traits_ & NOT_IN_TRANSFER; }
 
     /*! Must be preceeded by a valid STOR or PASV conmand */
-    virtual bool NeedPostOrPasv() const { return false; }
+    bool NeedPostOrPasv() const noexcept { return traits_ & POST_OR_PASV; }
 
     /*! Can only be used after encryption is established if
      *  encryption (TLS) is mandentory.
      */
-    virtual bool MustHaveEncryptionIfEnforced() const { return true; }
+    bool MustHaveEncryptionIfEnforced() const noexcept {
+        return !(traits_ & PLAINTEXT_OK);
+    }
 
     /*! Can only be used after encryption is established */
-    virtual bool MustHaveEncryption() const { return false; }
+    bool MustHaveEncryption() const noexcept { return traits_ & ENCRYPTED; }
 
     /*! Returns the command required as the previos command.
 
@@ -342,6 +466,8 @@ public:
                         FtpReply& reply);
 
 private:
+    static ParamSyntax ParseParamSyntax(const std::string& syntax);
+
     /// Regex for the command's parameters
     const boost::regex regex_;
     /// The help-string provided for this command
@@ -350,11 +476,60 @@ private:
     const std::string name_;
     /// FEAT message
     const std::string feat_;
+    const traits_t traits_;
+    const ParamSyntax param_syntax_;
+};
+
+/*! Immutable lookup table for the FTP commands
+ *
+ * Built once, and shared by all the sessions. The names are at most
+ * max_name_length characters, so each name is packed into a 64 bit
+ * key. The keys are placed with a multiplicative hash, with a
+ * multiplier that is picked so that none of our commands collide.
+ * A lookup is then one multiplication and one compare.
+ */
+class FtpCmdTable
+{
+public:
+    static constexpr std::size_t max_name_length = 8;
+
+    /*! Build the table
+     *
+     * \exception ExceptionInvalidParameter if a name is too long,
+     *      or is used twice.
+     */
+    explicit FtpCmdTable(std::vector<FtpCmd *> commands);
+
+    /*! Find a command by name. The name is case-insensitive.
+     *
+     * \return nullptr if the command is unknown
+     */
+    FtpCmd *Find(const boost::string_ref& name) const noexcept;
+
+    /*! All the commands, in the order they were added */
+    const std::vector<FtpCmd *>& GetCommands() const noexcept {
+        return commands_;
+    }
+
+private:
+    using slot_t = std::pair<std::uint64_t, FtpCmd *>;
+
+    static bool MakeKey(const boost::string_ref& name,
+                        std::uint64_t& key) noexcept;
+
+    std::size_t GetSlot(const std::uint64_t key) const noexcept {
+        return static_cast<std::size_t>((key * multiplier_) >> shift_);
+    }
+
+    const std::vector<FtpCmd *> commands_;
+    std::vector<slot_t> slots_;
+    std::uint64_t multiplier_ = 0;
+    unsigned shift_ = 63;
 };
 
 
 /*! Get the default implementation of the FTP commands */
-FtpCmd::ftp_commands_t GetDefaultFtpCommands();
+const FtpCmdTable& GetDefaultFtpCommands();
 
 } // wfde
 } // war
@@ -366,3 +541,4 @@ FtpCmd::ftp_commands_t GetDefaultFtpCommands();
  */
 std::ostream& operator << (std::ostream& o, const war::wfde::FtpReplyCodes& code);
 std::ostream& operator << (std::ostream& o, const war::wfde::FtpState::Type type);
+std::ostream& operator << (std::ostream& o, const war::wfde::FtpState::Mode mode);
@@ -70,6 +70,9 @@ public:
 
     bool IsFake() const noexcept { return dir_ == nullptr; }
 
+    /*! True while we iterate over the entries added with AddVirtualPath() */
+    bool IsVirtual() const noexcept { return have_vpath_; }
+
     // Intended only to detect eof
     bool operator != (const FileListIterator&) const {
         return !is_eof_ || have_vpath_;
@@ -121,6 +124,8 @@ public:
 
     bool IsDirectory() const noexcept { return S_ISDIR(st_.st_mode); }
 
+    const struct stat& GetStat() const noexcept { return st_; }
+
     const boost::string_ref& GetName() const noexcept {
         return name_;
     }
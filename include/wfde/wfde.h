@@ -2,12 +2,18 @@
 
 #include <memory>
 #include <chrono>
+#include <functional>
+#include <exception>
 
 #include <boost/uuid/uuid.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/utility/string_ref_fwd.hpp>
 #include <boost/asio/buffer.hpp>
 
+#ifndef WIN32
+#   include <sys/stat.h>
+#endif
+
 #include <wfde/config.h>
 #include <warlib/basics.h>
 #include <warlib/error_handling.h>
@@ -46,6 +52,9 @@ class Client;
 class Session;
 class SessionManager;
 class AuthManager;
+class FileCache;
+class CompressedCache;
+class HashEngine;
 
 /*! WFDE version */
 enum class Version
@@ -131,7 +140,7 @@ public:
      *      The meta-data specifies if each individual node is a
      *      data-node or a child node.
      */
-    virtual node_enum_t EnumNodes(const char *path) = 0;
+    virtual node_enum_t EnumNodes(const char *path) const = 0;
 
     /*! Get the configuration
      *
@@ -545,6 +554,145 @@ public:
 };
 
 
+/*! Tuning of file transfers
+ *
+ * Each Host has one instance of this, loaded from the "/Transfer" node
+ * of the host's configuration when the host is created.
+ *
+ * Some Configuration settings:
+ *      "/Transfer/ZeroCopySend" : Use sendfile() for binary downloads over
+ *          unencrypted (or kTLS) data connections. Defaults to "1".
+ *      "/Transfer/ZeroCopyReceive" : Use splice() for binary uploads over
+ *          unencrypted data connections. Defaults to "1".
+ *      "/Transfer/ZeroCopyChunkSize" : Max bytes to hand to the kernel in
+ *          one zero-copy operation. Defaults to "4M".
+ *      "/Transfer/KernelTls" : Let the kernel encrypt downloads over TLS
+ *          data connections (kTLS), so that they can use sendfile() as
+ *          well. Falls back to user-space TLS when the kernel or the
+ *          cipher does not support it. Linux only. Defaults to "1".
+ *      "/Transfer/MinWindow" : Initial size of the memory-mapped window
+ *          used for file transfers. Defaults to "256K".
+ *      "/Transfer/MaxWindow" : The window is doubled for each sequential
+ *          remap, up to this size. Defaults to "8M".
+ *      "/Transfer/ReadAheadWindows" : Number of windows beyond the current
+ *          one to ask the kernel to load while we send. "0" disables
+ *          read-ahead. Defaults to "2".
+ *      "/Transfer/Backend" : How to access the files on disk. One of
+ *          "mmap", "pread" or "direct". Defaults to "mmap".
+ *      "/Transfer/BufferSize" : Size of the IO buffers used by the
+ *          "pread" and "direct" backends. Defaults to "1M". Transfers
+ *          with these backends do not use zero-copy.
+ *      "/Transfer/BackendOverrides/{name}/Path" : Physical path prefix
+ *          that use another backend.
+ *      "/Transfer/BackendOverrides/{name}/Backend" : The backend to use for
+ *          files below Path. The longest matching Path wins.
+ *      "/Transfer/SharedCache" : Let sessions downloading the same file
+ *          share the file-descriptor and the mapped windows. Only used
+ *          with the "mmap" backend. Defaults to "1".
+ *      "/Transfer/WriteBackWindow" : Start write-back of uploaded data to
+ *          disk each time this many bytes are received, and drop the
+ *          previous window from the page-cache. This limits the amount of
+ *          dirty memory for each upload. "0" leaves it to the kernel.
+ *          Defaults to "8M".
+ *      "/Transfer/SyncBeforeReply" : Flush uploaded files to disk before
+ *          we tell the client that the transfer is complete. This is
+ *          expensive: The reply waits until the disk has written all
+ *          of the file, which for large uploads can take many seconds.
+ *          The sync runs on a worker thread, so other sessions are not
+ *          delayed, but the worker threads are shared by all uploads.
+ *          Defaults to "0".
+ *      "/Transfer/DropBehindThreshold" : Downloads of files of at least this
+ *          size drop the data from the page-cache after it is sent, so that
+ *          one-shot downloads of huge files don't push the small, hot files
+ *          out of the cache. "0" disables it. Defaults to "0".
+ *      "/Transfer/DropBehindPaths/{name}/Path" : Physical path prefix where
+ *          all downloads drop the data from the page-cache after it is sent.
+ *      "/Transfer/HashThreads" : Number of threads computing digests for
+ *          HASH and the X* checksum commands. Defaults to "2".
+ *      "/Transfer/HashChunkSize" : Large files are split in chunks of this
+ *          size, hashed in parallel, for algorithms that allow it.
+ *          Defaults to "64M".
+ *      "/Transfer/HashCache/Path" : Directory where the digests of whole
+ *          files are kept across restarts. Empty disables the cache.
+ *      "/Transfer/HashCache/MaxEntries" : Max number of files in the
+ *          cache. The oldest entries are dropped first.
+ *          Defaults to "1000000".
+ *      "/Transfer/HashCache/Upload" : Algorithms, like "SHA-256 MD5", to
+ *          compute as binary uploads are received. Requires the cache.
+ *      "/Transfer/ControlStackSize" : Coroutine stack for each control
+ *          connection. Only the pages in use count against the memory,
+ *          but deep call chains need room. Min "16K". Defaults to "128K".
+ *      "/Transfer/DataStackSize" : Coroutine stack for each file transfer.
+ *          Min "16K". Defaults to "128K".
+ *
+ * Sizes can have a K, M or G suffix.
+ */
+struct TransferOptions
+{
+    /*! Implementation used to access files on disk */
+    enum class Backend {
+        MMAP, // Memory mapped windows
+        PREAD, // pread/pwrite trough pooled buffers
+        DIRECT // Like PREAD, but bypassing the page-cache (O_DIRECT)
+    };
+
+    struct BackendOverride {
+        boost::filesystem::path path;
+        Backend backend;
+    };
+
+    bool zero_copy_send = true;
+    bool zero_copy_receive = true;
+    std::size_t zero_copy_chunk_size = 1024 * 1024 * 4;
+    bool kernel_tls = true;
+    std::size_t min_window = 1024 * 256;
+    std::size_t max_window = 1024 * 1024 * 8;
+    unsigned read_ahead_windows = 2;
+    Backend backend = Backend::MMAP;
+    std::size_t buffer_size = 1024 * 1024;
+    std::vector<BackendOverride> backend_overrides;
+    bool shared_cache = true;
+    std::size_t write_back_window = 1024 * 1024 * 8;
+    bool sync_before_reply = false;
+    std::uint64_t drop_behind_threshold = 0;
+    std::vector<boost::filesystem::path> drop_behind_paths;
+    boost::filesystem::path compressed_cache_dir; // Empty disables .gz variants
+    std::uint64_t compressed_cache_size = 1024 * 1024 * 1024;
+    std::uint64_t compressed_min_size = 1024 * 64;
+    int compressed_level = 6;
+    unsigned compressed_min_requests = 2; // Requests before we compress a file
+    std::vector<boost::filesystem::path> compressed_paths;
+    unsigned hash_threads = 2;
+    std::uint64_t hash_chunk_size = 1024 * 1024 * 64;
+    boost::filesystem::path hash_cache_dir; // Empty disables the hash cache
+    std::size_t hash_cache_size = 1000000; // Entries
+    std::vector<std::string> upload_hashes; // Algorithm names
+    std::size_t control_stack_size = 1024 * 128; // Coroutine stack per session
+    std::size_t data_stack_size = 1024 * 128; // Coroutine stack per transfer
+
+    /*! Get the backend to use for a physical path */
+    Backend GetBackend(const boost::filesystem::path& path) const;
+
+    /*! Returns true if a download should drop the data it has sent
+     * from the page-cache.
+     */
+    bool UseDropBehind(const boost::filesystem::path& path,
+                       std::uint64_t size) const;
+
+    /*! Returns true if we can offer a compressed variant of the file */
+    bool UseCompressedVariant(const boost::filesystem::path& path,
+                              std::uint64_t size) const;
+
+    /*! Load the options from a host's configuration */
+    static TransferOptions Load(const Configuration& conf);
+
+    /*! Parse a size like "4096", "256K" or "8M" */
+    static std::uint64_t ParseSize(const std::string& value);
+
+    /*! Parse the name of a backend, like "pread" */
+    static Backend ParseBackend(const std::string& name);
+};
+
 /*! Interface for a Host instance.
  *
  * Think of a host as a HTTP virtual host.
@@ -610,6 +758,27 @@ public:
 
     /*! Get the auth-manager for this host */
     virtual AuthManager& GetAuthManager() = 0;
+
+    /*! Get the file transfer tuning for this host */
+    virtual const TransferOptions& GetTransferOptions() const = 0;
+
+    /*! Get the host-wide cache of open files
+     *
+     * Returns nullptr if the cache is disabled.
+     */
+    virtual FileCache *GetFileCache() = 0;
+
+    /*! Get the host-wide cache of compressed file variants
+     *
+     * Returns nullptr if the cache is disabled.
+     */
+    virtual CompressedCache *GetCompressedCache() = 0;
+
+    /*! Get the host's engine for file digests
+     *
+     * Returns nullptr if hashing is not supported.
+     */
+    virtual HashEngine *GetHashEngine() = 0;
 };
 
 
@@ -723,6 +892,48 @@ public:
 
     // Get the path to the TLS certificate (if it has one).
     virtual boost::filesystem::path GetCertPath() = 0;
+
+    /*! Returns true if data on the socket is currently encrypted */
+    virtual bool IsEncrypted() const = 0;
+
+    /*! Returns true if AsyncSendFile() can be used
+     *
+     * That is the case for unencrypted sockets, and for encrypted
+     * sockets where the kernel does the encryption.
+     */
+    virtual bool CanSendFile() const = 0;
+
+    /*! Send bytes directly from a file-descriptor to the socket
+     *
+     * The data is copied by the kernel, and never enters user-space.
+     * Only available when CanSendFile() returns true, on platforms that
+     * support it.
+     *
+     * \param fd Native file-descriptor to send from
+     * \param offset Offset in the file to start at
+     * \param bytes Max number of bytes to send
+     *
+     * \return Number of bytes sent. 0 means that we reached the end of
+     *      the file.
+     */
+    virtual std::size_t AsyncSendFile(int fd, std::uint64_t offset,
+                                      std::size_t bytes,
+                                      boost::asio::yield_context& yield) = 0;
+
+    /*! Receive bytes from the socket directly into a file-descriptor
+     *
+     * This is the reverse of AsyncSendFile(). The data is moved by
+     * the kernel, and never enters user-space.
+     *
+     * \param fd Native file-descriptor to write to
+     * \param offset Offset in the file to write at
+     * \param bytes Max number of bytes to receive
+     * \return Number of bytes written to the file. 0 means that the
+     *      peer closed the connection.
+     */
+    virtual std::size_t AsyncReceiveFile(int fd, std::uint64_t offset,
+                                         std::size_t bytes,
+                                         boost::asio::yield_context& yield) = 0;
 };
 
 /*! Interface to a protocol
@@ -779,6 +990,16 @@ public:
 
     enum class FileOperation { READ, WRITE, WRITE_NEW, APPEND };
 
+    /*! Counters for the IO on a File instance */
+    struct Stats {
+        std::uint64_t remaps = 0; // Number of windows mapped
+        std::size_t window_size = 0; // Current window size
+        std::uint64_t read_ahead_bytes = 0; // Bytes requested for read-ahead
+        std::uint64_t shared_windows = 0; // Windows already mapped by others
+        std::uint64_t write_back_bytes = 0; // Bytes we started write-back for
+        std::uint64_t dropped_bytes = 0; // Bytes dropped from the page-cache
+    };
+
     File() = default;
     virtual ~File() = default;
 
@@ -812,6 +1033,30 @@ public:
      */
     virtual void SetBytesWritten(std::size_t bytes) = 0;
 
+    /*! Account for bytes written directly to the native handle
+     *
+     * Used instead of Write() / SetBytesWritten() when the data has
+     * been written at the current position trough GetNativeHandle().
+     * Advances the current position accordingly.
+     */
+    virtual void SetBytesWrittenToHandle(std::size_t bytes) = 0;
+
+    /*! Allocate disk-space for an upload
+     *
+     * Reserves real disk-space for at least bytes bytes from the current
+     * position, so that the data can be written without fragmenting the
+     * file, and so that we fail early if the disk is full.
+     *
+     * \exception ExceptionDiskFull if there is not enough space
+     */
+    virtual void Reserve(std::uint64_t bytes) = 0;
+
+    /*! Flush the data written so far to the disk
+     *
+     * Returns when the data is on stable storage.
+     */
+    virtual void Sync() = 0;
+
     /*! Get the current file offset */
     virtual fpos_t GetPos() const = 0;
 
@@ -850,6 +1095,213 @@ public:
      * or another reasonable buffre-size.
      */
     virtual std::size_t GetSegmentSize() const noexcept = 0;
+
+    /*! Return the native file-descriptor for the file
+     *
+     * This is -1 if the file does not have a handle that can be used
+     * directly with the operating systems IO functions, for example
+     * when the data is converted or generated on the fly.
+     */
+    virtual int GetNativeHandle() const noexcept = 0;
+
+    /*! Get the IO counters for this file */
+    virtual const Stats& GetStats() const noexcept = 0;
+};
+
+/*! Identifies a version of a file on disk
+ *
+ * When a file is changed, it gets a new modification time, and
+ * usually a new size. Data derived from the file can therefore be
+ * revalidated by a stat() call.
+ */
+struct FileId {
+    std::uint64_t device = 0;
+    std::uint64_t inode = 0;
+    std::int64_t mtime = 0; // Nanoseconds
+    std::uint64_t size = 0;
+
+    bool operator == (const FileId& id) const noexcept;
+    bool operator < (const FileId& id) const noexcept;
+
+    /*! Get the identity of a regular file
+     *
+     * Returns false if the file does not exist, or is not a
+     * regular file.
+     */
+    static bool Get(const boost::filesystem::path& path, FileId& id);
+
+#ifndef WIN32
+    static FileId FromStat(const struct stat& st) noexcept;
+#endif
+};
+
+/*! Cache of files opened for reading
+ *
+ * Sessions that download the same file at the same time share the
+ * open file and the memory-mapped windows, rather than opening and
+ * mapping their own.
+ *
+ * Files are identified by device, inode, modification time and size,
+ * so a file that is changed on disk gets a new entry. Entries are
+ * released when the last reader closes the file.
+ */
+class FileCache
+{
+public:
+    using ptr_t = std::shared_ptr<FileCache>;
+
+    virtual ~FileCache() = default;
+
+    /*! Open a file for reading trough the cache */
+    virtual std::unique_ptr<File> Open(const boost::filesystem::path& path) = 0;
+
+    /*! Get the number of files currently shared trough the cache */
+    virtual std::size_t GetNumOpenFiles() const = 0;
+
+    /*! Create a cache instance */
+    static ptr_t Create(const TransferOptions& options);
+};
+
+/*! Cache of compressed copies of files
+ *
+ * Eligible files are offered to the clients with a virtual ".gz"
+ * suffix. The compressed copy is made once by a background thread,
+ * when the file has been requested a few times, and kept in a
+ * size-bounded directory until it is evicted. Files that don't
+ * compress well are remembered, and not offered compressed.
+ *
+ * Like FileCache, the copies are identified by device, inode,
+ * modification time and size, so a file that is changed on disk
+ * is compressed again when it is requested.
+ */
+class CompressedCache
+{
+public:
+    using ptr_t = std::shared_ptr<CompressedCache>;
+
+    virtual ~CompressedCache() = default;
+
+    /*! Get the compressed copy of a file
+     *
+     * If the copy is not ready, the request is counted, an eligible
+     * file is queued for compression when it has been requested
+     * TransferOptions::compressed_min_requests times, and an empty
+     * path is returned.
+     */
+    virtual boost::filesystem::path Lookup(const boost::filesystem::path& path) = 0;
+
+    /*! Get the compressed copy of a file if it is ready
+     *
+     * Unlike Lookup(), this never queues the file.
+     */
+    virtual boost::filesystem::path Peek(const FileId& id) const = 0;
+
+    /*! Get the total size of the compressed copies in the cache */
+    virtual std::uint64_t GetCacheSize() const = 0;
+
+    /*! Suffix used for the virtual names, ".gz" */
+    static const std::string& GetSuffix();
+
+    /*! Create a cache instance */
+    static ptr_t Create(const TransferOptions& options);
+};
+
+/*! Computes digests of files on a pool of worker threads
+ *
+ * The files are read trough the same backends as downloads. The
+ * IO pipelines are never blocked by the hashing.
+ *
+ * Algorithms that can be combined from independently computed
+ * parts (CRC32) are computed in parallel chunks for large files.
+ *
+ * If the host has a hash cache, the digests of whole files are
+ * remembered, identified by FileId, so that repeated requests for
+ * an unchanged file are answered without reading it.
+ */
+class HashEngine
+{
+public:
+    using ptr_t = std::shared_ptr<HashEngine>;
+
+    enum class Algorithm { CRC32, MD5, SHA1, SHA256, SHA512 };
+
+    /*! Called from a worker thread when the digest is ready
+     *
+     * If the digest is cached, it's called before Hash() returns.
+     * If the hashing failed, error is set and digest is empty.
+     */
+    using callback_t = std::function<void (const std::string& digest,
+                                           std::exception_ptr error)>;
+
+    /*! Incremental digest, for data that is not in a file (yet) */
+    class Digest
+    {
+    public:
+        virtual ~Digest() = default;
+        virtual void Update(const void *data, std::size_t len) = 0;
+
+        /*! Get the digest as a lower-case hex string */
+        virtual std::string Final() = 0;
+    };
+
+    /*! Given to the callbacks of requests that were still queued
+     * when the engine was destroyed
+     */
+    struct ExceptionCancelled : public ExceptionBase {};
+
+    virtual ~HashEngine() = default;
+
+    /*! Compute the digest of a part of a file
+     *
+     * \param path Physical path to the file
+     * \param algorithm Algorithm to use
+     * \param from First byte to hash
+     * \param to One past the last byte to hash, or 0 to hash to
+     *      the end of the file.
+     * \param callback Receives the digest as a lower-case hex string.
+     *      It is always called, also if the engine is destroyed before
+     *      the request is served.
+     */
+    virtual void Hash(const boost::filesystem::path& path,
+                      Algorithm algorithm,
+                      std::uint64_t from,
+                      std::uint64_t to,
+                      callback_t callback) = 0;
+
+    /*! Get the digest of a whole file from the cache
+     *
+     * Does no IO. Returns an empty string if the digest is unknown.
+     */
+    virtual std::string GetCachedDigest(const FileId& id,
+                                        Algorithm algorithm) const = 0;
+
+    /*! Add the digest of a whole file to the cache
+     *
+     * Used for digests computed elsewhere, like during uploads.
+     */
+    virtual void AddDigest(const boost::filesystem::path& path,
+                           const FileId& id,
+                           Algorithm algorithm,
+                           const std::string& digest) = 0;
+
+    /*! Get the algorithms we support */
+    static const std::vector<Algorithm>& GetAlgorithms();
+
+    /*! Get the IANA name of an algorithm, like "SHA-256" */
+    static const std::string& GetName(Algorithm algorithm);
+
+    /*! Get an algorithm from it's name
+     *
+     * \exception ExceptionNotFound if the algorithm is unknown or
+     *      not supported.
+     */
+    static Algorithm GetAlgorithm(const std::string& name);
+
+    /*! Create an incremental digest */
+    static std::unique_ptr<Digest> CreateDigest(Algorithm algorithm);
+
+    /*! Create an engine instance */
+    static ptr_t Create(const TransferOptions& options);
 };
 
 /*! A logged-in session */
@@ -886,6 +1338,16 @@ public:
         virtual void StartTransfer(std::unique_ptr<File>) = 0;
         /* Enable TLS on the protocol */
         virtual void StartTls() = 0;
+
+        /*! Get the digest of a part of a file from the host's HashEngine
+         *
+         * Suspends the session until the digest is ready, without
+         * blocking the thread that runs the session.
+         */
+        virtual std::string HashFile(const boost::filesystem::path& path,
+                                     HashEngine::Algorithm algorithm,
+                                     std::uint64_t from,
+                                     std::uint64_t to) = 0;
     };
 
     Session() = default;
@@ -918,7 +1380,7 @@ public:
      *
      * \returns a "virtual" path to the users current directory.
      */
-    virtual vpath_t GetCwd() const = 0;
+    virtual const vpath_t& GetCwd() const = 0;
 
     /*! Set the current dir for a session */
     virtual void SetCwd(const vpath_t& path) = 0;
@@ -1262,6 +1724,20 @@ Interface::ptr_t CreateInterface(Protocol *parent,
 
 
 
+/*! Create a File instance for a file on disk
+ *
+ * \param path Physical path to the file
+ * \param operation What we are going to do with the file
+ * \param options Transfer options for the host. Decides what
+ *      backend to use for the path.
+ * \param cache If not nullptr, files opened for reading with the
+ *      mmap backend will be shared trough the cache.
+ */
+std::unique_ptr<File> CreateDiskFile(const boost::filesystem::path& path,
+                                     File::FileOperation operation,
+                                     const TransferOptions& options,
+                                     FileCache *cache = nullptr);
+
 /*! Factory type used to create an instance of a protocol */
 using protocol_factory_t = std::function<Protocol::ptr_t(Host *parent,
                                                          const Configuration::ptr_t&)>;
@@ -1292,5 +1768,7 @@ std::ostream& operator << (std::ostream& o, const war::wfde::Session& ses);
 std::ostream& operator << (std::ostream& o, const war::wfde::Client& cli);
 std::ostream& operator << (std::ostream& o, const war::wfde::File& f);
 std::ostream& operator << (std::ostream& o, const war::wfde::File::FileOperation& op);
+std::ostream& operator << (std::ostream& o, const war::wfde::File::Stats& stats);
+std::ostream& operator << (std::ostream& o, const war::wfde::TransferOptions::Backend& backend);
 std::ostream& operator << (std::ostream& o, const war::wfde::Permissions& op);
 
@@ -25,66 +25,48 @@ WfdeAsciiFile::~WfdeAsciiFile()
 }
 
 
+char *WfdeAsciiFile::GetBuffer(size_t size)
+{
+    if (buffer_.size() < size) {
+        buffer_.resize(size);
+    }
+    return buffer_.data();
+}
+
 /*! Convert from local format to CRLF delimited text */
 File::const_buffer_t WfdeAsciiFile::Read(size_t bytes)
 {
     auto buffer = file_->Read(bytes);
-    buffer_.clear();
-
-    //for(const auto& b : buffer) {
-        auto p = static_cast<const char*>(buffer.data());
-        const decltype(p) end = p + boost::asio::buffer_size(buffer);
-
-        for(; p < end; ++p) {
-            if (UNLIKELY(*p == '\r'))
-                continue;
-            if (UNLIKELY(*p == '\n')) {
-                buffer_ += crlf_;
-            } else {
-                buffer_ += *p;
-            }
-        }
-    //}
-
-    return {buffer_.c_str(), buffer_.size()};
+    const auto len = boost::asio::buffer_size(buffer);
+    auto out = GetBuffer(len * to_crlf_.GetMaxExpansion());
+
+    const auto converted = to_crlf_.Convert(
+        static_cast<const char*>(buffer.data()), len, out);
+
+    return {out, converted};
 }
 
 File::mutable_buffer_t WfdeAsciiFile::Write(const size_t bytes)
 {
-    buffer_.clear();
-    buffer_.resize(std::min(bytes ? bytes : GetSegmentSize(),
-                            GetSegmentSize()/2));
+    write_len_ = std::min(bytes ? bytes : GetSegmentSize(),
+                          GetSegmentSize()/2);
 
-    return {&buffer_[0], buffer_.size()};
+    return {GetBuffer(write_len_), write_len_};
 }
 
 /*! Convert from CRLF formatted text to local text format */
 void WfdeAsciiFile::SetBytesWritten(const size_t bytes)
 {
-    WAR_ASSERT(bytes <= buffer_.size());
+    WAR_ASSERT(bytes <= write_len_);
 
-    auto wr_buf = file_->Write(bytes * 2); //make space for worst-case expansion
+    const auto max_len = bytes * from_crlf_.GetMaxExpansion();
+    auto wr_buf = file_->Write(max_len); //make space for worst-case expansion
     WAR_ASSERT(wr_buf.begin() + 1 == wr_buf.end()); // We don't want the complexity with several buffers
 
     auto wr_ptr = static_cast<char*>(wr_buf.data());
-    auto b = wr_ptr;
-    WAR_ASSERT(b != nullptr);
-
-    auto ch = buffer_.cbegin();
-    const auto end = ch + bytes;
-    for(; ch != end; ++ch) {
-        if (UNLIKELY(*ch == '\r'))
-            continue;
-        if (UNLIKELY(*ch == '\n')) {
-            for(const auto eol : local_eol_) {
-                *b++ = eol;
-            }
-        } else {
-            *b++ = *ch;
-        }
-    }
+    WAR_ASSERT(wr_ptr != nullptr);
 
-    const auto bytes_written = b - wr_ptr;
+    const auto bytes_written = from_crlf_.Convert(buffer_.data(), bytes, wr_ptr);
 
 #ifdef DEBUG
     LOG_TRACE4_F_FN(log::LA_IO) << "ASCII mapping: bytes=" << bytes
@@ -92,7 +74,7 @@ void WfdeAsciiFile::SetBytesWritten(const size_t bytes)
         << ' ' << *this;
 #endif
 
-	WAR_ASSERT(bytes_written <= static_cast<decltype(bytes_written)>(bytes * 2));
+	WAR_ASSERT(bytes_written <= max_len);
 
     file_->SetBytesWritten(bytes_written);
 }
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <vector>
+
 #include <warlib/config.h>
 #include "WfdeFile.h"
+#include "WfdeEolConverter.h"
 
 namespace war {
 namespace wfde {
@@ -20,6 +23,12 @@ public:
     const_buffer_t Read(std::size_t bytes) override;
     mutable_buffer_t Write(size_t bytes = 0) override;
     void SetBytesWritten(size_t bytes) override;
+    void SetBytesWrittenToHandle(size_t bytes) override {
+        WAR_ASSERT(false && "Not implemented");
+        WAR_THROW_T(ExceptionNotImplemented, "Not implemented");
+    }
+    void Reserve(std::uint64_t bytes) override { file_->Reserve(bytes); }
+    void Sync() override { file_->Sync(); }
     void Seek(fpos_t pos) override {file_->Seek(pos);};
     fpos_t GetPos() const override { return file_->GetPos(); }
     fpos_t GetSize() const override { return file_->GetSize(); }
@@ -30,12 +39,20 @@ public:
     std::size_t GetSegmentSize() const noexcept override {
         return file_->GetSegmentSize();
     }
+    // The data is converted, so the raw file can not be used directly
+    int GetNativeHandle() const noexcept override { return -1; }
+    const Stats& GetStats() const noexcept override {
+        return file_->GetStats();
+    }
 
 private:
+    char *GetBuffer(std::size_t size);
+
     std::unique_ptr<File> file_;
-    std::string buffer_;
-    const std::string crlf_ = "\r\n";
-    const std::string local_eol_ = WAR_SYSTEM_EOL;
+    std::vector<char> buffer_; // Re-used for all the conversions
+    std::size_t write_len_ = 0; // The length of the last buffer from Write()
+    const EolConverter to_crlf_{"\r\n"};
+    const EolConverter from_crlf_{WAR_SYSTEM_EOL};
 };
 
 }}} // namespaces
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <memory>
+
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <warlib/WarPipeline.h>
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Lets a coroutine on a pipeline wait for work done on another thread
+ *
+ * Create it with make_shared, and give the worker a reference. The
+ * worker stores its results in the derived class and calls SetDone().
+ * The coroutine is resumed on the pipeline, so the results are only
+ * read there. The shared ownership keeps the object alive if the
+ * coroutine is gone before the worker is done.
+ *
+ * Derive from it to add the fields for the results.
+ */
+class WfdeAsyncResult : public std::enable_shared_from_this<WfdeAsyncResult>
+{
+public:
+    explicit WfdeAsyncResult(Pipeline& pipeline)
+    : pipeline_{pipeline}, timer_{pipeline.GetIoService()}
+    {
+        timer_.expires_at(boost::asio::steady_timer::time_point::max());
+    }
+
+    virtual ~WfdeAsyncResult() = default;
+
+    /*! Resume the waiting coroutine. May be called from any thread. */
+    void SetDone() {
+        auto self = shared_from_this();
+        pipeline_.Post({[self] {
+            self->done_ = true;
+            self->timer_.cancel();
+        }, "Async result is ready"});
+    }
+
+    /*! Suspend the coroutine until SetDone() is called */
+    void Wait(boost::asio::yield_context& yield) {
+        while(!done_) {
+            boost::system::error_code ec;
+            timer_.async_wait(yield[ec]);
+        }
+    }
+
+private:
+    Pipeline& pipeline_;
+    boost::asio::steady_timer timer_;
+    bool done_ = false; // Only used on the pipeline
+};
+
+}}} // namespaces
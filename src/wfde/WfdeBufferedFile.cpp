@@ -0,0 +1,493 @@
+#include "war_wfde.h"
+#include "WfdeBufferedFile.h"
+#include "WfdeIdGenerator.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <map>
+
+#ifndef WIN32
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <errno.h>
+#   include <sys/stat.h>
+#endif
+
+#include <warlib/uuid.h>
+#include <warlib/WarLog.h>
+#include <warlib/error_handling.h>
+
+using namespace std;
+using namespace std::string_literals;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+namespace {
+
+/* Process-wide pool of IO buffers.
+ *
+ * Uploads and downloads allocate and release buffers of the same few
+ * sizes all the time, so we keep some of them around.
+ */
+class IoBufferPool
+{
+public:
+    char *Get(std::size_t size) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            auto it = free_.find(size);
+            if (it != free_.end()) {
+                auto *p = it->second;
+                free_.erase(it);
+                --num_free_;
+                return p;
+            }
+        }
+
+        void *p = nullptr;
+        if (posix_memalign(&p, IoBuffer::alignment, size) != 0) {
+            throw std::bad_alloc();
+        }
+        return static_cast<char *>(p);
+    }
+
+    void Release(char *p, std::size_t size) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (num_free_ < max_free_) {
+                free_.emplace(size, p);
+                ++num_free_;
+                return;
+            }
+        }
+        free(p);
+    }
+
+    static IoBufferPool& Instance() {
+        static IoBufferPool pool;
+        return pool;
+    }
+
+private:
+    mutex mutex_;
+    multimap<std::size_t, char *> free_;
+    std::size_t num_free_ = 0;
+    const std::size_t max_free_ = 64;
+};
+
+std::size_t AlignUp(std::size_t v) {
+    const auto a = IoBuffer::alignment;
+    return std::max(a, ((v + a - 1) / a) * a);
+}
+
+} // anonymous namespace
+
+IoBuffer::IoBuffer(std::size_t size)
+: data_{IoBufferPool::Instance().Get(size)}, size_{size}
+{
+}
+
+IoBuffer::IoBuffer(IoBuffer&& v) noexcept
+: data_{v.data_}, size_{v.size_}
+{
+    v.data_ = nullptr;
+    v.size_ = 0;
+}
+
+IoBuffer::~IoBuffer()
+{
+    Release();
+}
+
+IoBuffer& IoBuffer::operator = (IoBuffer&& v) noexcept
+{
+    if (this != &v) {
+        Release();
+        data_ = v.data_;
+        size_ = v.size_;
+        v.data_ = nullptr;
+        v.size_ = 0;
+    }
+    return *this;
+}
+
+void IoBuffer::Release() noexcept
+{
+    if (data_) {
+        IoBufferPool::Instance().Release(data_, size_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+}
+
+
+WfdeBufferedFile::WfdeBufferedFile(const boost::filesystem::path& path,
+                                   FileOperation operation,
+                                   const TransferOptions& options,
+                                   TransferOptions::Backend backend)
+: path_{path}
+, operation_{operation}
+, backend_{backend}
+, id_(WfdeIdGenerator::NextUuid())
+, buffer_size_{AlignUp(options.buffer_size)}
+, write_back_{options.write_back_window}
+, drop_behind_{std::max(buffer_size_, options.max_window)}
+{
+    const auto st = boost::filesystem::status(path_);
+    int flags = O_CLOEXEC;
+
+    switch(operation) {
+        case FileOperation::READ:
+            if (!boost::filesystem::is_regular_file(st)) {
+                LOG_NOTICE_FN << "The path " << log::Esc(path.string())
+                    << " is not a regular file";
+                WAR_THROW_T(ExceptionNotFound, "Not a file");
+            }
+            flags |= O_RDONLY;
+            break;
+        case FileOperation::WRITE_NEW:
+            flags |= O_RDWR | O_CREAT | O_EXCL;
+            break;
+        case FileOperation::WRITE:
+            flags |= O_RDWR | O_CREAT | O_TRUNC;
+            break;
+        case FileOperation::APPEND:
+            flags |= O_RDWR | O_CREAT;
+            break;
+        default:
+            WAR_ASSERT(false && "Not implemented");
+            break;
+    }
+
+    fd_ = ::open(path_.c_str(), flags, 0644);
+    if (fd_ < 0) {
+        const auto err = errno;
+        if (err == EEXIST) {
+            WAR_THROW_T(ExceptionAlreadyExist, path_.string());
+        }
+        if (err == ENOENT) {
+            WAR_THROW_T(ExceptionNotFound, path_.string());
+        }
+        if (err == EACCES) {
+            WAR_THROW_T(ExceptionAccessDenied, path_.string());
+        }
+        LOG_ERROR_FN << "Failed to open " << log::Esc(path_.string())
+            << ": " << strerror(err);
+        WAR_THROW_T(ExceptionIoError, path_.string());
+    }
+
+    if (backend_ == TransferOptions::Backend::DIRECT) {
+#ifdef O_DIRECT
+        direct_fd_ = ::open(path_.c_str(),
+                            (flags & ~(O_CREAT | O_EXCL | O_TRUNC)) | O_DIRECT);
+        if (direct_fd_ < 0) {
+            LOG_WARN_FN << "Failed to open " << log::Esc(path_.string())
+                << " with O_DIRECT (" << strerror(errno)
+                << "). Using buffered IO for " << *this;
+        }
+#else
+        LOG_WARN_FN << "O_DIRECT is not supported on this platform. "
+            << "Using buffered IO for " << *this;
+#endif
+    }
+
+    struct stat sb = {};
+    if (::fstat(fd_, &sb) == 0) {
+        file_size_ = static_cast<fpos_t>(sb.st_size);
+    }
+
+    if (operation == FileOperation::APPEND) {
+        pos_ = flush_pos_ = file_size_;
+        write_back_.Reset(pos_);
+    }
+
+    if ((operation == FileOperation::READ) && (direct_fd_ < 0)
+        && options.UseDropBehind(path_, file_size_)) {
+        drop_behind_.Enable(fd_);
+    }
+
+    stats_.window_size = buffer_size_;
+
+    LOG_TRACE2_FN << "Opened " << *this << " using the " << backend_
+        << " backend";
+}
+
+WfdeBufferedFile::~WfdeBufferedFile()
+{
+    try {
+        Close();
+    } WAR_CATCH_ERROR;
+}
+
+File::const_buffer_t WfdeBufferedFile::Read(std::size_t bytes)
+{
+    WAR_ASSERT(operation_ == FileOperation::READ);
+
+    if (!buffer_.size()) {
+        buffer_ = IoBuffer(buffer_size_);
+    }
+
+    if (IsEof()) {
+        return {buffer_.data(), 0};
+    }
+
+    auto want = bytes ? std::min(bytes, buffer_size_) : buffer_size_;
+    std::size_t got = 0;
+
+    if ((direct_fd_ >= 0) && IsAligned(pos_)) {
+        // O_DIRECT require aligned length and offset
+        got = ReadAt(direct_fd_, buffer_size_, pos_);
+    } else {
+        if (direct_fd_ >= 0) {
+            // Read up to the next aligned position, so that we can
+            // use O_DIRECT for the rest.
+            const auto a = IoBuffer::alignment;
+            want = std::min<std::size_t>(want, a - (pos_ % a));
+        }
+        got = ReadAt(fd_, want, pos_);
+    }
+
+    if ((got == 0) && (pos_ < file_size_)) {
+        LOG_WARN_FN << "The file " << *this << " was truncated while reading it.";
+        file_size_ = pos_;
+    }
+
+    const auto len = std::min(got, want);
+    pos_ += len;
+
+    // The data is copied to our buffer
+    drop_behind_.OnConsumed(fd_, pos_, stats_);
+
+    return {buffer_.data(), len};
+}
+
+File::mutable_buffer_t WfdeBufferedFile::Write(size_t bytes)
+{
+    WAR_ASSERT(operation_ != FileOperation::READ);
+
+    if (!buffer_.size()) {
+        buffer_ = IoBuffer(buffer_size_);
+    }
+
+    const auto min_space = bytes ? std::min(bytes, buffer_size_)
+        : IoBuffer::alignment;
+    if ((buffer_size_ - pending_) < min_space) {
+        Flush(false);
+    }
+
+    const auto space = buffer_size_ - pending_;
+    last_buffer_len_ = bytes ? std::min(bytes, space) : space;
+    return {buffer_.data() + pending_, last_buffer_len_};
+}
+
+void WfdeBufferedFile::SetBytesWritten(size_t bytes)
+{
+    WAR_ASSERT(bytes <= last_buffer_len_);
+
+    pending_ += bytes;
+    pos_ += bytes;
+    last_buffer_len_ = 0;
+
+    if (file_size_ < pos_) {
+        file_size_ = pos_;
+    }
+
+    if (pending_ == buffer_size_) {
+        Flush(false);
+    }
+}
+
+void WfdeBufferedFile::SetBytesWrittenToHandle(size_t bytes)
+{
+    WAR_ASSERT(operation_ != FileOperation::READ);
+    WAR_ASSERT(pending_ == 0);
+
+    pos_ += bytes;
+    flush_pos_ = pos_;
+
+    if (file_size_ < pos_) {
+        file_size_ = pos_;
+    }
+}
+
+void WfdeBufferedFile::Reserve(std::uint64_t bytes)
+{
+    WAR_ASSERT(operation_ != FileOperation::READ);
+
+    // The size of the file still follows what we write. Space beyond
+    // that is released in Close().
+    AllocateDiskSpace(fd_, path_, pos_, bytes, true);
+    have_reserved_ = true;
+}
+
+void WfdeBufferedFile::Flush(bool all)
+{
+    if (!pending_) {
+        return;
+    }
+
+    const auto a = IoBuffer::alignment;
+    std::size_t bulk = pending_;
+
+    if (direct_fd_ >= 0) {
+        // Write the unaligned head trough the buffered fd.
+        if (!IsAligned(flush_pos_)) {
+            const auto head = std::min<std::size_t>(pending_, a - (flush_pos_ % a));
+            WriteAt(buffer_.data(), head, flush_pos_, false);
+            flush_pos_ += head;
+            pending_ -= head;
+            if (pending_) {
+                memmove(buffer_.data(), buffer_.data() + head, pending_);
+            }
+        }
+
+        bulk = (pending_ / a) * a;
+    }
+
+    if (bulk) {
+        WriteAt(buffer_.data(), bulk, flush_pos_, direct_fd_ >= 0);
+        flush_pos_ += bulk;
+        pending_ -= bulk;
+
+        if (pending_) {
+            memmove(buffer_.data(), buffer_.data() + bulk, pending_);
+        }
+    }
+
+    if (all) {
+        if (pending_) {
+            // The unaligned tail
+            WriteAt(buffer_.data(), pending_, flush_pos_, false);
+            flush_pos_ += pending_;
+            pending_ = 0;
+        }
+    }
+
+    if (direct_fd_ < 0) {
+        write_back_.OnWritten(fd_, flush_pos_, stats_);
+    }
+}
+
+void WfdeBufferedFile::Sync()
+{
+    WAR_ASSERT(operation_ != FileOperation::READ);
+
+    Flush(true);
+
+    LOG_TRACE4_F_FN(log::LA_IO) << "Syncing " << *this;
+
+    if (::fdatasync(fd_) != 0) {
+        throw boost::system::system_error(errno, boost::system::system_category());
+    }
+}
+
+void WfdeBufferedFile::WriteAt(const char *data, std::size_t bytes,
+                               fpos_t offset, bool direct)
+{
+    const auto fd = direct ? direct_fd_ : fd_;
+    for(std::size_t written = 0; written < bytes;) {
+        const auto rval = ::pwrite(fd, data + written, bytes - written,
+                                   offset + written);
+        if (rval < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw boost::system::system_error(errno, boost::system::system_category());
+        }
+        written += static_cast<std::size_t>(rval);
+    }
+}
+
+/*! Read until we have the bytes or reach EOF
+ *
+ * \return Number of bytes read into buffer_.
+ */
+std::size_t WfdeBufferedFile::ReadAt(int fd, std::size_t bytes,
+                                     fpos_t offset)
+{
+    WAR_ASSERT(bytes <= buffer_.size());
+    std::size_t got = 0;
+    while(got < bytes) {
+        const auto rval = ::pread(fd, buffer_.data() + got, bytes - got,
+                                  offset + got);
+        if (rval < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw boost::system::system_error(errno, boost::system::system_category());
+        }
+        if (rval == 0) {
+            break; // EOF
+        }
+        got += static_cast<std::size_t>(rval);
+    }
+    return got;
+}
+
+void WfdeBufferedFile::Seek(File::fpos_t pos)
+{
+    if (pos > file_size_) {
+        LOG_NOTICE_FN << "Seek beoind EOF, file-size=" << file_size_
+            << ", requested position=" << pos
+            << ' ' << *this;
+        WAR_THROW_T(ExceptionSeekBeoindEof, boost::uuids::to_string(id_));
+    }
+
+    if (operation_ != FileOperation::READ) {
+        Flush(true);
+        flush_pos_ = pos;
+        write_back_.Reset(pos);
+    } else {
+        // The zero-copy send path moves trough the file with Seek()
+        drop_behind_.OnConsumed(fd_, pos, stats_);
+    }
+
+    LOG_TRACE4_F_FN(log::LA_IO) << "Setting pos to " << pos << " in " << *this;
+    pos_ = pos;
+}
+
+void WfdeBufferedFile::Close()
+{
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+
+    LOG_TRACE2_FN << "Closing " << *this;
+
+    // Make sure that the descriptors are closed even if the final
+    // write fails.
+    auto close_fds = [this] {
+        if (direct_fd_ >= 0) {
+            ::close(direct_fd_);
+            direct_fd_ = -1;
+        }
+
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    };
+
+    try {
+        if (operation_ != FileOperation::READ) {
+            Flush(true);
+        }
+
+        // Release reserved space we did not use.
+        if (have_reserved_ && (::ftruncate(fd_, file_size_) != 0)) {
+            LOG_WARN_FN << "Failed to truncate " << *this
+                << " to " << file_size_ << " bytes";
+        }
+    } catch(...) {
+        close_fds();
+        throw;
+    }
+
+    close_fds();
+}
+
+}}} // namespaces
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <string>
+#include <memory>
+
+#include <boost/filesystem.hpp>
+#include <boost/uuid/uuid.hpp>
+
+#include <wfde/wfde.h>
+#include "WfdeFile.h"
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Buffer from the process-wide IO buffer pool
+ *
+ * The memory is aligned so that it can be used with O_DIRECT.
+ */
+class IoBuffer
+{
+public:
+    IoBuffer() = default;
+    IoBuffer(std::size_t size);
+    IoBuffer(const IoBuffer&) = delete;
+    IoBuffer(IoBuffer&& v) noexcept;
+    ~IoBuffer();
+
+    IoBuffer& operator = (const IoBuffer&) = delete;
+    IoBuffer& operator = (IoBuffer&& v) noexcept;
+
+    char *data() noexcept { return data_; }
+    const char *data() const noexcept { return data_; }
+    std::size_t size() const noexcept { return size_; }
+
+    static constexpr std::size_t alignment = 4096;
+
+private:
+    void Release() noexcept;
+
+    char *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+/*! File that use read/write-calls on pooled buffers
+ *
+ * This is an alternative to the memory-mapped WfdeFile for file-systems
+ * where mmap works poorly, like network file-systems, or under memory
+ * pressure. Data is copied between the kernel and a buffer from
+ * the buffer-pool.
+ *
+ * With the DIRECT backend, the file is also opened with O_DIRECT
+ * so that bulk IO bypass the page-cache. Unaligned heads and tails are
+ * written trough a normal file-descriptor.
+ */
+class WfdeBufferedFile : public File
+{
+public:
+    WfdeBufferedFile(const boost::filesystem::path& path,
+                     FileOperation operation,
+                     const TransferOptions& options,
+                     TransferOptions::Backend backend);
+    ~WfdeBufferedFile();
+
+    struct ExceptionSeekBeoindEof : public ExceptionBase {};
+
+    const_buffer_t Read(std::size_t bytes) override;
+    mutable_buffer_t Write(size_t bytes = 0) override;
+    void SetBytesWritten(size_t bytes) override;
+    void SetBytesWrittenToHandle(size_t bytes) override;
+    void Reserve(std::uint64_t bytes) override;
+    void Sync() override;
+    void Seek(fpos_t pos) override;
+    fpos_t GetPos() const override { return pos_; }
+    fpos_t GetSize() const override { return file_size_; }
+    bool IsEof() const override { return pos_ >= file_size_; }
+    void Close() override;
+    FileOperation GetOperation() const override { return operation_; }
+    const boost::uuids::uuid& GetUuid() const override { return id_; }
+    std::size_t GetSegmentSize() const noexcept override {
+        return buffer_size_;
+    }
+    // The data goes trough our buffers, so that the backend decides how
+    // the disk is accessed. Zero-copy transfers would bypass that.
+    int GetNativeHandle() const noexcept override { return -1; }
+    const Stats& GetStats() const noexcept override { return stats_; }
+
+private:
+    void Flush(bool all);
+    std::size_t ReadAt(int fd, std::size_t bytes, fpos_t offset);
+    void WriteAt(const char *data, std::size_t bytes, fpos_t offset,
+                 bool direct);
+    bool IsAligned(fpos_t v) const noexcept {
+        return (v % IoBuffer::alignment) == 0;
+    }
+
+    fpos_t pos_ = 0; // Logical position, including unflushed data
+    const boost::filesystem::path path_;
+    const FileOperation operation_;
+    const TransferOptions::Backend backend_;
+    const boost::uuids::uuid id_;
+    const std::size_t buffer_size_;
+    int fd_ = -1;
+    int direct_fd_ = -1;
+    fpos_t file_size_ = 0;
+
+    // Reading
+    IoBuffer buffer_;
+
+    // Writing
+    fpos_t flush_pos_ = 0; // File offset for the start of buffer_
+    std::size_t pending_ = 0; // Bytes in buffer_ not yet written to disk
+    std::size_t last_buffer_len_ = 0; // The length of the last write buffer we returned
+    WriteBackControl write_back_; // Not used with O_DIRECT
+    DropBehindControl drop_behind_; // Not used with O_DIRECT
+
+    bool closed_ = false;
+    bool have_reserved_ = false; // Disk-space is allocated beyond EOF
+    Stats stats_;
+};
+
+}}} // namespaces
@@ -0,0 +1,399 @@
+#include "war_wfde.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <warlib/WarLog.h>
+#include <warlib/error_handling.h>
+
+#include "WfdeCompressedCache.h"
+
+using namespace std;
+using namespace std::string_literals;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+namespace {
+// Don't let a listing of a huge directory fill up the memory
+constexpr size_t max_queue_len = 256;
+constexpr size_t io_buffer_size = 1024 * 256;
+// Files we track without having a copy of them
+constexpr size_t max_entries = 1024 * 64;
+const std::string poor_suffix{".poor"};
+} // anonymous namespace
+
+WfdeCompressedCache::WfdeCompressedCache(const TransferOptions& options)
+: options_{options}
+{
+    boost::filesystem::create_directories(options_.compressed_cache_dir);
+    Load();
+    worker_ = std::thread([this] { Run(); });
+
+    LOG_DEBUG_FN << "Using " << log::Esc(options_.compressed_cache_dir.string())
+        << " for compressed variants. " << entries_.size()
+        << " files with " << cache_size_ << " bytes are already in the cache.";
+}
+
+WfdeCompressedCache::~WfdeCompressedCache()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+}
+
+boost::filesystem::path
+WfdeCompressedCache::GetCachePath(const FileId& key,
+                                  const std::string& suffix) const
+{
+    char name[128] = {};
+    snprintf(name, sizeof(name), "%llx-%llx-%llx-%llx%s",
+             static_cast<unsigned long long>(key.device),
+             static_cast<unsigned long long>(key.inode),
+             static_cast<unsigned long long>(key.mtime),
+             static_cast<unsigned long long>(key.size),
+             suffix.c_str());
+
+    return options_.compressed_cache_dir / name;
+}
+
+/*! Adopt the copies from a previous run, and remove junk */
+void WfdeCompressedCache::Load()
+{
+    using namespace boost::filesystem;
+
+    for(const auto& de : directory_iterator(options_.compressed_cache_dir)) {
+        if (!is_regular_file(de.status())) {
+            continue;
+        }
+
+        const auto name = de.path().filename().string();
+        unsigned long long device = 0, inode = 0, mtime = 0, size = 0;
+        FileId key;
+        int consumed = 0;
+
+        if (sscanf(name.c_str(), "%llx-%llx-%llx-%llx%n",
+                   &device, &inode, &mtime, &size, &consumed) == 4) {
+
+            key.device = device;
+            key.inode = inode;
+            key.mtime = static_cast<int64_t>(mtime);
+            key.size = size;
+
+            const auto suffix = name.substr(consumed);
+            if (suffix == GetSuffix()) {
+                auto& entry = entries_[key];
+                entry.state = State::READY;
+                entry.size = file_size(de.path());
+                cache_size_ += entry.size;
+                continue;
+            }
+
+            if (suffix == poor_suffix) {
+                entries_[key].state = State::POOR;
+                continue;
+            }
+        }
+
+        LOG_DEBUG_FN << "Removing unknown file "
+            << log::Esc(de.path().string()) << " from the cache";
+        boost::system::error_code ec;
+        remove(de.path(), ec);
+    }
+
+    Evict();
+    if (entries_.size() > max_entries) {
+        Forget();
+    }
+}
+
+boost::filesystem::path
+WfdeCompressedCache::Lookup(const boost::filesystem::path& path)
+{
+    FileId key;
+    if (!FileId::Get(path, key)
+        || !options_.UseCompressedVariant(path, key.size)) {
+        return {};
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if ((entries_.size() >= max_entries) && !entries_.count(key)) {
+        Forget();
+    }
+
+    auto& entry = entries_[key];
+    entry.last_used = ++clock_;
+
+    if (entry.state == State::READY) {
+        return GetCachePath(key);
+    }
+
+    if ((entry.state != State::COUNTING)
+        || (++entry.requests < options_.compressed_min_requests)) {
+        return {};
+    }
+
+    if (queue_.size() >= max_queue_len) {
+        LOG_TRACE1_FN << "The queue is full. Not compressing "
+            << log::Esc(path.string());
+        return {};
+    }
+
+    LOG_TRACE1_FN << "Queuing " << log::Esc(path.string())
+        << " for compression";
+
+    entry.state = State::QUEUED;
+    queue_.push_back({key, path});
+    cond_.notify_all();
+    return {};
+}
+
+boost::filesystem::path WfdeCompressedCache::Peek(const FileId& id) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = entries_.find(id);
+    if ((it != entries_.end()) && (it->second.state == State::READY)) {
+        it->second.last_used = ++clock_;
+        return GetCachePath(id);
+    }
+
+    return {};
+}
+
+std::uint64_t WfdeCompressedCache::GetCacheSize() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cache_size_;
+}
+
+void WfdeCompressedCache::WaitForIdle()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return queue_.empty() && !busy_; });
+}
+
+std::size_t WfdeCompressedCache::GetNumCompressions() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_compressions_;
+}
+
+void WfdeCompressedCache::Run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while(!stop_) {
+        if (queue_.empty()) {
+            busy_ = false;
+            cond_.notify_all();
+            cond_.wait(lock);
+            continue;
+        }
+
+        const auto job = move(queue_.front());
+        queue_.pop_front();
+        busy_ = true;
+        const auto dst = GetCachePath(job.key);
+
+        lock.unlock();
+        std::uint64_t size = 0;
+        auto state = State::FAILED;
+        try {
+            state = Compress(job, dst, size);
+        } WAR_CATCH_ERROR;
+        lock.lock();
+        ++num_compressions_;
+
+        // Queued entries are never evicted or forgotten
+        auto it = entries_.find(job.key);
+        WAR_ASSERT(it != entries_.end());
+        if (it == entries_.end()) {
+            continue;
+        }
+
+        if ((state == State::READY) && (size > options_.compressed_cache_size)) {
+            boost::system::error_code ec;
+            boost::filesystem::remove(dst, ec);
+            state = State::FAILED;
+        }
+
+        it->second.state = state;
+        if (state == State::READY) {
+            it->second.size = size;
+            it->second.last_used = ++clock_;
+            cache_size_ += size;
+            Evict();
+        }
+    }
+
+    busy_ = false;
+    cond_.notify_all();
+}
+
+WfdeCompressedCache::State
+WfdeCompressedCache::Compress(const Job& job,
+                              const boost::filesystem::path& dst,
+                              std::uint64_t& size)
+{
+    const auto tmp = dst.string() + ".tmp";
+    const auto fail = [&tmp](const char *why) {
+        boost::system::error_code ec;
+        boost::filesystem::remove(tmp, ec);
+        LOG_DEBUG_FN << why;
+        return State::FAILED;
+    };
+
+    LOG_DEBUG_FN << "Compressing " << log::Esc(job.path.string())
+        << " to " << log::Esc(dst.string());
+
+    const int fd = ::open(job.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return fail("Failed to open the file");
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    const auto mode = "wb"s + to_string(options_.compressed_level);
+    auto gz = gzopen(tmp.c_str(), mode.c_str());
+    if (!gz) {
+        ::close(fd);
+        return fail("gzopen failed");
+    }
+
+    std::vector<char> buffer(io_buffer_size);
+    ssize_t bytes = 0;
+    bool ok = true;
+    while(ok && ((bytes = ::read(fd, buffer.data(), buffer.size())) > 0)) {
+        ok = !stop_
+            && (gzwrite(gz, buffer.data(), static_cast<unsigned>(bytes)) == bytes);
+    }
+
+    // We will not send this data from the page-cache
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+
+    if ((gzclose(gz) != Z_OK) || !ok || (bytes < 0)) {
+        return fail("Compression failed");
+    }
+
+    // The file may have been changed while we compressed it
+    FileId key;
+    if (!FileId::Get(job.path, key) || !(key == job.key)) {
+        return fail("The file was changed during compression");
+    }
+
+    size = boost::filesystem::file_size(tmp);
+    if ((size / 9) > (job.key.size / 10)) {
+        fail("The file does not compress well");
+
+        const auto marker = GetCachePath(job.key, poor_suffix);
+        const int mfd = ::open(marker.c_str(),
+                               O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (mfd >= 0) {
+            ::close(mfd);
+        }
+        return State::POOR;
+    }
+
+    boost::filesystem::rename(tmp, dst);
+
+    LOG_DEBUG_FN << "Compressed " << log::Esc(job.path.string())
+        << " from " << job.key.size << " to " << size << " bytes";
+    return State::READY;
+}
+
+/*! Remove the least recently used copies until we are within the limit
+ *
+ * Must be called with the mutex locked.
+ */
+void WfdeCompressedCache::Evict()
+{
+    while(cache_size_ > options_.compressed_cache_size) {
+        auto victim = entries_.end();
+        for(auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if ((it->second.state == State::READY)
+                && ((victim == entries_.end())
+                    || (it->second.last_used < victim->second.last_used))) {
+                victim = it;
+            }
+        }
+
+        if (victim == entries_.end()) {
+            break;
+        }
+
+        const auto path = GetCachePath(victim->first);
+        LOG_TRACE1_FN << "Evicting " << log::Esc(path.string());
+
+        // Readers that have the file open can still complete
+        boost::system::error_code ec;
+        boost::filesystem::remove(path, ec);
+        cache_size_ -= victim->second.size;
+        entries_.erase(victim);
+    }
+}
+
+/*! Forget the least recently used half of the files we have no copy of
+ *
+ * This keeps the memory, and the number of ".poor" markers, bounded
+ * when a lot of different files are requested.
+ * Must be called with the mutex locked.
+ */
+void WfdeCompressedCache::Forget()
+{
+    std::vector<decltype(entries_)::iterator> candidates;
+    for(auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if ((it->second.state != State::READY)
+            && (it->second.state != State::QUEUED)) {
+            candidates.push_back(it);
+        }
+    }
+
+    const auto num = (candidates.size() + 1) / 2;
+    std::nth_element(candidates.begin(), candidates.begin() + num,
+                     candidates.end(), [](const auto& a, const auto& b) {
+        return a->second.last_used < b->second.last_used;
+    });
+
+    LOG_TRACE1_FN << "Forgetting " << num << " of " << entries_.size()
+        << " files";
+
+    for(size_t i = 0; i < num; ++i) {
+        if (candidates[i]->second.state == State::POOR) {
+            boost::system::error_code ec;
+            boost::filesystem::remove(
+                GetCachePath(candidates[i]->first, poor_suffix), ec);
+        }
+        entries_.erase(candidates[i]);
+    }
+}
+
+} // namespace impl
+
+const std::string& CompressedCache::GetSuffix()
+{
+    static const std::string suffix{".gz"};
+    return suffix;
+}
+
+CompressedCache::ptr_t CompressedCache::Create(const TransferOptions& options)
+{
+    return make_shared<impl::WfdeCompressedCache>(options);
+}
+
+} // namespace wfde
+} // namespace war
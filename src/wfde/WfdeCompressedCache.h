@@ -0,0 +1,93 @@
+#pragma once
+
+#include <map>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include <boost/filesystem.hpp>
+
+#include <wfde/wfde.h>
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Host-wide CompressedCache implementation
+ *
+ * The copies are stored as "<device>-<inode>-<mtime>-<size>.gz" in
+ * the cache directory, so they survive a restart of the server. A
+ * single worker thread compresses the queued files, one at the time.
+ * When the cache grows beyond its size limit, the least recently used
+ * copies are deleted.
+ *
+ * A file is queued when it has been requested compressed_min_requests
+ * times, so that one-off downloads don't cost a compression. Files that
+ * don't compress well get an empty "<device>-<inode>-<mtime>-<size>.poor"
+ * marker, so that we don't waste time on them again after a restart.
+ */
+class WfdeCompressedCache : public CompressedCache
+{
+public:
+    WfdeCompressedCache(const TransferOptions& options);
+    ~WfdeCompressedCache();
+
+    boost::filesystem::path Lookup(const boost::filesystem::path& path) override;
+    boost::filesystem::path Peek(const FileId& id) const override;
+    std::uint64_t GetCacheSize() const override;
+
+    /*! Wait until the work queue is empty. Used by the unit tests. */
+    void WaitForIdle();
+
+    /*! Number of files we have tried to compress. Used by the unit tests. */
+    std::size_t GetNumCompressions() const;
+
+private:
+    enum class State {
+        COUNTING, // Not yet requested often enough
+        QUEUED,
+        READY,
+        FAILED, // Don't try again until the file changes
+        POOR // Like FAILED, but remembered across restarts
+    };
+
+    struct Entry {
+        State state = State::COUNTING;
+        unsigned requests = 0;
+        std::uint64_t size = 0; // Size of the compressed copy
+        mutable std::uint64_t last_used = 0;
+    };
+
+    struct Job {
+        FileId key;
+        boost::filesystem::path path;
+    };
+
+    boost::filesystem::path GetCachePath(const FileId& key,
+                                         const std::string& suffix) const;
+    boost::filesystem::path GetCachePath(const FileId& key) const {
+        return GetCachePath(key, GetSuffix());
+    }
+    void Load();
+    void Run();
+    State Compress(const Job& job, const boost::filesystem::path& dst,
+                   std::uint64_t& size);
+    void Evict();
+    void Forget();
+
+    const TransferOptions options_;
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+    std::map<FileId, Entry> entries_;
+    std::deque<Job> queue_;
+    std::uint64_t cache_size_ = 0;
+    mutable std::uint64_t clock_ = 0; // Incremented for each use
+    std::size_t num_compressions_ = 0;
+    bool busy_ = false; // The worker is compressing a file
+    std::atomic_bool stop_{false};
+    std::thread worker_;
+};
+
+}}} // namespaces
@@ -41,7 +41,7 @@ void WfdeConfigurationPropertyTree::SetValue(const char* path, string value)
     data_.put(ToPath(path), value);
 }
 
-Configuration::node_enum_t WfdeConfigurationPropertyTree::EnumNodes(const char* path)
+Configuration::node_enum_t WfdeConfigurationPropertyTree::EnumNodes(const char* path) const
 {
     Configuration::node_enum_t rval;
 
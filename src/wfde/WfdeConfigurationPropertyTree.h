@@ -46,7 +46,7 @@ public:
             conf_->SetValue((root_path_ + Sep(path) + path).c_str(), value);
         }
 
-        node_enum_t EnumNodes(const char *path) override {
+        node_enum_t EnumNodes(const char *path) const override {
             return conf_->EnumNodes((root_path_ + Sep(path) + path).c_str());
         }
 
@@ -80,7 +80,7 @@ public:
 
     void SetValue(const char* path, std::string value) override;
 
-    node_enum_t EnumNodes(const char* path) override;
+    node_enum_t EnumNodes(const char* path) const override;
 
     static auto CreateInstance(const std::string& path) {
         // Must use new, since make_shared don't has access to the
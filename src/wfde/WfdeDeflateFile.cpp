@@ -0,0 +1,200 @@
+#include "war_wfde.h"
+#include "WfdeDeflateFile.h"
+
+#include <warlib/WarLog.h>
+#include <warlib/error_handling.h>
+
+
+using namespace std;
+using namespace std::string_literals;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+
+WfdeDeflateFile::WfdeDeflateFile(unique_ptr< File > file, const int level)
+: file_{std::move(file)}, level_{level}
+{
+    LOG_DEBUG_FN << "Wrapping " << *file_ << " for deflate transfer"
+        << (IsReading() ? " with level "s + to_string(level_) : ""s);
+
+    if (IsReading()) {
+        Check(deflateInit(&strm_, level_), "deflateInit");
+    } else {
+        Check(inflateInit(&strm_), "inflateInit");
+    }
+}
+
+WfdeDeflateFile::~WfdeDeflateFile()
+{
+    if (IsReading()) {
+        deflateEnd(&strm_);
+    } else {
+        inflateEnd(&strm_);
+    }
+}
+
+void WfdeDeflateFile::Check(const int rval, const char *operation) const
+{
+    if (rval == Z_OK) {
+        return;
+    }
+
+    if (rval == Z_MEM_ERROR) {
+        throw std::bad_alloc();
+    }
+
+    LOG_WARN_FN << operation << " failed on " << *file_ << ": "
+        << (strm_.msg ? strm_.msg : zError(rval));
+
+    WAR_THROW_T(ExceptionIoError, operation + " failed: "s
+        + (strm_.msg ? strm_.msg : zError(rval)));
+}
+
+void WfdeDeflateFile::Reset()
+{
+    Check(IsReading() ? deflateReset(&strm_) : inflateReset(&strm_),
+          "Reset");
+    strm_.next_in = nullptr;
+    strm_.avail_in = 0;
+    input_eof_ = stream_end_ = false;
+}
+
+/*! Compress the next part of the file */
+File::const_buffer_t WfdeDeflateFile::Read(size_t bytes)
+{
+    WAR_ASSERT(IsReading());
+
+    const auto len = bytes ? min(bytes, GetSegmentSize()) : GetSegmentSize();
+    if (buffer_.size() < len) {
+        buffer_.resize(len);
+    }
+
+    strm_.next_out = reinterpret_cast<Bytef *>(buffer_.data());
+    strm_.avail_out = static_cast<uInt>(len);
+
+    while(strm_.avail_out && !stream_end_) {
+        if (!strm_.avail_in && !input_eof_) {
+            if (file_->IsEof()) {
+                input_eof_ = true;
+            } else {
+                // The buffer is valid until the next Read() on file_
+                auto in = file_->Read();
+                strm_.next_in = reinterpret_cast<Bytef *>(
+                    const_cast<void *>(in.data()));
+                strm_.avail_in = static_cast<uInt>(boost::asio::buffer_size(in));
+                if (!strm_.avail_in && !file_->IsEof()) {
+                    break; // Nothing available right now
+                }
+            }
+        }
+
+        const auto rval = deflate(&strm_,
+            (input_eof_ && !strm_.avail_in) ? Z_FINISH : Z_NO_FLUSH);
+
+        if (rval == Z_STREAM_END) {
+            stream_end_ = true;
+        } else if (rval != Z_BUF_ERROR) {
+            Check(rval, "deflate");
+        }
+    }
+
+    const auto compressed = len - strm_.avail_out;
+
+#ifdef DEBUG
+    LOG_TRACE4_F_FN(log::LA_IO) << "Deflate: compressed=" << compressed
+        << ", total_in=" << strm_.total_in
+        << ", total_out=" << strm_.total_out
+        << ' ' << *this;
+#endif
+
+    return {buffer_.data(), compressed};
+}
+
+File::mutable_buffer_t WfdeDeflateFile::Write(const size_t bytes)
+{
+    WAR_ASSERT(!IsReading());
+
+    const auto len = bytes ? min(bytes, GetSegmentSize()) : GetSegmentSize();
+    if (buffer_.size() < len) {
+        buffer_.resize(len);
+    }
+
+    return {buffer_.data(), len};
+}
+
+/*! Decompress the received data to the wrapped file */
+void WfdeDeflateFile::SetBytesWritten(const size_t bytes)
+{
+    WAR_ASSERT(bytes <= buffer_.size());
+
+    if (stream_end_) {
+        if (bytes) {
+            LOG_WARN_FN << "Ignoring " << bytes
+                << " bytes received after the end of the deflate stream "
+                << *this;
+        }
+        return;
+    }
+
+    strm_.next_in = reinterpret_cast<Bytef *>(buffer_.data());
+    strm_.avail_in = static_cast<uInt>(bytes);
+
+    // Loop until we have consumed the input, and the inflater has no
+    // more pending output for us.
+    do {
+        auto wr_buf = file_->Write();
+        const auto wr_len = boost::asio::buffer_size(wr_buf);
+        WAR_ASSERT(wr_len > 0);
+
+        strm_.next_out = static_cast<Bytef *>(wr_buf.data());
+        strm_.avail_out = static_cast<uInt>(wr_len);
+
+        const auto rval = inflate(&strm_, Z_NO_FLUSH);
+        file_->SetBytesWritten(wr_len - strm_.avail_out);
+
+        if (rval == Z_STREAM_END) {
+            stream_end_ = true;
+        } else if (rval == Z_BUF_ERROR) {
+            break; // Need more input
+        } else {
+            Check(rval, "inflate");
+        }
+    } while(!stream_end_ && (strm_.avail_in || !strm_.avail_out));
+
+#ifdef DEBUG
+    LOG_TRACE4_F_FN(log::LA_IO) << "Inflate: bytes=" << bytes
+        << ", total_in=" << strm_.total_in
+        << ", total_out=" << strm_.total_out
+        << ' ' << *this;
+#endif
+}
+
+void WfdeDeflateFile::Seek(fpos_t pos)
+{
+    // Restart the stream at the new position
+    file_->Seek(pos);
+    Reset();
+}
+
+bool WfdeDeflateFile::IsEof() const
+{
+    if (IsReading()) {
+        return stream_end_;
+    }
+    return file_->IsEof();
+}
+
+void WfdeDeflateFile::Close()
+{
+    file_->Close();
+
+    // An empty upload is accepted as an empty file
+    if (!IsReading() && !stream_end_ && strm_.total_in) {
+        WAR_THROW_T(ExceptionIoError, "The deflate stream was truncated");
+    }
+}
+
+
+}}} // namespaces
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+
+#include <zlib.h>
+
+#include "WfdeFile.h"
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Wrapper around a File to compress or decompress the data with deflate
+ *
+ * Required by the FTP Deflate Transmission Mode (MODE Z). When the
+ * file is opened for reading, Read() returns a zlib stream with the
+ * compressed content of the wrapped file. When the file is opened for
+ * writing, the data written is expected to be a zlib stream, and it
+ * is decompressed before it is written to the wrapped file.
+ */
+class WfdeDeflateFile : public File
+{
+public:
+    /*!
+     * \param file The file to wrap
+     * \param level Compression level, from 0 (no compression) to 9
+     *      (best compression). Ignored when writing.
+     */
+    WfdeDeflateFile(std::unique_ptr<File> file, int level = Z_DEFAULT_COMPRESSION);
+    ~WfdeDeflateFile();
+
+    const_buffer_t Read(std::size_t bytes) override;
+    mutable_buffer_t Write(size_t bytes = 0) override;
+    void SetBytesWritten(size_t bytes) override;
+    void SetBytesWrittenToHandle(size_t bytes) override {
+        WAR_ASSERT(false && "Not implemented");
+        WAR_THROW_T(ExceptionNotImplemented, "Not implemented");
+    }
+    void Reserve(std::uint64_t bytes) override { file_->Reserve(bytes); }
+    void Sync() override { file_->Sync(); }
+    void Seek(fpos_t pos) override;
+    fpos_t GetPos() const override { return file_->GetPos(); }
+    fpos_t GetSize() const override { return file_->GetSize(); }
+    bool IsEof() const override;
+    void Close() override;
+    FileOperation GetOperation() const override { return file_->GetOperation(); }
+    const boost::uuids::uuid& GetUuid() const override { return file_->GetUuid(); }
+    std::size_t GetSegmentSize() const noexcept override {
+        return file_->GetSegmentSize();
+    }
+    // The data is compressed, so the raw file can not be used directly
+    int GetNativeHandle() const noexcept override { return -1; }
+    const Stats& GetStats() const noexcept override {
+        return file_->GetStats();
+    }
+
+    /*! Number of compressed bytes sent or received so far */
+    std::uint64_t GetCompressedBytes() const noexcept {
+        return IsReading() ? strm_.total_out : strm_.total_in;
+    }
+
+private:
+    bool IsReading() const noexcept {
+        return file_->GetOperation() == FileOperation::READ;
+    }
+    void Reset();
+    void Check(int rval, const char *operation) const;
+
+    std::unique_ptr<File> file_;
+    const int level_;
+    z_stream strm_ = {};
+    std::vector<char> buffer_; // Compressed data
+    bool input_eof_ = false; // We have consumed all the data from file_
+    bool stream_end_ = false; // The zlib stream is complete
+};
+
+}}} // namespaces
@@ -0,0 +1,244 @@
+#include "war_wfde.h"
+#include "WfdeEolConverter.h"
+
+#include <cstring>
+
+#include <warlib/error_handling.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#   define WFDE_EOL_WITH_SSE2 1
+#   include <emmintrin.h>
+#endif
+
+#if defined(WFDE_EOL_WITH_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#   define WFDE_EOL_WITH_AVX2 1
+#   include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#   include <intrin.h>
+#endif
+
+using namespace std;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+namespace {
+
+inline bool IsEolChar(const char ch) noexcept {
+    return (ch == '\n') || (ch == '\r');
+}
+
+// Handle one '\r' or '\n'
+inline char *EmitEol(const char ch, char *dst, const char *eol,
+                     const size_t eolLen) noexcept {
+    if (ch == '\n') {
+        memcpy(dst, eol, eolLen);
+        dst += eolLen;
+    }
+    return dst;
+}
+
+inline unsigned CountTrailingZeros(unsigned v) noexcept {
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanForward(&index, v);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctz(v));
+#endif
+}
+
+// Copy a block where mask has a bit set for each '\r' or '\n'
+inline char *ConvertBlock(const char *src, const size_t blockLen, unsigned mask,
+                          char *dst, const char *eol,
+                          const size_t eolLen) noexcept {
+    size_t pos = 0;
+    while(mask) {
+        const auto i = CountTrailingZeros(mask);
+        memcpy(dst, src + pos, i - pos);
+        dst += i - pos;
+        dst = EmitEol(src[i], dst, eol, eolLen);
+        pos = i + 1;
+        mask &= mask - 1;
+    }
+    memcpy(dst, src + pos, blockLen - pos);
+    return dst + (blockLen - pos);
+}
+
+size_t ConvertScalar(const char *src, const size_t len, char *dst,
+                     const char *eol, const size_t eolLen) noexcept
+{
+    const char *p = src;
+    const char *const end = src + len;
+    char *d = dst;
+
+    while(p < end) {
+        const char *run = p;
+        while((p < end) && !IsEolChar(*p)) {
+            ++p;
+        }
+
+        memcpy(d, run, p - run);
+        d += p - run;
+
+        if (p < end) {
+            d = EmitEol(*p, d, eol, eolLen);
+            ++p;
+        }
+    }
+
+    return d - dst;
+}
+
+#ifdef WFDE_EOL_WITH_SSE2
+size_t ConvertSse2(const char *src, const size_t len, char *dst,
+                   const char *eol, const size_t eolLen) noexcept
+{
+    const auto nl = _mm_set1_epi8('\n');
+    const auto cr = _mm_set1_epi8('\r');
+    const char *p = src;
+    const char *const end = src + len;
+    char *d = dst;
+
+    while((end - p) >= 16) {
+        const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        const auto mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr))));
+
+        if (mask == 0) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(d), v);
+            d += 16;
+        } else {
+            d = ConvertBlock(p, 16, mask, d, eol, eolLen);
+        }
+        p += 16;
+    }
+
+    return (d - dst) + ConvertScalar(p, end - p, d, eol, eolLen);
+}
+#endif
+
+#ifdef WFDE_EOL_WITH_AVX2
+__attribute__((target("avx2")))
+size_t ConvertAvx2(const char *src, const size_t len, char *dst,
+                   const char *eol, const size_t eolLen) noexcept
+{
+    const auto nl = _mm256_set1_epi8('\n');
+    const auto cr = _mm256_set1_epi8('\r');
+    const char *p = src;
+    const char *const end = src + len;
+    char *d = dst;
+
+    while((end - p) >= 32) {
+        const auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        const auto mask = static_cast<unsigned>(_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, cr))));
+
+        if (mask == 0) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(d), v);
+            d += 32;
+        } else {
+            d = ConvertBlock(p, 32, mask, d, eol, eolLen);
+        }
+        p += 32;
+    }
+
+    return (d - dst) + ConvertSse2(p, end - p, d, eol, eolLen);
+}
+#endif
+
+auto GetConvertFunction(EolConverter::Implementation implementation)
+    -> decltype(&ConvertScalar)
+{
+    WAR_ASSERT(EolConverter::IsSupported(implementation));
+
+    switch(implementation) {
+#ifdef WFDE_EOL_WITH_AVX2
+        case EolConverter::Implementation::AVX2:
+            return ConvertAvx2;
+#endif
+#ifdef WFDE_EOL_WITH_SSE2
+        case EolConverter::Implementation::SSE2:
+            return ConvertSse2;
+#endif
+        default:
+            return ConvertScalar;
+    }
+}
+
+} // anonymous namespace
+
+
+EolConverter::EolConverter(const string& eol)
+: EolConverter(eol, GetBestImplementation())
+{
+}
+
+EolConverter::EolConverter(const string& eol, Implementation implementation)
+: eol_{eol}
+, implementation_{implementation}
+, convert_{GetConvertFunction(implementation)}
+{
+    WAR_ASSERT(!eol_.empty());
+}
+
+size_t EolConverter::Convert(const char *src, size_t len, char *dst) const noexcept
+{
+    return convert_(src, len, dst, eol_.data(), eol_.size());
+}
+
+EolConverter::Implementation EolConverter::GetBestImplementation() noexcept
+{
+    static const auto best = [] {
+        if (IsSupported(Implementation::AVX2)) {
+            return Implementation::AVX2;
+        }
+        if (IsSupported(Implementation::SSE2)) {
+            return Implementation::SSE2;
+        }
+        return Implementation::SCALAR;
+    }();
+
+    return best;
+}
+
+bool EolConverter::IsSupported(Implementation implementation) noexcept
+{
+    switch(implementation) {
+        case Implementation::SCALAR:
+            return true;
+        case Implementation::SSE2:
+#ifdef WFDE_EOL_WITH_SSE2
+            return true;
+#else
+            return false;
+#endif
+        case Implementation::AVX2:
+#ifdef WFDE_EOL_WITH_AVX2
+            return __builtin_cpu_supports("avx2");
+#else
+            return false;
+#endif
+    }
+
+    return false;
+}
+
+const char *EolConverter::GetName(Implementation implementation) noexcept
+{
+    switch(implementation) {
+        case Implementation::SCALAR:
+            return "scalar";
+        case Implementation::SSE2:
+            return "sse2";
+        case Implementation::AVX2:
+            return "avx2";
+    }
+
+    return "unknown";
+}
+
+}}} // namespaces
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Fast conversion of line-endings for ASCII transfers
+ *
+ * Removes all '\r' characters and replaces '\n' with the configured
+ * end-of-line sequence. With "\r\n" this converts local text to the
+ * FTP ASCII format. With the local EOL it converts the other way.
+ *
+ * On x86 CPU's, the input is scanned 16 or 32 bytes at the time with
+ * SSE2 or AVX2 instructions, and the data between the line-endings is
+ * copied in bulk. The implementation is selected at runtime.
+ */
+class EolConverter
+{
+public:
+    enum class Implementation {
+        SCALAR,
+        SSE2,
+        AVX2
+    };
+
+    /*! Use the fastest implementation the CPU supports */
+    EolConverter(const std::string& eol);
+
+    EolConverter(const std::string& eol, Implementation implementation);
+
+    /*! Convert len bytes from src into dst
+     *
+     * \param dst Buffer with room for at least len * GetMaxExpansion()
+     *      bytes.
+     * \return Number of bytes written to dst
+     */
+    std::size_t Convert(const char *src, std::size_t len, char *dst) const noexcept;
+
+    /*! How many bytes one input byte can expand to */
+    std::size_t GetMaxExpansion() const noexcept { return eol_.size(); }
+
+    Implementation GetImplementation() const noexcept { return implementation_; }
+
+    /*! Get the fastest implementation the CPU supports */
+    static Implementation GetBestImplementation() noexcept;
+
+    /*! Returns true if the implementation can be used on this CPU */
+    static bool IsSupported(Implementation implementation) noexcept;
+
+    static const char *GetName(Implementation implementation) noexcept;
+
+private:
+    using convert_fn_t = std::size_t (*)(const char *src, std::size_t len,
+                                         char *dst, const char *eol,
+                                         std::size_t eolLen);
+
+    const std::string eol_;
+    const Implementation implementation_;
+    const convert_fn_t convert_;
+};
+
+}}} // namespaces
@@ -1,11 +1,26 @@
 
 #include "war_wfde.h"
 #include "WfdeFile.h"
+#include "WfdeIdGenerator.h"
+#ifndef WIN32
+#   include "WfdeBufferedFile.h"
+#endif
 #include <warlib/uuid.h>
 #include <warlib/WarLog.h>
 #include "wfde/ftp_protocol.h"
 #include <warlib/error_handling.h>
 
+#include <tuple>
+
+#ifndef WIN32
+#   include <unistd.h>
+#endif
+
+#ifdef __linux__
+#   include <fcntl.h>
+#   include <errno.h>
+#endif
+
 using namespace std;
 using namespace std::string_literals;
 
@@ -14,6 +29,17 @@ std::ostream& operator << (std::ostream& o, const war::wfde::File& f) {
     return o << "{File " << boost::uuids::to_string(f.GetUuid()) << '}';
 }
 
+std::ostream& operator << (std::ostream& o,
+                           const war::wfde::File::Stats& stats) {
+
+    return o << "{remaps=" << stats.remaps
+        << ", window_size=" << stats.window_size
+        << ", read_ahead_bytes=" << stats.read_ahead_bytes
+        << ", shared_windows=" << stats.shared_windows
+        << ", write_back_bytes=" << stats.write_back_bytes
+        << ", dropped_bytes=" << stats.dropped_bytes << '}';
+}
+
 std::ostream& operator << (std::ostream& o,
                            const war::wfde::File::FileOperation& op) {
 
@@ -29,13 +55,83 @@ std::ostream& operator << (std::ostream& o,
 
 namespace war {
 namespace wfde {
+
+bool FileId::operator == (const FileId& id) const noexcept
+{
+    return std::tie(device, inode, mtime, size)
+        == std::tie(id.device, id.inode, id.mtime, id.size);
+}
+
+bool FileId::operator < (const FileId& id) const noexcept
+{
+    return std::tie(device, inode, mtime, size)
+        < std::tie(id.device, id.inode, id.mtime, id.size);
+}
+
+bool FileId::Get(const boost::filesystem::path& path, FileId& id)
+{
+#ifdef WIN32
+    boost::system::error_code ec;
+    if (!boost::filesystem::is_regular_file(path, ec)) {
+        return false;
+    }
+
+    id = {};
+    id.size = boost::filesystem::file_size(path, ec);
+    id.mtime = static_cast<int64_t>(
+        boost::filesystem::last_write_time(path, ec)) * 1000000000LL;
+    return !ec;
+#else
+    struct stat st = {};
+    if ((::stat(path.c_str(), &st) != 0) || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    id = FromStat(st);
+    return true;
+#endif
+}
+
+#ifndef WIN32
+FileId FileId::FromStat(const struct stat& st) noexcept
+{
+    FileId id;
+    id.device = st.st_dev;
+    id.inode = st.st_ino;
+    id.mtime = (static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL)
+        + st.st_mtim.tv_nsec;
+    id.size = st.st_size;
+    return id;
+}
+#endif
+
 namespace impl {
 
 
-WfdeFile::WfdeFile(const boost::filesystem::path& path, FileOperation operation)
+namespace {
+
+std::size_t AlignToPage(const std::size_t bytes, const std::size_t pageSize) {
+    const auto pages = std::max<std::size_t>(1, (bytes + pageSize - 1) / pageSize);
+    return pages * pageSize;
+}
+
+// Upper limit for how much we pre-allocate when an upload grows
+constexpr std::size_t max_grow_size = 1024 * 1024 * 256;
+
+} // anonymous namespace
+
+WfdeFile::WfdeFile(const boost::filesystem::path& path, FileOperation operation,
+                   const TransferOptions& options)
 : path_{path}
 , operation_{operation}
-, id_(boost::uuids::random_generator()())
+, id_(WfdeIdGenerator::NextUuid())
+, min_window_{AlignToPage(options.min_window, segment_size_)}
+, max_window_{AlignToPage(std::max(options.min_window, options.max_window),
+                          segment_size_)}
+, grow_size_{max_window_}
+, read_ahead_windows_{options.read_ahead_windows}
+, write_back_{options.write_back_window}
+, drop_behind_{max_window_}
 {
     bool must_exist = true;
     bool truncate_if_exists = false;
@@ -83,6 +179,11 @@ WfdeFile::WfdeFile(const boost::filesystem::path& path, FileOperation operation)
     end_of_file_pos_ = file_size_ = boost::filesystem::file_size(path_);
     MapFile();
 
+    if ((operation == FileOperation::READ)
+        && options.UseDropBehind(path_, file_size_)) {
+        drop_behind_.Enable(GetNativeHandle());
+    }
+
     if (operation == FileOperation::APPEND) {
         Seek(end_of_file_pos_);
     }
@@ -102,27 +203,20 @@ File::const_buffer_t WfdeFile::Read(std::size_t bytes)
 
 File::mutable_buffer_t WfdeFile::Write(size_t bytes)
 {
-    if (!bytes)
-        bytes = segment_size_;
+    // If the caller has no preference, give it the rest of the window
+    const auto want = bytes ? bytes : window_size_;
 
-    auto min_file_size = pos_ + bytes + segment_size_;
+    auto min_file_size = pos_ + want + segment_size_;
     if (min_file_size > GetSize()) {
 
         auto align = (min_file_size % segment_size_) ? segment_size_ : 0;
         auto segments = (min_file_size / segment_size_);
         min_file_size = std::max((segments * segment_size_) + align, GetSize() + grow_size_);
 
-#ifdef DEBUG
-        LOG_TRACE4_F_FN(log::LA_IO) << "Enlarging the file " << *this
-            << ' ' << log::Esc(path_.string()) << ' '
-            << " from " << GetSize() << " to " << min_file_size << " bytes";
-#endif
+        Enlarge(min_file_size);
 
-#ifdef WIN32
-        UnmapFile();
-#endif
-        boost::filesystem::resize_file(path_, min_file_size);
-        file_size_ = min_file_size;
+        // Grow geometrically, so that large uploads get few, large extents
+        grow_size_ = std::max(grow_size_, std::min(grow_size_ * 2, max_grow_size));
     }
 
     auto b = GetBufferValues(bytes);
@@ -156,6 +250,93 @@ void WfdeFile::SetBytesWritten(size_t bytes)
 
     if (end_of_file_pos_ < pos_)
         end_of_file_pos_ = pos_;
+
+    write_back_.OnWritten(GetNativeHandle(), pos_, stats_);
+}
+
+void WfdeFile::SetBytesWrittenToHandle(size_t bytes)
+{
+    WAR_ASSERT(mode_ == boost::interprocess::read_write);
+
+    // The kernel extends the file as needed, so there is no
+    // pre-allocated space to truncate here.
+    pos_ += bytes;
+
+    if (file_size_ < pos_)
+        file_size_ = pos_;
+
+    if (end_of_file_pos_ < pos_)
+        end_of_file_pos_ = pos_;
+
+    write_back_.OnWritten(GetNativeHandle(), pos_, stats_);
+}
+
+void WfdeFile::Reserve(std::uint64_t bytes)
+{
+    WAR_ASSERT(mode_ == boost::interprocess::read_write);
+
+    const auto want = AlignToPage(pos_ + bytes, segment_size_);
+    if (want <= static_cast<std::uint64_t>(GetSize())) {
+        return;
+    }
+
+    LOG_TRACE4_F_FN(log::LA_IO) << "Reserving " << bytes << " bytes at "
+        << pos_ << " for " << *this;
+
+    Enlarge(want);
+}
+
+void WfdeFile::Sync()
+{
+    WAR_ASSERT(mode_ == boost::interprocess::read_write);
+
+#ifdef WIN32
+    if (have_mapped_region_) {
+        region_.flush(0, 0, false);
+    }
+#else
+    const auto fd = GetNativeHandle();
+    if (fd < 0) {
+        return;
+    }
+
+    // Release the pre-allocated space first, so that we don't
+    // sync a file-size that is about to change.
+    if (do_truncate_ && (file_size_ > end_of_file_pos_)) {
+        UmapRegion();
+        if (::ftruncate(fd, end_of_file_pos_) != 0) {
+            throw boost::system::system_error(errno, boost::system::system_category());
+        }
+        file_size_ = end_of_file_pos_;
+    }
+
+    LOG_TRACE4_F_FN(log::LA_IO) << "Syncing " << *this;
+
+    if (::fdatasync(fd) != 0) {
+        throw boost::system::system_error(errno, boost::system::system_category());
+    }
+#endif
+}
+
+void WfdeFile::Enlarge(fpos_t newSize)
+{
+    WAR_ASSERT(newSize > GetSize());
+
+#ifdef DEBUG
+    LOG_TRACE4_F_FN(log::LA_IO) << "Enlarging the file " << *this
+        << ' ' << log::Esc(path_.string()) << ' '
+        << " from " << GetSize() << " to " << newSize << " bytes";
+#endif
+
+#ifdef WIN32
+    UnmapFile();
+#endif
+    // Remove the unused space when we close, also if we run out of space
+    // half way trough.
+    do_truncate_ = true;
+    AllocateDiskSpace(GetNativeHandle(), path_, GetSize(),
+                      newSize - GetSize(), false);
+    file_size_ = newSize;
 }
 
 pair< File::fpos_t, size_t > WfdeFile::GetBufferValues(const std::size_t bytes)
@@ -188,30 +369,73 @@ pair< File::fpos_t, size_t > WfdeFile::GetBufferValues(const std::size_t bytes)
 }
 
 
+bool WfdeFile::CanUseRegion(const std::size_t wantBytes) const
+{
+    if (!have_mapped_region_
+        || (pos_ < region_start_)
+        || (pos_ >= region_end_)) {
+        return false;
+    }
+
+    // Don't hand out tiny buffers at the end of the window if
+    // the file continues beyond it.
+    const auto min_bytes = std::min<fpos_t>(wantBytes ? wantBytes : segment_size_,
+                                            GetSize() - pos_);
+    return (region_end_ - pos_) >= min_bytes;
+}
+
 void WfdeFile::MapRegion(const std::size_t wantBytes)
 {
     if (!have_mapped_file_) {
         MapFile();
     }
+
+    if (CanUseRegion(wantBytes)) {
+        return;
+    }
+
     const auto file_size = GetSize();
     auto start_segment = pos_ / segment_size_;
-    region_start_ = start_segment * segment_size_;
-    const auto max_region_size = wantBytes
-        ? std::min(wantBytes + segment_size_, region_limit_) : region_limit_;
+    const auto new_start = start_segment * segment_size_;
+
+    // Grow the window as long as the file is accessed sequentially.
+    // Start over with a small window after a seek.
+    if (stats_.remaps) {
+        if ((new_start >= region_start_) && (new_start <= region_end_)) {
+            window_size_ = std::min(window_size_ * 2, max_window_);
+        } else {
+            window_size_ = min_window_;
+        }
+    }
+
+    region_start_ = new_start;
+    const auto max_region_size = std::max<fpos_t>(window_size_,
+        (pos_ - region_start_) + wantBytes);
     const auto region_len = min(max_region_size, file_size - region_start_);
 
+    UmapRegion();
     region_ = boost::interprocess::mapped_region(file_, mode_, region_start_,
                                                  region_len);
     have_mapped_region_ = true;
+    region_end_ = region_start_ + region_len;
     region_.advise(boost::interprocess::mapped_region::advice_sequential);
 
+    ++stats_.remaps;
+    stats_.window_size = window_size_;
+
+    if (operation_ == FileOperation::READ) {
+        // Nothing before the new window is mapped anymore
+        drop_behind_.OnConsumed(GetNativeHandle(), region_start_, stats_);
+        ReadAhead();
+    }
+
 #ifdef DEBUG
 #define VAL(v) v << hex << "(0x" << v << ')' << dec
     LOG_TRACE4_F_FN(log::LA_IO) << "Mapping file " << *this
         << " pos_=" << VAL(pos_)
         << ", region_start_=" << VAL(region_start_)
         << ", region_len=" << VAL(region_len)
-        << ", region_limit_=" << VAL(region_limit_)
+        << ", window_size_=" << VAL(window_size_)
         << ", file_size=" << VAL(file_size)
         << ", start_segment=" << VAL(start_segment)
         << ", [ofs from ptr]=" << VAL(pos_ - region_start_);
@@ -219,6 +443,54 @@ void WfdeFile::MapRegion(const std::size_t wantBytes)
 #endif
 }
 
+void WfdeFile::ReadAhead()
+{
+    if (!read_ahead_windows_ || !have_mapped_file_) {
+        return;
+    }
+
+    // Start the IO for the current window. This is non-blocking.
+    if (have_mapped_region_) {
+        region_.advise(boost::interprocess::mapped_region::advice_willneed);
+    }
+
+#ifdef __linux__
+    // Let the kernel load the next windows in the background, so that
+    // we don't stall on page-faults when we move on. When nothing is
+    // mapped (zero-copy sends), we assume the largest window.
+    const auto window = have_mapped_region_ ? window_size_ : max_window_;
+    const auto start = std::max(pos_, region_end_);
+    const auto from = std::max(read_ahead_pos_, start);
+    const auto to = std::min<fpos_t>(start + (window * read_ahead_windows_),
+                                     GetSize());
+
+    // Avoid a syscall for every small step forward
+    if ((to <= from) || (((to - from) < (window / 2)) && (to < GetSize()))) {
+        return;
+    }
+
+    const auto fd = GetNativeHandle();
+    if (fd < 0) {
+        return;
+    }
+
+    const auto err = posix_fadvise(fd, static_cast<off_t>(from),
+                                   static_cast<off_t>(to - from),
+                                   POSIX_FADV_WILLNEED);
+    if (err) {
+        LOG_DEBUG_FN << "posix_fadvise failed with error " << err
+            << " on " << *this;
+        return;
+    }
+
+    LOG_TRACE4_F_FN(log::LA_IO) << "Read-ahead of " << (to - from)
+        << " bytes at offset " << from << " in " << *this;
+
+    read_ahead_pos_ = to;
+    stats_.read_ahead_bytes += to - from;
+#endif
+}
+
 void WfdeFile::Seek(File::fpos_t pos)
 {
     const auto len = GetSize();
@@ -230,7 +502,35 @@ void WfdeFile::Seek(File::fpos_t pos)
     }
 
     LOG_TRACE4_F_FN(log::LA_IO) << "Setting pos to " << pos << " in " << *this;
+    const auto prev_pos = pos_;
     pos_ = pos;
+
+    if (mode_ == boost::interprocess::read_write) {
+        write_back_.Reset(pos_);
+    }
+
+    // The zero-copy send path moves trough the file with Seek(), without
+    // mapping any windows.
+    if (operation_ == FileOperation::READ) {
+        if (pos_ < prev_pos) {
+            read_ahead_pos_ = 0;
+        }
+        drop_behind_.OnConsumed(GetNativeHandle(),
+            have_mapped_region_ ? std::min(pos_, region_start_) : pos_,
+            stats_);
+        ReadAhead();
+    }
+}
+
+int WfdeFile::GetNativeHandle() const noexcept
+{
+#ifdef WIN32
+    return -1;
+#else
+    if (!have_mapped_file_)
+        return -1;
+    return file_.get_mapping_handle().handle;
+#endif
 }
 
 void WfdeFile::Close()
@@ -256,4 +556,176 @@ void WfdeFile::Close()
 }
 
 
-}}} // namespaces
+void WriteBackControl::OnWritten(int fd, File::fpos_t pos, File::Stats& stats)
+{
+    if (!window_ || (fd < 0)) {
+        return;
+    }
+
+    if (pos < start_) {
+        Reset(pos);
+        return;
+    }
+
+    if (static_cast<std::size_t>(pos - start_) < window_) {
+        return;
+    }
+
+#ifdef __linux__
+    // Start write-back for the new range
+    if (::sync_file_range(fd, start_, pos - start_, SYNC_FILE_RANGE_WRITE) != 0) {
+        LOG_DEBUG_FN << "sync_file_range failed with error " << errno;
+        return;
+    }
+
+    stats.write_back_bytes += pos - start_;
+
+    // Release the previous range from the page-cache. We are on the
+    // pipeline thread, so we must not wait for its write-back to
+    // complete. Pages that are still under write-back are left alone
+    // by the kernel, and the dirty-page throttling takes care of
+    // uploads that outrun the disk.
+    if (start_ > prev_start_) {
+        const auto err = posix_fadvise(fd, static_cast<off_t>(prev_start_),
+                                       static_cast<off_t>(start_ - prev_start_),
+                                       POSIX_FADV_DONTNEED);
+        if (err) {
+            LOG_DEBUG_FN << "posix_fadvise failed with error " << err;
+        }
+    }
+#endif
+
+    prev_start_ = start_;
+    start_ = pos;
+}
+
+void DropBehindControl::Enable(int fd)
+{
+    if (fd < 0) {
+        return;
+    }
+
+    enabled_ = true;
+
+#ifdef __linux__
+    const auto err = posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (err) {
+        LOG_DEBUG_FN << "posix_fadvise failed with error " << err;
+    }
+#endif
+}
+
+void DropBehindControl::OnConsumed(int fd, File::fpos_t pos, File::Stats& stats)
+{
+    if (!enabled_ || (fd < 0)) {
+        return;
+    }
+
+    if (pos < dropped_) {
+        // We seeked backwards. Start over from here.
+        dropped_ = pos;
+        return;
+    }
+
+    if (static_cast<std::size_t>(pos - dropped_) < window_) {
+        return;
+    }
+
+#ifdef __linux__
+    const auto err = posix_fadvise(fd, static_cast<off_t>(dropped_),
+                                   static_cast<off_t>(pos - dropped_),
+                                   POSIX_FADV_DONTNEED);
+    if (err) {
+        LOG_DEBUG_FN << "posix_fadvise failed with error " << err;
+        return;
+    }
+
+    LOG_TRACE4_F_FN(log::LA_IO) << "Dropped " << (pos - dropped_)
+        << " bytes at offset " << dropped_ << " from the page-cache";
+
+    stats.dropped_bytes += pos - dropped_;
+#endif
+    dropped_ = pos;
+}
+
+void AllocateDiskSpace(int fd, const boost::filesystem::path& path,
+                       File::fpos_t offset, File::fpos_t len, bool keepSize)
+{
+#ifdef __linux__
+    if (fd >= 0) {
+        const int rval = ::fallocate(fd, keepSize ? FALLOC_FL_KEEP_SIZE : 0,
+                                     static_cast<off_t>(offset),
+                                     static_cast<off_t>(len));
+        if (rval == 0) {
+            return;
+        }
+
+        const auto err = errno;
+        if ((err == ENOSPC) || (err == EFBIG)) {
+            LOG_WARN_FN << "Out of disk-space when allocating " << len
+                << " bytes for " << log::Esc(path.string());
+            WAR_THROW_T(ExceptionDiskFull, path.string());
+        }
+
+        if ((err != EOPNOTSUPP) && (err != ENOSYS)) {
+            throw boost::system::system_error(err, boost::system::system_category());
+        }
+
+        LOG_TRACE4_F_FN(log::LA_IO) << "fallocate() is not supported for "
+            << log::Esc(path.string());
+    }
+#endif
+
+    if (keepSize) {
+        return; // Nothing we can do
+    }
+
+    try {
+        boost::filesystem::resize_file(path, offset + len);
+    } catch(const boost::filesystem::filesystem_error& ex) {
+        if ((ex.code() == boost::system::errc::no_space_on_device)
+            || (ex.code() == boost::system::errc::file_too_large)) {
+            WAR_THROW_T(ExceptionDiskFull, path.string());
+        }
+        throw;
+    }
+}
+
+} // namespace impl
+
+std::unique_ptr<File> CreateDiskFile(const boost::filesystem::path& path,
+                                     File::FileOperation operation,
+                                     const TransferOptions& options,
+                                     FileCache *cache)
+{
+    const auto backend = options.GetBackend(path);
+
+    if (backend == TransferOptions::Backend::MMAP) {
+        if (cache && (operation == File::FileOperation::READ)) {
+            // Files we drop from the page-cache are not expected to be hot,
+            // so there is no point in sharing them.
+            bool drop_behind = false;
+            if (options.drop_behind_threshold
+                || !options.drop_behind_paths.empty()) {
+                boost::system::error_code ec;
+                const auto size = boost::filesystem::file_size(path, ec);
+                drop_behind = options.UseDropBehind(path, ec ? 0 : size);
+            }
+
+            if (!drop_behind) {
+                return cache->Open(path);
+            }
+        }
+        return make_unique<impl::WfdeFile>(path, operation, options);
+    }
+
+#ifdef WIN32
+    LOG_WARN_FN << "The " << backend << " file backend is not available "
+        << "on this platform. Using mmap.";
+    return make_unique<impl::WfdeFile>(path, operation, options);
+#else
+    return make_unique<impl::WfdeBufferedFile>(path, operation, options, backend);
+#endif
+}
+
+}} // namespaces
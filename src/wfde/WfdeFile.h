@@ -13,10 +13,63 @@ namespace war {
 namespace wfde {
 namespace impl {
 
+/*! Rolling write-back for uploads
+ *
+ * Starts write-back of each window of data as soon as it is
+ * written, and drops the window before that from the page-cache.
+ * This keeps the amount of dirty memory for a transfer small,
+ * rather than letting the kernel flush it in large bursts later on.
+ * Nothing here blocks; it is called from the pipeline thread.
+ */
+class WriteBackControl
+{
+public:
+    WriteBackControl(std::size_t window) : window_{window} {}
+
+    /*! Data up to pos is written to fd */
+    void OnWritten(int fd, File::fpos_t pos, File::Stats& stats);
+
+    /*! The write position moved to pos */
+    void Reset(File::fpos_t pos) { start_ = prev_start_ = pos; }
+
+private:
+    const std::size_t window_; // 0 if disabled
+    File::fpos_t start_ = 0; // Start of the range not yet handed to the kernel
+    File::fpos_t prev_start_ = 0; // Start of the range in write-back
+};
+
+/*! Drop downloaded data from the page-cache behind the reader
+ *
+ * Used for huge files that are unlikely to be read again soon, so that
+ * they don't evict the hot files from the cache.
+ */
+class DropBehindControl
+{
+public:
+    DropBehindControl(std::size_t window) : window_{window} {}
+
+    /*! Start dropping data from the file
+     *
+     * Also tells the kernel that we will read the file sequentially.
+     */
+    void Enable(int fd);
+
+    bool IsEnabled() const noexcept { return enabled_; }
+
+    /*! The data before pos is no longer needed */
+    void OnConsumed(int fd, File::fpos_t pos, File::Stats& stats);
+
+private:
+    const std::size_t window_;
+    bool enabled_ = false;
+    File::fpos_t dropped_ = 0; // Data before this is dropped
+};
+
 class WfdeFile : public File
 {
 public:
-    WfdeFile(const boost::filesystem::path& path, FileOperation operation);
+    WfdeFile(const boost::filesystem::path& path, FileOperation operation,
+             const TransferOptions& options = {});
     ~WfdeFile();
 
     struct ExceptionSeekBeoindEof : public ExceptionBase {};
@@ -24,6 +77,9 @@ public:
     const_buffer_t Read(std::size_t bytes) override;
     mutable_buffer_t Write(size_t bytes = 0) override;
     void SetBytesWritten(size_t bytes) override;
+    void SetBytesWrittenToHandle(size_t bytes) override;
+    void Reserve(std::uint64_t bytes) override;
+    void Sync() override;
     void Seek(fpos_t pos) override;
     fpos_t GetPos() const override { return pos_; }
     fpos_t GetSize() const override { return file_size_; }
@@ -32,12 +88,17 @@ public:
     FileOperation GetOperation() const override { return operation_; }
     const boost::uuids::uuid& GetUuid() const override { return id_; }
     std::size_t GetSegmentSize() const noexcept override {
-        return segment_size_;
+        return min_window_;
     }
+    int GetNativeHandle() const noexcept override;
+    const Stats& GetStats() const noexcept override { return stats_; }
 
 private:
     void MapRegion(const std::size_t wantBytes); // Map the region_ according to pos_
+    bool CanUseRegion(const std::size_t wantBytes) const;
+    void ReadAhead(); // Ask the kernel to load the next windows
     std::pair<std::size_t, std::size_t> GetBufferValues(const std::size_t bytes);
+    void Enlarge(fpos_t newSize);
     void MapFile() {
         UmapRegion();
         file_ = boost::interprocess::file_mapping(path_.string().c_str(), mode_);
@@ -48,6 +109,7 @@ private:
         if (have_mapped_region_) {
             region_ = boost::interprocess::mapped_region();
             have_mapped_region_ = false;
+            region_end_ = 0;
         }
     }
 
@@ -67,9 +129,14 @@ private:
     boost::interprocess::mapped_region region_;
     boost::interprocess::mode_t mode_ = boost::interprocess::read_only;
     const std::size_t segment_size_ = region_.get_page_size();
-    const std::size_t region_limit_ = (segment_size_ * 8);
-    const std::size_t grow_size_ = region_limit_ * 128;
+    const std::size_t min_window_; // Page-aligned
+    const std::size_t max_window_; // Page-aligned
+    std::size_t grow_size_; // Doubles each time we enlarge the file
+    std::size_t window_size_ = min_window_; // Adapts between min and max
+    const unsigned read_ahead_windows_;
+    fpos_t read_ahead_pos_ = 0; // End of the range we have asked the kernel to load
     fpos_t region_start_ = 0;
+    fpos_t region_end_ = 0; // region_start_ + region_.get_size()
     fpos_t file_size_ = 0; // Actual length of file
     fpos_t end_of_file_pos_ = -1; // The "real" eof, determined by initial
         // file size, and the bytes we have actually appended to this.
@@ -79,8 +146,29 @@ private:
     bool closed_ = false;
     bool have_mapped_region_ = false;
     bool have_mapped_file_ = false;
+    WriteBackControl write_back_;
+    DropBehindControl drop_behind_;
+    Stats stats_;
 };
 
+/*! Allocate disk-space for a file
+ *
+ * Uses fallocate() where it is available. Falls back to
+ * resize_file() (which gives a sparse file) if the file-system
+ * don't support it.
+ *
+ * \param fd Native handle for the file, opened for writing. May be -1.
+ * \param path The path to the file
+ * \param offset Start of the range to allocate
+ * \param len Length of the range to allocate
+ * \param keepSize If true, the size of the file is not changed.
+ *      Only used when fallocate() is supported.
+ *
+ * \exception ExceptionDiskFull if there is not enough space
+ */
+void AllocateDiskSpace(int fd, const boost::filesystem::path& path,
+                       File::fpos_t offset, File::fpos_t len, bool keepSize);
+
 
 }}} // namespaces
 
@@ -0,0 +1,349 @@
+
+#include "war_wfde.h"
+#include "WfdeFileCache.h"
+#include "WfdeIdGenerator.h"
+#include <warlib/uuid.h>
+#include <warlib/WarLog.h>
+#include <warlib/error_handling.h>
+
+#ifndef WIN32
+#   include <sys/types.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#endif
+
+using namespace std;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+namespace {
+
+std::size_t AlignToPage(const std::size_t bytes) {
+    const auto page_size = boost::interprocess::mapped_region::get_page_size();
+    const auto pages = std::max<std::size_t>(1, (bytes + page_size - 1) / page_size);
+    return pages * page_size;
+}
+
+// Sweep the cache for closed files every this many opens, and
+// a shared file for unused windows every this many mappings.
+constexpr unsigned sweep_interval = 64;
+
+} // anonymous namespace
+
+SharedFile::SharedFile(const boost::filesystem::path& path,
+                       std::size_t windowSize)
+: path_{path}
+, file_{path.string().c_str(), boost::interprocess::read_only}
+, window_size_{windowSize}
+{
+#ifdef WIN32
+    size_ = boost::filesystem::file_size(path_);
+#else
+    struct stat st = {};
+    if (::fstat(GetNativeHandle(), &st) != 0) {
+        throw boost::system::system_error(errno, boost::system::system_category());
+    }
+    size_ = st.st_size;
+#endif
+}
+
+SharedFile::region_t SharedFile::GetWindow(File::fpos_t offset, bool& shared)
+{
+    WAR_ASSERT((offset % window_size_) == 0);
+    WAR_ASSERT(offset < size_);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto& slot = windows_[offset];
+    if (auto region = slot.lock()) {
+        shared = true;
+        return region;
+    }
+
+    const auto len = std::min<File::fpos_t>(window_size_, size_ - offset);
+    auto region = make_shared<boost::interprocess::mapped_region>(
+        file_, boost::interprocess::read_only, offset, len);
+    region->advise(boost::interprocess::mapped_region::advice_sequential);
+    slot = region;
+    shared = false;
+
+    // Forget windows that nobody use anymore
+    if (++maps_since_sweep_ >= sweep_interval) {
+        for(auto it = windows_.begin(); it != windows_.end();) {
+            if (it->second.expired()) {
+                it = windows_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        maps_since_sweep_ = 0;
+    }
+
+    return region;
+}
+
+int SharedFile::GetNativeHandle() const noexcept
+{
+#ifdef WIN32
+    return -1;
+#else
+    return file_.get_mapping_handle().handle;
+#endif
+}
+
+
+WfdeCachedFile::WfdeCachedFile(std::shared_ptr<SharedFile> file,
+                               const TransferOptions& options)
+: file_{move(file)}
+, size_{file_->GetSize()}
+, id_(WfdeIdGenerator::NextUuid())
+, read_ahead_windows_{options.read_ahead_windows}
+{
+    stats_.window_size = file_->GetWindowSize();
+}
+
+WfdeCachedFile::~WfdeCachedFile()
+{
+    Close();
+}
+
+File::const_buffer_t WfdeCachedFile::Read(std::size_t bytes)
+{
+    if (!file_) {
+        WAR_THROW_T(ExceptionIoError, "The file is closed");
+    }
+
+    if (pos_ >= size_) {
+        return {nullptr, 0};
+    }
+
+    const auto window_size = file_->GetWindowSize();
+    if (!region_
+        || (pos_ < region_start_)
+        || (pos_ >= static_cast<fpos_t>(region_start_ + region_->get_size()))) {
+
+        bool shared = false;
+        region_.reset();
+        region_start_ = (pos_ / window_size) * window_size;
+        region_ = file_->GetWindow(region_start_, shared);
+        ++stats_.remaps;
+        if (shared) {
+            ++stats_.shared_windows;
+        }
+
+        LOG_TRACE4_F_FN(log::LA_IO) << "Using "
+            << (shared ? "shared" : "new") << " window at offset "
+            << region_start_ << " for " << *this;
+
+        ReadAhead();
+    }
+
+    const size_t offset = pos_ - region_start_;
+    const size_t seg_len = region_->get_size() - offset;
+    const size_t use_len = bytes ? std::min(bytes, seg_len) : seg_len;
+
+    pos_ += use_len;
+
+    return {static_cast<const char *>(region_->get_address()) + offset, use_len};
+}
+
+File::mutable_buffer_t WfdeCachedFile::Write(size_t bytes)
+{
+    WAR_ASSERT(false && "Cached files are read-only");
+    WAR_THROW_T(ExceptionAccessDenied, "Cached files are read-only");
+}
+
+void WfdeCachedFile::SetBytesWritten(size_t bytes)
+{
+    WAR_ASSERT(false && "Cached files are read-only");
+    WAR_THROW_T(ExceptionAccessDenied, "Cached files are read-only");
+}
+
+void WfdeCachedFile::SetBytesWrittenToHandle(size_t bytes)
+{
+    WAR_ASSERT(false && "Cached files are read-only");
+    WAR_THROW_T(ExceptionAccessDenied, "Cached files are read-only");
+}
+
+void WfdeCachedFile::Reserve(std::uint64_t bytes)
+{
+    WAR_ASSERT(false && "Cached files are read-only");
+    WAR_THROW_T(ExceptionAccessDenied, "Cached files are read-only");
+}
+
+void WfdeCachedFile::Seek(File::fpos_t pos)
+{
+    if (pos > size_) {
+        LOG_NOTICE_FN << "Seek beoind EOF, file-size=" << size_
+            << ", requested position=" << pos
+            << ' ' << *this;
+        WAR_THROW_T(ExceptionSeekBeoindEof, boost::uuids::to_string(id_));
+    }
+
+    LOG_TRACE4_F_FN(log::LA_IO) << "Setting pos to " << pos << " in " << *this;
+    if (pos < pos_) {
+        read_ahead_pos_ = 0;
+    }
+    pos_ = pos;
+
+    // The zero-copy send path moves trough the file with Seek()
+    ReadAhead();
+}
+
+void WfdeCachedFile::ReadAhead()
+{
+#ifdef __linux__
+    if (!read_ahead_windows_ || !file_) {
+        return;
+    }
+
+    const auto window = file_->GetWindowSize();
+    const auto start = region_ ? std::max<fpos_t>(pos_, region_start_ + region_->get_size())
+        : pos_;
+    const auto from = std::max(read_ahead_pos_, start);
+    const auto to = std::min<fpos_t>(start + (window * read_ahead_windows_),
+                                     size_);
+
+    // Avoid a syscall for every small step forward
+    if ((to <= from) || (((to - from) < (window / 2)) && (to < size_))) {
+        return;
+    }
+
+    const auto err = posix_fadvise(file_->GetNativeHandle(),
+                                   static_cast<off_t>(from),
+                                   static_cast<off_t>(to - from),
+                                   POSIX_FADV_WILLNEED);
+    if (err) {
+        LOG_DEBUG_FN << "posix_fadvise failed with error " << err
+            << " on " << *this;
+        return;
+    }
+
+    read_ahead_pos_ = to;
+    stats_.read_ahead_bytes += to - from;
+#endif
+}
+
+void WfdeCachedFile::Close()
+{
+    if (file_) {
+        LOG_TRACE2_FN << "Closing " << *this;
+        region_.reset();
+        file_.reset();
+    }
+}
+
+size_t WfdeCachedFile::GetSegmentSize() const noexcept
+{
+    return stats_.window_size;
+}
+
+int WfdeCachedFile::GetNativeHandle() const noexcept
+{
+    return file_ ? file_->GetNativeHandle() : -1;
+}
+
+
+WfdeFileCache::WfdeFileCache(const TransferOptions& options)
+: options_{options}
+, window_size_{AlignToPage(std::max(options.min_window, options.max_window))}
+{
+}
+
+WfdeFileCache::key_t WfdeFileCache::GetKey(const boost::filesystem::path& path)
+{
+    key_t key;
+
+    if (!FileId::Get(path, key.first)) {
+        LOG_NOTICE_FN << "The path " << log::Esc(path.string())
+            << " is not a regular file";
+        WAR_THROW_T(ExceptionNotFound, "Not a file");
+    }
+
+    if (key.first.inode == 0) {
+        key.second = path.string();
+    }
+
+    return key;
+}
+
+std::unique_ptr<File> WfdeFileCache::Open(const boost::filesystem::path& path)
+{
+    const auto key = GetKey(path);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (++opens_since_sweep_ >= sweep_interval) {
+            Sweep();
+        }
+
+        auto it = files_.find(key);
+        if (it != files_.end()) {
+            if (auto file = it->second.lock()) {
+                LOG_TRACE2_FN << "Sharing the open file "
+                    << log::Esc(path.string());
+                return make_unique<WfdeCachedFile>(move(file), options_);
+            }
+        }
+    }
+
+    // Opening the file may be slow, for example on NFS, so we don't
+    // hold the lock while we do it.
+    //
+    // If the file was replaced after we called GetKey(), the new
+    // file will have a different size or mtime the next time, so
+    // this entry will not be used again.
+    auto opened = make_shared<SharedFile>(path, window_size_);
+    shared_ptr<SharedFile> file;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        // Someone else may have opened it meanwhile
+        auto& slot = files_[key];
+        file = slot.lock();
+        if (file) {
+            LOG_TRACE2_FN << "Sharing the open file "
+                << log::Esc(path.string());
+        } else {
+            slot = opened;
+            file = move(opened);
+        }
+    }
+
+    return make_unique<WfdeCachedFile>(move(file), options_);
+}
+
+std::size_t WfdeFileCache::GetNumOpenFiles() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return count_if(files_.begin(), files_.end(), [](const auto& v) {
+        return !v.second.expired();
+    });
+}
+
+void WfdeFileCache::Sweep()
+{
+    for(auto it = files_.begin(); it != files_.end();) {
+        if (it->second.expired()) {
+            it = files_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    opens_since_sweep_ = 0;
+}
+
+} // namespace impl
+
+FileCache::ptr_t FileCache::Create(const TransferOptions& options)
+{
+    return make_shared<impl::WfdeFileCache>(options);
+}
+
+}} // namespaces
+
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <memory>
+
+#include <boost/filesystem.hpp>
+#include <boost/uuid/uuid.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <wfde/wfde.h>
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! A file that is open for reading by one or more sessions
+ *
+ * Windows are mapped at fixed offsets, so that readers at the same
+ * position in the file share the same mapping.
+ */
+class SharedFile
+{
+public:
+    using region_t = std::shared_ptr<const boost::interprocess::mapped_region>;
+
+    SharedFile(const boost::filesystem::path& path, std::size_t windowSize);
+    SharedFile(const SharedFile&) = delete;
+    SharedFile& operator = (const SharedFile&) = delete;
+
+    /*! Get the window that starts at offset
+     *
+     * \param offset Offset into the file. Must be aligned to the window size.
+     * \param shared Set to true if the window was already mapped.
+     */
+    region_t GetWindow(File::fpos_t offset, bool& shared);
+
+    const boost::filesystem::path& GetPath() const noexcept { return path_; }
+    File::fpos_t GetSize() const noexcept { return size_; }
+    std::size_t GetWindowSize() const noexcept { return window_size_; }
+    int GetNativeHandle() const noexcept;
+
+private:
+    const boost::filesystem::path path_;
+    const boost::interprocess::file_mapping file_;
+    const std::size_t window_size_;
+    File::fpos_t size_ = 0;
+    std::mutex mutex_;
+    std::map<File::fpos_t, std::weak_ptr<const boost::interprocess::mapped_region>> windows_;
+    unsigned maps_since_sweep_ = 0;
+};
+
+/*! Read-only file that use the windows of a SharedFile */
+class WfdeCachedFile : public File
+{
+public:
+    WfdeCachedFile(std::shared_ptr<SharedFile> file,
+                   const TransferOptions& options);
+    ~WfdeCachedFile();
+
+    struct ExceptionSeekBeoindEof : public ExceptionBase {};
+
+    const_buffer_t Read(std::size_t bytes) override;
+    mutable_buffer_t Write(size_t bytes = 0) override;
+    void SetBytesWritten(size_t bytes) override;
+    void SetBytesWrittenToHandle(size_t bytes) override;
+    void Reserve(std::uint64_t bytes) override;
+    void Sync() override {}
+    void Seek(fpos_t pos) override;
+    fpos_t GetPos() const override { return pos_; }
+    fpos_t GetSize() const override { return size_; }
+    bool IsEof() const override { return pos_ >= size_; }
+    void Close() override;
+    FileOperation GetOperation() const override { return FileOperation::READ; }
+    const boost::uuids::uuid& GetUuid() const override { return id_; }
+    std::size_t GetSegmentSize() const noexcept override;
+    int GetNativeHandle() const noexcept override;
+    const Stats& GetStats() const noexcept override { return stats_; }
+
+private:
+    void ReadAhead();
+
+    fpos_t pos_ = 0;
+    std::shared_ptr<SharedFile> file_;
+    const fpos_t size_;
+    const boost::uuids::uuid id_;
+    const unsigned read_ahead_windows_;
+    SharedFile::region_t region_;
+    fpos_t region_start_ = 0;
+    fpos_t read_ahead_pos_ = 0;
+    Stats stats_;
+};
+
+/*! Host-wide FileCache implementation */
+class WfdeFileCache : public FileCache
+{
+public:
+    WfdeFileCache(const TransferOptions& options);
+
+    std::unique_ptr<File> Open(const boost::filesystem::path& path) override;
+    std::size_t GetNumOpenFiles() const override;
+
+private:
+    // Identifies a version of a file on disk. The path is only
+    // used if we don't have inode numbers.
+    using key_t = std::pair<FileId, std::string>;
+
+    static key_t GetKey(const boost::filesystem::path& path);
+    void Sweep();
+
+    const TransferOptions options_;
+    const std::size_t window_size_;
+    mutable std::mutex mutex_;
+    std::map<key_t, std::weak_ptr<SharedFile>> files_;
+    unsigned opens_since_sweep_ = 0;
+};
+
+}}} // namespaces
+
@@ -0,0 +1,262 @@
+#include "war_wfde.h"
+
+#include <sstream>
+
+#include <warlib/WarLog.h>
+#include <warlib/error_handling.h>
+
+#include "WfdeHashCache.h"
+
+using namespace std;
+using namespace std::string_literals;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+namespace {
+// Don't rewrite small journals all the time
+constexpr size_t min_journal_lines = 1024;
+} // anonymous namespace
+
+WfdeHashCache::WfdeHashCache(const TransferOptions& options)
+: options_{options}
+, journal_path_{options.hash_cache_dir / "digests"}
+{
+    boost::filesystem::create_directories(options_.hash_cache_dir);
+    Load();
+
+    LOG_DEBUG_FN << "Using " << log::Esc(journal_path_.string())
+        << " for cached digests. " << entries_.size()
+        << " files are already in the cache.";
+}
+
+WfdeHashCache::~WfdeHashCache()
+{
+    Flush();
+}
+
+string WfdeHashCache::Get(const FileId& id,
+                          const HashEngine::Algorithm algorithm) const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    const auto it = entries_.find(id);
+    if (it == entries_.end()) {
+        return {};
+    }
+
+    return it->second.digests[static_cast<size_t>(algorithm)];
+}
+
+void WfdeHashCache::Add(const boost::filesystem::path& path,
+                        const FileId& id,
+                        const HashEngine::Algorithm algorithm,
+                        const string& digest)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    auto& entry = GetEntry(path, id);
+    auto& current = entry.digests[static_cast<size_t>(algorithm)];
+    if (current == digest) {
+        return;
+    }
+
+    current = digest;
+
+    LOG_TRACE1_FN << "Adding " << HashEngine::GetName(algorithm) << ' '
+        << digest << " for " << log::Esc(path.string());
+
+    ostringstream line;
+    journal_lines_ += Save(line, id, entry, algorithm);
+    pending_ += line.str();
+
+    Evict();
+}
+
+void WfdeHashCache::Flush()
+{
+    lock_guard<mutex> io_lock(io_mutex_);
+
+    string data;
+    bool compact = false;
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (journal_lines_ > max(entries_.size() * 2, min_journal_lines)) {
+            // The snapshot replaces the pending lines as well
+            data = Snapshot(journal_lines_);
+            pending_.clear();
+            compact = true;
+        } else {
+            swap(data, pending_);
+        }
+    }
+
+    if (compact) {
+        Rewrite(data);
+    } else if (journal_ && !data.empty()) {
+        journal_ << data;
+        journal_.flush();
+    }
+}
+
+size_t WfdeHashCache::GetNumEntries() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return entries_.size();
+}
+
+/*! Get or create the entry for a file
+ *
+ * Must be called with the mutex locked.
+ */
+WfdeHashCache::Entry& WfdeHashCache::GetEntry(
+    const boost::filesystem::path& path, const FileId& id)
+{
+    auto& entry = entries_[id];
+    if (entry.age == 0) {
+        entry.path = path;
+        entry.age = ++clock_;
+        by_age_[entry.age] = id;
+    }
+
+    return entry;
+}
+
+void WfdeHashCache::Load()
+{
+    std::ifstream in(journal_path_.string());
+    string line;
+    size_t lines = 0, bad_lines = 0;
+
+    while(getline(in, line)) {
+        ++lines;
+
+        istringstream parser(line);
+        FileId id;
+        string name, digest, path;
+        parser >> id.device >> id.inode >> id.mtime >> id.size
+            >> name >> digest;
+        parser.get(); // Space before the path
+        getline(parser, path);
+
+        if (!parser || path.empty() || digest.empty()) {
+            ++bad_lines;
+            continue;
+        }
+
+        try {
+            const auto algorithm = HashEngine::GetAlgorithm(name);
+            GetEntry(path, id).digests[static_cast<size_t>(algorithm)] = digest;
+        } catch(const ExceptionNotFound&) {
+            ++bad_lines;
+        }
+    }
+
+    if (bad_lines) {
+        LOG_WARN_FN << "Ignored " << bad_lines << " bad lines in "
+            << log::Esc(journal_path_.string());
+    }
+
+    // Drop the files that are changed or removed since we hashed them
+    for(auto it = entries_.begin(); it != entries_.end();) {
+        FileId id;
+        if (FileId::Get(it->second.path, id) && (id == it->first)) {
+            ++it;
+            continue;
+        }
+
+        LOG_TRACE1_FN << "Dropping " << log::Esc(it->second.path.string())
+            << " from the cache. The file is changed.";
+        by_age_.erase(it->second.age);
+        it = entries_.erase(it);
+    }
+
+    Evict();
+
+    LOG_TRACE1_FN << "Loaded " << entries_.size() << " files from "
+        << lines << " lines";
+
+    Rewrite(Snapshot(journal_lines_));
+}
+
+/*! Format the journal for the current entries
+ *
+ * Must be called with the mutex locked.
+ */
+string WfdeHashCache::Snapshot(size_t& lines) const
+{
+    ostringstream out;
+    lines = 0;
+    for(const auto& age : by_age_) {
+        const auto& entry = entries_.at(age.second);
+        for(size_t i = 0; i < entry.digests.size(); ++i) {
+            lines += Save(out, age.second, entry,
+                          static_cast<HashEngine::Algorithm>(i));
+        }
+    }
+
+    return out.str();
+}
+
+/*! Replace the journal
+ *
+ * Must be called with the io-mutex locked (or from the constructor).
+ */
+void WfdeHashCache::Rewrite(const string& data)
+{
+    const auto tmp = journal_path_.string() + ".tmp";
+
+    {
+        std::ofstream out(tmp, ios::out | ios::trunc);
+        out << data;
+        out.flush();
+        if (!out) {
+            LOG_ERROR_FN << "Failed to write " << log::Esc(tmp)
+                << ". The digests will not survive a restart.";
+            journal_.close();
+            return;
+        }
+    }
+
+    journal_.close();
+    boost::filesystem::rename(tmp, journal_path_);
+    journal_.open(journal_path_.string(), ios::out | ios::app);
+}
+
+/*! Write one digest to the journal
+ *
+ * Returns the number of lines written.
+ */
+size_t WfdeHashCache::Save(ostream& out, const FileId& id,
+                           const Entry& entry,
+                           const HashEngine::Algorithm algorithm) const
+{
+    const auto& digest = entry.digests[static_cast<size_t>(algorithm)];
+    const auto& path = entry.path.string();
+
+    // The path is the rest of the line
+    if (digest.empty() || (path.find('\n') != string::npos)) {
+        return 0;
+    }
+
+    out << id.device << ' ' << id.inode << ' ' << id.mtime << ' ' << id.size
+        << ' ' << HashEngine::GetName(algorithm) << ' ' << digest
+        << ' ' << path << '\n';
+    return 1;
+}
+
+/*! Drop the oldest entries until we are within the limit
+ *
+ * Must be called with the mutex locked.
+ */
+void WfdeHashCache::Evict()
+{
+    while(entries_.size() > options_.hash_cache_size) {
+        const auto oldest = by_age_.begin();
+        entries_.erase(oldest->second);
+        by_age_.erase(oldest);
+    }
+}
+
+}}} // namespaces
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <map>
+#include <array>
+#include <mutex>
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+
+#include <wfde/wfde.h>
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Persistent cache of the digests of whole files
+ *
+ * The digests are appended to a journal in the cache directory as
+ * they are added, one line per digest:
+ *
+ *      <device> <inode> <mtime> <size> <algorithm> <digest> <path>
+ *
+ * At startup, the journal is read back, and each file is stat()'ed.
+ * Entries for files that are changed or gone are dropped, and the
+ * journal is rewritten with what remains. The journal is also
+ * rewritten when it has grown to twice the number of entries.
+ *
+ * Add() only updates the memory. The file IO is done by Flush(),
+ * without holding the lock that Get() use, so that the owner can
+ * do it on a thread where blocking is acceptable.
+ */
+class WfdeHashCache
+{
+public:
+    WfdeHashCache(const TransferOptions& options);
+    ~WfdeHashCache();
+
+    /*! Get a digest, or an empty string if it's unknown */
+    std::string Get(const FileId& id, HashEngine::Algorithm algorithm) const;
+
+    void Add(const boost::filesystem::path& path,
+             const FileId& id,
+             HashEngine::Algorithm algorithm,
+             const std::string& digest);
+
+    /*! Write the digests added since the last call to the journal */
+    void Flush();
+
+    std::size_t GetNumEntries() const;
+
+private:
+    static constexpr std::size_t num_algorithms
+        = static_cast<std::size_t>(HashEngine::Algorithm::SHA512) + 1;
+
+    struct Entry {
+        boost::filesystem::path path;
+        std::array<std::string, num_algorithms> digests;
+        std::uint64_t age = 0; // Key in by_age_
+    };
+
+    Entry& GetEntry(const boost::filesystem::path& path, const FileId& id);
+    void Load();
+    std::string Snapshot(std::size_t& lines) const;
+    void Rewrite(const std::string& data);
+    std::size_t Save(std::ostream& out, const FileId& id,
+                     const Entry& entry, HashEngine::Algorithm algorithm) const;
+    void Evict();
+
+    const TransferOptions options_;
+    const boost::filesystem::path journal_path_;
+    mutable std::mutex mutex_;
+    std::map<FileId, Entry> entries_;
+    std::map<std::uint64_t, FileId> by_age_;
+    std::uint64_t clock_ = 0;
+    std::string pending_; // Journal lines not yet written
+    std::size_t journal_lines_ = 0; // Including the pending lines
+    std::mutex io_mutex_; // Serializes Flush()
+    std::ofstream journal_; // Protected by io_mutex_
+};
+
+}}} // namespaces
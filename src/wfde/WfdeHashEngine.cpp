@@ -0,0 +1,417 @@
+#include "war_wfde.h"
+
+#include <map>
+#include <atomic>
+#include <locale>
+
+#include <openssl/evp.h>
+#ifdef WFDE_WITH_ZLIB
+#   include <zlib.h>
+#endif
+
+#include <boost/algorithm/string.hpp>
+
+#include <warlib/WarLog.h>
+#include <warlib/error_handling.h>
+
+#include "WfdeHashEngine.h"
+
+using namespace std;
+using namespace std::string_literals;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+namespace {
+
+string ToHex(const unsigned char *data, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    hex.reserve(len * 2);
+    for(size_t i = 0; i < len; ++i) {
+        hex += digits[data[i] >> 4];
+        hex += digits[data[i] & 0x0f];
+    }
+    return hex;
+}
+
+using Digest = HashEngine::Digest;
+
+class EvpDigest : public Digest
+{
+public:
+    EvpDigest(const EVP_MD *md)
+    : ctx_{EVP_MD_CTX_new()}
+    {
+        if (!ctx_ || !EVP_DigestInit_ex(ctx_, md, nullptr)) {
+            EVP_MD_CTX_free(ctx_);
+            WAR_THROW_T(ExceptionNotImplemented, "EVP_DigestInit_ex failed");
+        }
+    }
+
+    ~EvpDigest() {
+        EVP_MD_CTX_free(ctx_);
+    }
+
+    void Update(const void *data, size_t len) override {
+        EVP_DigestUpdate(ctx_, data, len);
+    }
+
+    string Final() override {
+        unsigned char md[EVP_MAX_MD_SIZE] = {};
+        unsigned int len = 0;
+        EVP_DigestFinal_ex(ctx_, md, &len);
+        return ToHex(md, len);
+    }
+
+private:
+    EVP_MD_CTX *ctx_;
+};
+
+#ifdef WFDE_WITH_ZLIB
+class Crc32Digest : public Digest
+{
+public:
+    void Update(const void *data, size_t len) override {
+        // crc32() takes an uInt length
+        auto p = static_cast<const Bytef *>(data);
+        while(len) {
+            const auto chunk = static_cast<uInt>(
+                min<size_t>(len, numeric_limits<uInt>::max()));
+            crc_ = crc32(crc_, p, chunk);
+            p += chunk;
+            len -= chunk;
+        }
+    }
+
+    string Final() override { return ToHex(crc_); }
+
+    uLong GetCrc() const noexcept { return crc_; }
+
+    static string ToHex(uLong crc) {
+        const unsigned char bytes[] = {
+            static_cast<unsigned char>(crc >> 24),
+            static_cast<unsigned char>(crc >> 16),
+            static_cast<unsigned char>(crc >> 8),
+            static_cast<unsigned char>(crc)
+        };
+        return impl::ToHex(bytes, sizeof(bytes));
+    }
+
+private:
+    uLong crc_ = crc32(0L, Z_NULL, 0);
+};
+#endif
+
+/*! Feed the bytes [from, to) of the file to the digest */
+void HashRange(Digest& digest, const boost::filesystem::path& path,
+               const uint64_t from, const uint64_t to,
+               const TransferOptions& options)
+{
+    auto file = CreateDiskFile(path, File::FileOperation::READ, options);
+    if (from) {
+        file->Seek(from);
+    }
+
+    for(auto pos = from; (pos < to) && !file->IsEof();) {
+        const auto buffer = file->Read(static_cast<size_t>(
+            min<uint64_t>(to - pos, file->GetSegmentSize())));
+        const auto len = boost::asio::buffer_size(buffer);
+        digest.Update(buffer.data(), len);
+        pos += len;
+    }
+
+    file->Close();
+}
+
+} // anonymous namespace
+
+WfdeHashEngine::WfdeHashEngine(const TransferOptions& options)
+: options_{options}
+{
+    if (!options_.hash_cache_dir.empty()) {
+        cache_ = make_unique<WfdeHashCache>(options_);
+    }
+
+    for(unsigned i = 0; i < options_.hash_threads; ++i) {
+        workers_.emplace_back([this] { Run(); });
+    }
+}
+
+WfdeHashEngine::~WfdeHashEngine()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    for(auto& worker : workers_) {
+        worker.join();
+    }
+
+    // Let the owners of the pending requests know that
+    // they will not be served.
+    if (!queue_.empty()) {
+        LOG_DEBUG_FN << "Cancelling " << queue_.size() << " pending tasks";
+    }
+    for(auto& task : queue_) {
+        task(true);
+    }
+}
+
+void WfdeHashEngine::Post(task_t task)
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        queue_.push_back(move(task));
+    }
+    cond_.notify_one();
+}
+
+void WfdeHashEngine::Run()
+{
+    unique_lock<mutex> lock(mutex_);
+
+    while(true) {
+        cond_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (stop_) {
+            return;
+        }
+
+        auto task = move(queue_.front());
+        queue_.pop_front();
+
+        lock.unlock();
+        task(false);
+        lock.lock();
+    }
+}
+
+void WfdeHashEngine::Hash(const boost::filesystem::path& path,
+                          const Algorithm algorithm,
+                          const uint64_t from,
+                          uint64_t to,
+                          callback_t callback)
+{
+    FileId id;
+    if (cache_ && (from == 0) && FileId::Get(path, id)
+        && ((to == 0) || (to >= id.size))) {
+
+        const auto digest = cache_->Get(id, algorithm);
+        if (!digest.empty()) {
+            LOG_TRACE1_FN << "Using cached " << GetName(algorithm) << " for "
+                << log::Esc(path.string());
+            callback(digest, nullptr);
+            return;
+        }
+
+        // Remember the digest if the file is unchanged when we are done
+        callback = [this, path, id, algorithm, callback](
+            const string& digest, exception_ptr error) {
+
+            FileId now;
+            if (!error && FileId::Get(path, now) && (now == id)) {
+                // We are on a worker, so we can do the IO right away
+                cache_->Add(path, id, algorithm, digest);
+                cache_->Flush();
+            }
+            callback(digest, error);
+        };
+    }
+
+    Post([=](bool cancelled) {
+        try {
+            if (cancelled) {
+                WAR_THROW_T(ExceptionCancelled, "The hash engine is shutting down");
+            }
+
+            const auto size = boost::filesystem::file_size(path);
+            const auto end = ((to == 0) || (to > size)) ? size : to;
+            if (from > end) {
+                WAR_THROW_T(ExceptionOutOfRange, "Start of range is beyond EOF");
+            }
+
+            LOG_DEBUG_FN << "Computing " << GetName(algorithm) << " for "
+                << log::Esc(path.string()) << " [" << from << ", "
+                << end << ")";
+
+#ifdef WFDE_WITH_ZLIB
+            if ((algorithm == Algorithm::CRC32) && (workers_.size() > 1)
+                && ((end - from) > options_.hash_chunk_size)) {
+                HashInParallel(path, from, end, callback);
+                return;
+            }
+#endif
+            auto digest = CreateDigest(algorithm);
+            HashRange(*digest, path, from, end, options_);
+            callback(digest->Final(), nullptr);
+        } catch(...) {
+            LOG_DEBUG_FN << "Failed to hash " << log::Esc(path.string());
+            callback({}, current_exception());
+        }
+    });
+}
+
+/*! Compute the CRC of each chunk in it's own task, and combine them
+ * when the last one is done.
+ */
+void WfdeHashEngine::HashInParallel(const boost::filesystem::path& path,
+                                    const uint64_t from,
+                                    const uint64_t to,
+                                    callback_t callback)
+{
+#ifdef WFDE_WITH_ZLIB
+    struct Chunk {
+        uint64_t from = 0;
+        uint64_t to = 0;
+        uLong crc = 0;
+    };
+
+    struct Job {
+        vector<Chunk> chunks;
+        atomic_size_t remaining{0};
+        mutex error_mutex;
+        exception_ptr error;
+        callback_t callback;
+    };
+
+    auto job = make_shared<Job>();
+    job->callback = move(callback);
+    for(auto pos = from; pos < to; pos += options_.hash_chunk_size) {
+        job->chunks.push_back({pos, min(to, pos + options_.hash_chunk_size)});
+    }
+    job->remaining = job->chunks.size();
+
+    LOG_TRACE1_FN << "Splitting " << log::Esc(path.string()) << " in "
+        << job->chunks.size() << " chunks";
+
+    for(auto& chunk : job->chunks) {
+        Post([this, job, &chunk, path](bool cancelled) {
+            try {
+                if (cancelled) {
+                    WAR_THROW_T(ExceptionCancelled,
+                                "The hash engine is shutting down");
+                }
+
+                Crc32Digest digest;
+                HashRange(digest, path, chunk.from, chunk.to, options_);
+                chunk.crc = digest.GetCrc();
+            } catch(...) {
+                lock_guard<mutex> lock(job->error_mutex);
+                job->error = current_exception();
+            }
+
+            if (--job->remaining) {
+                return;
+            }
+
+            // We are the last one. The atomic decrement makes the
+            // other chunks' results visible here.
+            if (job->error) {
+                job->callback({}, job->error);
+                return;
+            }
+
+            auto crc = job->chunks.front().crc;
+            for(size_t i = 1; i < job->chunks.size(); ++i) {
+                const auto& c = job->chunks[i];
+                crc = crc32_combine(crc, c.crc,
+                                    static_cast<z_off_t>(c.to - c.from));
+            }
+            job->callback(Crc32Digest::ToHex(crc), nullptr);
+        });
+    }
+#endif
+}
+
+std::string WfdeHashEngine::GetCachedDigest(const FileId& id,
+                                            const Algorithm algorithm) const
+{
+    if (cache_) {
+        return cache_->Get(id, algorithm);
+    }
+
+    return {};
+}
+
+void WfdeHashEngine::AddDigest(const boost::filesystem::path& path,
+                               const FileId& id,
+                               const Algorithm algorithm,
+                               const std::string& digest)
+{
+    if (cache_) {
+        cache_->Add(path, id, algorithm, digest);
+
+        // The caller may be an IO pipeline. Leave the file IO to a worker,
+        // also if we are shutting down.
+        Post([this](bool /*cancelled*/) {
+            cache_->Flush();
+        });
+    }
+}
+
+} // namespace impl
+
+std::unique_ptr<HashEngine::Digest>
+HashEngine::CreateDigest(const Algorithm algorithm)
+{
+    switch(algorithm) {
+#ifdef WFDE_WITH_ZLIB
+        case Algorithm::CRC32:
+            return make_unique<impl::Crc32Digest>();
+#endif
+        case Algorithm::MD5:
+            return make_unique<impl::EvpDigest>(EVP_md5());
+        case Algorithm::SHA1:
+            return make_unique<impl::EvpDigest>(EVP_sha1());
+        case Algorithm::SHA256:
+            return make_unique<impl::EvpDigest>(EVP_sha256());
+        case Algorithm::SHA512:
+            return make_unique<impl::EvpDigest>(EVP_sha512());
+        default:
+            WAR_THROW_T(ExceptionNotImplemented, "Unsupported hash algorithm");
+    }
+}
+
+const std::vector<HashEngine::Algorithm>& HashEngine::GetAlgorithms()
+{
+    static const std::vector<Algorithm> algorithms = {
+#ifdef WFDE_WITH_ZLIB
+        Algorithm::CRC32,
+#endif
+        Algorithm::MD5, Algorithm::SHA1, Algorithm::SHA256, Algorithm::SHA512
+    };
+
+    return algorithms;
+}
+
+const std::string& HashEngine::GetName(const Algorithm algorithm)
+{
+    static const std::vector<std::string> names = {
+        "CRC32"s, "MD5"s, "SHA-1"s, "SHA-256"s, "SHA-512"s
+    };
+
+    WAR_ASSERT(static_cast<size_t>(algorithm) < names.size());
+    return names[static_cast<size_t>(algorithm)];
+}
+
+HashEngine::Algorithm HashEngine::GetAlgorithm(const std::string& name)
+{
+    for(const auto algorithm : GetAlgorithms()) {
+        if (boost::iequals(name, GetName(algorithm))) {
+            return algorithm;
+        }
+    }
+
+    WAR_THROW_T(ExceptionNotFound, "Unknown hash algorithm: "s + name);
+}
+
+HashEngine::ptr_t HashEngine::Create(const TransferOptions& options)
+{
+    return make_shared<impl::WfdeHashEngine>(options);
+}
+
+} // namespace wfde
+} // namespace war
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include <wfde/wfde.h>
+
+#include "WfdeHashCache.h"
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Host-wide HashEngine implementation
+ *
+ * Uses it's own threads, so that long running hash operations never
+ * compete with the IO pipelines.
+ */
+class WfdeHashEngine : public HashEngine
+{
+public:
+    WfdeHashEngine(const TransferOptions& options);
+    ~WfdeHashEngine();
+
+    void Hash(const boost::filesystem::path& path,
+              Algorithm algorithm,
+              std::uint64_t from,
+              std::uint64_t to,
+              callback_t callback) override;
+
+    std::string GetCachedDigest(const FileId& id,
+                                Algorithm algorithm) const override;
+
+    void AddDigest(const boost::filesystem::path& path,
+                   const FileId& id,
+                   Algorithm algorithm,
+                   const std::string& digest) override;
+
+private:
+    // cancelled is true if the engine is shutting down
+    using task_t = std::function<void (bool cancelled)>;
+
+    void Post(task_t task);
+    void Run();
+    void HashInParallel(const boost::filesystem::path& path,
+                        std::uint64_t from,
+                        std::uint64_t to,
+                        callback_t callback);
+
+    const TransferOptions options_;
+    std::unique_ptr<WfdeHashCache> cache_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<task_t> queue_;
+    bool stop_ = false;
+    std::vector<std::thread> workers_;
+};
+
+}}} // namespaces
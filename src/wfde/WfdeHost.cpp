@@ -22,7 +22,22 @@ WfdeHost::WfdeHost(Server& parent, AuthManager::ptr_t& authManager,
     , WFDE_DEFAULT_HOST_LONG_NAME)}
     , session_manager_{SessionManager::Create(parent.GetIoThreadpool())}
     , auth_manager_{authManager}
+    , transfer_options_{TransferOptions::Load(*conf)}
 {
+    if (transfer_options_.shared_cache) {
+        file_cache_ = FileCache::Create(transfer_options_);
+    }
+
+#ifdef WFDE_WITH_ZLIB
+    if (!transfer_options_.compressed_cache_dir.empty()) {
+        compressed_cache_ = CompressedCache::Create(transfer_options_);
+    }
+#endif
+
+#ifdef WFDE_WITH_HASH
+    hash_engine_ = HashEngine::Create(transfer_options_);
+#endif
+
     LOG_DEBUG_FN << "Created host: " << log::Esc(name_);
 }
 
@@ -44,6 +44,18 @@ public:
 
     virtual AuthManager& GetAuthManager() { return *auth_manager_; }
 
+    const TransferOptions& GetTransferOptions() const override {
+        return transfer_options_;
+    }
+
+    FileCache *GetFileCache() override { return file_cache_.get(); }
+
+    CompressedCache *GetCompressedCache() override {
+        return compressed_cache_.get();
+    }
+
+    HashEngine *GetHashEngine() override { return hash_engine_.get(); }
+
 private:
     const std::string long_name_;
     protocols_t protocols_;
@@ -51,6 +63,10 @@ private:
     Server::wptr_t parent_;
     SessionManager::ptr_t session_manager_;
     AuthManager::ptr_t auth_manager_;
+    const TransferOptions transfer_options_;
+    FileCache::ptr_t file_cache_;
+    CompressedCache::ptr_t compressed_cache_;
+    HashEngine::ptr_t hash_engine_;
 };
 
 } // namespace impl
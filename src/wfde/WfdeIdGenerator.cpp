@@ -0,0 +1,73 @@
+#include "war_wfde.h"
+
+#include <array>
+#include <atomic>
+
+#include <warlib/uuid.h>
+
+#include "WfdeIdGenerator.h"
+
+using namespace std;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+namespace {
+
+// Ids each thread takes from the shared counter at the time
+constexpr WfdeIdGenerator::id_t block_size = 1024;
+
+atomic<WfdeIdGenerator::id_t> next_block{1};
+
+const array<uint8_t, 8>& GetSalt()
+{
+    static const auto salt = [] {
+        const auto random = boost::uuids::random_generator()();
+        array<uint8_t, 8> rval;
+        copy(random.begin(), random.begin() + rval.size(), rval.begin());
+        return rval;
+    }();
+
+    return salt;
+}
+
+} // anonymous namespace
+
+WfdeIdGenerator::id_t WfdeIdGenerator::Next()
+{
+    thread_local id_t next = 0, end = 0;
+
+    if (next == end) {
+        next = next_block.fetch_add(block_size, memory_order_relaxed);
+        end = next + block_size;
+    }
+
+    return next++;
+}
+
+boost::uuids::uuid WfdeIdGenerator::ToUuid(const id_t id)
+{
+    boost::uuids::uuid uuid;
+    const auto& salt = GetSalt();
+    copy(salt.begin(), salt.end(), uuid.begin());
+    for(size_t i = 0; i < 8; ++i) {
+        uuid.data[8 + i] = static_cast<uint8_t>(id >> ((7 - i) * 8));
+    }
+
+    // Mark it as a random (version 4) UUID, like the ones we used to make
+    uuid.data[6] = (uuid.data[6] & 0x0f) | 0x40;
+    uuid.data[8] = (uuid.data[8] & 0x3f) | 0x80;
+    return uuid;
+}
+
+const std::string& WfdeLazyName::Get() const
+{
+    call_once(formatted_, [this] {
+        name_ = boost::uuids::to_string(WfdeIdGenerator::ToUuid(id_));
+    });
+
+    return name_;
+}
+
+}}} // namespaces
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <cstdint>
+
+#include <boost/uuid/uuid.hpp>
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Cheap identifiers for sessions, files, listings and sockets
+ *
+ * Each thread (in practice, each pipeline) reserves a block of numbers
+ * from a process-wide counter, so getting the next id is normally just
+ * an increment. The UUID's are the number mixed with a random salt that
+ * is generated once per process, so that they don't repeat across
+ * restarts. Only the salt touches the OS entropy source.
+ */
+class WfdeIdGenerator
+{
+public:
+    using id_t = std::uint64_t;
+
+    /*! Get the next id. Never 0, and increasing for each thread. */
+    static id_t Next();
+
+    /*! Get the UUID for an id */
+    static boost::uuids::uuid ToUuid(id_t id);
+
+    static boost::uuids::uuid NextUuid() { return ToUuid(Next()); }
+};
+
+/*! A name for an object, formatted the first time someone asks for it */
+class WfdeLazyName
+{
+public:
+    WfdeLazyName() : id_{WfdeIdGenerator::Next()} {}
+
+    const std::string& Get() const;
+
+private:
+    const WfdeIdGenerator::id_t id_;
+    mutable std::once_flag formatted_;
+    mutable std::string name_;
+};
+
+}}} // namespaces
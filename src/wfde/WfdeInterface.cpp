@@ -7,6 +7,7 @@
 #include "WfdeInterface.h"
 #include "WfdeTlsSocket.h"
 #include "WfdeSocket.h"
+#include "WfdeAsyncResult.h"
 #include <warlib/WarLog.h>
 
 using namespace std;
@@ -113,6 +114,23 @@ void WfdeInterface::Accept(boost::asio::yield_context yield)
             << " on " << some_pipeline
             << " from " << *this;
 
+#ifdef WFDE_WITH_TLS
+        // Let the connections wait in the listen backlog while the
+        // TLS handshake pool catches up.
+        if (!tls_cert_.empty()) {
+            auto& handshakes = WfdeTlsHandshakePool::GetInstance();
+            if (handshakes.IsSaturated()) {
+                LOG_DEBUG_FN << "Pausing accept on " << *this << ". "
+                    << handshakes.GetQueueDepth()
+                    << " TLS handshakes are queued.";
+
+                auto ready = make_shared<WfdeAsyncResult>(*pipeline_);
+                handshakes.WhenReady([ready] { ready->SetDone(); });
+                ready->Wait(yield);
+            }
+        }
+#endif
+
         acceptor_->async_accept(const_cast< boost::asio::ip::tcp::socket&>(
             socket->GetSocket()), yield[ec]);
 
@@ -0,0 +1,78 @@
+#include "war_wfde.h"
+
+#include <warlib/WarLog.h>
+#include <warlib/error_handling.h>
+
+#include "WfdeIoWorkers.h"
+
+using namespace std;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+WfdeIoWorkers::WfdeIoWorkers(const unsigned threads)
+{
+    for(unsigned i = 0; i < max(threads, 1u); ++i) {
+        workers_.emplace_back([this] { Run(); });
+    }
+
+    LOG_DEBUG_FN << "Started " << workers_.size()
+        << " threads for blocking file IO";
+}
+
+WfdeIoWorkers::~WfdeIoWorkers()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    for(auto& worker : workers_) {
+        worker.join();
+    }
+
+    for(auto& task : queue_) {
+        try {
+            task(true);
+        } WAR_CATCH_ERROR;
+    }
+}
+
+void WfdeIoWorkers::Post(task_t task)
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        queue_.push_back(move(task));
+    }
+    cond_.notify_one();
+}
+
+void WfdeIoWorkers::Run()
+{
+    unique_lock<mutex> lock(mutex_);
+
+    while(true) {
+        cond_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (stop_) {
+            return;
+        }
+
+        auto task = move(queue_.front());
+        queue_.pop_front();
+
+        lock.unlock();
+        try {
+            task(false);
+        } WAR_CATCH_ERROR;
+        lock.lock();
+    }
+}
+
+WfdeIoWorkers& WfdeIoWorkers::GetInstance()
+{
+    static WfdeIoWorkers instance;
+    return instance;
+}
+
+}}} // namespaces
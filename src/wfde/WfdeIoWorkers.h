@@ -0,0 +1,50 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Worker threads for file-system calls that can block for long
+ *
+ * fdatasync() on a large upload waits for the disk to write all
+ * the dirty pages. On a pipeline, that would stall every other
+ * session and transfer on it.
+ *
+ * Tasks that are still queued when the pool is destroyed are called
+ * with cancelled set, so that they can wake up whoever waits for them.
+ */
+class WfdeIoWorkers
+{
+public:
+    using task_t = std::function<void (bool cancelled)>;
+
+    explicit WfdeIoWorkers(unsigned threads = 4);
+    ~WfdeIoWorkers();
+
+    WfdeIoWorkers(const WfdeIoWorkers&) = delete;
+    WfdeIoWorkers& operator = (const WfdeIoWorkers&) = delete;
+
+    /*! Queue a task */
+    void Post(task_t task);
+
+    /*! The process-wide instance */
+    static WfdeIoWorkers& GetInstance();
+
+private:
+    void Run();
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<task_t> queue_;
+    bool stop_ = false;
+    std::vector<std::thread> workers_;
+};
+
+}}} // namespaces
@@ -0,0 +1,330 @@
+#include "war_wfde.h"
+
+#ifdef WFDE_WITH_KTLS
+
+#include <cstring>
+#include <algorithm>
+
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <netinet/tcp.h>
+
+#include <warlib/error_handling.h>
+
+#include "WfdeKernelTls.h"
+
+using namespace std;
+using namespace std::string_literals;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+namespace {
+
+using bytes_t = vector<unsigned char>;
+
+/*! Wipes the key material when it goes out of scope */
+struct Secret : public bytes_t
+{
+    using bytes_t::bytes_t;
+    ~Secret() { OPENSSL_cleanse(data(), size()); }
+};
+
+bool FromHex(const char *hex, size_t len, bytes_t& out)
+{
+    if (len % 2) {
+        return false;
+    }
+
+    out.clear();
+    for(size_t i = 0; i < len; i += 2) {
+        const auto hi = OPENSSL_hexchar2int(static_cast<unsigned char>(hex[i]));
+        const auto lo = OPENSSL_hexchar2int(static_cast<unsigned char>(hex[i + 1]));
+        if ((hi < 0) || (lo < 0)) {
+            return false;
+        }
+        out.push_back(static_cast<unsigned char>((hi << 4) | lo));
+    }
+
+    return true;
+}
+
+bool Derive(const char *kdfName, OSSL_PARAM *params, bytes_t& out)
+{
+    auto kdf = EVP_KDF_fetch(nullptr, kdfName, nullptr);
+    auto ctx = kdf ? EVP_KDF_CTX_new(kdf) : nullptr;
+    const bool ok = ctx && (EVP_KDF_derive(ctx, out.data(), out.size(),
+                                           params) == 1);
+    EVP_KDF_CTX_free(ctx);
+    EVP_KDF_free(kdf);
+    return ok;
+}
+
+/*! HKDF-Expand-Label from RFC 8446, with an empty context */
+bool ExpandLabel(const EVP_MD *md, const bytes_t& secret,
+                 const string& label, bytes_t& out)
+{
+    const auto full_label = "tls13 "s + label;
+    bytes_t info = {
+        static_cast<unsigned char>(out.size() >> 8),
+        static_cast<unsigned char>(out.size()),
+        static_cast<unsigned char>(full_label.size())
+    };
+    info.insert(info.end(), full_label.begin(), full_label.end());
+    info.push_back(0); // Context
+
+    int mode = EVP_KDF_HKDF_MODE_EXPAND_ONLY;
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_int(OSSL_KDF_PARAM_MODE, &mode),
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST,
+            const_cast<char *>(EVP_MD_get0_name(md)), 0),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY,
+            const_cast<unsigned char *>(secret.data()), secret.size()),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO,
+            info.data(), info.size()),
+        OSSL_PARAM_construct_end()
+    };
+
+    return Derive("HKDF", params, out);
+}
+
+/*! The TLS 1.2 key block (RFC 5246, 6.3) */
+bool KeyBlock(const SSL *ssl, const EVP_MD *md, bytes_t& out)
+{
+    Secret master(SSL_MAX_MASTER_KEY_LENGTH);
+    master.resize(SSL_SESSION_get_master_key(SSL_get_session(ssl),
+                                             master.data(), master.size()));
+
+    bytes_t seed(13 + SSL3_RANDOM_SIZE * 2);
+    memcpy(seed.data(), "key expansion", 13);
+    SSL_get_server_random(ssl, seed.data() + 13, SSL3_RANDOM_SIZE);
+    SSL_get_client_random(ssl, seed.data() + 13 + SSL3_RANDOM_SIZE,
+                          SSL3_RANDOM_SIZE);
+
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST,
+            const_cast<char *>(EVP_MD_get0_name(md)), 0),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SECRET,
+            master.data(), master.size()),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED,
+            seed.data(), seed.size()),
+        OSSL_PARAM_construct_end()
+    };
+
+    return !master.empty() && Derive("TLS1-PRF", params, out);
+}
+
+void PutSeq(unsigned char *dst, uint64_t seq)
+{
+    for(int i = 7; i >= 0; --i, seq >>= 8) {
+        dst[i] = static_cast<unsigned char>(seq);
+    }
+}
+
+/*! Fill in the kernel's crypto-info for one of the supported ciphers */
+template <typename InfoT>
+void Fill(InfoT& info, const WfdeKernelTls::SendKeys& keys)
+{
+    static_assert(sizeof(info.rec_seq) == 8, "Unexpected rec_seq");
+    WAR_ASSERT(keys.key.size() == sizeof(info.key));
+    WAR_ASSERT(keys.salt.size() == sizeof(info.salt));
+    WAR_ASSERT(keys.iv.size() == sizeof(info.iv));
+
+    info.info.version = keys.version;
+    info.info.cipher_type = keys.cipher_type;
+    memcpy(info.key, keys.key.data(), keys.key.size());
+    memcpy(info.salt, keys.salt.data(), keys.salt.size());
+    memcpy(info.iv, keys.iv.data(), keys.iv.size());
+    PutSeq(info.rec_seq, keys.seq);
+}
+
+} // anonymous namespace
+
+WfdeKernelTls::WfdeKernelTls(SSL *ssl)
+: ssl_{ssl}
+{
+    SSL_set_ex_data(ssl_, GetExDataIndex(), this);
+
+    // TLS 1.3 tickets are sent after the handshake, with the keys we
+    // want to hand over. Data connections have no use for them anyway.
+    SSL_set_num_tickets(ssl_, 0);
+}
+
+WfdeKernelTls::~WfdeKernelTls()
+{
+    SSL_set_ex_data(ssl_, GetExDataIndex(), nullptr);
+    OPENSSL_cleanse(server_secret_.data(), server_secret_.size());
+}
+
+WfdeKernelTls::SendKeys::~SendKeys()
+{
+    OPENSSL_cleanse(key.data(), key.size());
+    OPENSSL_cleanse(salt.data(), salt.size());
+    OPENSSL_cleanse(iv.data(), iv.size());
+}
+
+bool WfdeKernelTls::EnableSend(const int fd)
+{
+    SendKeys keys;
+    if (!GetSendKeys(keys)) {
+        return false;
+    }
+
+    if (::setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+        LOG_DEBUG_FN << "kTLS is not available: " << strerror(errno);
+        return false;
+    }
+
+    int rval = -1;
+    switch(keys.cipher_type) {
+        case TLS_CIPHER_AES_GCM_128: {
+            tls12_crypto_info_aes_gcm_128 info = {};
+            Fill(info, keys);
+            rval = ::setsockopt(fd, SOL_TLS, TLS_TX, &info, sizeof(info));
+            OPENSSL_cleanse(&info, sizeof(info));
+        } break;
+        case TLS_CIPHER_AES_GCM_256: {
+            tls12_crypto_info_aes_gcm_256 info = {};
+            Fill(info, keys);
+            rval = ::setsockopt(fd, SOL_TLS, TLS_TX, &info, sizeof(info));
+            OPENSSL_cleanse(&info, sizeof(info));
+        } break;
+        case TLS_CIPHER_CHACHA20_POLY1305: {
+            tls12_crypto_info_chacha20_poly1305 info = {};
+            Fill(info, keys);
+            rval = ::setsockopt(fd, SOL_TLS, TLS_TX, &info, sizeof(info));
+            OPENSSL_cleanse(&info, sizeof(info));
+        } break;
+    }
+
+    // With the ULP, but without keys, the socket still works as before
+    if (rval < 0) {
+        LOG_DEBUG_FN << "Failed to install the keys for kTLS: "
+            << strerror(errno);
+        return false;
+    }
+
+    LOG_TRACE2_FN << "kTLS enabled for sending with "
+        << SSL_CIPHER_get_name(SSL_get_current_cipher(ssl_));
+    return true;
+}
+
+bool WfdeKernelTls::GetSendKeys(SendKeys& keys) const
+{
+    const auto cipher = SSL_get_current_cipher(ssl_);
+    const auto md = cipher ? SSL_CIPHER_get_handshake_digest(cipher) : nullptr;
+    if (!md) {
+        return false;
+    }
+
+    const auto nid = SSL_CIPHER_get_cipher_nid(cipher);
+    size_t salt_len = 0, iv_len = 0;
+    switch(nid) {
+        case NID_aes_128_gcm:
+            keys.cipher_type = TLS_CIPHER_AES_GCM_128;
+            keys.key.resize(TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+            salt_len = TLS_CIPHER_AES_GCM_128_SALT_SIZE;
+            iv_len = TLS_CIPHER_AES_GCM_128_IV_SIZE;
+            break;
+        case NID_aes_256_gcm:
+            keys.cipher_type = TLS_CIPHER_AES_GCM_256;
+            keys.key.resize(TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+            salt_len = TLS_CIPHER_AES_GCM_256_SALT_SIZE;
+            iv_len = TLS_CIPHER_AES_GCM_256_IV_SIZE;
+            break;
+        case NID_chacha20_poly1305:
+            keys.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+            keys.key.resize(TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+            salt_len = TLS_CIPHER_CHACHA20_POLY1305_SALT_SIZE;
+            iv_len = TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE;
+            break;
+        default:
+            LOG_DEBUG_FN << "kTLS does not support the cipher "
+                << SSL_CIPHER_get_name(cipher);
+            return false;
+    }
+
+    // The nonce is always 12 bytes. The kernel wants the implicit part
+    // as the salt, and the rest as the iv.
+    Secret nonce(12);
+    const auto key_len = keys.key.size();
+
+    switch(SSL_version(ssl_)) {
+        case TLS1_3_VERSION:
+            if (server_secret_.empty()
+                || !ExpandLabel(md, server_secret_, "key", keys.key)
+                || !ExpandLabel(md, server_secret_, "iv", nonce)) {
+                LOG_DEBUG_FN << "Failed to derive the TLS 1.3 keys for kTLS";
+                return false;
+            }
+            keys.version = TLS_1_3_VERSION;
+            keys.seq = 0;
+            break;
+
+        case TLS1_2_VERSION: {
+            // client key, server key, client iv, server iv
+            const size_t fixed_iv_len = (nid == NID_chacha20_poly1305) ? 12 : 4;
+            Secret block(key_len * 2 + fixed_iv_len * 2);
+            if (!KeyBlock(ssl_, md, block)) {
+                LOG_DEBUG_FN << "Failed to derive the TLS 1.2 keys for kTLS";
+                return false;
+            }
+            copy_n(block.begin() + key_len, key_len, keys.key.begin());
+            copy_n(block.begin() + key_len * 2 + fixed_iv_len, fixed_iv_len,
+                   nonce.begin());
+
+            // Our Finished message is the only record sent with these keys
+            keys.version = TLS_1_2_VERSION;
+            keys.seq = 1;
+            if (fixed_iv_len == 4) {
+                // Explicit nonce. The kernel increments it for each record.
+                PutSeq(nonce.data() + 4, keys.seq);
+            }
+        } break;
+
+        default:
+            return false;
+    }
+
+    keys.salt.assign(nonce.begin(), nonce.begin() + salt_len);
+    keys.iv.assign(nonce.begin() + salt_len, nonce.begin() + salt_len + iv_len);
+    return true;
+}
+
+void WfdeKernelTls::Install(boost::asio::ssl::context& context)
+{
+    SSL_CTX_set_keylog_callback(context.native_handle(), OnKeyLog);
+}
+
+void WfdeKernelTls::OnKeyLog(const SSL *ssl, const char *line)
+{
+    static const string label = "SERVER_TRAFFIC_SECRET_0 ";
+
+    auto self = static_cast<WfdeKernelTls *>(
+        SSL_get_ex_data(ssl, GetExDataIndex()));
+    if (!self || strncmp(line, label.c_str(), label.size())) {
+        return;
+    }
+
+    // <label> <client random> <secret>
+    const auto secret = strrchr(line, ' ');
+    if (!secret || !FromHex(secret + 1, strlen(secret + 1),
+                            self->server_secret_)) {
+        LOG_WARN_FN << "Unexpected key-log line from OpenSSL";
+        self->server_secret_.clear();
+    }
+}
+
+int WfdeKernelTls::GetExDataIndex()
+{
+    static const int index = SSL_get_ex_new_index(0, nullptr, nullptr,
+                                                  nullptr, nullptr);
+    return index;
+}
+
+}}} // namespaces
+
+#endif // WFDE_WITH_KTLS
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <wfde/config.h>
+#ifdef WFDE_WITH_KTLS
+
+#include <vector>
+
+#include <openssl/ssl.h>
+#include <boost/asio/ssl.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <sys/socket.h>
+#include <linux/tls.h>
+#include <errno.h>
+
+#include <warlib/WarLog.h>
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Hand the encryption of a TLS connection over to the kernel (kTLS)
+ *
+ * After the handshake, the keys for the data we send are installed
+ * in the kernel's TLS module (TCP_ULP "tls"). From then on, anything
+ * written to the socket, including data sent with sendfile(), is
+ * encrypted by the kernel, so encrypted downloads can be zero-copy.
+ *
+ * Only the sending direction is offloaded. The asio SSL stream may
+ * already have read (and buffered) records from the peer when the
+ * handshake completes, so we can't move the receiving direction to
+ * the kernel reliably.
+ *
+ * Supports TLS 1.2 and 1.3 with AES-GCM and ChaCha20-Poly1305. For
+ * TLS 1.3, the traffic secret is captured through the key-log callback,
+ * and the connection must not send session tickets (which would
+ * advance the record sequence before we take over).
+ */
+class WfdeKernelTls
+{
+public:
+    /*! What the kernel needs to take over the sending direction */
+    struct SendKeys {
+        ~SendKeys();
+
+        std::uint16_t version = 0; // TLS_1_2_VERSION or TLS_1_3_VERSION
+        std::uint16_t cipher_type = 0; // TLS_CIPHER_*
+        std::vector<unsigned char> key;
+        std::vector<unsigned char> salt; // Implicit part of the nonce
+        std::vector<unsigned char> iv; // The rest of the nonce
+        std::uint64_t seq = 0; // Sequence number of the next record
+    };
+
+    /*! Prepare a server connection for kTLS. Call before the handshake. */
+    explicit WfdeKernelTls(SSL *ssl);
+    ~WfdeKernelTls();
+
+    WfdeKernelTls(const WfdeKernelTls&) = delete;
+    WfdeKernelTls& operator = (const WfdeKernelTls&) = delete;
+
+    /*! Let the kernel encrypt what we send on fd from now on
+     *
+     * Call right after the handshake, before anything else is sent.
+     *
+     * \return false if the kernel, the TLS version or the cipher does not
+     *      support it. The connection is unchanged, and can continue
+     *      to use user-space TLS.
+     */
+    bool EnableSend(int fd);
+
+    /*! Derive the keys for what we send. Call right after the handshake.
+     *
+     * \return false if the TLS version or the cipher is not supported.
+     */
+    bool GetSendKeys(SendKeys& keys) const;
+
+    /*! Let the contexts pass the TLS 1.3 secrets to us */
+    static void Install(boost::asio::ssl::context& context);
+
+private:
+    static void OnKeyLog(const SSL *ssl, const char *line);
+    static int GetExDataIndex();
+
+    SSL *ssl_;
+    std::vector<unsigned char> server_secret_;
+};
+
+/*! Send a TLS close_notify alert through kTLS */
+template <typename SocketT>
+void AsyncSendCloseNotify(SocketT& sck, boost::asio::yield_context& yield)
+{
+    unsigned char alert[] = {1 /* warning */, 0 /* close_notify */};
+    char cbuf[CMSG_SPACE(sizeof(unsigned char))] = {};
+    iovec iov = {alert, sizeof(alert)};
+
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = 21; // Alert
+
+    while(::sendmsg(sck.native_handle(), &msg, 0) < 0) {
+        const auto err = errno;
+        if (err == EINTR) {
+            continue;
+        }
+
+        if ((err == EAGAIN) || (err == EWOULDBLOCK)) {
+            sck.async_wait(SocketT::wait_write, yield);
+            continue;
+        }
+
+        throw boost::system::system_error(err, boost::system::system_category());
+    }
+}
+
+}}} // namespaces
+
+#endif // WFDE_WITH_KTLS
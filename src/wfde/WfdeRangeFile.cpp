@@ -0,0 +1,59 @@
+#include "war_wfde.h"
+
+#include <warlib/WarLog.h>
+#include <warlib/uuid.h>
+#include <warlib/error_handling.h>
+
+#include "WfdeRangeFile.h"
+
+using namespace std;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+WfdeRangeFile::WfdeRangeFile(unique_ptr<File> file, const fpos_t end)
+: file_{move(file)}, end_{end}
+{
+    WAR_ASSERT(file_);
+    WAR_ASSERT(file_->GetOperation() == FileOperation::READ);
+
+    LOG_TRACE2_FN << "Limiting " << *file_ << " to end at " << end_;
+}
+
+File::const_buffer_t WfdeRangeFile::Read(size_t bytes)
+{
+    const auto pos = file_->GetPos();
+    if (pos >= end_) {
+        return {nullptr, 0};
+    }
+
+    const auto remaining = end_ - pos;
+    if ((bytes == 0) || (bytes > remaining)) {
+        bytes = static_cast<size_t>(min<fpos_t>(remaining,
+            bytes ? bytes : file_->GetSegmentSize()));
+    }
+
+    return file_->Read(bytes);
+}
+
+void WfdeRangeFile::Seek(const fpos_t pos)
+{
+    if (pos > end_) {
+        WAR_THROW_T(ExceptionSeekBeoindEof, boost::uuids::to_string(GetUuid()));
+    }
+
+    file_->Seek(pos);
+}
+
+File::fpos_t WfdeRangeFile::GetSize() const
+{
+    return min(file_->GetSize(), end_);
+}
+
+bool WfdeRangeFile::IsEof() const
+{
+    return (file_->GetPos() >= end_) || file_->IsEof();
+}
+
+}}} // namespaces
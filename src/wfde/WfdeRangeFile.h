@@ -0,0 +1,64 @@
+#pragma once
+
+#include "WfdeFile.h"
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Wrapper around a File that is read up to, but not including, an offset
+ *
+ * Used for downloads of a byte range (RANG). The wrapped file is
+ * positioned at the start of the range by the caller. As the wrapper
+ * reports the end of the range as the file size, the zero-copy send
+ * path stops there as well.
+ */
+class WfdeRangeFile : public File
+{
+public:
+    /*!
+     * \param file The file to wrap. Must be opened for reading.
+     * \param end One past the last byte to read.
+     */
+    WfdeRangeFile(std::unique_ptr<File> file, fpos_t end);
+
+    struct ExceptionSeekBeoindEof : public ExceptionBase {};
+
+    const_buffer_t Read(std::size_t bytes) override;
+    mutable_buffer_t Write(size_t bytes = 0) override {
+        WAR_ASSERT(false && "Not implemented");
+        WAR_THROW_T(ExceptionNotImplemented, "Not implemented");
+    }
+    void SetBytesWritten(size_t bytes) override {
+        WAR_ASSERT(false && "Not implemented");
+        WAR_THROW_T(ExceptionNotImplemented, "Not implemented");
+    }
+    void SetBytesWrittenToHandle(size_t bytes) override {
+        WAR_ASSERT(false && "Not implemented");
+        WAR_THROW_T(ExceptionNotImplemented, "Not implemented");
+    }
+    void Reserve(std::uint64_t bytes) override { file_->Reserve(bytes); }
+    void Sync() override { file_->Sync(); }
+    void Seek(fpos_t pos) override;
+    fpos_t GetPos() const override { return file_->GetPos(); }
+    fpos_t GetSize() const override;
+    bool IsEof() const override;
+    void Close() override { file_->Close(); }
+    FileOperation GetOperation() const override { return file_->GetOperation(); }
+    const boost::uuids::uuid& GetUuid() const override { return file_->GetUuid(); }
+    std::size_t GetSegmentSize() const noexcept override {
+        return file_->GetSegmentSize();
+    }
+    int GetNativeHandle() const noexcept override {
+        return file_->GetNativeHandle();
+    }
+    const Stats& GetStats() const noexcept override {
+        return file_->GetStats();
+    }
+
+private:
+    std::unique_ptr<File> file_;
+    const fpos_t end_;
+};
+
+}}} // namespaces
@@ -6,7 +6,7 @@
 
 #include "WfdeClient.h"
 #include "WfdeSession.h"
-#include "WfdeFile.h"
+#include "WfdeIdGenerator.h"
 
 #define LOCK lock_guard<mutex> lock__(mutex_)
 
@@ -22,7 +22,7 @@ namespace wfde {
 namespace impl {
 
 WfdeSession::WfdeSession(const SessionManager::SessionParams& sp)
-: uuid_(boost::uuids::random_generator()())
+: uuid_(WfdeIdGenerator::NextUuid())
 , client_{sp.client}
 , protocol_{sp.protocol}
 , socket_{sp.socket}
@@ -131,17 +131,60 @@ unique_ptr< File > WfdeSession::OpenFile(const vpath_t& path,
             WAR_ASSERT(false && "Unsupported operation");
     }
 
-    auto file = make_unique<WfdeFile>(file_path->GetPhysPath(), operation);
+    auto phys_path = file_path->GetPhysPath();
+    if (operation == File::FileOperation::READ) {
+        if (auto cache = GetHost().GetCompressedCache()) {
+            phys_path = GetCompressedVariant(*cache, path, phys_path);
+        }
+    }
+
+    auto file = CreateDiskFile(phys_path, operation,
+                               GetHost().GetTransferOptions(),
+                               GetHost().GetFileCache());
 
     LOG_DEBUG_FN << "Opened " << *file
         << ' ' << log::Esc(file_path->GetVirtualPath())
-        << " as physical file " << log::Esc(file_path->GetPhysPath().string())
+        << " as physical file " << log::Esc(phys_path.string())
         << " for " << operation
         << " in " << *this;
 
     return std::move(file);
 }
 
+boost::filesystem::path
+WfdeSession::GetCompressedVariant(CompressedCache& cache,
+                                  const vpath_t& path,
+                                  const boost::filesystem::path& physPath)
+{
+    const auto& suffix = CompressedCache::GetSuffix();
+
+    if (boost::filesystem::exists(physPath)) {
+        // Someone wants the file, so prepare a compressed copy for later
+        cache.Lookup(physPath);
+        return physPath;
+    }
+
+    if ((path.size() <= suffix.size())
+        || (path.compare(path.size() - suffix.size(), suffix.size(), suffix) != 0)) {
+        return physPath;
+    }
+
+    auto original = GetPath(path.substr(0, path.size() - suffix.size()),
+                            Path::Type::FILE);
+    if (!original->CanRead()) {
+        return physPath;
+    }
+
+    auto variant = cache.Lookup(original->GetPhysPath());
+    if (variant.empty()) {
+        LOG_DEBUG_FN << "No compressed variant is ready for "
+            << log::Esc(original->GetVirtualPath());
+        return physPath;
+    }
+
+    return variant;
+}
+
 void WfdeSession::DeleteFile(const Session::vpath_t& path)
 {
     auto file_path = GetPath(path, Path::Type::FILE);
@@ -311,7 +354,7 @@ void WfdeSession::SetCwd(const vpath_t& path)
     cwd_ = dir->GetVirtualPath();
 }
 
-WfdeSession::vpath_t WfdeSession::GetCwd() const
+const WfdeSession::vpath_t& WfdeSession::GetCwd() const
 {
     return cwd_;
 }
@@ -29,7 +29,7 @@ public:
         return permissions_;
     }
 
-    vpath_t GetCwd() const override;
+    const vpath_t& GetCwd() const override;
 
     void SetCwd(const vpath_t& path) override;
 
@@ -147,6 +147,15 @@ protected:
     }
 
 private:
+    /*! Map a request for "file.gz" to the cached compressed copy of "file"
+     *
+     * Returns physPath if the client asked for something else, or if
+     * the copy is not ready.
+     */
+    boost::filesystem::path GetCompressedVariant(CompressedCache& cache,
+                                                 const vpath_t& path,
+                                                 const boost::filesystem::path& physPath);
+
     boost::uuids::uuid uuid_;
     Client::ptr_t client_;
     const Protocol::ptr_t protocol_;
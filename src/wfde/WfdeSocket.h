@@ -1,8 +1,9 @@
 #pragma once
 
 #include <wfde/wfde.h>
+#include "WfdeZeroCopy.h"
+#include "WfdeIdGenerator.h"
 #include <warlib/WarPipeline.h>
-#include <warlib/uuid.h>
 #include <warlib/WarLog.h>
 
 namespace war {
@@ -18,21 +19,19 @@ public:
     using socket_t = SocketT;
 
     WfdeSocket(Pipeline& pipeline)
-    : socket_(pipeline.GetIoService()), id_{get_uuid_as_string()}
-    ,  pipeline_{pipeline}
+    : socket_(pipeline.GetIoService()), pipeline_{pipeline}
     {
     }
 
     WfdeSocket(Pipeline& pipeline, socket_t&& socket)
-    : socket_{std::move(socket)}, id_{get_uuid_as_string()}
-    , pipeline_{pipeline}
+    : socket_{std::move(socket)}, pipeline_{pipeline}
     {
     }
 
     WfdeSocket(Pipeline& pipeline,
         const boost::asio::ip::tcp::endpoint::protocol_type & protocol)
     : socket_(pipeline.GetIoService(), protocol)
-    ,  id_{get_uuid_as_string()}, pipeline_{pipeline}
+    , pipeline_{pipeline}
     {
     }
 
@@ -42,7 +41,7 @@ public:
     }
     Pipeline& GetPipeline() override { return pipeline_; };
     const Pipeline& GetPipeline() const override { return pipeline_;}
-    const std::string& GetName() const override { return id_; }
+    const std::string& GetName() const override { return id_.Get(); }
 
     void AsyncConnect(const boost::asio::ip::tcp::endpoint& ep,
                       boost::asio::yield_context& yield) override {
@@ -123,10 +122,29 @@ public:
         return {};
     }
 
+    bool IsEncrypted() const override {
+        return false;
+    }
+
+    bool CanSendFile() const override {
+        return true;
+    }
+
+    std::size_t AsyncSendFile(int fd, std::uint64_t offset, std::size_t bytes,
+                              boost::asio::yield_context& yield) override {
+        return AsyncSendFileToSocket(socket_, fd, offset, bytes, yield);
+    }
+
+    std::size_t AsyncReceiveFile(int fd, std::uint64_t offset, std::size_t bytes,
+                                 boost::asio::yield_context& yield) override {
+        return splice_pipe_.Receive(socket_, fd, offset, bytes, yield);
+    }
+
 protected:
     socket_t socket_;
-    const std::string id_;
+    const WfdeLazyName id_; // Formatted when logged
     Pipeline& pipeline_;
+    SplicePipe splice_pipe_;
 };
 
 } // namespace impl
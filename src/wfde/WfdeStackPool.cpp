@@ -0,0 +1,186 @@
+#include "war_wfde.h"
+
+#include <new>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <warlib/WarLog.h>
+#include <warlib/error_handling.h>
+
+#include "WfdeStackPool.h"
+
+using namespace std;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+namespace {
+
+size_t GetPageSize()
+{
+    static const auto page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return page_size;
+}
+
+size_t RoundUpToPage(const size_t size)
+{
+    const auto page_size = GetPageSize();
+    return ((size + page_size - 1) / page_size) * page_size;
+}
+
+} // anonymous namespace
+
+constexpr size_t WfdeStackPool::min_stack_size;
+
+WfdeStackPool::WfdeStackPool(const size_t stackSize,
+                             const size_t stacksPerSlab,
+                             const size_t maxResidentFree)
+: page_size_{GetPageSize()}
+, stack_size_{RoundUpToPage(max(stackSize, min_stack_size))}
+, stacks_per_slab_{max<size_t>(stacksPerSlab, 1)}
+, max_resident_free_{maxResidentFree}
+{
+    LOG_DEBUG_FN << "Creating a pool of coroutine stacks of "
+        << stack_size_ << " bytes";
+}
+
+WfdeStackPool::~WfdeStackPool()
+{
+    lock_guard<mutex> lock(mutex_);
+
+    // Coroutines still running at shutdown keep their stacks
+    if (in_use_) {
+        LOG_WARN_FN << in_use_ << " coroutines of " << stack_size_
+            << " bytes are still running. Leaking their stacks.";
+        return;
+    }
+
+    for(const auto& slab : slabs_) {
+        ::munmap(slab.first, slab.second);
+    }
+}
+
+boost::context::stack_context WfdeStackPool::Allocate()
+{
+    lock_guard<mutex> lock(mutex_);
+
+    if (free_.empty()) {
+        AddSlab();
+    }
+
+    // The stack freed last is the one most likely to still be in the cache
+    if (free_.size() == num_released_) {
+        --num_released_;
+    }
+    auto bottom = free_.back();
+    free_.pop_back();
+    ++in_use_;
+
+    boost::context::stack_context sc;
+    sc.size = stack_size_;
+    sc.sp = bottom + stack_size_; // The stack grows down
+    return sc;
+}
+
+void WfdeStackPool::Deallocate(boost::context::stack_context& sc) noexcept
+{
+    WAR_ASSERT(sc.size == stack_size_);
+    auto bottom = static_cast<char *>(sc.sp) - stack_size_;
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        WAR_ASSERT(in_use_ > 0);
+        if ((free_.size() - num_released_) < max_resident_free_) {
+            --in_use_;
+            free_.push_back(bottom);
+            return;
+        }
+    }
+
+    // Nobody else knows about the stack now, so we can release the
+    // pages without holding the lock.
+    if (::madvise(bottom, stack_size_, MADV_DONTNEED) != 0) {
+        LOG_WARN_FN << "Failed to release the pages of a coroutine stack: "
+            << strerror(errno);
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    --in_use_;
+    free_.push_front(bottom);
+    ++num_released_;
+}
+
+size_t WfdeStackPool::GetNumInUse() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return in_use_;
+}
+
+size_t WfdeStackPool::GetNumFree() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return free_.size();
+}
+
+/*! Reserve address space for another batch of stacks
+ *
+ * Must be called with the mutex locked.
+ */
+void WfdeStackPool::AddSlab()
+{
+    // Each slot is a guard page followed by the stack
+    const auto slot_size = page_size_ + stack_size_;
+    const auto len = slot_size * stacks_per_slab_;
+    auto slab = ::mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slab == MAP_FAILED) {
+        LOG_ERROR_FN << "Failed to allocate " << stacks_per_slab_
+            << " coroutine stacks: " << strerror(errno);
+        throw bad_alloc();
+    }
+
+    auto base = static_cast<char *>(slab);
+    for(size_t i = 0; i < stacks_per_slab_; ++i) {
+        if (::mprotect(base + (i * slot_size), page_size_, PROT_NONE) != 0) {
+            LOG_ERROR_FN << "Failed to add guard pages to "
+                << stacks_per_slab_ << " coroutine stacks: "
+                << strerror(errno);
+            ::munmap(slab, len);
+            throw bad_alloc();
+        }
+    }
+
+    slabs_.emplace_back(slab, len);
+
+    // Hand out the lowest addresses first. None of the pages are
+    // resident yet, so they all count as released.
+    WAR_ASSERT(free_.empty());
+    for(auto i = stacks_per_slab_; i > 0; --i) {
+        free_.push_back(base + ((i - 1) * slot_size) + page_size_);
+    }
+    num_released_ = free_.size();
+
+    LOG_TRACE1_FN << "Added " << stacks_per_slab_ << " stacks of "
+        << stack_size_ << " bytes to the pool. "
+        << (in_use_ + free_.size()) << " stacks in total.";
+}
+
+WfdeStackPool& WfdeStackPool::Get(const size_t stackSize)
+{
+    static mutex pools_mutex;
+    static map<size_t, unique_ptr<WfdeStackPool>> pools;
+
+    const auto size = RoundUpToPage(max(stackSize, min_stack_size));
+
+    lock_guard<mutex> lock(pools_mutex);
+    auto& pool = pools[size];
+    if (!pool) {
+        pool = make_unique<WfdeStackPool>(size);
+    }
+
+    return *pool;
+}
+
+}}} // namespaces
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <boost/context/stack_context.hpp>
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Pool of coroutine stacks of one size
+ *
+ * Each control connection and each transfer runs in it's own stackful
+ * coroutine. With the default allocator, every stack is a separate
+ * malloc() of 128 KB, which glibc serves with it's own mmap() and
+ * munmap(). The malloc header also dirties an extra page per stack.
+ *
+ * The pool carves the stacks out of large slabs, and keeps the stacks
+ * that are returned for the next coroutine. Only the pages a coroutine
+ * actually touches become resident, so an idle session costs the pages
+ * it's call chain used, no matter how large the stack is. A smaller
+ * stack mostly saves address space.
+ *
+ * Below each stack is a PROT_NONE guard page, so a coroutine that
+ * overflows it's stack crashes the server instead of silently
+ * corrupting the stack below. Each guard page is a separate mapping
+ * in the kernel, so vm.max_map_count limits the number of stacks.
+ *
+ * The address space is never returned, but when more than
+ * maxResidentFree stacks are free, the pages of the stacks released
+ * after that are given back to the kernel with madvise(). That way a
+ * burst of sessions does not pin it's memory after they are gone.
+ * The released stacks are reused last.
+ *
+ * Thread safe. The stacks are allocated in the thread that spawns the
+ * coroutine, and released in the pipeline where it ends.
+ */
+class WfdeStackPool
+{
+public:
+    /*! StackAllocator for boost::asio::spawn() */
+    class Allocator
+    {
+    public:
+        explicit Allocator(WfdeStackPool& pool) noexcept : pool_{&pool} {}
+
+        boost::context::stack_context allocate() {
+            return pool_->Allocate();
+        }
+
+        void deallocate(boost::context::stack_context& sc) noexcept {
+            pool_->Deallocate(sc);
+        }
+
+    private:
+        WfdeStackPool *pool_;
+    };
+
+    /*! Create a pool
+     *
+     * \param stackSize Size of each stack. Rounded up to whole pages.
+     * \param stacksPerSlab Number of stacks we reserve from the
+     *      kernel at the time.
+     * \param maxResidentFree Number of free stacks we keep the pages
+     *      for.
+     */
+    explicit WfdeStackPool(std::size_t stackSize,
+                           std::size_t stacksPerSlab = 64,
+                           std::size_t maxResidentFree = 64);
+    ~WfdeStackPool();
+
+    WfdeStackPool(const WfdeStackPool&) = delete;
+    WfdeStackPool& operator = (const WfdeStackPool&) = delete;
+
+    boost::context::stack_context Allocate();
+    void Deallocate(boost::context::stack_context& sc) noexcept;
+
+    Allocator GetAllocator() noexcept { return Allocator{*this}; }
+
+    std::size_t GetStackSize() const noexcept { return stack_size_; }
+
+    /*! Number of stacks used by coroutines right now */
+    std::size_t GetNumInUse() const;
+
+    /*! Number of stacks ready for new coroutines */
+    std::size_t GetNumFree() const;
+
+    /*! The process-wide pool for stacks of a size */
+    static WfdeStackPool& Get(std::size_t stackSize);
+
+    /*! The smallest stack we accept in the configuration
+     *
+     * Smaller stacks will not hold the coroutines' call chains.
+     */
+    static constexpr std::size_t min_stack_size = 1024 * 16;
+
+private:
+    void AddSlab();
+
+    const std::size_t page_size_;
+    const std::size_t stack_size_;
+    const std::size_t stacks_per_slab_;
+    const std::size_t max_resident_free_;
+    mutable std::mutex mutex_;
+    // The lowest address of each stack, with the released ones first
+    std::deque<char *> free_;
+    std::size_t num_released_ = 0; // Released stacks at the front of free_
+    std::vector<std::pair<void *, std::size_t>> slabs_;
+    std::size_t in_use_ = 0;
+};
+
+}}} // namespaces
@@ -0,0 +1,121 @@
+#include "war_wfde.h"
+
+#ifdef WFDE_WITH_TLS
+
+#include <warlib/WarLog.h>
+#include <warlib/error_handling.h>
+
+#include "WfdeTlsContext.h"
+#include "WfdeTlsSessionCache.h"
+#include "WfdeKernelTls.h"
+
+using namespace std;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+WfdeTlsContextCache::WfdeTlsContextCache(const clock_t::duration checkInterval)
+: check_interval_{checkInterval}
+{
+}
+
+WfdeTlsContextCache::context_ptr_t
+WfdeTlsContextCache::Get(const boost::filesystem::path& certPath)
+{
+    const auto now = clock_t::now();
+    context_ptr_t current;
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto it = contexts_.find(certPath);
+        if (it != contexts_.end()) {
+            if (now < it->second.next_check) {
+                return it->second.context;
+            }
+
+            // Only one caller checks the file
+            it->second.next_check = now + check_interval_;
+            current = it->second.context;
+        }
+    }
+
+    FileId id;
+    FileId::Get(certPath, id);
+
+    if (current) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (contexts_[certPath].file_id == id) {
+                return current;
+            }
+        }
+
+        LOG_NOTICE_FN << "The TLS certificate " << log::Esc(certPath.string())
+            << " is changed. Reloading it.";
+
+        try {
+            auto context = Load(certPath);
+            lock_guard<mutex> lock(mutex_);
+            auto& entry = contexts_[certPath];
+            entry.context = context;
+            entry.file_id = id;
+            return context;
+        } catch(const std::exception& ex) {
+            LOG_ERROR_FN << "Failed to reload the TLS certificate "
+                << log::Esc(certPath.string()) << ": " << ex.what()
+                << ". Using the previous certificate.";
+        }
+
+        return current;
+    }
+
+    // First use. Let the caller deal with errors.
+    auto context = Load(certPath);
+
+    lock_guard<mutex> lock(mutex_);
+    auto& entry = contexts_[certPath];
+    if (!entry.context) {
+        entry.context = context;
+        entry.file_id = id;
+        entry.next_check = now + check_interval_;
+    }
+
+    return entry.context;
+}
+
+WfdeTlsContextCache::context_ptr_t
+WfdeTlsContextCache::Load(const boost::filesystem::path& certPath)
+{
+    LOG_DEBUG_FN << "Loading TLS certificate " << log::Esc(certPath.string());
+
+    auto context = make_shared<context_t>(context_t::sslv23_server);
+    context->set_options(context_t::default_workarounds
+        | context_t::no_sslv2
+        | context_t::single_dh_use);
+    context->use_certificate_chain_file(certPath.string());
+    context->use_private_key_file(certPath.string(), context_t::pem);
+
+    // Catch a certificate that is replaced before the key
+    if (SSL_CTX_check_private_key(context->native_handle()) != 1) {
+        WAR_THROW_T(ExceptionParseError,
+                    "The private key does not match the certificate");
+    }
+
+    WfdeTlsSessionCache::GetInstance().Install(*context, certPath);
+#ifdef WFDE_WITH_KTLS
+    WfdeKernelTls::Install(*context);
+#endif
+
+    return context;
+}
+
+WfdeTlsContextCache& WfdeTlsContextCache::GetInstance()
+{
+    static WfdeTlsContextCache instance;
+    return instance;
+}
+
+}}} // namespaces
+
+#endif // WFDE_WITH_TLS
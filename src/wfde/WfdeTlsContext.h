@@ -0,0 +1,67 @@
+#pragma once
+
+#include <wfde/config.h>
+#ifdef WFDE_WITH_TLS
+
+#include <map>
+#include <mutex>
+#include <chrono>
+
+#include <boost/asio/ssl.hpp>
+#include <boost/filesystem.hpp>
+
+#include <wfde/wfde.h>
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Shared TLS server contexts, one for each certificate file
+ *
+ * Loading the certificate chain and the private key means reading
+ * and parsing PEM files, so we do it once for each certificate, and
+ * let all the sockets using it share the context.
+ *
+ * The certificate file is stat()'ed at most once per check interval.
+ * If it is changed, a new context is loaded and replaces the old one
+ * for new sockets. Sockets that use the old context keep it alive
+ * until they are closed. If the new file can not be loaded, for example
+ * because it's only partially written, we keep using the old context
+ * and try again at the next check.
+ */
+class WfdeTlsContextCache
+{
+public:
+    using context_t = boost::asio::ssl::context;
+    using context_ptr_t = std::shared_ptr<context_t>;
+    using clock_t = std::chrono::steady_clock;
+
+    WfdeTlsContextCache(clock_t::duration checkInterval = std::chrono::seconds(5));
+
+    /*! Get the context for a PEM file with the certificate chain and key
+     *
+     * \exception boost::system::system_error if the file can not be
+     *      loaded the first time it is used.
+     */
+    context_ptr_t Get(const boost::filesystem::path& certPath);
+
+    /*! The instance used by the TLS sockets */
+    static WfdeTlsContextCache& GetInstance();
+
+private:
+    struct Entry {
+        context_ptr_t context;
+        FileId file_id;
+        clock_t::time_point next_check;
+    };
+
+    static context_ptr_t Load(const boost::filesystem::path& certPath);
+
+    const clock_t::duration check_interval_;
+    std::mutex mutex_;
+    std::map<boost::filesystem::path, Entry> contexts_;
+};
+
+}}} // namespaces
+
+#endif // WFDE_WITH_TLS
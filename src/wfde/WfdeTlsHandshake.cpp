@@ -0,0 +1,266 @@
+#include "war_wfde.h"
+
+#ifdef WFDE_WITH_TLS
+
+#include <openssl/err.h>
+#include <boost/asio/ssl/error.hpp>
+
+#include <warlib/WarLog.h>
+#include <warlib/error_handling.h>
+
+#include "WfdeTlsHandshake.h"
+#include "WfdeAsyncResult.h"
+
+using namespace std;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+namespace {
+
+// Record header: type, version (2 bytes), length (2 bytes)
+constexpr size_t record_header_len = 5;
+
+// Largest TLS 1.2 ciphertext record. TLS 1.3 records are smaller.
+constexpr size_t max_record_len = 16384 + 2048;
+
+/*! Send whatever OpenSSL has written to the memory BIO */
+void Flush(BIO *out, boost::asio::ip::tcp::socket& socket,
+           boost::asio::yield_context& yield)
+{
+    char *data = nullptr;
+    const auto len = BIO_get_mem_data(out, &data);
+    if (len > 0) {
+        boost::asio::async_write(socket,
+            boost::asio::buffer(data, static_cast<size_t>(len)), yield);
+        (void)BIO_reset(out);
+    }
+}
+
+/*! Read exactly one record from the socket into the memory BIO */
+void ReadRecord(BIO *in, boost::asio::ip::tcp::socket& socket,
+                boost::asio::yield_context& yield)
+{
+    unsigned char header[record_header_len];
+    boost::asio::async_read(socket, boost::asio::buffer(header), yield);
+
+    // change_cipher_spec, alert, handshake or application_data
+    if ((header[0] < 20) || (header[0] > 23)) {
+        WAR_THROW_T(ExceptionOutOfRange, "Not a TLS record");
+    }
+
+    const size_t len = (static_cast<size_t>(header[3]) << 8) | header[4];
+    if (len > max_record_len) {
+        WAR_THROW_T(ExceptionOutOfRange, "TLS record is too large");
+    }
+
+    vector<unsigned char> record(header, header + sizeof(header));
+    record.resize(sizeof(header) + len);
+    boost::asio::async_read(socket,
+        boost::asio::buffer(record.data() + sizeof(header), len), yield);
+
+    BIO_write(in, record.data(), static_cast<int>(record.size()));
+}
+
+} // anonymous namespace
+
+WfdeTlsHandshakePool::WfdeTlsHandshakePool(const unsigned threads,
+                                           const size_t maxQueueDepth)
+: max_depth_{maxQueueDepth}
+{
+    for(unsigned i = 0; i < max(threads, 1u); ++i) {
+        workers_.emplace_back([this] { Run(); });
+    }
+
+    LOG_DEBUG_FN << "Started " << workers_.size()
+        << " threads for TLS handshakes";
+}
+
+WfdeTlsHandshakePool::~WfdeTlsHandshakePool()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    for(auto& worker : workers_) {
+        worker.join();
+    }
+
+    // The tasks hold references to SSL objects, and coroutines
+    // are waiting for them.
+    for(auto& task : queue_) {
+        try {
+            task(true);
+        } WAR_CATCH_ERROR;
+    }
+
+    for(auto& ready : ready_waiters_) {
+        ready();
+    }
+}
+
+bool WfdeTlsHandshakePool::Post(task_t task)
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (depth_ >= max_depth_) {
+            ++rejected_;
+            return false;
+        }
+
+        queue_.push_back(move(task));
+        const size_t depth = ++depth_;
+        if (depth > peak_depth_) {
+            peak_depth_ = depth;
+        }
+    }
+    cond_.notify_one();
+    return true;
+}
+
+void WfdeTlsHandshakePool::WhenReady(ready_t ready)
+{
+    {
+        // The workers check the waiters with the lock held, after
+        // they have decremented the depth.
+        lock_guard<mutex> lock(mutex_);
+        if (IsSaturated()) {
+            ready_waiters_.push_back(move(ready));
+            return;
+        }
+    }
+
+    ready();
+}
+
+void WfdeTlsHandshakePool::Run()
+{
+    unique_lock<mutex> lock(mutex_);
+
+    while(true) {
+        cond_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (stop_) {
+            return;
+        }
+
+        auto task = move(queue_.front());
+        queue_.pop_front();
+
+        lock.unlock();
+        try {
+            task(false);
+        } WAR_CATCH_ERROR;
+        --depth_;
+        lock.lock();
+
+        if (!ready_waiters_.empty() && !IsSaturated()) {
+            auto waiters = move(ready_waiters_);
+            ready_waiters_.clear();
+            lock.unlock();
+            for(auto& ready : waiters) {
+                ready();
+            }
+            lock.lock();
+        }
+    }
+}
+
+WfdeTlsHandshakePool& WfdeTlsHandshakePool::GetInstance()
+{
+    static WfdeTlsHandshakePool instance;
+    return instance;
+}
+
+unsigned WfdeTlsHandshakePool::DefaultThreads()
+{
+    // Leave most of the cores to the pipelines
+    return max(thread::hardware_concurrency() / 2, 1u);
+}
+
+void AsyncTlsServerHandshake(SSL *ssl,
+                             boost::asio::ip::tcp::socket& socket,
+                             Pipeline& pipeline,
+                             boost::asio::yield_context& yield)
+{
+    struct Result : public WfdeAsyncResult {
+        using WfdeAsyncResult::WfdeAsyncResult;
+
+        int rval = 0;
+        int error = SSL_ERROR_NONE;
+        unsigned long reason = 0;
+    };
+
+    // Keep the stream's own BIO while we use memory BIOs. It's the
+    // same BIO for reading and writing, so SSL_set_bio() releases it once.
+    BIO *stream_bio = SSL_get_rbio(ssl);
+    BIO_up_ref(stream_bio);
+    BIO *in = BIO_new(BIO_s_mem());
+    BIO *out = BIO_new(BIO_s_mem());
+    SSL_set_bio(ssl, in, out);
+    SSL_set_accept_state(ssl);
+
+    auto restore = [ssl, stream_bio] {
+        SSL_set_bio(ssl, stream_bio, stream_bio);
+    };
+
+    try {
+        auto& pool = WfdeTlsHandshakePool::GetInstance();
+        while(true) {
+            auto result = make_shared<Result>(pipeline);
+
+            // The SSL object must survive the socket if it's closed now
+            SSL_up_ref(ssl);
+            const bool queued = pool.Post([ssl, result](bool cancelled) {
+                if (cancelled) {
+                    result->error = SSL_ERROR_SYSCALL;
+                } else {
+                    ERR_clear_error();
+                    result->rval = SSL_do_handshake(ssl);
+                    result->error = SSL_get_error(ssl, result->rval);
+                    result->reason = ERR_peek_last_error();
+                }
+                SSL_free(ssl);
+                result->SetDone();
+            });
+
+            if (!queued) {
+                SSL_free(ssl);
+                LOG_WARN_FN << "The TLS handshake queue is full ("
+                    << pool.GetQueueDepth() << "). Refusing the handshake.";
+                WAR_THROW_T(ExceptionOutOfRange, "Too many TLS handshakes");
+            }
+
+            result->Wait(yield);
+
+            // Alerts or handshake messages for the peer
+            Flush(out, socket, yield);
+
+            if (result->rval == 1) {
+                break;
+            }
+
+            if (result->error != SSL_ERROR_WANT_READ) {
+                throw boost::system::system_error(
+                    (result->error == SSL_ERROR_SSL)
+                        ? boost::system::error_code(
+                            static_cast<int>(result->reason),
+                            boost::asio::error::get_ssl_category())
+                        : boost::asio::error::connection_reset,
+                    "TLS handshake");
+            }
+
+            ReadRecord(in, socket, yield);
+        }
+    } catch(...) {
+        restore();
+        throw;
+    }
+
+    restore();
+}
+
+}}} // namespaces
+
+#endif // WFDE_WITH_TLS
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <wfde/config.h>
+#ifdef WFDE_WITH_TLS
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+#include <openssl/ssl.h>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <warlib/WarPipeline.h>
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Worker threads for the CPU heavy part of TLS handshakes
+ *
+ * The key exchange and the signature in a handshake take far longer
+ * than anything else we do on a pipeline. If they run on the pipeline,
+ * a burst of new TLS connections stalls all the other sessions and
+ * transfers on it.
+ *
+ * The queue is bounded. When it's full, new handshakes are refused,
+ * and the interfaces stop accepting connections until it drains.
+ *
+ * Tasks that are still queued when the pool is destroyed are called
+ * with cancelled set, so that they can release what they hold.
+ */
+class WfdeTlsHandshakePool
+{
+public:
+    using task_t = std::function<void (bool cancelled)>;
+    using ready_t = std::function<void ()>;
+
+    WfdeTlsHandshakePool(unsigned threads = DefaultThreads(),
+                         std::size_t maxQueueDepth = 1024);
+    ~WfdeTlsHandshakePool();
+
+    WfdeTlsHandshakePool(const WfdeTlsHandshakePool&) = delete;
+    WfdeTlsHandshakePool& operator = (const WfdeTlsHandshakePool&) = delete;
+
+    /*! Queue a task
+     *
+     * \return false if the queue is full
+     */
+    bool Post(task_t task);
+
+    /*! Number of tasks that are queued or running */
+    std::size_t GetQueueDepth() const noexcept { return depth_; }
+
+    /*! The highest queue depth seen so far */
+    std::size_t GetPeakQueueDepth() const noexcept { return peak_depth_; }
+
+    /*! Number of tasks refused because the queue was full */
+    std::uint64_t GetNumRejected() const noexcept { return rejected_; }
+
+    /*! True when new connections should wait */
+    bool IsSaturated() const noexcept { return depth_ >= max_depth_ / 2; }
+
+    /*! Call ready when the pool is no longer saturated
+     *
+     * It's called right away if the pool is not saturated, and
+     * otherwise from a worker thread.
+     */
+    void WhenReady(ready_t ready);
+
+    /*! The instance used by the TLS sockets */
+    static WfdeTlsHandshakePool& GetInstance();
+
+    static unsigned DefaultThreads();
+
+private:
+    void Run();
+
+    const std::size_t max_depth_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<task_t> queue_;
+    std::vector<ready_t> ready_waiters_;
+    bool stop_ = false;
+    std::atomic_size_t depth_{0};
+    std::atomic_size_t peak_depth_{0};
+    std::atomic<std::uint64_t> rejected_{0};
+    std::vector<std::thread> workers_;
+};
+
+/*! Server side TLS handshake, with the crypto on the handshake pool
+ *
+ * The records are read from and written to the socket on the pipeline,
+ * while SSL_do_handshake() runs on the pool. During the handshake, the
+ * connection's BIOs are replaced with memory BIOs. We read exactly one
+ * record at the time, so nothing beyond the handshake is consumed from
+ * the socket, and the original BIOs can be put back when we are done.
+ *
+ * \exception ExceptionOutOfRange if the pool's queue is full
+ * \exception boost::system::system_error if the handshake fails
+ */
+void AsyncTlsServerHandshake(SSL *ssl,
+                             boost::asio::ip::tcp::socket& socket,
+                             Pipeline& pipeline,
+                             boost::asio::yield_context& yield);
+
+}}} // namespaces
+
+#endif // WFDE_WITH_TLS
@@ -0,0 +1,189 @@
+#include "war_wfde.h"
+
+#ifdef WFDE_WITH_TLS
+
+#include <ctime>
+#include <functional>
+
+#include <warlib/WarLog.h>
+#include <warlib/error_handling.h>
+
+#include "WfdeTlsSessionCache.h"
+
+using namespace std;
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+namespace {
+
+string ToKey(const unsigned char *id, const unsigned len)
+{
+    return {reinterpret_cast<const char *>(id), len};
+}
+
+/*! Not expired, and not marked as bad by OpenSSL after an unclean shutdown */
+bool IsUsable(const SSL_SESSION *session)
+{
+    return SSL_SESSION_is_resumable(session)
+        && ((SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session))
+            >= time(nullptr));
+}
+
+} // anonymous namespace
+
+WfdeTlsSessionCache::Shard::~Shard()
+{
+    for(auto& it : sessions) {
+        SSL_SESSION_free(it.second.session);
+    }
+}
+
+/*! Take ownership of a session */
+void WfdeTlsSessionCache::Shard::Add(SSL_SESSION *session)
+{
+    unsigned len = 0;
+    const auto id = SSL_SESSION_get_id(session, &len);
+    auto key = ToKey(id, len);
+
+    lock_guard<std::mutex> lock(mutex);
+
+    auto& slot = sessions[key];
+    if (slot.session) {
+        SSL_SESSION_free(slot.session);
+    } else {
+        slot.age = by_age.insert(by_age.end(), move(key));
+    }
+    slot.session = session;
+
+    while(sessions.size() > max_sessions) {
+        const auto oldest = sessions.find(by_age.front());
+        WAR_ASSERT(oldest != sessions.end());
+        SSL_SESSION_free(oldest->second.session);
+        sessions.erase(oldest);
+        by_age.pop_front();
+    }
+}
+
+/*! Get a session. The caller gets a reference to it. */
+SSL_SESSION *WfdeTlsSessionCache::Shard::Get(const string& id)
+{
+    lock_guard<std::mutex> lock(mutex);
+
+    const auto it = sessions.find(id);
+    if (it == sessions.end()) {
+        return nullptr;
+    }
+
+    if (!IsUsable(it->second.session)) {
+        SSL_SESSION_free(it->second.session);
+        by_age.erase(it->second.age);
+        sessions.erase(it);
+        return nullptr;
+    }
+
+    SSL_SESSION_up_ref(it->second.session);
+    return it->second.session;
+}
+
+WfdeTlsSessionCache::WfdeTlsSessionCache(const size_t sessionsPerPipeline)
+: sessions_per_pipeline_{sessionsPerPipeline}
+{
+}
+
+void WfdeTlsSessionCache::Install(boost::asio::ssl::context& context,
+                                  const boost::filesystem::path& certPath)
+{
+    auto ctx = context.native_handle();
+
+    // Keep sessions for different certificates apart
+    const auto sid_ctx = hash<string>()(certPath.string());
+    SSL_CTX_set_session_id_context(ctx,
+        reinterpret_cast<const unsigned char *>(&sid_ctx), sizeof(sid_ctx));
+
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+#ifdef TLS1_3_VERSION
+    // The default is two tickets, each a session in the cache
+    SSL_CTX_set_num_tickets(ctx, 1);
+#endif
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER
+        | SSL_SESS_CACHE_NO_INTERNAL | SSL_SESS_CACHE_NO_AUTO_CLEAR);
+    SSL_CTX_sess_set_new_cb(ctx, OnNewSession);
+    SSL_CTX_sess_set_get_cb(ctx, OnGetSession);
+}
+
+void WfdeTlsSessionCache::Attach(SSL *ssl, const int pipelineId)
+{
+    Shard *shard = nullptr;
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto& s = shards_[pipelineId];
+        if (!s) {
+            s = make_unique<Shard>(sessions_per_pipeline_);
+        }
+        shard = s.get();
+    }
+
+    SSL_set_ex_data(ssl, GetExDataIndex(), shard);
+}
+
+size_t WfdeTlsSessionCache::GetNumSessions() const
+{
+    size_t sessions = 0;
+
+    lock_guard<mutex> lock(mutex_);
+    for(const auto& shard : shards_) {
+        lock_guard<mutex> shard_lock(shard.second->mutex);
+        sessions += shard.second->sessions.size();
+    }
+
+    return sessions;
+}
+
+int WfdeTlsSessionCache::OnNewSession(SSL *ssl, SSL_SESSION *session)
+{
+    if (auto shard = GetShard(ssl)) {
+        shard->Add(session);
+        return 1; // We keep the reference
+    }
+
+    return 0;
+}
+
+SSL_SESSION *WfdeTlsSessionCache::OnGetSession(SSL *ssl,
+                                               const unsigned char *id,
+                                               int len, int *copy)
+{
+    *copy = 0; // Shard::Get() gave us a reference
+
+    if (auto shard = GetShard(ssl)) {
+        auto session = shard->Get(ToKey(id, static_cast<unsigned>(len)));
+        LOG_TRACE3_FN << (session ? "Resuming" : "Unknown") << " TLS session";
+        return session;
+    }
+
+    return nullptr;
+}
+
+WfdeTlsSessionCache::Shard *WfdeTlsSessionCache::GetShard(SSL *ssl)
+{
+    return static_cast<Shard *>(SSL_get_ex_data(ssl, GetExDataIndex()));
+}
+
+int WfdeTlsSessionCache::GetExDataIndex()
+{
+    static const int index = SSL_get_ex_new_index(0, nullptr, nullptr,
+                                                  nullptr, nullptr);
+    return index;
+}
+
+WfdeTlsSessionCache& WfdeTlsSessionCache::GetInstance()
+{
+    static WfdeTlsSessionCache instance;
+    return instance;
+}
+
+}}} // namespaces
+
+#endif // WFDE_WITH_TLS
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <wfde/config.h>
+#ifdef WFDE_WITH_TLS
+
+#include <map>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
+
+#include <openssl/ssl.h>
+#include <boost/asio/ssl.hpp>
+#include <boost/filesystem.hpp>
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Server side TLS session cache
+ *
+ * Lets the data connections resume the TLS session of the control
+ * connection (or of an earlier data connection), instead of doing a
+ * full handshake for each transfer.
+ *
+ * The cache replaces OpenSSL's internal cache, which is one big
+ * locked table per SSL_CTX. We keep one bounded shard for each
+ * pipeline. A session is stored in the shard of the pipeline that
+ * negotiated it, and the data connections for a FTP session are
+ * always created on the same pipeline as the control connection,
+ * so the lookup will normally find it there. When a shard is full,
+ * the oldest sessions are dropped.
+ *
+ * Stateless session tickets are disabled, so that TLS 1.3 resumption
+ * also goes through the cache.
+ */
+class WfdeTlsSessionCache
+{
+public:
+    WfdeTlsSessionCache(std::size_t sessionsPerPipeline = 1024);
+
+    WfdeTlsSessionCache(const WfdeTlsSessionCache&) = delete;
+    WfdeTlsSessionCache& operator = (const WfdeTlsSessionCache&) = delete;
+
+    /*! Enable session caching for a newly loaded context
+     *
+     * Sessions are only resumed by contexts loaded from the same
+     * certificate file.
+     */
+    void Install(boost::asio::ssl::context& context,
+                 const boost::filesystem::path& certPath);
+
+    /*! Make a connection use the shard for it's pipeline */
+    void Attach(SSL *ssl, int pipelineId);
+
+    std::size_t GetNumSessions() const;
+
+    /*! The instance used by the TLS sockets */
+    static WfdeTlsSessionCache& GetInstance();
+
+private:
+    struct Shard {
+        using by_age_t = std::list<std::string>;
+
+        struct Entry {
+            SSL_SESSION *session = nullptr;
+            by_age_t::iterator age; // Our key in by_age
+        };
+
+        explicit Shard(std::size_t maxSessions)
+        : max_sessions{maxSessions} {}
+        ~Shard();
+
+        void Add(SSL_SESSION *session);
+        SSL_SESSION *Get(const std::string& id);
+
+        const std::size_t max_sessions;
+        std::mutex mutex;
+        std::unordered_map<std::string, Entry> sessions;
+        by_age_t by_age; // Oldest first
+    };
+
+    static int OnNewSession(SSL *ssl, SSL_SESSION *session);
+    static SSL_SESSION *OnGetSession(SSL *ssl, const unsigned char *id,
+                                     int len, int *copy);
+    static Shard *GetShard(SSL *ssl);
+    static int GetExDataIndex();
+
+    const std::size_t sessions_per_pipeline_;
+    mutable std::mutex mutex_;
+    std::map<int, std::unique_ptr<Shard>> shards_;
+};
+
+}}} // namespaces
+
+#endif // WFDE_WITH_TLS
@@ -6,18 +6,22 @@
 #include <boost/asio/ssl.hpp>
 
 #include <wfde/wfde.h>
+#include "WfdeZeroCopy.h"
+#include "WfdeIdGenerator.h"
+#include "WfdeTlsContext.h"
+#include "WfdeTlsSessionCache.h"
+#include "WfdeKernelTls.h"
+#include "WfdeTlsHandshake.h"
 
 #include <warlib/WarPipeline.h>
-#include <warlib/uuid.h>
 #include <warlib/WarLog.h>
 
-/* At this point boost::asio does not allow us to upgrade
- * from plain TCP to SSL by constructing an ssl stream over an
- * existing tcp socket. It appears that the ssl stream must own
- * the underlaying socket.
+/* The socket starts out as plain TCP. Most clients never ask for TLS,
+ * so the SSL stream is only created when the connection is upgraded.
  *
- * That means that we need to construct a SSL stream for each TCP socket that
- * may need to use SSL at some later time.
+ * The SSL stream is layered over a reference to the TCP socket that we
+ * own, rather than owning the socket itself. That way the socket
+ * stays the same object before, during and after TLS.
  */
 
 namespace war {
@@ -31,36 +35,30 @@ public:
     using ptr_t = std::shared_ptr<WfdeTlsSocket>;
     using wptr_t = std::weak_ptr<WfdeTlsSocket>;
     using socket_t = SocketT;
-    using ssl_socket_t = boost::asio::ssl::stream<socket_t>;
-
-    WfdeTlsSocket(Pipeline& pipeline, const boost::filesystem::path& certPath)
-    : id_{get_uuid_as_string()}
-    , pipeline_{ pipeline }, cert_path_{certPath}
+    using ssl_socket_t = boost::asio::ssl::stream<socket_t&>;
+
+    /*! Create a socket
+     *
+     * \param kernelTls Try to let the kernel encrypt what we send,
+     *      after the TLS handshake.
+     */
+    WfdeTlsSocket(Pipeline& pipeline, const boost::filesystem::path& certPath,
+                  bool kernelTls = false)
+    : socket_{pipeline.GetIoService()}
+    , pipeline_{ pipeline }, kernel_tls_wanted_{kernelTls}
+    , cert_path_{certPath}
     {
-        InitSocket();
     }
 
-
-////     Not supported by asio at this time!
-//     WfdeTlsSocket(Socket&& origin)
-//     : tls_context_{boost::asio::ssl::context::sslv23_server}
-//     , socket_{std::move(origin.GetSocket())}
-//     , ssl_socket_(socket_, tls_context_)
-//     , id_{origin.GetName()}
-//     , pipeline_{origin.GetPipeline()}
-//     {
-//     }
-
-
     boost::asio::ip::tcp::socket& GetSocket() override {
-        return  static_cast<socket_t&>(ssl_socket_->lowest_layer());
+        return socket_;
     }
     const boost::asio::ip::tcp::socket& GetSocket() const override {
-        return  static_cast<const socket_t&>(ssl_socket_->lowest_layer());
+        return socket_;
     }
     Pipeline& GetPipeline() override { return pipeline_; };
     const Pipeline& GetPipeline() const override { return pipeline_;}
-    const std::string& GetName() const override { return id_; }
+    const std::string& GetName() const override { return id_.Get(); }
 
     void AsyncConnect(const boost::asio::ip::tcp::endpoint& ep,
                       boost::asio::yield_context& yield) override {
@@ -106,7 +104,7 @@ public:
             << boost::asio::buffer_size(buffers)
             << " bytes " << *this;
 
-        if (using_tls_)
+        if (using_tls_ && !kernel_tls_send_)
             boost::asio::async_write(*ssl_socket_, buffers, yield);
         else
             boost::asio::async_write(GetSocket(), buffers, yield);
@@ -119,7 +117,7 @@ public:
             << boost::asio::buffer_size(buffers)
             << " bytes " << *this;
 
-        if (using_tls_)
+        if (using_tls_ && !kernel_tls_send_)
             boost::asio::async_write(*ssl_socket_, buffers, yield);
         else
             boost::asio::async_write(GetSocket(), buffers, yield);
@@ -130,6 +128,15 @@ public:
         if (!using_tls_)
             return;
 
+#ifdef WFDE_WITH_KTLS
+        if (kernel_tls_send_) {
+            // The SSL stream's state is stale. We don't wait for the
+            // peer's close_notify, as it's not required.
+            AsyncSendCloseNotify(GetSocket(), yield);
+            using_tls_ = false;
+            return;
+        }
+#endif
         ssl_socket_->async_shutdown(yield);
         using_tls_ = false;
     }
@@ -169,38 +176,86 @@ public:
 
         LOG_TRACE2_FN << "Upgrading " << *this << " To TLS";
 
-        ssl_socket_->async_handshake(boost::asio::ssl::stream_base::server,
-                                    yield);
+        CreateTlsStream();
+
+        // The crypto runs on the handshake pool, not on our pipeline
+        AsyncTlsServerHandshake(ssl_socket_->native_handle(), socket_,
+                                pipeline_, yield);
         using_tls_ = true;
+
+#ifdef WFDE_WITH_KTLS
+        if (kernel_tls_) {
+            kernel_tls_send_ = kernel_tls_->EnableSend(GetSocketVal());
+            kernel_tls_.reset();
+        }
+#endif
     }
 
     boost::filesystem::path GetCertPath() {
         return cert_path_;
     }
 
-private:
-    void InitSocket() {
-        tls_context_.set_options(boost::asio::ssl::context::default_workarounds
-            | boost::asio::ssl::context::no_sslv2
-            | boost::asio::ssl::context::single_dh_use);
-        tls_context_.use_certificate_chain_file(cert_path_.c_str());
-        tls_context_.use_private_key_file(cert_path_.c_str(),
-                                          boost::asio::ssl::context::pem);
-        //tls_context_.use_tmp_dh_file("dh512.pem");
+    bool IsEncrypted() const override {
+        return using_tls_;
+    }
 
-        LOG_DEBUG_FN << "Using TLS certificate " << cert_path_
-            << " for socket " << id_;
+    bool CanSendFile() const override {
+        return !using_tls_ || kernel_tls_send_;
+    }
 
-        ssl_socket_ = std::make_unique<ssl_socket_t>(pipeline_.GetIoService(),
-                                                     tls_context_);
+    std::size_t AsyncSendFile(int fd, std::uint64_t offset, std::size_t bytes,
+                              boost::asio::yield_context& yield) override {
+        if (!CanSendFile()) {
+            WAR_THROW_T(ExceptionNotImplemented,
+                        "sendfile is not available on encrypted sockets without kTLS");
+        }
+        return AsyncSendFileToSocket(GetSocket(), fd, offset, bytes, yield);
+    }
+
+    std::size_t AsyncReceiveFile(int fd, std::uint64_t offset, std::size_t bytes,
+                                 boost::asio::yield_context& yield) override {
+        if (using_tls_) {
+            WAR_THROW_T(ExceptionNotImplemented,
+                        "splice is not available on encrypted sockets");
+        }
+        return splice_pipe_.Receive(GetSocket(), fd, offset, bytes, yield);
+    }
+
+private:
+    void CreateTlsStream() {
+#ifdef WFDE_WITH_KTLS
+        kernel_tls_.reset(); // Refers to the old stream
+#endif
+        kernel_tls_send_ = false;
+        tls_context_ = WfdeTlsContextCache::GetInstance().Get(cert_path_);
+
+        LOG_TRACE2_FN << "Using TLS certificate " << cert_path_
+            << " for socket " << GetName();
+
+        ssl_socket_ = std::make_unique<ssl_socket_t>(socket_, *tls_context_);
+        WfdeTlsSessionCache::GetInstance().Attach(ssl_socket_->native_handle(),
+                                                  pipeline_.GetId());
+#ifdef WFDE_WITH_KTLS
+        if (kernel_tls_wanted_) {
+            kernel_tls_ = std::make_unique<WfdeKernelTls>(
+                ssl_socket_->native_handle());
+        }
+#endif
     }
 
-    const std::string id_;
+    socket_t socket_;
+    const WfdeLazyName id_; // Formatted when logged
     Pipeline& pipeline_;
     bool using_tls_ = false;
-    boost::asio::ssl::context tls_context_{ boost::asio::ssl::context::sslv23_server };
-    std::unique_ptr<ssl_socket_t> ssl_socket_;
+    const bool kernel_tls_wanted_;
+    bool kernel_tls_send_ = false; // The kernel encrypts what we send
+    WfdeTlsContextCache::context_ptr_t tls_context_; // Shared, immutable
+    std::unique_ptr<ssl_socket_t> ssl_socket_; // Only after UpgradeToTls()
+#ifdef WFDE_WITH_KTLS
+    std::unique_ptr<WfdeKernelTls> kernel_tls_; // Until the handshake is done
+#endif
     const boost::filesystem::path cert_path_;
+    SplicePipe splice_pipe_;
 };
 
 } // namespace impl
@@ -0,0 +1,360 @@
+#include "war_wfde.h"
+#include <cctype>
+#include <map>
+#include <limits>
+#include <algorithm>
+#include <boost/algorithm/string.hpp>
+#include <warlib/WarLog.h>
+#include <warlib/error_handling.h>
+
+#include "WfdeStackPool.h"
+
+using namespace std;
+using namespace std::string_literals;
+
+std::ostream& operator << (std::ostream& o,
+                           const war::wfde::TransferOptions::Backend& backend) {
+
+    static const vector<std::string> names = {
+        "mmap"s, "pread"s, "direct"s
+    };
+
+    WAR_ASSERT(static_cast<decltype(names.size())>(backend) < names.size());
+
+    return o << names[static_cast<int>(backend)];
+}
+
+namespace war {
+namespace wfde {
+
+namespace {
+
+/*! Parse the digits at the start of value
+ *
+ * Unlike stoull(), we don't accept signs or white space,
+ * and we don't let large numbers wrap around.
+ */
+uint64_t ParseUnsigned(const std::string& value, size_t& end)
+{
+    uint64_t rval = 0;
+    for(end = 0; (end < value.size())
+        && isdigit(static_cast<unsigned char>(value[end])); ++end) {
+        const auto digit = static_cast<uint64_t>(value[end] - '0');
+        if (rval > (numeric_limits<uint64_t>::max() - digit) / 10) {
+            WAR_THROW_T(ExceptionParseError, "Number is too large: "s + value);
+        }
+        rval = (rval * 10) + digit;
+    }
+
+    if (end == 0) {
+        WAR_THROW_T(ExceptionParseError, "Invalid number: "s + value);
+    }
+
+    return rval;
+}
+
+/*! Get a number from the configuration
+ *
+ * The errors name the key, so that the user knows what to fix.
+ */
+uint64_t GetNumber(const Configuration& conf, const char *key,
+                   const char *defaultVal,
+                   const uint64_t maxVal = numeric_limits<uint64_t>::max())
+{
+    const auto value = conf.GetValue(key, defaultVal);
+    size_t end = 0;
+    uint64_t rval = 0;
+    try {
+        rval = ParseUnsigned(value, end);
+    } catch(const ExceptionParseError&) {
+        end = 0;
+    }
+
+    if ((end == 0) || (end != value.size()) || (rval > maxVal)) {
+        WAR_THROW_T(ExceptionParseError,
+                    key + ": Invalid value: "s + value);
+    }
+
+    return rval;
+}
+
+// Like GetNumber(), for sizes like "256K"
+uint64_t GetSize(const Configuration& conf, const char *key,
+                 const char *defaultVal)
+{
+    const auto value = conf.GetValue(key, defaultVal);
+    try {
+        return TransferOptions::ParseSize(value);
+    } catch(const ExceptionParseError&) {
+        WAR_THROW_T(ExceptionParseError, key + ": Invalid size: "s + value);
+    }
+}
+
+// Returns true if name is prefix, or a path below it
+bool IsBelow(const std::string& name, const std::string& prefix)
+{
+    return !prefix.empty()
+        && (name.compare(0, prefix.size(), prefix) == 0)
+        && ((name.size() == prefix.size())
+            || (prefix.back() == '/')
+            || (name[prefix.size()] == '/'));
+}
+
+} // anonymous namespace
+
+std::uint64_t TransferOptions::ParseSize(const string& value)
+{
+    size_t end = 0;
+    auto size = ParseUnsigned(value, end);
+
+    if (end < value.size()) {
+        uint64_t mult = 1;
+        switch(toupper(value[end])) {
+            case 'K':
+                mult = 1024;
+                break;
+            case 'M':
+                mult = 1024 * 1024;
+                break;
+            case 'G':
+                mult = 1024 * 1024 * 1024;
+                break;
+            default:
+                WAR_THROW_T(ExceptionParseError, "Invalid size: "s + value);
+        }
+
+        if (++end != value.size()) {
+            WAR_THROW_T(ExceptionParseError, "Invalid size: "s + value);
+        }
+
+        if (size > numeric_limits<uint64_t>::max() / mult) {
+            WAR_THROW_T(ExceptionParseError, "Size is too large: "s + value);
+        }
+        size *= mult;
+    }
+
+    return size;
+}
+
+TransferOptions::Backend TransferOptions::ParseBackend(const string& name)
+{
+    static const std::map<std::string, Backend> backends = {
+        {"mmap"s, Backend::MMAP},
+        {"pread"s, Backend::PREAD},
+        {"direct"s, Backend::DIRECT}
+    };
+
+    const auto it = backends.find(name);
+    if (it == backends.end()) {
+        WAR_THROW_T(ExceptionParseError, "Unknown file backend: "s + name);
+    }
+
+    return it->second;
+}
+
+TransferOptions::Backend
+TransferOptions::GetBackend(const boost::filesystem::path& path) const
+{
+    const auto& name = path.generic_string();
+    const BackendOverride *best = nullptr;
+    size_t best_len = 0;
+
+    for(const auto& bo : backend_overrides) {
+        const auto& prefix = bo.path.generic_string();
+        if ((prefix.size() >= best_len) && IsBelow(name, prefix)) {
+            best = &bo;
+            best_len = prefix.size();
+        }
+    }
+
+    return best ? best->backend : backend;
+}
+
+bool TransferOptions::UseDropBehind(const boost::filesystem::path& path,
+                                    std::uint64_t size) const
+{
+    if (drop_behind_threshold && (size >= drop_behind_threshold)) {
+        return true;
+    }
+
+    const auto& name = path.generic_string();
+    for(const auto& prefix : drop_behind_paths) {
+        if (IsBelow(name, prefix.generic_string())) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool TransferOptions::UseCompressedVariant(const boost::filesystem::path& path,
+                                           std::uint64_t size) const
+{
+    // Files that are already compressed will not shrink
+    static const std::vector<std::string> compressed = {
+        ".gz"s, ".tgz"s, ".zst"s, ".xz"s, ".bz2"s, ".zip"s, ".7z"s,
+        ".jpg"s, ".png"s, ".mp4"s
+    };
+
+    if (compressed_cache_dir.empty() || (size < compressed_min_size)) {
+        return false;
+    }
+
+    const auto& name = path.generic_string();
+    for(const auto& ext : compressed) {
+        if ((name.size() >= ext.size())
+            && (name.compare(name.size() - ext.size(), ext.size(), ext) == 0)) {
+            return false;
+        }
+    }
+
+    if (compressed_paths.empty()) {
+        return true;
+    }
+
+    for(const auto& prefix : compressed_paths) {
+        if (IsBelow(name, prefix.generic_string())) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+TransferOptions TransferOptions::Load(const Configuration& conf)
+{
+    TransferOptions opts;
+
+    opts.zero_copy_send = conf.GetValue("/Transfer/ZeroCopySend", "1") == "1";
+    opts.zero_copy_receive = conf.GetValue("/Transfer/ZeroCopyReceive", "1") == "1";
+    opts.zero_copy_chunk_size = static_cast<size_t>(
+        GetSize(conf, "/Transfer/ZeroCopyChunkSize", "4M"));
+    opts.kernel_tls = conf.GetValue("/Transfer/KernelTls", "1") == "1";
+
+    opts.min_window = static_cast<size_t>(
+        GetSize(conf, "/Transfer/MinWindow", "256K"));
+    opts.max_window = static_cast<size_t>(
+        GetSize(conf, "/Transfer/MaxWindow", "8M"));
+    opts.read_ahead_windows = static_cast<unsigned>(
+        GetNumber(conf, "/Transfer/ReadAheadWindows", "2",
+                  numeric_limits<unsigned>::max()));
+
+    opts.backend = ParseBackend(conf.GetValue("/Transfer/Backend", "mmap"));
+    opts.buffer_size = static_cast<size_t>(
+        GetSize(conf, "/Transfer/BufferSize", "1M"));
+
+    for(const auto& node : conf.EnumNodes("/Transfer/BackendOverrides")) {
+        const auto key = "/Transfer/BackendOverrides/"s + node.name;
+        const auto path = conf.GetValue((key + "/Path").c_str(), "");
+        if (path.empty()) {
+            WAR_THROW_T(ExceptionParseError, key + "/Path is missing");
+        }
+        opts.backend_overrides.push_back({path,
+            ParseBackend(conf.GetValue((key + "/Backend").c_str(), "mmap"))});
+    }
+
+    opts.shared_cache = conf.GetValue("/Transfer/SharedCache", "1") == "1";
+    opts.write_back_window = static_cast<size_t>(
+        GetSize(conf, "/Transfer/WriteBackWindow", "8M"));
+    opts.sync_before_reply = conf.GetValue("/Transfer/SyncBeforeReply", "0") == "1";
+
+    opts.drop_behind_threshold =
+        GetSize(conf, "/Transfer/DropBehindThreshold", "0");
+    for(const auto& node : conf.EnumNodes("/Transfer/DropBehindPaths")) {
+        const auto key = "/Transfer/DropBehindPaths/"s + node.name;
+        const auto path = conf.GetValue((key + "/Path").c_str(), "");
+        if (path.empty()) {
+            WAR_THROW_T(ExceptionParseError, key + "/Path is missing");
+        }
+        opts.drop_behind_paths.push_back(path);
+    }
+
+    opts.compressed_cache_dir = conf.GetValue("/Transfer/CompressedCache/Path", "");
+    opts.compressed_cache_size =
+        GetSize(conf, "/Transfer/CompressedCache/MaxSize", "1G");
+    opts.compressed_min_size =
+        GetSize(conf, "/Transfer/CompressedCache/MinFileSize", "64K");
+    opts.compressed_level = static_cast<int>(
+        GetNumber(conf, "/Transfer/CompressedCache/Level", "6", 9));
+    opts.compressed_min_requests = static_cast<unsigned>(
+        GetNumber(conf, "/Transfer/CompressedCache/MinRequests", "2",
+                  numeric_limits<unsigned>::max()));
+    for(const auto& node : conf.EnumNodes("/Transfer/CompressedCache/Files")) {
+        const auto key = "/Transfer/CompressedCache/Files/"s + node.name;
+        const auto path = conf.GetValue((key + "/Path").c_str(), "");
+        if (path.empty()) {
+            WAR_THROW_T(ExceptionParseError, key + "/Path is missing");
+        }
+        opts.compressed_paths.push_back(path);
+    }
+
+    opts.hash_threads = static_cast<unsigned>(
+        GetNumber(conf, "/Transfer/HashThreads", "2",
+                  numeric_limits<unsigned>::max()));
+    opts.hash_chunk_size =
+        GetSize(conf, "/Transfer/HashChunkSize", "64M");
+
+    opts.hash_cache_dir = conf.GetValue("/Transfer/HashCache/Path", "");
+    opts.hash_cache_size = static_cast<size_t>(
+        GetNumber(conf, "/Transfer/HashCache/MaxEntries", "1000000",
+                  numeric_limits<size_t>::max()));
+    {
+        const auto names = conf.GetValue("/Transfer/HashCache/Upload", "");
+        boost::split(opts.upload_hashes, names, boost::is_any_of(", "),
+                     boost::token_compress_on);
+        opts.upload_hashes.erase(remove(opts.upload_hashes.begin(),
+                                        opts.upload_hashes.end(), ""s),
+                                 opts.upload_hashes.end());
+    }
+
+    opts.control_stack_size = static_cast<size_t>(
+        GetSize(conf, "/Transfer/ControlStackSize", "128K"));
+    opts.data_stack_size = static_cast<size_t>(
+        GetSize(conf, "/Transfer/DataStackSize", "128K"));
+
+#ifdef WFDE_WITH_HASH
+    for(const auto& name : opts.upload_hashes) {
+        try {
+            HashEngine::GetAlgorithm(name);
+        } catch(const ExceptionNotFound&) {
+            WAR_THROW_T(ExceptionParseError,
+                        "/Transfer/HashCache/Upload: Unknown algorithm "s + name);
+        }
+    }
+#endif
+
+    if ((opts.hash_threads == 0) || (opts.hash_chunk_size == 0)) {
+        WAR_THROW_T(ExceptionParseError,
+                    "/Transfer/HashThreads and /Transfer/HashChunkSize must be > 0");
+    }
+
+    if ((opts.compressed_level < 1) || (opts.compressed_level > 9)) {
+        WAR_THROW_T(ExceptionParseError,
+                    "/Transfer/CompressedCache/Level must be 1 - 9");
+    }
+
+    if (opts.buffer_size == 0) {
+        WAR_THROW_T(ExceptionParseError, "/Transfer/BufferSize must be > 0");
+    }
+
+    if (opts.zero_copy_chunk_size == 0) {
+        WAR_THROW_T(ExceptionParseError, "/Transfer/ZeroCopyChunkSize must be > 0");
+    }
+
+    if ((opts.control_stack_size < impl::WfdeStackPool::min_stack_size)
+        || (opts.data_stack_size < impl::WfdeStackPool::min_stack_size)) {
+        WAR_THROW_T(ExceptionParseError,
+                    "/Transfer/ControlStackSize and /Transfer/DataStackSize "
+                    "must be >= 16K");
+    }
+
+    if ((opts.min_window == 0) || (opts.max_window < opts.min_window)) {
+        WAR_THROW_T(ExceptionParseError,
+                    "/Transfer/MinWindow must be > 0 and <= /Transfer/MaxWindow");
+    }
+
+    return opts;
+}
+
+} // namespace wfde
+} // namespace war
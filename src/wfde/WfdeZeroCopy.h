@@ -0,0 +1,171 @@
+#pragma once
+
+#include <wfde/wfde.h>
+#include <warlib/WarLog.h>
+
+#ifdef __linux__
+#   include <sys/sendfile.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <errno.h>
+#endif
+
+namespace war {
+namespace wfde {
+namespace impl {
+
+/*! Send data from a file directly to a plain TCP socket
+ *
+ * Uses sendfile(2) so that the data never enters user-space. If the
+ * socket buffer is full, the coroutine is suspended until asio reports
+ * the socket as writable.
+ *
+ * \return Number of bytes sent. 0 if we are at the end of the file.
+ */
+template <typename SocketT>
+std::size_t AsyncSendFileToSocket(SocketT& sck, int fd, std::uint64_t offset,
+                                  std::size_t bytes,
+                                  boost::asio::yield_context& yield)
+{
+#ifdef __linux__
+    if (!sck.native_non_blocking()) {
+        sck.native_non_blocking(true);
+    }
+
+    while(true) {
+        off_t ofs = static_cast<off_t>(offset);
+        const auto sent = ::sendfile(sck.native_handle(), fd, &ofs, bytes);
+
+        if (sent >= 0) {
+            LOG_TRACE4_F_FN(log::LA_IO) << "Sent " << sent
+                << " bytes from fd " << fd << " at offset " << offset;
+            return static_cast<std::size_t>(sent);
+        }
+
+        const auto err = errno;
+        if (err == EINTR) {
+            continue;
+        }
+
+        if ((err == EAGAIN) || (err == EWOULDBLOCK)) {
+            sck.async_wait(SocketT::wait_write, yield);
+            continue;
+        }
+
+        throw boost::system::system_error(err, boost::system::system_category());
+    }
+#else
+    WAR_THROW_T(ExceptionNotImplemented, "sendfile is not supported on this platform");
+#endif
+}
+
+/*! Kernel pipe used to splice() data from a socket to a file.
+ *
+ * The pipe is created the first time it is needed, and
+ * closed when the owning socket is destroyed.
+ */
+class SplicePipe
+{
+public:
+    SplicePipe() = default;
+    SplicePipe(const SplicePipe&) = delete;
+    SplicePipe& operator = (const SplicePipe&) = delete;
+
+    ~SplicePipe() {
+#ifdef __linux__
+        if (fds_[0] >= 0) {
+            ::close(fds_[0]);
+            ::close(fds_[1]);
+        }
+#endif
+    }
+
+    /*! Move up to bytes bytes from the socket to fd at offset
+     *
+     * \return Number of bytes written to the file. 0 if the peer
+     *      closed the connection.
+     */
+    template <typename SocketT>
+    std::size_t Receive(SocketT& sck, int fd, std::uint64_t offset,
+                        std::size_t bytes, boost::asio::yield_context& yield) {
+#ifdef __linux__
+        Open(bytes);
+
+        if (!sck.native_non_blocking()) {
+            sck.native_non_blocking(true);
+        }
+
+        ssize_t received = 0;
+        while(true) {
+            received = ::splice(sck.native_handle(), nullptr, fds_[1], nullptr,
+                                std::min(bytes, pipe_size_),
+                                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (received >= 0) {
+                break;
+            }
+
+            const auto err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+
+            if ((err == EAGAIN) || (err == EWOULDBLOCK)) {
+                sck.async_wait(SocketT::wait_read, yield);
+                continue;
+            }
+
+            throw boost::system::system_error(err, boost::system::system_category());
+        }
+
+        // Drain the pipe into the file. The pipe is in blocking mode,
+        // and we know the data is there.
+        loff_t ofs = static_cast<loff_t>(offset);
+        for(auto remaining = received; remaining > 0;) {
+            const auto written = ::splice(fds_[0], nullptr, fd, &ofs,
+                                          remaining, SPLICE_F_MOVE);
+            if (written < 0) {
+                const auto err = errno;
+                if (err == EINTR) {
+                    continue;
+                }
+                throw boost::system::system_error(err, boost::system::system_category());
+            }
+            WAR_ASSERT(written > 0);
+            remaining -= written;
+        }
+
+        LOG_TRACE4_F_FN(log::LA_IO) << "Received " << received
+            << " bytes to fd " << fd << " at offset " << offset;
+
+        return static_cast<std::size_t>(received);
+#else
+        WAR_THROW_T(ExceptionNotImplemented, "splice is not supported on this platform");
+#endif
+    }
+
+private:
+#ifdef __linux__
+    void Open(std::size_t wantBytes) {
+        if (fds_[0] >= 0) {
+            return;
+        }
+
+        if (::pipe2(fds_, O_CLOEXEC) != 0) {
+            throw boost::system::system_error(errno, boost::system::system_category());
+        }
+
+        // Try to get a larger pipe than the default 64K. This may fail
+        // if we ask for more than /proc/sys/fs/pipe-max-size, and that is OK.
+        const auto size = std::min<std::size_t>(wantBytes, 1024 * 1024);
+        const auto actual = ::fcntl(fds_[1], F_SETPIPE_SZ, static_cast<int>(size));
+        if (actual > 0) {
+            pipe_size_ = static_cast<std::size_t>(actual);
+        }
+    }
+#endif
+
+    int fds_[2] = {-1, -1};
+    std::size_t pipe_size_ = 1024 * 64;
+};
+
+}}} // namespaces
@@ -0,0 +1,163 @@
+#include "war_wfde.h"
+
+#include <warlib/WarLog.h>
+#include <warlib/error_handling.h>
+
+#include "wfde/ftp_protocol.h"
+
+using namespace std;
+using namespace std::string_literals;
+
+namespace war {
+namespace wfde {
+
+namespace {
+
+bool IsDigit(const char ch) noexcept
+{
+    return (ch >= '0') && (ch <= '9');
+}
+
+// Fixed seed, so that the table is the same on every start
+uint64_t NextMultiplier(uint64_t& state) noexcept
+{
+    // splitmix64
+    auto z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return (z ^ (z >> 31)) | 1;
+}
+
+} // anonymous namespace
+
+constexpr size_t FtpCmdTable::max_name_length;
+
+FtpCmd::ParamSyntax FtpCmd::ParseParamSyntax(const string& syntax)
+{
+    if (syntax.empty()) {
+        return ParamSyntax::NONE;
+    }
+    if (syntax == "(.*)") {
+        return ParamSyntax::ANY;
+    }
+    if (syntax == "(.+)") {
+        return ParamSyntax::NOT_EMPTY;
+    }
+    if (syntax == R"((\d+))") {
+        return ParamSyntax::NUMBER;
+    }
+    return ParamSyntax::REGEX;
+}
+
+bool FtpCmd::MatchParam(const param_t& param, string& buffer,
+                        match_t& match) const
+{
+    switch(param_syntax_) {
+        case ParamSyntax::NONE:
+        case ParamSyntax::ANY:
+            return true;
+        case ParamSyntax::NOT_EMPTY:
+            return !param.empty();
+        case ParamSyntax::NUMBER:
+            return !param.empty()
+                && all_of(param.begin(), param.end(), IsDigit);
+        case ParamSyntax::REGEX:
+            break;
+    }
+
+    // boost::regex needs the match to refer to a std::string
+    buffer.assign(param.data(), param.size());
+    return boost::regex_match(buffer, match, regex_);
+}
+
+FtpCmdTable::FtpCmdTable(vector<FtpCmd *> commands)
+: commands_{move(commands)}
+{
+    vector<slot_t> keys;
+    keys.reserve(commands_.size());
+    for(const auto cmd : commands_) {
+        uint64_t key = 0;
+        if (!MakeKey(cmd->GetName(), key)) {
+            WAR_THROW_T(ExceptionInvalidParameter,
+                        "Invalid FTP command name: "s + cmd->GetName());
+        }
+        keys.emplace_back(key, cmd);
+    }
+
+    // Start with a table at least four times the number of commands,
+    // and grow it until we find a multiplier without collisions.
+    unsigned bits = 2;
+    while((1u << bits) < (keys.size() * 4)) {
+        ++bits;
+    }
+
+    uint64_t seed = 0;
+    for(; bits < 16; ++bits) {
+        for(int attempt = 0; attempt < 1000; ++attempt) {
+            multiplier_ = NextMultiplier(seed);
+            shift_ = 64 - bits;
+            slots_.assign(size_t{1} << bits, slot_t{0, nullptr});
+
+            bool collision = false;
+            for(const auto& k : keys) {
+                auto& slot = slots_[GetSlot(k.first)];
+                if (slot.second) {
+                    if (slot.first == k.first) {
+                        WAR_THROW_T(ExceptionInvalidParameter,
+                                    "Duplicate FTP command: "s
+                                    + k.second->GetName());
+                    }
+                    collision = true;
+                    break;
+                }
+                slot = k;
+            }
+
+            if (!collision) {
+                LOG_TRACE1_FN << "Placed " << keys.size()
+                    << " FTP commands in " << slots_.size() << " slots";
+                return;
+            }
+        }
+    }
+
+    WAR_THROW_T(ExceptionInvalidParameter, "Failed to build the FTP command table");
+}
+
+FtpCmd *FtpCmdTable::Find(const boost::string_ref& name) const noexcept
+{
+    uint64_t key = 0;
+    if (!MakeKey(name, key)) {
+        return nullptr;
+    }
+
+    const auto& slot = slots_[GetSlot(key)];
+    return (slot.first == key) ? slot.second : nullptr;
+}
+
+/*! Pack the upper-case name into an integer, one byte per character
+ *
+ * The names never contain 0, so names of different lengths can't get
+ * the same key.
+ */
+bool FtpCmdTable::MakeKey(const boost::string_ref& name,
+                          uint64_t& key) noexcept
+{
+    if (name.empty() || (name.size() > max_name_length)) {
+        return false;
+    }
+
+    key = 0;
+    for(const char ch : name) {
+        const auto upper = ((ch >= 'a') && (ch <= 'z')) ? (ch - ('a' - 'A')) : ch;
+        if (upper == 0) {
+            return false;
+        }
+        key = (key << 8) | static_cast<unsigned char>(upper);
+    }
+
+    return true;
+}
+
+} // wfde
+} // war
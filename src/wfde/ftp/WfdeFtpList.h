@@ -13,6 +13,8 @@
 #include <wfde/ftp_protocol.h>
 #include <warlib/impl.h>
 
+#include "WfdeIdGenerator.h"
+
 /* I don't like using namespaces in header-files, but this makes sense
  * as this header-file is actually an implementation detail used by
  * wfde_ftp_commands.cpp only, and the using simplifies this file a lot.
@@ -26,7 +28,7 @@ namespace impl {
 class LsLongFormat
 {
 public:
-    LsLongFormat(const FtpState& /*state*/)
+    LsLongFormat(Session& /*session*/, const FtpState& /*state*/)
     : year_time_border_{time(0) - half_year()} {}
 
     int CalculateSize(const FileListIterator& fli) const noexcept {
@@ -104,7 +106,7 @@ private:
 class NlstFormat
 {
 public:
-    NlstFormat(const FtpState& /*state*/) {}
+    NlstFormat(Session& /*session*/, const FtpState& /*state*/) {}
 
     int CalculateSize(const FileListIterator& fli) const noexcept {
 
@@ -130,12 +132,24 @@ void print_timeval(char *&cur, const timespec& ts);
 class MlsdFormat
 {
 public:
-    MlsdFormat(const FtpState& state)
-    : state_{state.mdtx_state} {}
+    MlsdFormat(Session& session, const FtpState& state)
+    : state_{state.mdtx_state}
+    , hash_engine_{session.GetHost().GetHashEngine()}
+    {
+        HashEngine::Algorithm algorithm;
+        for(const auto fact : state_.GetFacts()) {
+            if (state_.IsEnabled(fact) && MdtxState::IsDigest(fact, algorithm)) {
+                // Room for "name=<up to 512 bits as hex>;"
+                digests_size_ += static_cast<int>(
+                    state_.GetFactName(fact).size() + 2 + 128);
+            }
+        }
+    }
 
     int CalculateSize(const FileListIterator& fli) const noexcept {
 
-        return approx_size_ = static_cast<int>(fli.GetName().size() + 128);
+        return approx_size_ = static_cast<int>(fli.GetName().size() + 128
+            + digests_size_);
     }
 
     int PrintIt(char *buffer, const FileListIterator& fli) const noexcept {
@@ -236,6 +250,12 @@ public:
             *cur_++ = ';';
         }
 
+#ifndef WIN32
+        if (digests_size_ && hash_engine_ && !fli.IsDirectory()) {
+            PrintDigests(fli);
+        }
+#endif
+
         // Space before name, if we have facts (not a double space)
         // TODO: Double check RFC 3659 for this
         if (*(cur_ -1) != ' ')
@@ -252,6 +272,29 @@ public:
     }
 
 private:
+#ifndef WIN32
+    // Only the digests we have in the cache are listed
+    void PrintDigests(const FileListIterator& fli) const {
+        const auto id = FileId::FromStat(fli.GetStat());
+
+        HashEngine::Algorithm algorithm;
+        for(const auto fact : state_.GetFacts()) {
+            if (!state_.IsEnabled(fact)
+                || !MdtxState::IsDigest(fact, algorithm)) {
+                continue;
+            }
+
+            const auto digest = hash_engine_->GetCachedDigest(id, algorithm);
+            if (!digest.empty()) {
+                Print(state_.GetFactName(fact));
+                *cur_++ = '=';
+                Print(digest);
+                *cur_++ = ';';
+            }
+        }
+    }
+#endif
+
     void Print(const boost::string_ref& str) const {
         memcpy(cur_, str.data(), str.size());
         cur_ += str.size();
@@ -265,6 +308,8 @@ private:
     mutable char *cur_ = nullptr;
     mutable int approx_size_{};;
     const MdtxState& state_;
+    HashEngine *hash_engine_ = nullptr;
+    int digests_size_ = 0;
 };
 
 class DirListerLs : public DirLister<LsLongFormat>
@@ -305,7 +350,7 @@ public:
 
     WfdeFtpList(std::unique_ptr<Path>&& path, Session& session,
                 const FtpState& state)
-    : id_(boost::uuids::random_generator()())
+    : id_(WfdeIdGenerator::NextUuid())
     , current_path_{move(path)}
     , dir_lister_{*current_path_, session, state}
     {}
@@ -327,6 +372,9 @@ public:
         return {nullptr, 0};
     };
     void SetBytesWritten(size_t bytes) override { WAR_ASSERT(false); };
+    void SetBytesWrittenToHandle(size_t bytes) override { WAR_ASSERT(false); };
+    void Reserve(std::uint64_t bytes) override { WAR_ASSERT(false); };
+    void Sync() override { WAR_ASSERT(false); };
     void Seek(fpos_t pos) override { WAR_ASSERT(false); };;
     fpos_t GetPos() const override { return pos_; }
     fpos_t GetSize() const override { return 0; }
@@ -344,8 +392,12 @@ public:
         return 1024 * 16;
     }
 
+    int GetNativeHandle() const noexcept override { return -1; }
+    const Stats& GetStats() const noexcept override { return stats_; }
+
 private:
     const boost::uuids::uuid id_;
+    const Stats stats_;
     std::unique_ptr<Path> current_path_;
     bool is_eof_ = false;
     fpos_t pos_ = 0;
@@ -9,12 +9,20 @@
 #include <warlib/WarLog.h>
 #include "wfde/ftp_protocol.h"
 #include "WfdeAsciiFile.h"
+#include "WfdeRangeFile.h"
+#ifdef WFDE_WITH_ZLIB
+#   include "WfdeDeflateFile.h"
+#endif
 #include "WfdeSocket.h"
 #include "WfdeTlsSocket.h"
+#include "WfdeStackPool.h"
+#include "WfdeAsyncResult.h"
+#include "WfdeIoWorkers.h"
 
 #include <boost/iterator/iterator_concepts.hpp>
 #include "boost/regex.hpp"
 #include <boost/algorithm/string.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 #include <warlib/helper.h>
 
@@ -108,6 +116,13 @@ boost::string_ref WfdeFtpSessionInput::FetchNextCommand()
     }
 }
 
+bool WfdeFtpSessionInput::HaveBufferedCommand() const
+{
+    return bytes_leftover_
+        && (boost::string_ref(current_buffer_, bytes_leftover_)
+            .find_first_of(crlf_) != boost::string_ref::npos);
+}
+
 class Foo
 {
 public:
@@ -135,6 +150,11 @@ WfdeFtpSession::WfdeFtpSession(const Session::ptr_t& session)
 , socket_ptr_{session->GetSocket().shared_from_this()}
 , ftp_commands_{GetDefaultFtpCommands()}
 {
+    // Most replies fit, so they don't allocate
+    reply_text_.reserve(256);
+    reply_sending_.reserve(256);
+    reply_message_.reserve(256);
+
     LOG_TRACE1_FN << "Session " << *this << " is constructed";
 }
 
@@ -166,6 +186,16 @@ void WfdeFtpSession::ProcessCommands(boost::asio::yield_context yield)
         && !session_.expired() && socket_ptr_->IsOpen()) {
 
         try {
+            // Commands that the client pipelined are processed before
+            // we send the replies, so they go out in one write.
+            if (!input_.HaveBufferedCommand()
+                || (reply_text_.size() >= max_queued_replies_)) {
+                FlushReplies(*yield_);
+                if (reply_failed_) {
+                    break;
+                }
+            }
+
             const auto request = input_.FetchNextCommand();
 
             LOG_TRACE1_FN << "Received FTP request " << log::Esc(request)
@@ -190,6 +220,7 @@ void WfdeFtpSession::ProcessCommands(boost::asio::yield_context yield)
         )
     }
 
+    FlushReplies(*yield_);
     DoClose();
 }
 
@@ -207,32 +238,33 @@ void WfdeFtpSession::ProcessRequest(const boost::string_ref& request)
 
 FtpCmd& WfdeFtpSession::GetFtpCommand(const boost::string_ref& request)
 {
-    locale loc;
-    string cmd_name;
-
-    for(auto ch = request.begin()
-        ; (ch != request.end()) && isalpha(*ch, loc)
-        ; ++ch) {
-        cmd_name += toupper(*ch, loc);
+    // Some extensions, like XSHA256, have digits in their names.
+    // Plain ASCII, so that we don't need a locale for each command.
+    size_t len = 0;
+    for(; len < request.size(); ++len) {
+        const auto ch = request[len] | 0x20; // Lower case for letters
+        const bool is_alpha = (ch >= 'a') && (ch <= 'z');
+        const bool is_digit = (request[len] >= '0') && (request[len] <= '9');
+        if (!is_alpha && !(len && is_digit)) {
+            break;
+        }
     }
 
-    if (cmd_name.empty()) {
+    if (!len) {
         WAR_THROW_T(ExceptionParseError, "No command name");
     }
 
-    if (cmd_name.size() > max_cmd_name_length_) {
+    if (len > max_cmd_name_length_) {
         WAR_THROW_T(ExceptionParseError, "Command name too long.");
         // TODO: Potential hacker attack - Notify the security manager
     }
 
-    auto my_cmd = ftp_commands_.find(cmd_name);
-    if (my_cmd == ftp_commands_.end()) {
+    auto my_cmd = ftp_commands_.Find(request.substr(0, len));
+    if (!my_cmd) {
         WAR_THROW_T(ExceptionParseError, "Unrecognized command");
     }
 
-    curr_cmd_name_ = cmd_name;
-
-    return my_cmd->second;
+    return *my_cmd;
 }
 
 void WfdeFtpSession::OnCommand(FtpCmd& cmd, const boost::string_ref& request)
@@ -243,10 +275,11 @@ void WfdeFtpSession::OnCommand(FtpCmd& cmd, const boost::string_ref& request)
     }
 
     if (!cmd.NeedPrevCmd().empty()) {
-        if (prev_cmd_name_ != cmd.NeedPrevCmd()) {
+        if (!prev_cmd_ || (prev_cmd_->GetName() != cmd.NeedPrevCmd())) {
             LOG_NOTICE_FN << "Bad sequence of commands for " << *this
-                << ". I require this command " << log::Esc(curr_cmd_name_)
-                << " to follow the previous command " << log::Esc(prev_cmd_name_);
+                << ". I require this command " << log::Esc(cmd.GetName())
+                << " to follow the previous command "
+                << log::Esc(prev_cmd_ ? prev_cmd_->GetName() : ""s);
 
            Reply(FtpReplyCodes::RC_BAD_SEQUENCE_OF_COMMANDS);
            return;
@@ -254,7 +287,7 @@ void WfdeFtpSession::OnCommand(FtpCmd& cmd, const boost::string_ref& request)
     }
 
     if (cmd.MustBeLoggedIn() && !state_.IsLoggedIn()) {
-        LOG_NOTICE_FN << "The command " << log::Esc(curr_cmd_name_)
+        LOG_NOTICE_FN << "The command " << log::Esc(cmd.GetName())
                 << " Requires the user to be logged in. Saying no-no to "
                 << *this;
         Reply(FtpReplyCodes::RC_NOT_LOGGED_ON);
@@ -262,7 +295,7 @@ void WfdeFtpSession::OnCommand(FtpCmd& cmd, const boost::string_ref& request)
     }
 
     if (cmd.MustNotBeLoggedIn() && state_.IsLoggedIn()) {
-        LOG_NOTICE_FN << "The command " << log::Esc(curr_cmd_name_)
+        LOG_NOTICE_FN << "The command " << log::Esc(cmd.GetName())
                 << " Requires the user NOT to be logged in. Saying no-no to "
                 << *this;
         Reply(FtpReplyCodes::RC_ACTION_NOT_TAKEN, "You are logged in!");
@@ -270,7 +303,7 @@ void WfdeFtpSession::OnCommand(FtpCmd& cmd, const boost::string_ref& request)
     }
 
     if (cmd.MustBeInTransfer() && !state_.IsInTransfer()) {
-        LOG_NOTICE_FN << "The command " << log::Esc(curr_cmd_name_)
+        LOG_NOTICE_FN << "The command " << log::Esc(cmd.GetName())
                 << " Requires the user to be in file transfer. Saying no-no to "
                 << *this;
         Reply(FtpReplyCodes::RC_ACTION_NOT_TAKEN, "No active file transfer");
@@ -278,7 +311,7 @@ void WfdeFtpSession::OnCommand(FtpCmd& cmd, const boost::string_ref& request)
     }
 
     if (cmd.MustNotBeInTransfer() && state_.IsInTransfer()) {
-        LOG_NOTICE_FN << "The command " << log::Esc(curr_cmd_name_)
+        LOG_NOTICE_FN << "The command " << log::Esc(cmd.GetName())
                 << " Requires the user NOT to be in file transfer. Saying no-no to "
                 << *this;
         Reply(FtpReplyCodes::RC_ACTION_NOT_TAKEN, "Active file transfer!");
@@ -296,7 +329,7 @@ void WfdeFtpSession::OnCommand(FtpCmd& cmd, const boost::string_ref& request)
 #ifdef WFDE_WITH_TLS
     if (cmd.MustHaveEncryption() && !state_.cc_is_encrypted) {
         LOG_DEBUG_FN << "Control Channel must be encrypted for "
-            << log::Esc(curr_cmd_name_)
+            << log::Esc(cmd.GetName())
             << ". Rejecting command"
             << " on " << session;
 
@@ -305,38 +338,31 @@ void WfdeFtpSession::OnCommand(FtpCmd& cmd, const boost::string_ref& request)
         return;
     }
 #endif
-    // Ugly and error-prone way to get a pointer to the start of the command parameters
-    // TODO: Replace with something better.
-    auto remaining = request.size();
-    auto start_of_param = request.begin();
-    start_of_param += curr_cmd_name_.size();
-    remaining -= curr_cmd_name_.size();
-    while(remaining && (*start_of_param == ' ')) {
-        ++start_of_param;
-        --remaining;
-    }
-
-    const boost::string_ref param(start_of_param, remaining);
-    const std::string wasted_buffer_workaround_for_broken_regex(param.data(), param.length());
+    // The parameters follow the command name and the spaces after it
+    auto param = request.substr(cmd.GetName().size());
+    while(!param.empty() && (param.front() == ' ')) {
+        param.remove_prefix(1);
+    }
+
+    std::string regex_buffer; // Only used by commands with complex syntax
     FtpCmd::match_t param_match;
-    if (!cmd.CanHaveParams()
-        || boost::regex_match(wasted_buffer_workaround_for_broken_regex,
-                              param_match, cmd.GetRegex())) {
+    if (cmd.MatchParam(param, regex_buffer, param_match)) {
 
         LOG_DEBUG_FN << "Executing FTP command " << cmd.GetName() << ' '
             << log::Esc(param) << " on " << *this;
 
         try {
-            FtpReply reply;
+            FtpReply reply(reply_message_);
             cmd.OnCmd(*session, state_, request, param, param_match, reply);
             session->Touch();
-            prev_cmd_name_ = cmd.GetName();
+            prev_cmd_ = &cmd;
 
             if (reply.HaveReply()) {
                 auto cmd_replied = reply.GetReply();
                 Reply(cmd_replied.first, cmd_replied.second, reply.IsMultiline());
                 if (reply.NeedToEndSession()) {
                     LOG_DEBUG_FN << "The client requested to end " << *this;
+                    FlushReplies(*yield_);
                     Close();
                 }
                 return;
@@ -353,7 +379,7 @@ void WfdeFtpSession::OnCommand(FtpCmd& cmd, const boost::string_ref& request)
         )
     } else {
         LOG_WARN_FN << "Invalid argument " << log::Esc(param)
-            << " to FTP command " << log::Esc(curr_cmd_name_)
+            << " to FTP command " << log::Esc(cmd.GetName())
             << " using regex " << cmd.GetRegex();
         Reply(FtpReplyCodes::RC_SYNTAX_ERROR_IN_PARAMS);
     }
@@ -361,65 +387,100 @@ void WfdeFtpSession::OnCommand(FtpCmd& cmd, const boost::string_ref& request)
 }
 
 void WfdeFtpSession::Reply(FtpReplyCodes code,
-                           const string& message,
+                           const boost::string_ref& message,
                            bool multiLine)
 {
-    Reply(code, *yield_, message, multiLine);
+    QueueReply(code, message, multiLine);
+
+    // The tasks, like switching to TLS, must not wait for the next command
+    if (!state_.tasks_pending_after_reply.empty()) {
+        FlushReplies(*yield_);
+    }
 }
 
 void WfdeFtpSession::Reply(FtpReplyCodes code,
                            boost::asio::yield_context& yield,
-                           const string& message,
+                           const boost::string_ref& message,
                            const bool multiLine)
 {
-    static const string end{" END\r\n"}, dash{"- "}, space{" "};
+    QueueReply(code, message, multiLine);
+    FlushReplies(yield);
+}
 
+void WfdeFtpSession::QueueReply(FtpReplyCodes code,
+                                const boost::string_ref& message,
+                                const bool multiLine)
+{
     if (reply_failed_ || !socket_ptr_->IsOpen()) {
         LOG_DEBUG_FN << "The socket is dead. No reply is expected.";
         return;
     }
 
-    // Put the reply in the text-buffer;
-    reply_strings_.resize(1);
-    const auto& reply = Resolve(code);
-    reply_strings_[0] = to_string(reply.first) + (multiLine ? dash : space)
-        + (message.empty() ? reply.second : message) + crlf_;
-    if (multiLine) {
-        reply_strings_[0] += to_string(reply.first) + end;
-    }
+    // Append the reply to the ones we have not sent yet
+    const auto start = reply_text_.size();
+    FormatReply(reply_text_, code, message, multiLine);
 
-    const bool logging = log::LogEngine::IsRelevant(war::log::LL_TRACE1, war::log::LA_GENERAL);
-    std::string relply_msg_for_log;
+    // Strip off the last CRLF in the reply for logging.
+    const boost::string_ref reply_for_log(reply_text_.data() + start,
+                                          reply_text_.size() - start - 2);
 
-    // Prepare the asio message buffer-wrappers
-    reply_buffers_.resize(reply_strings_.size());
-    for(size_t i = 0; i < reply_strings_.size(); ++i) {
-        reply_buffers_[i] = {&reply_strings_[i][0], reply_strings_[i].size()};
-        if (logging)
-            relply_msg_for_log += reply_strings_[i];
-    }
+    LOG_TRACE1_FN << "Replying " << log::Esc(reply_for_log)
+        << " in " << *this;
+}
 
+/*! Send all the queued replies in one write
+ *
+ * Both the control connection and the transfer coroutine reply on the
+ * control channel. Only one of them writes at the time. The others
+ * wait on their own timers, so that they don't cancel each other,
+ * and are woken in the order they arrived when the write is done.
+ */
+void WfdeFtpSession::FlushReplies(boost::asio::yield_context& yield)
+{
+    while(reply_flushing_) {
+        auto waiter = make_shared<boost::asio::steady_timer>(
+            socket_ptr_->GetPipeline().GetIoService());
+        waiter->expires_at(boost::asio::steady_timer::time_point::max());
+        reply_waiters_.push_back(waiter);
 
-    // Strip off the last CRLF in the copy of the reply for logging.
-    if (logging && !relply_msg_for_log.empty()) {
-        WAR_ASSERT(relply_msg_for_log.size() > 2);
-        relply_msg_for_log.resize(relply_msg_for_log.size() -2);
+        boost::system::error_code ec;
+        waiter->async_wait(yield[ec]);
     }
 
-    LOG_TRACE1_FN << "Replying " << log::Esc(relply_msg_for_log)
-        << " in " << *this;
+    if (reply_text_.empty()) {
+        return;
+    }
 
-    // Send the reply
-    WAR_ASSERT(reply_failed_ == false);
+    reply_flushing_ = true;
+    while(!reply_text_.empty() && !reply_failed_ && socket_ptr_->IsOpen()) {
 
-    // boost::asio::buffer need a const in order to return the correct type
-    try {
-        socket_ptr_->AsyncWrite(reply_buffers_, yield);
-    } WAR_CATCH_ALL_EF(
-        reply_failed_ = true;
-        LOG_WARN_FN << "Failed to reply in " << *this;
+        // Replies queued while we write go out in the next round
+        swap(reply_text_, reply_sending_);
+        reply_text_.clear();
+        reply_buffers_.resize(1);
+        reply_buffers_[0] = {reply_sending_.data(), reply_sending_.size()};
+
+        try {
+            socket_ptr_->AsyncWrite(reply_buffers_, yield);
+        } WAR_CATCH_ALL_EF(
+            reply_failed_ = true;
+            LOG_WARN_FN << "Failed to reply in " << *this;
+        )
+    }
+    reply_text_.clear();
+    reply_flushing_ = false;
+
+    // Our write may have sent their replies as well. If not, the
+    // first one to resume takes over.
+    auto waiters = move(reply_waiters_);
+    reply_waiters_.clear();
+    for(auto& waiter : waiters) {
+        waiter->cancel();
+    }
+
+    if (reply_failed_) {
         return;
-    )
+    }
 
     /* Execute any tasks pending after the reply is sent */
     while(!state_.tasks_pending_after_reply.empty()) {
@@ -463,12 +524,38 @@ void WfdeFtpSession::DoClose()
 
 void WfdeFtpSession::StartTransfer(unique_ptr<File> file)
 {
+    // Allocate the space the client announced with ALLO up front, so
+    // that the file gets few extents, and a full disk is reported
+    // before we open the data connection.
+    if (state_.allo && (file->GetOperation() != File::FileOperation::READ)) {
+        file->Reserve(state_.allo);
+    }
+
+    // REST and RANG. Only accepted for binary transfers.
+    if (file->GetOperation() == File::FileOperation::READ) {
+        if (state_.rest) {
+            file->Seek(state_.rest);
+        }
+        if (state_.rang_end) {
+            file = make_unique<WfdeRangeFile>(move(file), state_.rang_end);
+        }
+    }
+
     if (state_.GetType() == FtpState::Type::BIN) {
         current_file_ = move(file);
     } else {
         current_file_ = make_unique<WfdeAsciiFile>(move(file));
     }
 
+#ifdef WFDE_WITH_ZLIB
+    // Compression is applied on the data as it is sent, after any
+    // conversion required by the transfer type.
+    if (state_.mode == FtpState::Mode::DEFLATE) {
+        current_file_ = make_unique<WfdeDeflateFile>(move(current_file_),
+                                                     state_.deflate_level);
+    }
+#endif
+
     switch(current_file_->GetOperation()) {
         case File::FileOperation::READ:
             state_.transfer = FtpState::Transfer::OUTGOING;
@@ -480,13 +567,58 @@ void WfdeFtpSession::StartTransfer(unique_ptr<File> file)
             break;
     }
 
+    auto& stacks = WfdeStackPool::Get(
+        GetSession()->GetHost().GetTransferOptions().data_stack_size);
+
     boost::asio::spawn(GetPipeline().GetIoService(),
+                       std::allocator_arg, stacks.GetAllocator(),
                        bind(&WfdeFtpSession::TransferFile,
                             shared_from_this(),
                             std::placeholders::_1),
                        boost::asio::detached);
 }
 
+std::string WfdeFtpSession::HashFile(const boost::filesystem::path& path,
+                                     const HashEngine::Algorithm algorithm,
+                                     const uint64_t from,
+                                     const uint64_t to)
+{
+    auto engine = GetSession()->GetHost().GetHashEngine();
+    if (!engine) {
+        WAR_THROW_T(ExceptionNotImplemented, "No hash engine");
+    }
+
+    WAR_ASSERT(yield_);
+
+    // Don't keep the replies to pipelined commands while we are hashing
+    FlushReplies(*yield_);
+
+    struct Result : public WfdeAsyncResult {
+        using WfdeAsyncResult::WfdeAsyncResult;
+
+        std::string digest;
+        std::exception_ptr error;
+    };
+
+    auto result = make_shared<Result>(GetPipeline());
+
+    engine->Hash(path, algorithm, from, to,
+                 [result](const string& digest, exception_ptr error) {
+        result->digest = digest;
+        result->error = error;
+        result->SetDone();
+    });
+
+    // Suspend the control connection until the worker is done
+    result->Wait(*yield_);
+
+    if (result->error) {
+        std::rethrow_exception(result->error);
+    }
+
+    return result->digest;
+}
+
 void WfdeFtpSession::TransferFile(boost::asio::yield_context yield)
 {
     WAR_ASSERT(current_file_);
@@ -508,7 +640,11 @@ void WfdeFtpSession::TransferFile(boost::asio::yield_context yield)
 #ifdef WFDE_WITH_TLS
     if (!cert_path.empty()) {
         LOG_DEBUG_FN << "Creating TLS socket with certificate: " << log::Esc(cert_path.string());
-        sck = make_shared<tls_tcp_socket_t>(GetPipeline(), cert_path);
+        // Only the sending direction can be handed over to the kernel
+        const bool kernel_tls = (state_.transfer == FtpState::Transfer::OUTGOING)
+            && GetSession()->GetHost().GetTransferOptions().kernel_tls;
+        sck = make_shared<tls_tcp_socket_t>(GetPipeline(), cert_path,
+                                            kernel_tls);
     } else {
 #else
     {
@@ -573,6 +709,16 @@ void WfdeFtpSession::TransferFile(boost::asio::yield_context yield)
         } else {
             ReceiveFile(yield);
         }
+    } catch(const ExceptionDiskFull&) {
+        LOG_WARN_FN << "File transfer of  " << *current_file_
+                    << " Failed in " << *this << ": The disk is full";
+        Reply(FtpReplyCodes::RC_OUT_OF_DISKSPACE, yield);
+    } catch(const boost::system::system_error& ex) {
+        LOG_WARN_FN << "File transfer of  " << *current_file_
+                    << " Failed in " << *this << ": " << ex.what();
+        Reply((ex.code() == boost::system::errc::no_space_on_device)
+            ? FtpReplyCodes::RC_OUT_OF_DISKSPACE
+            : FtpReplyCodes::RC_TRANSFER_ABORTED, yield);
     } WAR_CATCH_ALL_EF(
         LOG_WARN_FN << "File transfer of  " << *current_file_
                     << " Failed in " << *this;
@@ -599,16 +745,44 @@ void WfdeFtpSession::SendFile(boost::asio::yield_context& yield)
     WAR_ASSERT(current_file_);
     WAR_ASSERT(transfer_sck_->IsOpen());
 
-    LOG_TRACE2_FN << "Entering send-loop for " << *current_file_;
+    // Let the kernel copy the data directly from the file to the socket
+    // when nothing needs to be converted, or encrypted in user-space,
+    // on the way.
+    const auto& opts = GetSession()->GetHost().GetTransferOptions();
+    const int fd = current_file_->GetNativeHandle();
+    const bool zero_copy = opts.zero_copy_send && (fd >= 0)
+        && transfer_sck_->CanSendFile();
+
+    LOG_TRACE2_FN << "Entering send-loop for " << *current_file_
+        << (zero_copy ? " using sendfile" : "");
 
     while(!current_file_->IsEof()) {
-        auto buffer = current_file_->Read();
-        if (boost::asio::buffer_size(buffer) == 0) {
-            continue; // May happen when generators filter content
-        }
+        std::size_t sent = 0;
 
         try {
-            transfer_sck_->AsyncWrite(buffer, yield);
+            if (zero_copy) {
+                const auto pos = current_file_->GetPos();
+                const auto want = static_cast<std::size_t>(
+                    min<File::fpos_t>(current_file_->GetSize() - pos,
+                                      opts.zero_copy_chunk_size));
+
+                sent = transfer_sck_->AsyncSendFile(fd, pos, want, yield);
+                if (sent == 0) {
+                    LOG_WARN_FN << "The file " << *current_file_
+                        << " was truncated while sending it on " << *this;
+                    NotifyFailed(yield);
+                    return;
+                }
+                current_file_->Seek(pos + sent);
+            } else {
+                auto buffer = current_file_->Read();
+                sent = boost::asio::buffer_size(buffer);
+                if (sent == 0) {
+                    continue; // May happen when generators filter content
+                }
+
+                transfer_sck_->AsyncWrite(buffer, yield);
+            }
         } WAR_CATCH_ALL_EF(
             LOG_WARN_FN << "File transfer of  " << *current_file_
                         << " Failed " << *this;
@@ -623,7 +797,7 @@ void WfdeFtpSession::SendFile(boost::asio::yield_context& yield)
             return;
         }
 
-        bytes += boost::asio::buffer_size(buffer);
+        bytes += sent;
         TransferTouch();
     }
 
@@ -646,6 +820,8 @@ void WfdeFtpSession::SendFile(boost::asio::yield_context& yield)
     LOG_NOTICE << *this << " successfully sent " << *current_file_
                << ' ' << log::Esc(state_.requested_path_)
                << " (" << bytes << " bytes)";
+    LOG_DEBUG_FN << "IO stats for " << *current_file_ << ": "
+        << current_file_->GetStats();
     Reply(FtpReplyCodes::RC_CLOSING_DATA_CONNECTION, yield,
           "Successfully sent " + state_.requested_path_);
 }
@@ -689,14 +865,39 @@ void WfdeFtpSession::ReceiveFile(boost::asio::yield_context& yield)
     WAR_ASSERT(current_file_);
     WAR_ASSERT(transfer_sck_->IsOpen());
 
-    LOG_TRACE2_FN << "Entering receive-loop for " << *current_file_;
+    // Digests for the hash cache are computed as the data arrives, so
+    // that we don't have to read the file again.
+    auto digests = CreateUploadDigests();
+
+    // Let the kernel move the data directly from the socket to the file
+    // when nothing needs to be converted, decrypted or hashed on the way.
+    const auto& opts = GetSession()->GetHost().GetTransferOptions();
+    const int fd = current_file_->GetNativeHandle();
+    const bool zero_copy = opts.zero_copy_receive && (fd >= 0)
+        && !transfer_sck_->IsEncrypted() && digests.empty();
+
+    LOG_TRACE2_FN << "Entering receive-loop for " << *current_file_
+        << (zero_copy ? " using splice" : "");
 
     for(size_t bytes_read = 0;;) {
-        auto buffer = current_file_->Write();
+        File::mutable_buffer_t buffer;
+        if (!zero_copy) {
+            buffer = current_file_->Write();
+        }
         //const auto bytes_read = boost::asio::async_read(sck, buffer, yield[ec]);
 
         try {
-            bytes_read = transfer_sck_->AsyncReadSome(buffer, yield);
+            if (zero_copy) {
+                bytes_read = transfer_sck_->AsyncReceiveFile(
+                    fd, current_file_->GetPos(), opts.zero_copy_chunk_size,
+                    yield);
+                if (bytes_read == 0) {
+                    LOG_TRACE4_FN << "Got eof from splice";
+                    break;
+                }
+            } else {
+                bytes_read = transfer_sck_->AsyncReadSome(buffer, yield);
+            }
         } catch(const boost::system::system_error& ex) {
             if (ex.code() == boost::asio::error::eof) {
                 current_file_->SetBytesWritten(0);
@@ -704,6 +905,11 @@ void WfdeFtpSession::ReceiveFile(boost::asio::yield_context& yield)
                 break;
             }
 
+            if (ex.code() == boost::system::errc::no_space_on_device) {
+                // From splice()
+                throw;
+            }
+
             LOG_ERROR_FN << "Caught exception [" << typeid(ex).name() << "]: " << ex;
             LOG_WARN_FN << "File transfer of " << *current_file_
                 << " Failed " << " with ec=" << ex.code() << " in " << *this;
@@ -736,7 +942,14 @@ void WfdeFtpSession::ReceiveFile(boost::asio::yield_context& yield)
             Reply(FtpReplyCodes::RC_TRANSFER_ABORTED, yield);
         }
 
-        current_file_->SetBytesWritten(bytes_read);
+        if (zero_copy) {
+            current_file_->SetBytesWrittenToHandle(bytes_read);
+        } else {
+            for(auto& digest : digests) {
+                digest.second->Update(buffer.data(), bytes_read);
+            }
+            current_file_->SetBytesWritten(bytes_read);
+        }
         bytes += bytes_read;
 
         TransferTouch();
@@ -753,16 +966,116 @@ void WfdeFtpSession::ReceiveFile(boost::asio::yield_context& yield)
     )
 
     transfer_sck_->Close();
+
+    // Don't confirm the upload before the data is on the disk
+    if (opts.sync_before_reply) {
+        SyncCurrentFile(yield);
+    }
+
     current_file_->Close();
 
+    if (!digests.empty()) {
+        SaveUploadDigests(digests, bytes);
+    }
+
     LOG_NOTICE << *this << " successfully received " << *current_file_
                << ' ' << log::Esc(state_.requested_path_)
                << " (" << bytes << " bytes)";
+    LOG_DEBUG_FN << "IO stats for " << *current_file_ << ": "
+        << current_file_->GetStats();
     Reply(FtpReplyCodes::RC_CLOSING_DATA_CONNECTION, yield,
          "Successfully received " + state_.requested_path_
     );
 }
 
+/*! Flush the uploaded file to disk from a worker thread
+ *
+ * The transfer coroutine is suspended until it's done, so nothing
+ * else use current_file_ meanwhile.
+ */
+void WfdeFtpSession::SyncCurrentFile(boost::asio::yield_context& yield)
+{
+    struct Result : public WfdeAsyncResult {
+        using WfdeAsyncResult::WfdeAsyncResult;
+
+        std::exception_ptr error;
+    };
+
+    auto result = make_shared<Result>(GetPipeline());
+    auto file = current_file_.get();
+
+    WfdeIoWorkers::GetInstance().Post([file, result](bool cancelled) {
+        try {
+            if (cancelled) {
+                WAR_THROW_T(ExceptionIoError, "Shutting down");
+            }
+            file->Sync();
+        } catch(...) {
+            result->error = current_exception();
+        }
+        result->SetDone();
+    });
+
+    result->Wait(yield);
+
+    if (result->error) {
+        std::rethrow_exception(result->error);
+    }
+}
+
+WfdeFtpSession::upload_digests_t WfdeFtpSession::CreateUploadDigests()
+{
+    upload_digests_t digests;
+
+#ifdef WFDE_WITH_HASH
+    const auto& opts = GetSession()->GetHost().GetTransferOptions();
+    if (opts.hash_cache_dir.empty() || opts.upload_hashes.empty()
+        || !GetSession()->GetHost().GetHashEngine()) {
+        return digests;
+    }
+
+    // The digests are for the file on disk, so we can only use uploads
+    // that are stored exactly as received, from the start of the file.
+    if ((state_.GetType() != FtpState::Type::BIN)
+        || (state_.mode != FtpState::Mode::STREAM)
+        || (current_file_->GetOperation() == File::FileOperation::APPEND)
+        || (current_file_->GetPos() != 0)) {
+        return digests;
+    }
+
+    for(const auto& name : opts.upload_hashes) {
+        const auto algorithm = HashEngine::GetAlgorithm(name);
+        digests.emplace_back(algorithm, HashEngine::CreateDigest(algorithm));
+    }
+#endif
+
+    return digests;
+}
+
+void WfdeFtpSession::SaveUploadDigests(upload_digests_t& digests,
+                                       const File::fpos_t bytes)
+{
+    try {
+        auto session = GetSession();
+        const auto path = session->GetPath(state_.requested_path_,
+                                           Path::Type::FILE);
+        const auto& phys_path = path->GetPhysPath();
+
+        // Another session may have written to the file as well
+        FileId id;
+        if (!FileId::Get(phys_path, id) || (id.size != bytes)) {
+            LOG_DEBUG_FN << "The file " << log::Esc(phys_path.string())
+                << " is changed after the upload. Not caching the digests.";
+            return;
+        }
+
+        for(auto& digest : digests) {
+            session->GetHost().GetHashEngine()->AddDigest(
+                phys_path, id, digest.first, digest.second->Final());
+        }
+    } WAR_CATCH_ERROR;
+}
+
 void WfdeFtpSession::TransferTouch()
 {
     const auto now = std::chrono::steady_clock::now();
@@ -8,6 +8,7 @@
 #include <string>
 
 #include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 #include <wfde/wfde.h>
 #include "wfde/ftp_protocol.h"
@@ -34,6 +35,11 @@ public:
     WfdeFtpSessionInput(WfdeFtpSession *ftpSes) : ftp_ses_{ftpSes} {}
 
     boost::string_ref FetchNextCommand();
+
+    /*! True if a complete command is buffered, so that the next
+     * FetchNextCommand() will not have to read from the socket.
+     */
+    bool HaveBufferedCommand() const;
 protected:
     virtual std::size_t ReadSome(char *p, const std::size_t bytes);
 private:
@@ -63,6 +69,11 @@ public:
 
     void StartTls() override;
 
+    std::string HashFile(const boost::filesystem::path& path,
+                         HashEngine::Algorithm algorithm,
+                         std::uint64_t from,
+                         std::uint64_t to) override;
+
     /********** End overrides for SessionData ********/
 
     void ProcessCommands(boost::asio::yield_context yield);
@@ -71,13 +82,15 @@ public:
 
 protected:
     /*! Prepare the first line of the reply.*/
-    virtual void Reply(FtpReplyCodes code, const std::string& message = "",
+    virtual void Reply(FtpReplyCodes code,
+                       const boost::string_ref& message = {},
                        bool multiLine = false);
 
     /*! Prepare the first line of the reply.*/
     virtual void Reply(FtpReplyCodes code,
                        boost::asio::yield_context& yield,
-                       const std::string& message = "",bool multiLine = false);
+                       const boost::string_ref& message = {},
+                       bool multiLine = false);
 
     /*! Close the session. Clean up. */
     virtual void Close();
@@ -95,7 +108,14 @@ protected:
 
     bool closed_ = false;
 private:
+    using upload_digests_t = std::vector<std::pair<HashEngine::Algorithm,
+        std::unique_ptr<HashEngine::Digest>>>;
+
     void DoClose();
+    void QueueReply(FtpReplyCodes code,
+                    const boost::string_ref& message,
+                    bool multiLine);
+    void FlushReplies(boost::asio::yield_context& yield);
 
     friend class WfdeFtpSessionInput;
     void ProcessRequest(const boost::string_ref& request);
@@ -104,27 +124,34 @@ private:
     void TransferFile(boost::asio::yield_context yield);
     void SendFile(boost::asio::yield_context& yield);
     void ReceiveFile(boost::asio::yield_context& yield);
+    void SyncCurrentFile(boost::asio::yield_context& yield);
     void CleanupTransfer();
     bool DoPort(Socket& sck,
                 boost::asio::yield_context& yield);
     void TransferTouch();
     void NotifyFailed(boost::asio::yield_context& yield);
+    upload_digests_t CreateUploadDigests();
+    void SaveUploadDigests(upload_digests_t& digests, File::fpos_t bytes);
 
     WfdeFtpSessionInput input_;
     const Session::wptr_t session_; // The SessionManagers session we are bound to
     const boost::uuids::uuid id_; // Same as session_.lock()->GetUuid()
     const Socket::ptr_t socket_ptr_; // We need to keep the socket alive
     Socket::write_buffers_t reply_buffers_; // asio buffer wrappers
-    std::vector<std::string> reply_strings_; // The actual data to send
+    std::string reply_text_; // Replies queued, but not yet sent
+    std::string reply_sending_; // The replies we are currently writing
+    // Coroutines waiting to write, in the order they arrived
+    std::deque<std::shared_ptr<boost::asio::steady_timer>> reply_waiters_;
+    bool reply_flushing_ = false;
+    const std::size_t max_queued_replies_ = 1024 * 4; // Bytes
+    std::string reply_message_; // Formatted by the commands
     std::unique_ptr<boost::asio::yield_context> yield_; // Control connection only!
-    const FtpCmd::ftp_commands_t ftp_commands_; // The FTP commands we know about
-    std::string prev_cmd_name_;
-    std::string curr_cmd_name_;
+    const FtpCmdTable& ftp_commands_; // The FTP commands we know about
+    const FtpCmd *prev_cmd_ = nullptr; // Commands live as long as the process
     FtpState state_; // Transfer state
-    const std::size_t max_cmd_name_length_ = 8; // Reasonable max value for command-name
+    const std::size_t max_cmd_name_length_ = FtpCmdTable::max_name_length;
     unique_ptr<File> current_file_; // File being transferred
     std::function<void()> abort_transfer_;
-    const std::string crlf_ = "\r\n"s;
     bool close_pending_ = false;
     std::chrono::steady_clock::time_point last_touch_time_{};
     const int transefer_touch_interval_ = 5; // Call Touch() on session every n seconds
@@ -1,6 +1,7 @@
 #include "war_wfde.h"
 #include "WfdeProtocolFtp.h"
 #include "WfdeFtpSession.h"
+#include "WfdeStackPool.h"
 
 #include <warlib/helper.h>
 
@@ -37,10 +38,13 @@ void WfdeProtocolFtp::HandleConnection(const Socket::ptr_t& socket)
     session->Set(my_ftp_session);
 
     auto& ios = socket->GetPipeline().GetIoService();
+    auto& stacks = WfdeStackPool::Get(
+        GetHost().GetTransferOptions().control_stack_size);
 
     /* The pipeline works as a task sequencer.
      */
-    boost::asio::spawn(ios, bind(&WfdeFtpSession::ProcessCommands,
+    boost::asio::spawn(ios, std::allocator_arg, stacks.GetAllocator(),
+                       bind(&WfdeFtpSession::ProcessCommands,
                                  ftp_session,
                                  std::placeholders::_1),
                        boost::asio::detached);
@@ -3,6 +3,7 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <array>
 #include <algorithm>
 
 #include "wfde/ftp_protocol.h"
@@ -57,6 +58,37 @@ const std::pair<int, std::string>& Resolve(const FtpReplyCodes& code)
     return messages[static_cast<int>(code)];
 }
 
+void FormatReply(std::string& buffer, const FtpReplyCodes code,
+                 const boost::string_ref& message, const bool multiLine)
+{
+    // The digits for each code, so we don't have to format numbers
+    static const auto digits = [] {
+        const auto num_codes
+            = static_cast<size_t>(FtpReplyCodes::RC_ILLEGAL_FILE_NAME) + 1;
+        std::vector<std::array<char, 3>> rval;
+        for(size_t i = 0; i < num_codes; ++i) {
+            const auto value = Resolve(static_cast<FtpReplyCodes>(i)).first;
+            rval.push_back({{static_cast<char>('0' + (value / 100)),
+                             static_cast<char>('0' + ((value / 10) % 10)),
+                             static_cast<char>('0' + (value % 10))}});
+        }
+        return rval;
+    }();
+
+    const auto& code_digits = digits[static_cast<size_t>(code)];
+    const boost::string_ref text = message.empty()
+        ? boost::string_ref(Resolve(code).second) : message;
+
+    buffer.append(code_digits.data(), code_digits.size());
+    buffer += (multiLine ? '-' : ' ');
+    buffer.append(text.data(), text.size());
+    buffer.append("\r\n", 2);
+    if (multiLine) {
+        buffer.append(code_digits.data(), code_digits.size());
+        buffer.append(" END\r\n", 6);
+    }
+}
+
 }} // namespaces
 
 std::ostream& operator << (std::ostream& o, const war::wfde::FtpReplyCodes& code)
@@ -1,6 +1,7 @@
 #include "war_wfde.h"
 
 #include <vector>
+#include <limits>
 #include <memory>
 
 #include <boost/algorithm/string.hpp>
@@ -21,19 +22,32 @@ using namespace string_literals;
 
 std::ostream& operator << (std::ostream& o, const war::wfde::FtpState::Type type)
 {
-    return o << (type == war::wfde::FtpState::Type::ASCII ? "ASCII"s : "Binary"s);
+    return o << (type == war::wfde::FtpState::Type::ASCII ? "ASCII" : "Binary");
+}
+
+std::ostream& operator << (std::ostream& o, const war::wfde::FtpState::Mode mode)
+{
+    return o << (mode == war::wfde::FtpState::Mode::DEFLATE ? "Deflate" : "Stream");
 }
 
 namespace war {
 namespace wfde {
 
 const vector<string> MdtxState::fact_names_ = {
-    "Size", "Modify", "Type", "Unique", "Perm"
+    "Size", "Modify", "Type", "Unique", "Perm",
+    "x.crc32", "x.md5", "x.sha1", "x.sha256", "x.sha512"
 };
 
 const vector<MdtxState::Facts> MdtxState::facts_ = {
     MdtxState::Facts::SIZE, MdtxState::Facts::MODIFY,
-    MdtxState::Facts::TYPE, MdtxState::Facts::UNIQUE, MdtxState::Facts::PERM
+    MdtxState::Facts::TYPE, MdtxState::Facts::UNIQUE, MdtxState::Facts::PERM,
+#ifdef WFDE_WITH_HASH
+#   ifdef WFDE_WITH_ZLIB
+    MdtxState::Facts::X_CRC32,
+#   endif
+    MdtxState::Facts::X_MD5, MdtxState::Facts::X_SHA1,
+    MdtxState::Facts::X_SHA256, MdtxState::Facts::X_SHA512
+#endif
 };
 
 void FtpCmd::OnOpts(Session& session,
@@ -86,9 +100,7 @@ class FtpCmdFeat : public FtpCmd
 public:
     using feat_fun_t = std::function<string (const FtpState&)>;
 
-    bool MustHaveEncryptionIfEnforced() const { return false; }
-
-    FtpCmdFeat() : FtpCmd("FEAT") {}
+    FtpCmdFeat() : FtpCmd("FEAT", PLAINTEXT_OK) {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -132,10 +144,8 @@ private:
 class FtpCmdOpts : public FtpCmd
 {
 public:
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
-
-    FtpCmdOpts() : FtpCmd("OPTS", "[PARAM [PARAM...]]", "([a-z]+)(\\ (.+))?") {}
+    FtpCmdOpts() : FtpCmd("OPTS", LOGGED_IN | NOT_IN_TRANSFER,
+                          "[PARAM [PARAM...]]", "([a-z]+)(\\ (.+))?") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -187,7 +197,7 @@ public:
 class FtpCmdType : public FtpCmd
 {
 public:
-    FtpCmdType() : FtpCmd("TYPE", "A[ N]|I", "([A](\\ N)?)|(I)") {}
+    FtpCmdType() : FtpCmd("TYPE", NO_TRAITS, "A[ N]|I", "([A](\\ N)?)|(I)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -197,8 +207,7 @@ public:
                FtpReply& reply) override
     {
         WAR_ASSERT(!param.empty());
-        std::locale loc;
-        if ('I' == std::toupper(param[0], loc)) {
+        if ((param[0] == 'I') || (param[0] == 'i')) {
             state.ttype = FtpState::Type::BIN;
         } else {
             state.ttype = FtpState::Type::ASCII;
@@ -207,12 +216,79 @@ public:
     }
 };
 
-class FtpCmdUser : public FtpCmd
+#ifdef WFDE_WITH_ZLIB
+/*! Transmission mode
+ *
+ * We support Stream and Deflate (MODE Z). The compression level for
+ * Deflate can be set with OPTS MODE Z LEVEL n, where n is 0 - 9.
+ */
+class FtpCmdMode : public FtpCmd
+{
+public:
+    FtpCmdMode() : FtpCmd("MODE", NOT_IN_TRANSFER, "S|Z", "(S|Z)", "MODE Z") {}
+
+    void OnCmd(Session& session,
+               FtpState& state,
+               const param_t& cmd,
+               const param_t& param,
+               const match_t& match,
+               FtpReply& reply) override
+    {
+        WAR_ASSERT(!param.empty());
+        if ((param[0] == 'Z') || (param[0] == 'z')) {
+            state.mode = FtpState::Mode::DEFLATE;
+        } else {
+            state.mode = FtpState::Mode::STREAM;
+        }
+        reply.Reply(FtpReplyCodes::RC_OK) << state.mode << " mode OK";
+    }
+
+    void OnOpts(Session& session,
+                FtpState& state,
+                const param_t& cmd,
+                const param_t& param,
+                const match_t& match,
+                FtpReply& reply) override
+    {
+        static const boost::regex pattern("Z\\ +LEVEL\\ +([0-9])",
+                                          boost::regex::icase);
+        boost::smatch m;
+        const string options = param.to_string();
+
+        if (!boost::regex_match(options, m, pattern)) {
+            reply.Reply(FtpReplyCodes::RC_SYNTAX_ERROR_IN_PARAMS)
+                << "Syntax: OPTS MODE Z LEVEL 0-9";
+            return;
+        }
+
+        state.deflate_level = m[1].str()[0] - '0';
+        reply.Reply(FtpReplyCodes::RC_OK) << "MODE Z LEVEL set to "
+            << state.deflate_level;
+    }
+};
+#else
+class FtpCmdMode : public FtpCmd
 {
 public:
-    FtpCmdUser() : FtpCmd("USER", "username", "(.+)") {}
+    FtpCmdMode() : FtpCmd("MODE", NOT_IN_TRANSFER, "S", "(S)") {}
+
+    void OnCmd(Session& session,
+               FtpState& state,
+               const param_t& cmd,
+               const param_t& param,
+               const match_t& match,
+               FtpReply& reply) override
+    {
+        state.mode = FtpState::Mode::STREAM;
+        reply.Reply(FtpReplyCodes::RC_OK) << state.mode << " mode OK";
+    }
+};
+#endif
 
-    bool MustNotBeLoggedIn() const override { return true; }
+class FtpCmdUser : public FtpCmd
+{
+public:
+    FtpCmdUser() : FtpCmd("USER", NOT_LOGGED_IN, "username", "(.+)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -235,9 +311,7 @@ public:
 class FtpCmdPass : public FtpCmd
 {
 public:
-    FtpCmdPass() : FtpCmd("PASS", "password", "(.+)") {}
-
-    bool MustNotBeLoggedIn() const override { return true; }
+    FtpCmdPass() : FtpCmd("PASS", NOT_LOGGED_IN, "password", "(.+)") {}
 
     const string& NeedPrevCmd() const override {
         static const string user("USER");
@@ -266,13 +340,11 @@ public:
 class FtpCmdPort : public FtpCmd
 {
 public:
-    FtpCmdPort() : FtpCmd("PORT", "h1,h2,h3,h4,p1,p2",
+    FtpCmdPort() : FtpCmd("PORT", LOGGED_IN | NOT_IN_TRANSFER,
+                          "h1,h2,h3,h4,p1,p2",
                           R"((\d{1,3}),(\d{1,3}),(\d{1,3}),(\d{1,3}),(\d{1,3}),(\d{1,3}))")
     {}
 
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
-
     void OnCmd(Session& session,
                FtpState& state,
                const param_t& cmd,
@@ -333,12 +405,9 @@ private:
 class FtpCmdPasv : public FtpCmd
 {
 public:
-    FtpCmdPasv() : FtpCmd("PASV")
+    FtpCmdPasv() : FtpCmd("PASV", LOGGED_IN | NOT_IN_TRANSFER)
     {}
 
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
-
     void OnCmd(Session& session,
                FtpState& state,
                const param_t& cmd,
@@ -377,11 +446,8 @@ public:
 class FtpCmdRetr : public FtpCmd
 {
 public:
-    FtpCmdRetr() : FtpCmd("RETR", "pathname", "(.+)") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool NeedPostOrPasv() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdRetr() : FtpCmd("RETR", LOGGED_IN | NOT_IN_TRANSFER | POST_OR_PASV,
+                          "pathname", "(.+)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -415,11 +481,8 @@ public:
 class FtpCmdStor : public FtpCmd
 {
 public:
-    FtpCmdStor() : FtpCmd("STOR", "pathname", "(.+)") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool NeedPostOrPasv() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdStor() : FtpCmd("STOR", LOGGED_IN | NOT_IN_TRANSFER | POST_OR_PASV,
+                          "pathname", "(.+)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -437,12 +500,20 @@ public:
             return;
         }
 
+        if (state.rang_end) {
+            reply.Reply(FtpReplyCodes::RC_ACTION_NOT_TAKEN)
+                << "RANG is only available for downloads";
+            return;
+        }
+
         try {
             auto file = session.OpenFile(state.requested_path_,
                                          File::FileOperation::WRITE);
             session.GetSessionData().StartTransfer(move(file));
         } catch (ExceptionFailedToConnect&) {
             reply.Reply(FtpReplyCodes::RC_CANT_OPEN_DATA_CONN);
+        } catch (ExceptionDiskFull&) {
+            reply.Reply(FtpReplyCodes::RC_OUT_OF_DISKSPACE);
         } WAR_CATCH_ALL_EF (
             reply.Reply(FtpReplyCodes::RC_ACTION_FAILED);
         );
@@ -452,11 +523,7 @@ public:
 class FtpCmdStou : public FtpCmd
 {
 public:
-    FtpCmdStou() : FtpCmd("STOU") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool NeedPostOrPasv() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdStou() : FtpCmd("STOU", LOGGED_IN | NOT_IN_TRANSFER | POST_OR_PASV) {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -468,6 +535,12 @@ public:
 
         state.requested_path_ = get_uuid_as_string();
 
+        if (state.rang_end) {
+            reply.Reply(FtpReplyCodes::RC_ACTION_NOT_TAKEN)
+                << "RANG is only available for downloads";
+            return;
+        }
+
         if (state.rest) {
             reply.Reply(FtpReplyCodes::RC_ACTION_NOT_TAKEN)
                 << "STOU can not be combined with REST";
@@ -480,6 +553,8 @@ public:
             session.GetSessionData().StartTransfer(move(file));
         } catch (ExceptionFailedToConnect&) {
             reply.Reply(FtpReplyCodes::RC_CANT_OPEN_DATA_CONN);
+        } catch (ExceptionDiskFull&) {
+            reply.Reply(FtpReplyCodes::RC_OUT_OF_DISKSPACE);
         } WAR_CATCH_ALL_EF (
             reply.Reply(FtpReplyCodes::RC_ACTION_FAILED);
         );
@@ -489,11 +564,8 @@ public:
 class FtpCmdAppe : public FtpCmd
 {
 public:
-    FtpCmdAppe() : FtpCmd("APPE", "pathname", "(.+)") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool NeedPostOrPasv() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdAppe() : FtpCmd("APPE", LOGGED_IN | NOT_IN_TRANSFER | POST_OR_PASV,
+                          "pathname", "(.+)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -505,6 +577,12 @@ public:
         WAR_ASSERT(param.size() > 0);
         state.requested_path_.assign(param.begin(), param.end());
 
+        if (state.rang_end) {
+            reply.Reply(FtpReplyCodes::RC_ACTION_NOT_TAKEN)
+                << "RANG is only available for downloads";
+            return;
+        }
+
         if (state.rest) {
             reply.Reply(FtpReplyCodes::RC_ACTION_NOT_TAKEN)
                 << "APPE can not be combined with REST";
@@ -517,6 +595,8 @@ public:
             session.GetSessionData().StartTransfer(move(file));
         } catch (ExceptionFailedToConnect&) {
             reply.Reply(FtpReplyCodes::RC_CANT_OPEN_DATA_CONN);
+        } catch (ExceptionDiskFull&) {
+            reply.Reply(FtpReplyCodes::RC_OUT_OF_DISKSPACE);
         } WAR_CATCH_ALL_EF (
             reply.Reply(FtpReplyCodes::RC_ACTION_FAILED);
         );
@@ -526,11 +606,8 @@ public:
 class FtpCmdRest : public FtpCmd
 {
 public:
-    FtpCmdRest() : FtpCmd("REST", "file-offset", R"((\d+))", "REST STREAM") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool NeedPostOrPasv() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdRest() : FtpCmd("REST", LOGGED_IN | NOT_IN_TRANSFER | POST_OR_PASV,
+                          "file-offset", R"((\d+))", "REST STREAM") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -541,7 +618,7 @@ public:
     {
         WAR_ASSERT(param.size() > 0);
 
-        state.rest = 0;
+        state.rest = state.rang_end = 0;
         auto rest_val = state.rest;
 
         try {
@@ -569,13 +646,72 @@ public:
     }
 };
 
-class FtpCmdSize : public FtpCmd
+/*! RANG command, as in draft-bryan-ftp-range
+ *
+ * Syntax: RANG start end
+ *
+ * Both offsets are inclusive. "RANG 1 0" resets the range. Like REST,
+ * the range applies to the next RETR (or HASH), and is reset when the
+ * transfer is done. Clients can download disjoint ranges of one file
+ * over several sessions at the same time.
+ */
+class FtpCmdRang : public FtpCmd
 {
 public:
-    FtpCmdSize() : FtpCmd("SIZE", "pathname", "(.+)", "SIZE") {}
+    FtpCmdRang() : FtpCmd("RANG", LOGGED_IN | NOT_IN_TRANSFER,
+                          "start end", R"((\d+)\ +(\d+))",
+                          "RANG STREAM") {}
+
+    void OnCmd(Session& session,
+               FtpState& state,
+               const param_t& cmd,
+               const param_t& param,
+               const match_t& match,
+               FtpReply& reply) override
+    {
+        state.rest = state.rang_end = 0;
+
+        uint64_t start = 0, end = 0;
+        try {
+            start = boost::lexical_cast<uint64_t>(match[1].str());
+            end = boost::lexical_cast<uint64_t>(match[2].str());
+        } catch(const boost::bad_lexical_cast&) {
+            reply.Reply(FtpReplyCodes::RC_SYNTAX_ERROR_IN_PARAMS);
+            return;
+        }
+
+        if ((start == 1) && (end == 0)) {
+            reply.Reply(FtpReplyCodes::RC_FILE_ACTION_PENDING_INFO)
+                << "Byte range reset";
+            return;
+        }
+
+        if ((end < start) || (end == numeric_limits<uint64_t>::max())) {
+            reply.Reply(FtpReplyCodes::RC_SYNTAX_ERROR_IN_PARAMS)
+                << "Invalid range";
+            return;
+        }
+
+        // Same reason as for REST
+        if (state.GetType() != FtpState::Type::BIN) {
+            reply.Reply(FtpReplyCodes::RC_ACTION_NOT_TAKEN)
+                << "RANG is only available for binary (IMAGE) type transfers";
+            return;
+        }
+
+        state.rest = start;
+        state.rang_end = end + 1;
+
+        reply.Reply(FtpReplyCodes::RC_FILE_ACTION_PENDING_INFO)
+            << "Restarting at " << start << ". Ending byte " << end;
+    }
+};
 
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+class FtpCmdSize : public FtpCmd
+{
+public:
+    FtpCmdSize() : FtpCmd("SIZE", LOGGED_IN | NOT_IN_TRANSFER,
+                          "pathname", "(.+)", "SIZE") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -611,10 +747,8 @@ public:
 class FtpCmdMdtm : public FtpCmd
 {
 public:
-    FtpCmdMdtm() : FtpCmd("MDTM", "pathname", "(.+)", "MDTM") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdMdtm() : FtpCmd("MDTM", LOGGED_IN | NOT_IN_TRANSFER,
+                          "pathname", "(.+)", "MDTM") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -641,14 +775,12 @@ public:
     }
 };
 
-// TODO: Verify and eventually reserve the requested storage space
+// The space is reserved when the upload starts
 class FtpCmdAllo : public FtpCmd
 {
 public:
-    FtpCmdAllo() : FtpCmd("ALLO", "bytes", R"((\d+))") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdAllo() : FtpCmd("ALLO", LOGGED_IN | NOT_IN_TRANSFER,
+                          "bytes", R"((\d+))") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -673,9 +805,7 @@ public:
 class FtpCmdPwd : public FtpCmd
 {
 public:
-    FtpCmdPwd() : FtpCmd("PWD") {}
-
-    bool MustBeLoggedIn() const override { return true; }
+    FtpCmdPwd() : FtpCmd("PWD", LOGGED_IN) {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -692,10 +822,7 @@ public:
 class FtpCmdCwd : public FtpCmd
 {
 public:
-    FtpCmdCwd() : FtpCmd("CWD", "path", "(.*)") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdCwd() : FtpCmd("CWD", LOGGED_IN | NOT_IN_TRANSFER, "path", "(.*)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -729,10 +856,7 @@ public:
 class FtpCmdCdup : public FtpCmd
 {
 public:
-    FtpCmdCdup() : FtpCmd("CDUP") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdCdup() : FtpCmd("CDUP", LOGGED_IN | NOT_IN_TRANSFER) {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -759,10 +883,8 @@ public:
 class FtpCmdDele : public FtpCmd
 {
 public:
-    FtpCmdDele() : FtpCmd("DELE", "path", "(.+)") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdDele() : FtpCmd("DELE", LOGGED_IN | NOT_IN_TRANSFER,
+                          "path", "(.+)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -794,10 +916,7 @@ public:
 class FtpCmdMkd : public FtpCmd
 {
 public:
-    FtpCmdMkd() : FtpCmd("MKD", "path", "(.+)") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdMkd() : FtpCmd("MKD", LOGGED_IN | NOT_IN_TRANSFER, "path", "(.+)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -829,10 +948,7 @@ public:
 class FtpCmdRmd : public FtpCmd
 {
 public:
-    FtpCmdRmd() : FtpCmd("RMD", "path", "(.+)") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdRmd() : FtpCmd("RMD", LOGGED_IN | NOT_IN_TRANSFER, "path", "(.+)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -881,10 +997,8 @@ public:
 class FtpCmdRnfr : public FtpCmd
 {
 public:
-    FtpCmdRnfr() : FtpCmd("RNFR", "path", "(.+)") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdRnfr() : FtpCmd("RNFR", LOGGED_IN | NOT_IN_TRANSFER,
+                          "path", "(.+)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -925,10 +1039,9 @@ public:
 class FtpCmdRnto : public FtpCmd
 {
 public:
-    FtpCmdRnto() : FtpCmd("RNTO", "path", "(.+)") {}
+    FtpCmdRnto() : FtpCmd("RNTO", LOGGED_IN | NOT_IN_TRANSFER,
+                          "path", "(.+)") {}
 
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
     const string& NeedPrevCmd() const override {
         static const string rnfr("RNFR");
         return rnfr;
@@ -965,14 +1078,12 @@ public:
 class FtpCmdHelp : public FtpCmd
 {
 public:
-    FtpCmdHelp() : FtpCmd("HELP", "[command]", "(.*)")
+    FtpCmdHelp() : FtpCmd("HELP", LOGGED_IN | NOT_IN_TRANSFER,
+                          "[command]", "(.*)")
     {
         AddCmd(*this);
     }
 
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
-
     void OnCmd(Session& session,
                FtpState& state,
                const param_t& cmd,
@@ -1064,11 +1175,8 @@ get_path:
 class FtpCmdList : public FtpCmd
 {
 public:
-    FtpCmdList() : FtpCmd("LIST", "[path]", "(.*)") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
-    bool NeedPostOrPasv() const override { return true; }
+    FtpCmdList() : FtpCmd("LIST", LOGGED_IN | NOT_IN_TRANSFER | POST_OR_PASV,
+                          "[path]", "(.*)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -1109,11 +1217,8 @@ public:
 class FtpCmdNlst : public FtpCmd
 {
 public:
-    FtpCmdNlst() : FtpCmd("NLST", "[path]", "(.*)") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
-    bool NeedPostOrPasv() const override { return true; }
+    FtpCmdNlst() : FtpCmd("NLST", LOGGED_IN | NOT_IN_TRANSFER | POST_OR_PASV,
+                          "[path]", "(.*)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -1142,11 +1247,8 @@ public:
 class FtpCmdMlsd : public FtpCmd
 {
 public:
-    FtpCmdMlsd() : FtpCmd("MLSD", "[path]", "(.*)") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
-    bool NeedPostOrPasv() const override { return true; }
+    FtpCmdMlsd() : FtpCmd("MLSD", LOGGED_IN | NOT_IN_TRANSFER | POST_OR_PASV,
+                          "[path]", "(.*)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -1180,10 +1282,8 @@ public:
 class FtpCmdMlst : public FtpCmd
 {
 public:
-    FtpCmdMlst() : FtpCmd("MLST", "[path]", "(.*)") {}
-
-    bool MustBeLoggedIn() const override { return true; }
-    bool MustNotBeInTransfer() const override { return true; }
+    FtpCmdMlst() : FtpCmd("MLST", LOGGED_IN | NOT_IN_TRANSFER,
+                          "[path]", "(.*)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -1259,9 +1359,7 @@ public:
 class FtpCmdStat : public FtpCmd
 {
 public:
-    FtpCmdStat() : FtpCmd("STAT", "[path]", "(.*)") {}
-
-    bool MustBeLoggedIn() const override { return true; }
+    FtpCmdStat() : FtpCmd("STAT", LOGGED_IN, "[path]", "(.*)") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -1341,7 +1439,9 @@ private:
             << (state.abort_pending ? "Abort pending, " : "")
             << "Structure=File, "
             << "Type=" << state.GetType() << ", "
+            << "Mode=" << state.mode << ", "
             << "Rest offset=" << state.rest
+            << (state.rang_end ? ", Range end="s + to_string(state.rang_end - 1) : ""s)
 #ifdef WFDE_WITH_TLS
             << ", CC-TLS=" << state.cc_is_encrypted
             << ", PROT=" << (state.encrypt_transfers ? "P" : "C")
@@ -1350,13 +1450,171 @@ private:
     }
 };
 
+#ifdef WFDE_WITH_HASH
+/*! Get the physical path to a file the client can read */
+boost::filesystem::path GetPhysPathForHashing(Session& session,
+                                              const string& vpath)
+{
+    auto path = session.GetPath(vpath, Path::Type::FILE);
+    if (!path->CanRead()) {
+        LOG_DEBUG_FN << "Missing CAN_READ for " << log::Esc(vpath);
+        WAR_THROW_T(ExceptionAccessDenied, vpath);
+    }
+
+    return path->GetPhysPath();
+}
+
+/*! HASH command, as in draft-bryan-ftpext-hash
+ *
+ * The algorithm is selected with OPTS HASH <name>. If a range is
+ * set with RANG, only that part of the file is hashed, and the
+ * range is reset.
+ */
+class FtpCmdHash : public FtpCmd
+{
+public:
+    FtpCmdHash() : FtpCmd("HASH", LOGGED_IN | NOT_IN_TRANSFER,
+                          "pathname", "(.+)") {}
+
+    void OnCmd(Session& session,
+               FtpState& state,
+               const param_t& cmd,
+               const param_t& param,
+               const match_t& match,
+               FtpReply& reply) override
+    {
+        const auto vpath = param.to_string();
+        const uint64_t from = state.rang_end ? state.rest : 0;
+        const auto rang_end = state.rang_end;
+        state.rest = state.rang_end = 0;
+
+        try {
+            const auto path = GetPhysPathForHashing(session, vpath);
+            const auto size = boost::filesystem::file_size(path);
+            const auto to = rang_end ? min(rang_end, size) : size;
+            if (from > to) {
+                reply.Reply(FtpReplyCodes::RC_SYNTAX_ERROR_IN_PARAMS)
+                    << "The range is beyond the end of the file";
+                return;
+            }
+
+            const auto digest = session.GetSessionData().HashFile(
+                path, state.hash_algorithm, from, to);
+
+            // The range is inclusive
+            reply.Reply(FtpReplyCodes::RC_FILE_STATUS)
+                << HashEngine::GetName(state.hash_algorithm)
+                << ' ' << from << '-' << (to > from ? to - 1 : from)
+                << ' ' << digest << ' ' << vpath;
+        } catch(const ExceptionAccessDenied&) {
+            reply.Reply(FtpReplyCodes::RC_ACTION_NOT_TAKEN);
+        } catch(const boost::filesystem::filesystem_error&) {
+            reply.Reply(FtpReplyCodes::RC_ACTION_NOT_TAKEN) << "No such file";
+        } WAR_CATCH_ALL_EF (
+            reply.Reply(FtpReplyCodes::RC_LOCAL_ERROR);
+        );
+    }
+
+    void OnOpts(Session& session,
+                FtpState& state,
+                const param_t& cmd,
+                const param_t& param,
+                const match_t& match,
+                FtpReply& reply) override
+    {
+        if (!param.empty()) {
+            try {
+                state.hash_algorithm = HashEngine::GetAlgorithm(param.to_string());
+            } catch(const ExceptionNotFound&) {
+                reply.Reply(FtpReplyCodes::RC_PARAM_NOT_IMPLEMENTED)
+                    << "Unknown algorithm";
+                return;
+            }
+        }
+
+        reply.Reply(FtpReplyCodes::RC_OK)
+            << HashEngine::GetName(state.hash_algorithm);
+    }
+
+    /*! FEAT line, with the selected algorithm marked with a '*' */
+    static string GetFeatures(const FtpState& state) {
+        string features = "HASH ";
+        for(const auto algorithm : HashEngine::GetAlgorithms()) {
+            if (features.back() != ' ') {
+                features += ';';
+            }
+            features += HashEngine::GetName(algorithm);
+            if (algorithm == state.hash_algorithm) {
+                features += '*';
+            }
+        }
+        return features;
+    }
+};
+
+/*! The XCRC, XMD5 and XSHA* commands
+ *
+ * Syntax: XSHA256 "pathname" [start [end]]
+ *
+ * The end offset is inclusive. The digest is returned in a
+ * 250 reply.
+ */
+class FtpCmdXHash : public FtpCmd
+{
+public:
+    FtpCmdXHash(const string& name, const HashEngine::Algorithm algorithm)
+    : FtpCmd(name, LOGGED_IN | NOT_IN_TRANSFER, "pathname [start [end]]",
+             "(\"([^\"]+)\"|(.+?))(\\ +([0-9]+)(\\ +([0-9]+))?)?")
+    , algorithm_{algorithm}
+    {}
+
+    void OnCmd(Session& session,
+               FtpState& state,
+               const param_t& cmd,
+               const param_t& param,
+               const match_t& match,
+               FtpReply& reply) override
+    {
+        const auto vpath = match[2].matched ? match[2].str() : match[3].str();
+
+        try {
+            const uint64_t from = match[5].matched ? stoull(match[5].str()) : 0;
+            const uint64_t to = match[7].matched ? stoull(match[7].str()) + 1 : 0;
+            if (match[7].matched && (to <= from)) {
+                reply.Reply(FtpReplyCodes::RC_SYNTAX_ERROR_IN_PARAMS)
+                    << "Invalid range";
+                return;
+            }
+
+            const auto path = GetPhysPathForHashing(session, vpath);
+            reply.Reply(FtpReplyCodes::RC_FILE_ACTION_OK)
+                << session.GetSessionData().HashFile(path, algorithm_, from, to);
+        } catch(const std::out_of_range&) {
+            reply.Reply(FtpReplyCodes::RC_SYNTAX_ERROR_IN_PARAMS)
+                << "Invalid range";
+        } catch(const ExceptionOutOfRange&) {
+            reply.Reply(FtpReplyCodes::RC_SYNTAX_ERROR_IN_PARAMS)
+                << "Invalid range";
+        } catch(const ExceptionAccessDenied&) {
+            reply.Reply(FtpReplyCodes::RC_ACTION_NOT_TAKEN);
+        } catch(const boost::filesystem::filesystem_error&) {
+            reply.Reply(FtpReplyCodes::RC_ACTION_NOT_TAKEN) << "No such file";
+        } WAR_CATCH_ALL_EF (
+            reply.Reply(FtpReplyCodes::RC_LOCAL_ERROR);
+        );
+    }
+
+private:
+    const HashEngine::Algorithm algorithm_;
+};
+#endif // WFDE_WITH_HASH
+
 #ifdef WFDE_WITH_TLS
 class FtpCmdAuth : public FtpCmd
 {
 public:
-    FtpCmdAuth() : FtpCmd("AUTH", "tls", "(tls|tls-c)", "AUTH TLS") {}
-
-    bool MustHaveEncryptionIfEnforced() const override { return false; }
+    FtpCmdAuth() : FtpCmd("AUTH", PLAINTEXT_OK,
+                          "tls", "(tls|tls-c)", "AUTH TLS") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -1384,9 +1642,7 @@ public:
 class FtpCmdPbsz : public FtpCmd
 {
 public:
-    FtpCmdPbsz() : FtpCmd("PBSZ", "0", "(0)", "PBSZ") {}
-
-    bool MustHaveEncryption() const override { return true; }
+    FtpCmdPbsz() : FtpCmd("PBSZ", ENCRYPTED, "0", "(0)", "PBSZ") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -1407,9 +1663,8 @@ public:
 class FtpCmdProt : public FtpCmd
 {
 public:
-    FtpCmdProt() : FtpCmd("PROT", "protection-mode", "(P|C)", "PROT") {}
-
-    bool MustHaveEncryption() const override { return true; }
+    FtpCmdProt() : FtpCmd("PROT", ENCRYPTED,
+                          "protection-mode", "(P|C)", "PROT") {}
 
     void OnCmd(Session& session,
                FtpState& state,
@@ -1446,6 +1701,7 @@ public:
         Add(make_unique<FtpCmdQuit>());
         Add(make_unique<FtpCmdSyst>());
         Add(make_unique<FtpCmdType>());
+        Add(make_unique<FtpCmdMode>());
         Add(make_unique<FtpCmdPort>());
         Add(make_unique<FtpCmdUser>());
         Add(make_unique<FtpCmdPass>());
@@ -1454,6 +1710,7 @@ public:
         Add(make_unique<FtpCmdStou>());
         Add(make_unique<FtpCmdAppe>());
         Add(make_unique<FtpCmdRest>());
+        Add(make_unique<FtpCmdRang>());
         Add(make_unique<FtpCmdSize>());
         Add(make_unique<FtpCmdMdtm>());
         Add(make_unique<FtpCmdAllo>());
@@ -1473,21 +1730,33 @@ public:
         Add(make_unique<FtpCmdMlst>());
         Add(make_unique<FtpCmdPasv>());
         Add(make_unique<FtpCmdStat>());
+#ifdef WFDE_WITH_HASH
+        Add(make_unique<FtpCmdHash>());
+        feat_->AddFeature("HASH", FtpCmdHash::GetFeatures);
+#   ifdef WFDE_WITH_ZLIB
+        Add(make_unique<FtpCmdXHash>("XCRC", HashEngine::Algorithm::CRC32));
+#   endif
+        Add(make_unique<FtpCmdXHash>("XMD5", HashEngine::Algorithm::MD5));
+        Add(make_unique<FtpCmdXHash>("XSHA1", HashEngine::Algorithm::SHA1));
+        Add(make_unique<FtpCmdXHash>("XSHA256", HashEngine::Algorithm::SHA256));
+        Add(make_unique<FtpCmdXHash>("XSHA512", HashEngine::Algorithm::SHA512));
+#endif
 #ifdef WFDE_WITH_TLS
         Add(make_unique<FtpCmdAuth>());
         Add(make_unique<FtpCmdPbsz>());
         Add(make_unique<FtpCmdProt>());
 #endif
 
-        // Insert all the added commands into the default list that we hand
-        // out to session instances.
+        // Build the lookup table that is shared by all the sessions.
+        vector<FtpCmd *> commands;
         for(auto& cmd : commands_) {
-            commands_list_.emplace(cmd->GetName(), *cmd);
+            commands.push_back(cmd.get());
         }
+        table_ = make_unique<FtpCmdTable>(move(commands));
     }
 
-    FtpCmd::ftp_commands_t GetDefaultCommands() {
-        return commands_list_;
+    const FtpCmdTable& GetDefaultCommands() const {
+        return *table_;
     }
 
 private:
@@ -1527,13 +1796,13 @@ private:
     FtpCmdFeat *feat_ = nullptr;
     FtpCmdHelp *help_ = nullptr;
     FtpCmdOpts *opts_ = nullptr;
-    FtpCmd::ftp_commands_t commands_list_;
+    std::unique_ptr<FtpCmdTable> table_;
 };
 
 
 } // impl
 
-FtpCmd::ftp_commands_t GetDefaultFtpCommands()
+const FtpCmdTable& GetDefaultFtpCommands()
 {
     static impl::DefaultFtpCmds cmds_;
     return cmds_.GetDefaultCommands();
@@ -34,7 +34,7 @@ public:
         conf_->SetValue((root_path_ + path).c_str(), value);
     }
 
-    node_enum_t EnumNodes(const char *path) {
+    node_enum_t EnumNodes(const char *path) const override {
         return conf_->EnumNodes((root_path_ + path).c_str());
     }
 
@@ -82,7 +82,7 @@ public:
         config_[path] = value;
     }
 
-    node_enum_t EnumNodes(const char *path) override {
+    node_enum_t EnumNodes(const char *path) const override {
 
         LOG_TRACE4_FN << "Enumerating from: " << log::Esc(path)
             << ". I have " << config_.size() << " nodes.";
@@ -0,0 +1,218 @@
+#include "war_tests.h"
+#include <fstream>
+#include <zlib.h>
+#include <wfde/wfde.h>
+#include "../src/wfde/WfdeCompressedCache.h"
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+namespace {
+
+const boost::filesystem::path test_dir{"Test_CompressedCache.dir"};
+
+string MakeData(size_t len)
+{
+    string data;
+    for(size_t i = 0; data.size() < len; ++i) {
+        data += "2016-04-01 12:00:00 Log line " + to_string(i % 100) + "\n";
+    }
+    data.resize(len);
+    return data;
+}
+
+string MakeRandomData(size_t len)
+{
+    string data;
+    uint32_t seed = 4711;
+    while(data.size() < len) {
+        seed = seed * 1103515245 + 12345;
+        data += static_cast<char>(seed >> 16);
+    }
+    return data;
+}
+
+boost::filesystem::path Save(const string& name, const string& data)
+{
+    boost::filesystem::create_directories(test_dir / "files");
+    const auto path = test_dir / "files" / name;
+    std::ofstream out(path.string(), ios::binary | ios::trunc);
+    out << data;
+    return path;
+}
+
+string Gunzip(const boost::filesystem::path& path)
+{
+    string data;
+    auto gz = gzopen(path.c_str(), "rb");
+    if (!gz) {
+        return data;
+    }
+
+    char buffer[4096];
+    int bytes = 0;
+    while((bytes = gzread(gz, buffer, sizeof(buffer))) > 0) {
+        data.append(buffer, bytes);
+    }
+    gzclose(gz);
+    return data;
+}
+
+TransferOptions GetOptions()
+{
+    TransferOptions opts;
+    opts.compressed_cache_dir = test_dir / "cache";
+    opts.compressed_min_size = 1024;
+    opts.compressed_min_requests = 1;
+    return opts;
+}
+
+FileId GetId(const boost::filesystem::path& path)
+{
+    FileId id;
+    FileId::Get(path, id);
+    return id;
+}
+
+} // anonymous namespace
+
+const lest::test specification[] = {
+
+STARTCASE(Test_Compress) {
+    boost::filesystem::remove_all(test_dir);
+    const auto data = MakeData(1024 * 512);
+    const auto path = Save("access.log", data);
+
+    WfdeCompressedCache cache(GetOptions());
+    EXPECT(cache.Lookup(path).empty());
+    cache.WaitForIdle();
+
+    const auto variant = cache.Lookup(path);
+    EXPECT(!variant.empty());
+    EXPECT(cache.Peek(GetId(path)) == variant);
+    EXPECT(Gunzip(variant) == data);
+    EXPECT(cache.GetCacheSize() == boost::filesystem::file_size(variant));
+    EXPECT(cache.GetCacheSize() < data.size() / 4);
+} ENDCASE
+
+STARTCASE(Test_NotEligible) {
+    boost::filesystem::remove_all(test_dir);
+    const auto small = Save("small.log", MakeData(100));
+    const auto gz = Save("big.log.gz", MakeData(1024 * 64));
+
+    WfdeCompressedCache cache(GetOptions());
+    EXPECT(cache.Lookup(small).empty());
+    EXPECT(cache.Lookup(gz).empty());
+    EXPECT(cache.Lookup(test_dir / "files" / "missing.log").empty());
+    cache.WaitForIdle();
+    EXPECT(cache.Lookup(small).empty());
+    EXPECT(cache.Lookup(gz).empty());
+    EXPECT(cache.GetCacheSize() == 0);
+} ENDCASE
+
+STARTCASE(Test_FileChanged) {
+    boost::filesystem::remove_all(test_dir);
+    const auto path = Save("access.log", MakeData(1024 * 64));
+
+    WfdeCompressedCache cache(GetOptions());
+    cache.Lookup(path);
+    cache.WaitForIdle();
+    EXPECT(!cache.Lookup(path).empty());
+
+    const auto data = MakeData(1024 * 128);
+    Save("access.log", data);
+    EXPECT(cache.Lookup(path).empty());
+    cache.WaitForIdle();
+    const auto variant = cache.Lookup(path);
+    EXPECT(Gunzip(variant) == data);
+} ENDCASE
+
+STARTCASE(Test_SizeLimit) {
+    boost::filesystem::remove_all(test_dir);
+    auto opts = GetOptions();
+    opts.compressed_cache_size = 1024 * 16;
+
+    WfdeCompressedCache cache(opts);
+    vector<boost::filesystem::path> paths;
+    for(int i = 0; i < 10; ++i) {
+        paths.push_back(Save("file"s + to_string(i), MakeData(1024 * 256 + i)));
+        cache.Lookup(paths.back());
+        cache.WaitForIdle();
+    }
+
+    EXPECT(cache.GetCacheSize() <= opts.compressed_cache_size);
+    EXPECT(!cache.Lookup(paths.back()).empty());
+    EXPECT(cache.Lookup(paths.front()).empty());
+} ENDCASE
+
+STARTCASE(Test_MinRequests) {
+    boost::filesystem::remove_all(test_dir);
+    const auto path = Save("access.log", MakeData(1024 * 64));
+    auto opts = GetOptions();
+    opts.compressed_min_requests = 3;
+
+    WfdeCompressedCache cache(opts);
+    EXPECT(cache.Lookup(path).empty());
+    EXPECT(cache.Lookup(path).empty());
+    cache.WaitForIdle();
+    EXPECT(cache.GetNumCompressions() == 0);
+    EXPECT(cache.Lookup(path).empty());
+    cache.WaitForIdle();
+    EXPECT(cache.GetNumCompressions() == 1);
+    EXPECT(!cache.Lookup(path).empty());
+} ENDCASE
+
+STARTCASE(Test_PoorRatio) {
+    boost::filesystem::remove_all(test_dir);
+    const auto path = Save("random.bin", MakeRandomData(1024 * 64));
+
+    {
+        WfdeCompressedCache cache(GetOptions());
+        cache.Lookup(path);
+        cache.WaitForIdle();
+        EXPECT(cache.GetNumCompressions() == 1);
+        EXPECT(cache.Lookup(path).empty());
+        cache.WaitForIdle();
+        EXPECT(cache.GetNumCompressions() == 1);
+        EXPECT(cache.GetCacheSize() == 0);
+    }
+
+    // The verdict survives a restart
+    WfdeCompressedCache cache(GetOptions());
+    EXPECT(cache.Lookup(path).empty());
+    cache.WaitForIdle();
+    EXPECT(cache.GetNumCompressions() == 0);
+} ENDCASE
+
+STARTCASE(Test_Restart) {
+    boost::filesystem::remove_all(test_dir);
+    const auto data = MakeData(1024 * 64);
+    const auto path = Save("access.log", data);
+
+    {
+        WfdeCompressedCache cache(GetOptions());
+        cache.Lookup(path);
+        cache.WaitForIdle();
+    }
+
+    std::ofstream junk((test_dir / "cache" / "junk.tmp").string());
+    junk.close();
+
+    WfdeCompressedCache cache(GetOptions());
+    const auto variant = cache.Lookup(path);
+    EXPECT(Gunzip(variant) == data);
+    EXPECT(!boost::filesystem::exists(test_dir / "cache" / "junk.tmp"));
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_CompressedCache.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
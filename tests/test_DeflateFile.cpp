@@ -0,0 +1,147 @@
+#include "war_tests.h"
+#include <fstream>
+#include <iterator>
+#include <wfde/wfde.h>
+#include "../src/wfde/WfdeDeflateFile.h"
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+namespace {
+
+string MakeData(size_t len)
+{
+    string data;
+    for(size_t i = 0; data.size() < len; ++i) {
+        data += "Line " + to_string(i % 1000) + " of some compressible text\n";
+    }
+    data.resize(len);
+    return data;
+}
+
+void Save(const string& name, const string& data)
+{
+    std::ofstream out(name, ios::binary | ios::trunc);
+    out << data;
+}
+
+string Load(const string& name)
+{
+    std::ifstream in(name, ios::binary);
+    return {istreambuf_iterator<char>(in), istreambuf_iterator<char>()};
+}
+
+string Compress(const string& data)
+{
+    vector<char> out(compressBound(data.size()));
+    uLongf len = out.size();
+    compress2(reinterpret_cast<Bytef *>(out.data()), &len,
+              reinterpret_cast<const Bytef *>(data.data()), data.size(),
+              Z_DEFAULT_COMPRESSION);
+    return {out.data(), len};
+}
+
+string Uncompress(const string& data, size_t len)
+{
+    vector<char> out(len + 1);
+    uLongf out_len = out.size();
+    const auto rval = uncompress(reinterpret_cast<Bytef *>(out.data()), &out_len,
+                                 reinterpret_cast<const Bytef *>(data.data()),
+                                 data.size());
+    if (rval != Z_OK) {
+        return {};
+    }
+    return {out.data(), out_len};
+}
+
+string Download(const string& name)
+{
+    const TransferOptions opts;
+    WfdeDeflateFile file(CreateDiskFile(name, File::FileOperation::READ, opts),
+                         6);
+    string compressed;
+    while(!file.IsEof()) {
+        const auto b = file.Read(4096);
+        compressed.append(static_cast<const char *>(b.data()),
+                          boost::asio::buffer_size(b));
+    }
+    file.Close();
+    return compressed;
+}
+
+void Upload(const string& name, const string& compressed, size_t chunk)
+{
+    const TransferOptions opts;
+    WfdeDeflateFile file(CreateDiskFile(name, File::FileOperation::WRITE, opts));
+    for(size_t pos = 0; pos < compressed.size();) {
+        auto b = file.Write(chunk);
+        const auto len = min(boost::asio::buffer_size(b), compressed.size() - pos);
+        memcpy(b.data(), compressed.data() + pos, len);
+        file.SetBytesWritten(len);
+        pos += len;
+    }
+    file.Close();
+}
+
+} // anonymous namespace
+
+const lest::test specification[] = {
+
+STARTCASE(Test_Download) {
+    const auto name = "Test_DeflateFile.data001";
+    const auto data = MakeData(1024 * 1024 * 3 + 17);
+    Save(name, data);
+
+    const auto compressed = Download(name);
+    EXPECT(compressed.size() < data.size() / 4);
+    EXPECT(Uncompress(compressed, data.size()) == data);
+} ENDCASE
+
+STARTCASE(Test_DownloadEmpty) {
+    const auto name = "Test_DeflateFile.data002";
+    Save(name, "");
+
+    const auto compressed = Download(name);
+    EXPECT(!compressed.empty());
+    EXPECT(Uncompress(compressed, 0).empty());
+} ENDCASE
+
+STARTCASE(Test_Upload) {
+    const auto name = "Test_DeflateFile.data003";
+    const auto data = MakeData(1024 * 1024 * 3 + 17);
+    const auto compressed = Compress(data);
+
+    for(const size_t chunk : {1, 511, 64 * 1024}) {
+        Upload(name, compressed, chunk);
+        EXPECT(Load(name) == data);
+    }
+} ENDCASE
+
+STARTCASE(Test_UploadTruncated) {
+    const auto name = "Test_DeflateFile.data004";
+    const auto compressed = Compress(MakeData(1024 * 64));
+
+    EXPECT_THROWS_AS(Upload(name, compressed.substr(0, compressed.size() / 2),
+                            4096),
+                     war::ExceptionIoError);
+} ENDCASE
+
+STARTCASE(Test_UploadCorrupt) {
+    const auto name = "Test_DeflateFile.data005";
+    const auto compressed = "This is not a deflate stream"s;
+
+    EXPECT_THROWS_AS(Upload(name, compressed, 4096), war::ExceptionIoError);
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_DeflateFile.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
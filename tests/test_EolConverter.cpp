@@ -0,0 +1,108 @@
+#include "war_tests.h"
+#include <wfde/wfde.h>
+#include "../src/wfde/WfdeEolConverter.h"
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+namespace {
+
+string Reference(const string& src, const string& eol)
+{
+    string rval;
+    for(const auto ch : src) {
+        if (ch == '\r')
+            continue;
+        if (ch == '\n') {
+            rval += eol;
+        } else {
+            rval += ch;
+        }
+    }
+    return rval;
+}
+
+bool Verify(const string& src, const string& eol)
+{
+    for(const auto impl : {EolConverter::Implementation::SCALAR,
+                           EolConverter::Implementation::SSE2,
+                           EolConverter::Implementation::AVX2}) {
+        if (!EolConverter::IsSupported(impl)) {
+            continue;
+        }
+
+        const EolConverter converter(eol, impl);
+        vector<char> out(src.size() * converter.GetMaxExpansion() + 1);
+        const auto len = converter.Convert(src.data(), src.size(), out.data());
+        if (string(out.data(), len) != Reference(src, eol)) {
+            LOG_ERROR << "Conversion failed with "
+                << EolConverter::GetName(impl) << " for input of "
+                << src.size() << " bytes";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+} // anonymous namespace
+
+const lest::test specification[] = {
+
+STARTCASE(Test_ToCrlf) {
+    EXPECT(Verify("", "\r\n"));
+    EXPECT(Verify("\n", "\r\n"));
+    EXPECT(Verify("abc", "\r\n"));
+    EXPECT(Verify("abc\ndef\n", "\r\n"));
+    EXPECT(Verify("abc\r\ndef\r\n", "\r\n"));
+    EXPECT(Verify("\r\r\r\n\n\n", "\r\n"));
+} ENDCASE
+
+STARTCASE(Test_FromCrlf) {
+    EXPECT(Verify("", "\n"));
+    EXPECT(Verify("\r\n", "\n"));
+    EXPECT(Verify("abc\r\ndef\r\n", "\n"));
+    EXPECT(Verify("abc\ndef", "\n"));
+    EXPECT(Verify("abc\r\ndef", "\r\n"));
+} ENDCASE
+
+STARTCASE(Test_BlockBoundaries) {
+    // Line-endings at all positions in and around the SIMD blocks
+    for(size_t len = 0; len < 100; ++len) {
+        for(size_t pos = 0; pos < len; ++pos) {
+            string text(len, 'x');
+            text[pos] = '\n';
+            if (pos > 0) {
+                text[pos - 1] = '\r';
+            }
+            EXPECT(Verify(text, "\r\n"));
+            EXPECT(Verify(text, "\n"));
+        }
+    }
+
+    string dense;
+    for(size_t i = 0; i < 1000; ++i) {
+        dense += (i % 3) ? '\n' : ((i % 5) ? '\r' : 'a');
+    }
+    EXPECT(Verify(dense, "\r\n"));
+    EXPECT(Verify(dense, "\n"));
+} ENDCASE
+
+STARTCASE(Test_BestImplementation) {
+    const auto best = EolConverter::GetBestImplementation();
+    EXPECT(EolConverter::IsSupported(best));
+    EXPECT(EolConverter("\r\n").GetImplementation() == best);
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_EolConverter.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
@@ -0,0 +1,119 @@
+#include "war_tests.h"
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
+#include <wfde/wfde.h>
+#include <wfde/ftp_protocol.h>
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+
+namespace {
+
+const string file_name = "Test_File.data";
+
+const TransferOptions::Backend backends[] = {
+    TransferOptions::Backend::MMAP,
+    TransferOptions::Backend::PREAD
+};
+
+// Upload data like ReceiveFile() does, after an ALLO of reserve bytes
+void Upload(const string& data, uint64_t reserve,
+            TransferOptions::Backend backend)
+{
+    TransferOptions opts;
+    opts.backend = backend;
+    auto file = CreateDiskFile(file_name, File::FileOperation::WRITE, opts);
+    file->Reserve(reserve);
+
+    // The space is allocated before we write anything
+    struct stat st = {};
+    EXPECT(::stat(file_name.c_str(), &st) == 0);
+    EXPECT(static_cast<uint64_t>(st.st_blocks) * 512 >= reserve);
+
+    for(size_t written = 0; written < data.size();) {
+        auto buffer = file->Write(data.size() - written);
+        const auto len = min(buffer.size(), data.size() - written);
+        memcpy(buffer.data(), data.data() + written, len);
+        file->SetBytesWritten(len);
+        written += len;
+    }
+    file->Close();
+}
+
+string Load()
+{
+    ifstream in(file_name, ios::binary);
+    return {istreambuf_iterator<char>(in), istreambuf_iterator<char>()};
+}
+
+} // anonymous namespace
+
+const lest::test specification[] = {
+
+STARTCASE(Test_ReserveIsTruncatedOnClose) {
+    const string data(1000, 'x');
+    for(auto backend : backends) {
+        LOG_DEBUG << "Backend: " << backend;
+        Upload(data, 1024 * 1024, backend);
+        EXPECT(boost::filesystem::file_size(file_name) == data.size());
+        EXPECT(Load() == data);
+
+        // The space we did not use is released
+        struct stat st = {};
+        EXPECT(::stat(file_name.c_str(), &st) == 0);
+        EXPECT(static_cast<uint64_t>(st.st_blocks) * 512 < 1024 * 1024);
+    }
+} ENDCASE
+
+STARTCASE(Test_ReserveMoreThanWritten) {
+    // The reservation is a hint. Writing past it is fine.
+    const string data(1024 * 64 + 17, 'y');
+    for(auto backend : backends) {
+        LOG_DEBUG << "Backend: " << backend;
+        Upload(data, 4096, backend);
+        EXPECT(boost::filesystem::file_size(file_name) == data.size());
+        EXPECT(Load() == data);
+    }
+} ENDCASE
+
+STARTCASE(Test_DiskFull) {
+    // No file-system can hold an exbibyte, so fallocate() fails with
+    // ENOSPC or EFBIG.
+    const uint64_t too_much = 1ULL << 60;
+
+    for(auto backend : backends) {
+        LOG_DEBUG << "Backend: " << backend;
+        TransferOptions opts;
+        opts.backend = backend;
+        auto file = CreateDiskFile(file_name, File::FileOperation::WRITE, opts);
+        EXPECT_THROWS_AS(file->Reserve(too_much), ExceptionDiskFull);
+        file->Close();
+
+        // Nothing is left behind from the failed reservation
+        EXPECT(boost::filesystem::file_size(file_name) == 0u);
+    }
+} ENDCASE
+
+STARTCASE(Test_DiskFullReply) {
+    // What STOR, APPE and STOU reply when Reserve() throws ExceptionDiskFull
+    string message, text;
+    FtpReply reply(message);
+    reply.Reply(FtpReplyCodes::RC_OUT_OF_DISKSPACE);
+    const auto r = reply.GetReply();
+    FormatReply(text, r.first, r.second, reply.IsMultiline());
+    EXPECT(text.compare(0, 4, "452 ") == 0);
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_File.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
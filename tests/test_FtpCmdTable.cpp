@@ -0,0 +1,138 @@
+#include "war_tests.h"
+#include <wfde/wfde.h>
+#include <wfde/ftp_protocol.h>
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+
+namespace {
+
+class TestCmd : public FtpCmd
+{
+public:
+    TestCmd(const string& name, const traits_t traits = NO_TRAITS,
+            const string& syntax = "")
+    : FtpCmd(name, traits, "", syntax)
+    {}
+
+    void OnCmd(Session&, FtpState&, const param_t&, const param_t&,
+               const match_t&, FtpReply&) override {}
+};
+
+bool Match(const FtpCmd& cmd, const string& param)
+{
+    string buffer;
+    FtpCmd::match_t match;
+    return cmd.MatchParam(param, buffer, match);
+}
+
+} // anonymous namespace
+
+const lest::test specification[] = {
+
+STARTCASE(Test_Find) {
+    TestCmd noop("NOOP"), size("SIZE"), xsha256("XSHA256"), cwd("CWD");
+    FtpCmdTable table({&noop, &size, &xsha256, &cwd});
+
+    EXPECT(table.Find("NOOP") == &noop);
+    EXPECT(table.Find("noop") == &noop);
+    EXPECT(table.Find("SiZe") == &size);
+    EXPECT(table.Find("xsha256") == &xsha256);
+    EXPECT(table.Find("CWD") == &cwd);
+    EXPECT(table.GetCommands().size() == 4);
+
+    EXPECT(table.Find("CWDX") == nullptr);
+    EXPECT(table.Find("CW") == nullptr);
+    EXPECT(table.Find("") == nullptr);
+    EXPECT(table.Find("XSHA2561") == nullptr);
+    EXPECT(table.Find("XSHA25612") == nullptr);
+    EXPECT(table.Find(string("CW\0", 3)) == nullptr);
+} ENDCASE
+
+STARTCASE(Test_ManyCommands) {
+    // More names than the FTP protocol will ever have
+    vector<unique_ptr<TestCmd>> cmds;
+    vector<FtpCmd *> ptrs;
+    for(char a = 'A'; a <= 'Z'; ++a) {
+        for(char b = 'A'; b <= 'Z'; b += 5) {
+            cmds.push_back(make_unique<TestCmd>(string{a, b, 'X'}));
+            ptrs.push_back(cmds.back().get());
+        }
+    }
+
+    FtpCmdTable table(ptrs);
+    for(const auto& cmd : cmds) {
+        EXPECT(table.Find(cmd->GetName()) == cmd.get());
+    }
+} ENDCASE
+
+STARTCASE(Test_BadNames) {
+    TestCmd a("NOOP"), b("noop"), too_long("ABCDEFGHI");
+    EXPECT_THROWS_AS(FtpCmdTable({&a, &b}), ExceptionInvalidParameter);
+    EXPECT_THROWS_AS(FtpCmdTable({&too_long}), ExceptionInvalidParameter);
+} ENDCASE
+
+STARTCASE(Test_Traits) {
+    TestCmd retr("RETR", FtpCmd::LOGGED_IN | FtpCmd::NOT_IN_TRANSFER
+                         | FtpCmd::POST_OR_PASV);
+    EXPECT(retr.MustBeLoggedIn());
+    EXPECT(!retr.MustNotBeLoggedIn());
+    EXPECT(retr.MustNotBeInTransfer());
+    EXPECT(!retr.MustBeInTransfer());
+    EXPECT(retr.NeedPostOrPasv());
+    EXPECT(!retr.MustHaveEncryption());
+    EXPECT(retr.MustHaveEncryptionIfEnforced());
+
+    TestCmd auth("AUTH", FtpCmd::PLAINTEXT_OK);
+    EXPECT(!auth.MustHaveEncryptionIfEnforced());
+    EXPECT(!auth.MustBeLoggedIn());
+} ENDCASE
+
+STARTCASE(Test_Params) {
+    TestCmd none("NOOP"), any("LIST", FtpCmd::NO_TRAITS, "(.*)");
+    TestCmd not_empty("SIZE", FtpCmd::NO_TRAITS, "(.+)");
+    TestCmd number("REST", FtpCmd::NO_TRAITS, R"((\d+))");
+    TestCmd regex("PROT", FtpCmd::NO_TRAITS, "(P|C)");
+
+    EXPECT(none.GetParamSyntax() == FtpCmd::ParamSyntax::NONE);
+    EXPECT(!none.CanHaveParams());
+    EXPECT(Match(none, "whatever"));
+
+    EXPECT(any.GetParamSyntax() == FtpCmd::ParamSyntax::ANY);
+    EXPECT(Match(any, ""));
+    EXPECT(Match(any, "-la /tmp"));
+
+    EXPECT(not_empty.GetParamSyntax() == FtpCmd::ParamSyntax::NOT_EMPTY);
+    EXPECT(!Match(not_empty, ""));
+    EXPECT(Match(not_empty, "file name.txt"));
+
+    EXPECT(number.GetParamSyntax() == FtpCmd::ParamSyntax::NUMBER);
+    EXPECT(Match(number, "0"));
+    EXPECT(Match(number, "1234567890"));
+    EXPECT(!Match(number, ""));
+    EXPECT(!Match(number, "12a"));
+    EXPECT(!Match(number, "-1"));
+
+    EXPECT(regex.GetParamSyntax() == FtpCmd::ParamSyntax::REGEX);
+    EXPECT(Match(regex, "p"));
+    EXPECT(Match(regex, "C"));
+    EXPECT(!Match(regex, "S"));
+
+    string buffer;
+    FtpCmd::match_t match;
+    TestCmd rang("RANG", FtpCmd::NO_TRAITS, R"((\d+)\ +(\d+))");
+    EXPECT(rang.MatchParam("10 20", buffer, match));
+    EXPECT(match[2].str() == "20");
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_FtpCmdTable.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
@@ -0,0 +1,138 @@
+#include "war_tests.h"
+#include <atomic>
+#include <new>
+#include <wfde/wfde.h>
+#include <wfde/ftp_protocol.h>
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+
+namespace {
+
+atomic_bool counting{false};
+atomic_size_t allocations{0};
+
+/*! Like WfdeFtpSession: the command formats the message, and the
+ * session formats the reply that is sent.
+ */
+struct ReplyPath
+{
+    ReplyPath() {
+        message.reserve(256);
+        text.reserve(256);
+    }
+
+    template <typename FnT>
+    const string& Run(FnT command) {
+        FtpReply reply(message);
+        command(reply);
+        const auto r = reply.GetReply();
+        text.clear();
+        FormatReply(text, r.first, r.second, reply.IsMultiline());
+        return text;
+    }
+
+    /*! Count the allocations in the second run, when the buffers are warm */
+    template <typename FnT>
+    size_t CountAllocations(FnT command) {
+        Run(command);
+        allocations = 0;
+        counting = true;
+        Run(command);
+        counting = false;
+        return allocations;
+    }
+
+    string message;
+    string text;
+};
+
+} // anonymous namespace
+
+void *operator new(size_t size)
+{
+    if (counting) {
+        ++allocations;
+    }
+    if (auto p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+const lest::test specification[] = {
+
+STARTCASE(Test_Format) {
+    string buffer;
+    FormatReply(buffer, FtpReplyCodes::RC_OK, {}, false);
+    EXPECT(buffer == "200 Command okay.\r\n");
+
+    buffer.clear();
+    FormatReply(buffer, FtpReplyCodes::RC_FILE_STATUS, "1234", false);
+    EXPECT(buffer == "213 1234\r\n");
+
+    buffer.clear();
+    FormatReply(buffer, FtpReplyCodes::RC_HELP, "Help\r\n NOOP", true);
+    EXPECT(buffer == "214-Help\r\n NOOP\r\n214 END\r\n");
+} ENDCASE
+
+STARTCASE(Test_DefaultBuffer) {
+    FtpReply reply;
+    reply.Reply(FtpReplyCodes::RC_OK) << "Hello " << 42;
+    EXPECT(reply.GetReply().second == "Hello 42");
+} ENDCASE
+
+STARTCASE(Test_NoAllocations) {
+    ReplyPath path;
+    const string cwd = "/pub/releases/2024/some/deep/directory/for/testing";
+
+    const auto noop = [](FtpReply& reply) {
+        reply.Reply(FtpReplyCodes::RC_OK);
+    };
+    const auto pwd = [&cwd](FtpReply& reply) {
+        reply.Reply(FtpReplyCodes::RC_PATHNAME_CREATED) << cwd;
+    };
+    const auto type = [](FtpReply& reply) {
+        reply.Reply(FtpReplyCodes::RC_OK) << FtpState::Type::BIN << " type OK";
+    };
+    const auto size = [](FtpReply& reply) {
+        reply.Reply(FtpReplyCodes::RC_FILE_STATUS) << uint64_t{1234567890123};
+    };
+
+    EXPECT(path.Run(noop) == "200 Command okay.\r\n");
+    EXPECT(path.Run(pwd) == "257 " + cwd + "\r\n");
+    EXPECT(path.Run(type) == "200 Binary type OK\r\n");
+    EXPECT(path.Run(size) == "213 1234567890123\r\n");
+
+    EXPECT(path.CountAllocations(noop) == 0);
+    EXPECT(path.CountAllocations(pwd) == 0);
+    EXPECT(path.CountAllocations(type) == 0);
+    EXPECT(path.CountAllocations(size) == 0);
+
+    // Make sure that we would notice
+    EXPECT(path.CountAllocations([](FtpReply& reply) {
+        reply.Reply(FtpReplyCodes::RC_OK) << string(1000, 'x');
+    }) > 0);
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_FtpReply.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
@@ -0,0 +1,204 @@
+#include "war_tests.h"
+#include <future>
+#include <fstream>
+#include <wfde/wfde.h>
+#include "../src/wfde/WfdeHashEngine.h"
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+namespace {
+
+const boost::filesystem::path test_dir{"Test_HashEngine.dir"};
+
+boost::filesystem::path Save(const string& name, const string& data)
+{
+    boost::filesystem::create_directories(test_dir);
+    const auto path = test_dir / name;
+    std::ofstream out(path.string(), ios::binary | ios::trunc);
+    out << data;
+    return path;
+}
+
+string Hash(HashEngine& engine, const boost::filesystem::path& path,
+            HashEngine::Algorithm algorithm,
+            uint64_t from = 0, uint64_t to = 0)
+{
+    promise<string> result;
+    engine.Hash(path, algorithm, from, to,
+                [&result](const string& digest, exception_ptr err) {
+        if (err) {
+            result.set_exception(err);
+        } else {
+            result.set_value(digest);
+        }
+    });
+
+    return result.get_future().get();
+}
+
+} // anonymous namespace
+
+const lest::test specification[] = {
+
+STARTCASE(Test_Digests) {
+    const auto path = Save("abc", "abc");
+    WfdeHashEngine engine{TransferOptions{}};
+
+    EXPECT(Hash(engine, path, HashEngine::Algorithm::MD5)
+        == "900150983cd24fb0d6963f7d28e17f72");
+    EXPECT(Hash(engine, path, HashEngine::Algorithm::SHA1)
+        == "a9993e364706816aba3e25717850c26c9cd0d89d");
+    EXPECT(Hash(engine, path, HashEngine::Algorithm::SHA256)
+        == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+#ifdef WFDE_WITH_ZLIB
+    const auto digits = Save("digits", "123456789");
+    EXPECT(Hash(engine, digits, HashEngine::Algorithm::CRC32) == "cbf43926");
+#endif
+} ENDCASE
+
+STARTCASE(Test_Range) {
+    const auto path = Save("range", "xxabcyy");
+    WfdeHashEngine engine{TransferOptions{}};
+
+    EXPECT(Hash(engine, path, HashEngine::Algorithm::SHA256, 2, 5)
+        == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    EXPECT_THROWS_AS(Hash(engine, path, HashEngine::Algorithm::SHA256, 8, 0),
+                     ExceptionOutOfRange);
+    EXPECT_THROWS(Hash(engine, test_dir / "missing",
+                       HashEngine::Algorithm::SHA256));
+} ENDCASE
+
+#ifdef WFDE_WITH_ZLIB
+STARTCASE(Test_ParallelCrc) {
+    string data;
+    for(int i = 0; data.size() < 1024 * 1024; ++i) {
+        data += "Line " + to_string(i) + "\n";
+    }
+    const auto path = Save("big", data);
+
+    TransferOptions opts;
+    opts.hash_threads = 1;
+    WfdeHashEngine single{opts};
+    const auto expected = Hash(single, path, HashEngine::Algorithm::CRC32);
+
+    opts.hash_threads = 4;
+    opts.hash_chunk_size = 1024 * 100 + 7;
+    WfdeHashEngine parallel{opts};
+    EXPECT(Hash(parallel, path, HashEngine::Algorithm::CRC32) == expected);
+    EXPECT(Hash(parallel, path, HashEngine::Algorithm::CRC32, 1000, 900000)
+        == Hash(single, path, HashEngine::Algorithm::CRC32, 1000, 900000));
+} ENDCASE
+#endif
+
+STARTCASE(Test_Cache) {
+    boost::filesystem::remove_all(test_dir / "cache");
+    const auto path = Save("cached", "abc");
+    const auto sha256 =
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"s;
+
+    TransferOptions opts;
+    opts.hash_cache_dir = test_dir / "cache";
+
+    FileId id;
+    EXPECT(FileId::Get(path, id));
+
+    {
+        WfdeHashEngine engine{opts};
+        EXPECT(engine.GetCachedDigest(id, HashEngine::Algorithm::SHA256).empty());
+        EXPECT(Hash(engine, path, HashEngine::Algorithm::SHA256) == sha256);
+        EXPECT(engine.GetCachedDigest(id, HashEngine::Algorithm::SHA256) == sha256);
+
+        // Ranges are not cached
+        Hash(engine, path, HashEngine::Algorithm::MD5, 1, 2);
+        EXPECT(engine.GetCachedDigest(id, HashEngine::Algorithm::MD5).empty());
+
+        // Like an upload
+        engine.AddDigest(path, id, HashEngine::Algorithm::SHA1, "1234");
+        EXPECT(Hash(engine, path, HashEngine::Algorithm::SHA1) == "1234");
+    }
+
+    {
+        // After a restart
+        WfdeHashEngine engine{opts};
+        EXPECT(engine.GetCachedDigest(id, HashEngine::Algorithm::SHA256) == sha256);
+        EXPECT(engine.GetCachedDigest(id, HashEngine::Algorithm::SHA1) == "1234");
+    }
+
+    // Changed outside the server
+    Save("cached", "abcd");
+    FileId changed;
+    EXPECT(FileId::Get(path, changed));
+    EXPECT(!(changed == id));
+
+    {
+        WfdeHashEngine engine{opts};
+        EXPECT(engine.GetCachedDigest(id, HashEngine::Algorithm::SHA256).empty());
+        EXPECT(engine.GetCachedDigest(changed, HashEngine::Algorithm::SHA256).empty());
+        EXPECT(Hash(engine, path, HashEngine::Algorithm::SHA256)
+            == "88d4266fd4e6338d13b845fcf289579d209c897823b9217da3e161936f031589");
+    }
+} ENDCASE
+
+STARTCASE(Test_CacheLimit) {
+    boost::filesystem::remove_all(test_dir / "cache");
+
+    TransferOptions opts;
+    opts.hash_cache_dir = test_dir / "cache";
+    opts.hash_cache_size = 4;
+
+    WfdeHashEngine engine{opts};
+    vector<FileId> ids;
+    for(int i = 0; i < 8; ++i) {
+        const auto path = Save("file"s + to_string(i), to_string(i));
+        ids.emplace_back();
+        FileId::Get(path, ids.back());
+        engine.AddDigest(path, ids.back(), HashEngine::Algorithm::MD5, "x");
+    }
+
+    EXPECT(engine.GetCachedDigest(ids.front(), HashEngine::Algorithm::MD5).empty());
+    EXPECT(engine.GetCachedDigest(ids.back(), HashEngine::Algorithm::MD5) == "x");
+} ENDCASE
+
+STARTCASE(Test_CancelOnShutdown) {
+    const auto path = Save("abc", "abc");
+
+    // Without workers, the requests stay in the queue
+    TransferOptions opts;
+    opts.hash_threads = 0;
+
+    auto engine = make_unique<WfdeHashEngine>(opts);
+    promise<string> result;
+    engine->Hash(path, HashEngine::Algorithm::MD5, 0, 0,
+                 [&result](const string& digest, exception_ptr err) {
+        if (err) {
+            result.set_exception(err);
+        } else {
+            result.set_value(digest);
+        }
+    });
+
+    auto future = result.get_future();
+    engine.reset();
+    EXPECT(future.wait_for(chrono::seconds(0)) == future_status::ready);
+    EXPECT_THROWS_AS(future.get(), HashEngine::ExceptionCancelled);
+} ENDCASE
+
+STARTCASE(Test_Names) {
+    EXPECT(HashEngine::GetName(HashEngine::Algorithm::SHA256) == "SHA-256");
+    EXPECT(HashEngine::GetAlgorithm("sha-512") == HashEngine::Algorithm::SHA512);
+    EXPECT_THROWS_AS(HashEngine::GetAlgorithm("SHA-3"), ExceptionNotFound);
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_HashEngine.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
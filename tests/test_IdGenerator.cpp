@@ -0,0 +1,72 @@
+#include "war_tests.h"
+#include <set>
+#include <thread>
+#include <wfde/wfde.h>
+#include "../src/wfde/WfdeIdGenerator.h"
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+const lest::test specification[] = {
+
+STARTCASE(Test_Increasing) {
+    auto prev = WfdeIdGenerator::Next();
+    EXPECT(prev != 0u);
+    for(int i = 0; i < 5000; ++i) {
+        const auto id = WfdeIdGenerator::Next();
+        EXPECT(id > prev);
+        prev = id;
+    }
+} ENDCASE
+
+STARTCASE(Test_UniqueAcrossThreads) {
+    vector<vector<WfdeIdGenerator::id_t>> ids(4);
+    vector<thread> threads;
+    for(auto& list : ids) {
+        threads.emplace_back([&list] {
+            for(int i = 0; i < 5000; ++i) {
+                list.push_back(WfdeIdGenerator::Next());
+            }
+        });
+    }
+    for(auto& t : threads) {
+        t.join();
+    }
+
+    set<WfdeIdGenerator::id_t> all;
+    for(const auto& list : ids) {
+        all.insert(list.begin(), list.end());
+    }
+    EXPECT(all.size() == 4u * 5000u);
+} ENDCASE
+
+STARTCASE(Test_Uuid) {
+    const auto a = WfdeIdGenerator::NextUuid();
+    const auto b = WfdeIdGenerator::NextUuid();
+    EXPECT(a != b);
+    EXPECT(a.version() == boost::uuids::uuid::version_random_number_based);
+
+    // Same salt for the whole process
+    EXPECT(equal(a.begin(), a.begin() + 6, b.begin()));
+    EXPECT(WfdeIdGenerator::ToUuid(42) == WfdeIdGenerator::ToUuid(42));
+} ENDCASE
+
+STARTCASE(Test_LazyName) {
+    const WfdeLazyName a, b;
+    EXPECT(a.Get().size() == 36u);
+    EXPECT(&a.Get() == &a.Get());
+    EXPECT(a.Get() != b.Get());
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_IdGenerator.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
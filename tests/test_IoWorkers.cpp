@@ -0,0 +1,74 @@
+#include "war_tests.h"
+#include <atomic>
+#include <future>
+#include <wfde/wfde.h>
+#include "../src/wfde/WfdeIoWorkers.h"
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+const lest::test specification[] = {
+
+STARTCASE(Test_Post) {
+    WfdeIoWorkers workers{2};
+
+    atomic_int count{0};
+    promise<void> done;
+    for(int i = 0; i < 10; ++i) {
+        workers.Post([&](bool cancelled) {
+            if (!cancelled && (++count == 10)) {
+                done.set_value();
+            }
+        });
+    }
+
+    done.get_future().wait();
+    EXPECT(count == 10);
+} ENDCASE
+
+STARTCASE(Test_CancelQueued) {
+    promise<void> release;
+    auto blocker = release.get_future().share();
+    promise<void> started;
+    atomic_int cancelled{0};
+    thread releaser;
+
+    {
+        WfdeIoWorkers workers{1};
+        workers.Post([&](bool) {
+            started.set_value();
+            blocker.wait();
+        });
+        started.get_future().wait();
+
+        for(int i = 0; i < 3; ++i) {
+            workers.Post([&](bool c) {
+                if (c) {
+                    ++cancelled;
+                }
+            });
+        }
+
+        // Let the workers start shutting down while the thread is busy
+        releaser = thread([&] {
+            this_thread::sleep_for(chrono::milliseconds(100));
+            release.set_value();
+        });
+    }
+
+    releaser.join();
+    EXPECT(cancelled == 3);
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_IoWorkers.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
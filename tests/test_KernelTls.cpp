@@ -0,0 +1,257 @@
+#include "war_tests.h"
+#include <wfde/wfde.h>
+#include "../src/wfde/WfdeTlsContext.h"
+#include "../src/wfde/WfdeKernelTls.h"
+
+#include <netinet/in.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+namespace {
+
+/*! A connected pair of TCP sockets on the loopback interface */
+struct TcpPair
+{
+    TcpPair() {
+        const auto listener = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        ::bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+        ::listen(listener, 1);
+        ::getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &len);
+
+        client = ::socket(AF_INET, SOCK_STREAM, 0);
+        ::connect(client, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+        server = ::accept(listener, nullptr, nullptr);
+        ::close(listener);
+    }
+
+    ~TcpPair() {
+        ::close(client);
+        ::close(server);
+    }
+
+    int client = -1;
+    int server = -1;
+};
+
+
+/*! A client and a server connection, with the handshake done in
+ * memory, like the asio stream does it.
+ */
+struct Connection
+{
+    Connection(int version, const char *ciphers) {
+        server_ctx = contexts.Get(WFDE_TEST_CERT);
+        client_ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_min_proto_version(client_ctx, version);
+        SSL_CTX_set_max_proto_version(client_ctx, version);
+        if (version == TLS1_3_VERSION) {
+            SSL_CTX_set_ciphersuites(client_ctx, ciphers);
+        } else {
+            SSL_CTX_set_cipher_list(client_ctx, ciphers);
+        }
+
+        client = SSL_new(client_ctx);
+        server = SSL_new(server_ctx->native_handle());
+        ktls = make_unique<WfdeKernelTls>(server);
+
+        to_server = BIO_new(BIO_s_mem());
+        to_client = BIO_new(BIO_s_mem());
+        BIO_up_ref(to_server);
+        BIO_up_ref(to_client);
+        SSL_set_bio(client, to_client, to_server);
+        SSL_set_bio(server, to_server, to_client);
+        SSL_set_connect_state(client);
+        SSL_set_accept_state(server);
+
+        bool client_done = false, server_done = false;
+        for(int i = 0; (i < 100) && !(client_done && server_done); ++i) {
+            client_done = client_done || (SSL_do_handshake(client) == 1);
+            server_done = server_done || (SSL_do_handshake(server) == 1);
+        }
+        connected = client_done && server_done;
+    }
+
+    ~Connection() {
+        ktls.reset();
+        SSL_free(client);
+        SSL_free(server);
+        SSL_CTX_free(client_ctx);
+    }
+
+    /*! Let the client decrypt what's sent to it */
+    string Receive(const void *data, size_t len) {
+        BIO_write(to_client, data, static_cast<int>(len));
+        char buffer[1024] = {};
+        const auto got = SSL_read(client, buffer, sizeof(buffer));
+        return (got > 0) ? string(buffer, static_cast<size_t>(got)) : string();
+    }
+
+    WfdeTlsContextCache contexts;
+    WfdeTlsContextCache::context_ptr_t server_ctx;
+    SSL_CTX *client_ctx = nullptr;
+    SSL *client = nullptr;
+    SSL *server = nullptr;
+    BIO *to_server = nullptr;
+    BIO *to_client = nullptr;
+    unique_ptr<WfdeKernelTls> ktls;
+    bool connected = false;
+};
+
+/*! Encrypt a record like the kernel will, with the keys we derived */
+string Seal(const WfdeKernelTls::SendKeys& keys, const string& text)
+{
+    const bool tls13 = (keys.version == TLS_1_3_VERSION);
+    const bool explicit_nonce = !tls13
+        && (keys.cipher_type != TLS_CIPHER_CHACHA20_POLY1305);
+
+    // The 12 byte nonce is XOR'ed with the sequence number, except
+    // with the explicit nonce in TLS 1.2 AES-GCM.
+    vector<unsigned char> nonce(keys.salt);
+    nonce.insert(nonce.end(), keys.iv.begin(), keys.iv.end());
+    if (!explicit_nonce) {
+        for(int i = 0; i < 8; ++i) {
+            nonce[11 - i] ^= static_cast<unsigned char>(keys.seq >> (i * 8));
+        }
+    }
+
+    string plain = text;
+    if (tls13) {
+        plain += '\x17'; // Inner content type
+    }
+
+    const size_t body_len = (explicit_nonce ? 8 : 0) + plain.size() + 16;
+    const unsigned char header[] = {0x17, 0x03, 0x03,
+        static_cast<unsigned char>(body_len >> 8),
+        static_cast<unsigned char>(body_len)};
+
+    vector<unsigned char> aad;
+    if (tls13) {
+        aad.assign(header, header + sizeof(header));
+    } else {
+        for(int i = 7; i >= 0; --i) {
+            aad.push_back(static_cast<unsigned char>(keys.seq >> (i * 8)));
+        }
+        aad.insert(aad.end(), {0x17, 0x03, 0x03,
+            static_cast<unsigned char>(plain.size() >> 8),
+            static_cast<unsigned char>(plain.size())});
+    }
+
+    const auto cipher = (keys.cipher_type == TLS_CIPHER_AES_GCM_128)
+        ? EVP_aes_128_gcm()
+        : (keys.cipher_type == TLS_CIPHER_AES_GCM_256)
+            ? EVP_aes_256_gcm() : EVP_chacha20_poly1305();
+
+    string record(reinterpret_cast<const char *>(header), sizeof(header));
+    if (explicit_nonce) {
+        record.append(reinterpret_cast<const char *>(keys.iv.data()), 8);
+    }
+
+    vector<unsigned char> out(plain.size() + 16);
+    int len = 0;
+    auto ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, cipher, nullptr, keys.key.data(), nonce.data());
+    EVP_EncryptUpdate(ctx, nullptr, &len, aad.data(),
+                      static_cast<int>(aad.size()));
+    EVP_EncryptUpdate(ctx, out.data(), &len,
+                      reinterpret_cast<const unsigned char *>(plain.data()),
+                      static_cast<int>(plain.size()));
+    EVP_EncryptFinal_ex(ctx, out.data() + len, &len);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, 16,
+                        out.data() + plain.size());
+    EVP_CIPHER_CTX_free(ctx);
+
+    record.append(reinterpret_cast<const char *>(out.data()), out.size());
+    return record;
+}
+
+/*! Check that the client can decrypt what we encrypt with the keys */
+void CheckKeys(int version, const char *ciphers)
+{
+    Connection conn(version, ciphers);
+    EXPECT(conn.connected);
+
+    WfdeKernelTls::SendKeys keys;
+    EXPECT(conn.ktls->GetSendKeys(keys));
+
+    const auto record = Seal(keys, "Hello from the kernel");
+    EXPECT(conn.Receive(record.data(), record.size())
+        == "Hello from the kernel");
+}
+
+/*! Let the kernel encrypt a message on a real socket */
+void CheckKernel(int version, const char *ciphers)
+{
+    Connection conn(version, ciphers);
+    TcpPair tcp;
+    if (!conn.ktls->EnableSend(tcp.server)) {
+        cerr << "kTLS is not available here. Skipping " << ciphers << endl;
+        return;
+    }
+
+    const string message = "Hello from the kernel";
+    EXPECT(::write(tcp.server, message.data(), message.size())
+        == static_cast<ssize_t>(message.size()));
+
+    string received;
+    char buffer[1024];
+    for(int i = 0; (i < 10) && received.empty(); ++i) {
+        const auto len = ::read(tcp.client, buffer, sizeof(buffer));
+        if (len <= 0) {
+            break;
+        }
+        received = conn.Receive(buffer, static_cast<size_t>(len));
+    }
+
+    EXPECT(received == message);
+}
+
+} // anonymous namespace
+
+const lest::test specification[] = {
+
+STARTCASE(Test_Tls13Keys) {
+    CheckKeys(TLS1_3_VERSION, "TLS_AES_128_GCM_SHA256");
+    CheckKeys(TLS1_3_VERSION, "TLS_AES_256_GCM_SHA384");
+    CheckKeys(TLS1_3_VERSION, "TLS_CHACHA20_POLY1305_SHA256");
+} ENDCASE
+
+STARTCASE(Test_Tls12Keys) {
+    CheckKeys(TLS1_2_VERSION, "ECDHE-RSA-AES128-GCM-SHA256");
+    CheckKeys(TLS1_2_VERSION, "ECDHE-RSA-AES256-GCM-SHA384");
+    CheckKeys(TLS1_2_VERSION, "ECDHE-RSA-CHACHA20-POLY1305");
+} ENDCASE
+
+STARTCASE(Test_UnsupportedCipher) {
+    Connection conn(TLS1_2_VERSION, "ECDHE-RSA-AES128-SHA256");
+    EXPECT(conn.connected);
+
+    WfdeKernelTls::SendKeys keys;
+    EXPECT(!conn.ktls->GetSendKeys(keys));
+
+    TcpPair tcp;
+    EXPECT(!conn.ktls->EnableSend(tcp.server));
+} ENDCASE
+
+STARTCASE(Test_Kernel) {
+    CheckKernel(TLS1_3_VERSION, "TLS_AES_128_GCM_SHA256");
+    CheckKernel(TLS1_2_VERSION, "ECDHE-RSA-AES256-GCM-SHA384");
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_KernelTls.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
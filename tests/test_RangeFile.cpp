@@ -0,0 +1,94 @@
+#include "war_tests.h"
+#include <fstream>
+#include <wfde/wfde.h>
+#include "../src/wfde/WfdeRangeFile.h"
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+namespace {
+
+const string file_name = "Test_RangeFile.data";
+
+string MakeData(size_t len)
+{
+    string data;
+    for(size_t i = 0; data.size() < len; ++i) {
+        data += to_string(i) + ' ';
+    }
+    data.resize(len);
+    return data;
+}
+
+void Save(const string& data)
+{
+    std::ofstream out(file_name, ios::binary | ios::trunc);
+    out << data;
+}
+
+// Read [from, to) like a RANG download does
+string Download(File::fpos_t from, File::fpos_t to, size_t chunk,
+                TransferOptions::Backend backend = TransferOptions::Backend::MMAP)
+{
+    TransferOptions opts;
+    opts.backend = backend;
+    auto file = CreateDiskFile(file_name, File::FileOperation::READ, opts);
+    file->Seek(from);
+    WfdeRangeFile range(move(file), to);
+
+    string data;
+    while(!range.IsEof()) {
+        const auto b = range.Read(chunk);
+        data.append(static_cast<const char *>(b.data()),
+                    boost::asio::buffer_size(b));
+    }
+    range.Close();
+    return data;
+}
+
+} // anonymous namespace
+
+const lest::test specification[] = {
+
+STARTCASE(Test_Ranges) {
+    const auto data = MakeData(1024 * 1024 + 17);
+    Save(data);
+
+    EXPECT(Download(0, data.size(), 0) == data);
+    EXPECT(Download(0, 1, 0) == data.substr(0, 1));
+    EXPECT(Download(100, 200, 0) == data.substr(100, 100));
+    EXPECT(Download(1000, 500000, 4096) == data.substr(1000, 499000));
+    EXPECT(Download(1000, 500000, 0, TransferOptions::Backend::PREAD)
+        == data.substr(1000, 499000));
+
+    // The end may be beyond EOF
+    EXPECT(Download(data.size() - 10, data.size() + 1000, 0)
+        == data.substr(data.size() - 10));
+} ENDCASE
+
+STARTCASE(Test_Size) {
+    const auto data = MakeData(1000);
+    Save(data);
+
+    const TransferOptions opts;
+    WfdeRangeFile range(CreateDiskFile(file_name, File::FileOperation::READ,
+                                       opts), 200);
+    EXPECT(range.GetSize() == 200);
+    EXPECT(range.GetNativeHandle() >= 0);
+    range.Seek(200);
+    EXPECT(range.IsEof());
+    EXPECT_THROWS_AS(range.Seek(201), WfdeRangeFile::ExceptionSeekBeoindEof);
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_RangeFile.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
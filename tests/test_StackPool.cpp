@@ -0,0 +1,155 @@
+#include "war_tests.h"
+#include <thread>
+#include <cstring>
+#include <csignal>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <boost/context/fiber.hpp>
+#include <wfde/wfde.h>
+#include "../src/wfde/WfdeStackPool.h"
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+const lest::test specification[] = {
+
+STARTCASE(Test_Reuse) {
+    WfdeStackPool pool(1024 * 32, 4);
+    EXPECT(pool.GetStackSize() == 1024u * 32u);
+
+    auto a = pool.Allocate();
+    auto b = pool.Allocate();
+    EXPECT(a.size == pool.GetStackSize());
+    EXPECT(a.sp != b.sp);
+    EXPECT(pool.GetNumInUse() == 2u);
+    EXPECT(pool.GetNumFree() == 2u);
+
+    // The whole stack is ours
+    memset(static_cast<char *>(a.sp) - a.size, 0xaa, a.size);
+
+    const auto sp = a.sp;
+    pool.Deallocate(a);
+    EXPECT(pool.GetNumInUse() == 1u);
+    EXPECT(pool.Allocate().sp == sp);
+
+    // A new slab when the first is used up
+    pool.Allocate();
+    pool.Allocate();
+    EXPECT(pool.GetNumFree() == 0u);
+    pool.Allocate();
+    EXPECT(pool.GetNumInUse() == 5u);
+    EXPECT(pool.GetNumFree() == 3u);
+} ENDCASE
+
+STARTCASE(Test_Sizes) {
+    EXPECT(WfdeStackPool(1).GetStackSize() == WfdeStackPool::min_stack_size);
+    EXPECT((WfdeStackPool(1024 * 20).GetStackSize() % 4096) == 0u);
+    EXPECT(&WfdeStackPool::Get(1024 * 64) == &WfdeStackPool::Get(1024 * 64));
+    EXPECT(&WfdeStackPool::Get(1024 * 64) != &WfdeStackPool::Get(1024 * 32));
+} ENDCASE
+
+STARTCASE(Test_GuardPage) {
+    WfdeStackPool pool(1024 * 32, 4);
+    auto sc = pool.Allocate();
+    auto bottom = static_cast<char *>(sc.sp) - sc.size;
+
+    const auto pid = fork();
+    if (pid == 0) {
+        bottom[0] = 1; // Fine
+        bottom[-1] = 1; // Overflow into the guard page
+        _exit(0);
+    }
+
+    int status = 0;
+    EXPECT(waitpid(pid, &status, 0) == pid);
+    EXPECT(WIFSIGNALED(status));
+    EXPECT(WTERMSIG(status) == SIGSEGV);
+    pool.Deallocate(sc);
+} ENDCASE
+
+STARTCASE(Test_ReleasePages) {
+    WfdeStackPool pool(1024 * 32, 4, 1);
+    const auto page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+
+    auto is_resident = [&](const boost::context::stack_context& sc) {
+        unsigned char vec = 0;
+        if (::mincore(static_cast<char *>(sc.sp) - page_size,
+                      page_size, &vec) != 0) {
+            throw runtime_error("mincore() failed");
+        }
+        return (vec & 1) != 0;
+    };
+
+    auto a = pool.Allocate();
+    auto b = pool.Allocate();
+    auto c = pool.Allocate();
+    for(auto sc : {a, b, c}) {
+        memset(static_cast<char *>(sc.sp) - sc.size, 0xaa, sc.size);
+        EXPECT(is_resident(sc));
+    }
+
+    // The first stack is kept, the next ones go back to the kernel
+    pool.Deallocate(a);
+    pool.Deallocate(b);
+    pool.Deallocate(c);
+    EXPECT(is_resident(a));
+    EXPECT(!is_resident(b));
+    EXPECT(!is_resident(c));
+    EXPECT(pool.GetNumFree() == 4u);
+    EXPECT(pool.GetNumInUse() == 0u);
+
+    // The kept stack is reused first, and it's data is intact
+    auto d = pool.Allocate();
+    EXPECT(d.sp == a.sp);
+    EXPECT(static_cast<unsigned char *>(d.sp)[-1] == 0xaa);
+
+    // The released ones are zero-filled when they are reused
+    pool.Allocate();
+    pool.Allocate();
+    auto e = pool.Allocate();
+    EXPECT(static_cast<unsigned char *>(e.sp)[-1] == 0);
+    EXPECT(pool.GetNumFree() == 0u);
+} ENDCASE
+
+STARTCASE(Test_Fibers) {
+    WfdeStackPool pool(1024 * 32);
+    int sum = 0;
+
+    // Like the coroutines, they end in another thread than they started
+    vector<boost::context::fiber> fibers;
+    for(int i = 0; i < 100; ++i) {
+        fibers.emplace_back(std::allocator_arg, pool.GetAllocator(),
+                            [&sum, i](boost::context::fiber&& caller) {
+            char buffer[1024 * 8];
+            memset(buffer, i, sizeof(buffer));
+            caller = std::move(caller).resume();
+            sum += buffer[sizeof(buffer) - 1];
+            return std::move(caller);
+        });
+        fibers.back() = std::move(fibers.back()).resume();
+    }
+    EXPECT(pool.GetNumInUse() == 100u);
+
+    thread([&] {
+        for(auto& fiber : fibers) {
+            fiber = std::move(fiber).resume();
+        }
+    }).join();
+
+    EXPECT(sum == 99 * 100 / 2);
+    EXPECT(pool.GetNumInUse() == 0u);
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_StackPool.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
@@ -0,0 +1,210 @@
+#include "war_tests.h"
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <wfde/wfde.h>
+#include "../src/wfde/WfdeTlsContext.h"
+#include "../src/wfde/WfdeTlsSessionCache.h"
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+namespace {
+
+const boost::filesystem::path test_dir{"Test_TlsContext.dir"};
+
+boost::filesystem::path Copy(const string& name)
+{
+    boost::filesystem::create_directories(test_dir);
+    const auto path = test_dir / name;
+    boost::filesystem::copy_file(WFDE_TEST_CERT, path,
+        boost::filesystem::copy_option::overwrite_if_exists);
+    return path;
+}
+
+// Make sure the file looks changed, even on file systems with coarse mtime
+void Touch(const boost::filesystem::path& path)
+{
+    boost::filesystem::last_write_time(path,
+        boost::filesystem::last_write_time(path) + 10);
+}
+
+/*! Run a handshake between a client and our server context in memory
+ *
+ * Returns true if the server resumed the session.
+ */
+bool Handshake(SSL_CTX *clientCtx, WfdeTlsContextCache::context_ptr_t& serverCtx,
+               WfdeTlsSessionCache& cache, int pipelineId,
+               SSL_SESSION *resume, SSL_SESSION **session = nullptr)
+{
+    auto client = SSL_new(clientCtx);
+    auto server = SSL_new(serverCtx->native_handle());
+    cache.Attach(server, pipelineId);
+    if (resume) {
+        SSL_set_session(client, resume);
+    }
+
+    auto to_server = BIO_new(BIO_s_mem());
+    auto to_client = BIO_new(BIO_s_mem());
+    BIO_up_ref(to_server);
+    BIO_up_ref(to_client);
+    SSL_set_bio(client, to_client, to_server);
+    SSL_set_bio(server, to_server, to_client);
+    SSL_set_connect_state(client);
+    SSL_set_accept_state(server);
+
+    bool client_done = false, server_done = false;
+    for(int i = 0; (i < 100) && !(client_done && server_done); ++i) {
+        client_done = client_done || (SSL_do_handshake(client) == 1);
+        server_done = server_done || (SSL_do_handshake(server) == 1);
+    }
+
+    // Let the client pick up the session ticket in TLS 1.3
+    char byte = 'x';
+    SSL_write(server, &byte, 1);
+    SSL_read(client, &byte, 1);
+
+    const bool reused = client_done && server_done
+        && (SSL_session_reused(server) == 1);
+    if (session) {
+        *session = SSL_get1_session(client);
+    }
+
+    // Without a shutdown, OpenSSL will not resume the session
+    SSL_shutdown(client);
+    SSL_shutdown(server);
+    SSL_free(client);
+    SSL_free(server);
+    return reused;
+}
+
+} // anonymous namespace
+
+const lest::test specification[] = {
+
+STARTCASE(Test_Shared) {
+    const auto path = Copy("shared.pem");
+    WfdeTlsContextCache cache;
+
+    const auto first = cache.Get(path);
+    EXPECT(first);
+    EXPECT(cache.Get(path) == first);
+
+    // Not checked before the interval expires
+    Touch(path);
+    EXPECT(cache.Get(path) == first);
+} ENDCASE
+
+STARTCASE(Test_Reload) {
+    const auto path = Copy("reload.pem");
+    WfdeTlsContextCache cache{chrono::seconds(0)};
+
+    const auto first = cache.Get(path);
+    EXPECT(cache.Get(path) == first);
+
+    Copy("reload.pem");
+    Touch(path);
+    const auto second = cache.Get(path);
+    EXPECT(second);
+    EXPECT(second != first);
+    EXPECT(cache.Get(path) == second);
+} ENDCASE
+
+STARTCASE(Test_BadReload) {
+    const auto path = Copy("bad.pem");
+    WfdeTlsContextCache cache{chrono::seconds(0)};
+
+    const auto first = cache.Get(path);
+    {
+        std::ofstream out(path.string(), ios::trunc);
+        out << "-----BEGIN CERTIFICATE-----\n";
+    }
+    Touch(path);
+    EXPECT(cache.Get(path) == first);
+
+    // Recovers when the file is fixed
+    Copy("bad.pem");
+    Touch(path);
+    const auto fixed = cache.Get(path);
+    EXPECT(fixed);
+    EXPECT(fixed != first);
+} ENDCASE
+
+STARTCASE(Test_Resume) {
+    const auto path = Copy("resume.pem");
+    WfdeTlsContextCache contexts;
+    WfdeTlsSessionCache cache{2};
+    auto server_ctx = contexts.Get(path);
+    auto client_ctx = SSL_CTX_new(TLS_client_method());
+
+    SSL_SESSION *session = nullptr;
+    EXPECT(!Handshake(client_ctx, server_ctx, cache, 0, nullptr, &session));
+    EXPECT(session);
+    EXPECT(cache.GetNumSessions() == 1);
+
+    // Like a data connection for the same control connection
+    EXPECT(Handshake(client_ctx, server_ctx, cache, 0, session));
+
+    // Another pipeline has it's own shard
+    EXPECT(!Handshake(client_ctx, server_ctx, cache, 1, session));
+
+    // Pushed out by newer sessions
+    for(int i = 0; i < 4; ++i) {
+        Handshake(client_ctx, server_ctx, cache, 0, nullptr);
+    }
+    EXPECT(cache.GetNumSessions() <= 4);
+    EXPECT(!Handshake(client_ctx, server_ctx, cache, 0, session));
+
+    SSL_SESSION_free(session);
+    SSL_CTX_free(client_ctx);
+} ENDCASE
+
+STARTCASE(Test_Expired) {
+    const auto path = Copy("expired.pem");
+    WfdeTlsContextCache contexts;
+    WfdeTlsSessionCache cache{2};
+    auto server_ctx = contexts.Get(path);
+    auto client_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_timeout(server_ctx->native_handle(), 1);
+
+    SSL_SESSION *expired = nullptr;
+    Handshake(client_ctx, server_ctx, cache, 0, nullptr, &expired);
+    EXPECT(cache.GetNumSessions() == 1);
+    this_thread::sleep_for(chrono::seconds(2));
+
+    // The expired session is dropped when it's asked for
+    EXPECT(!Handshake(client_ctx, server_ctx, cache, 0, expired));
+    EXPECT(cache.GetNumSessions() == 1);
+
+    // ... and does not count against the newer ones
+    SSL_CTX_set_timeout(server_ctx->native_handle(), 300);
+    SSL_SESSION *first = nullptr, *second = nullptr;
+    Handshake(client_ctx, server_ctx, cache, 0, nullptr, &first);
+    Handshake(client_ctx, server_ctx, cache, 0, nullptr, &second);
+    EXPECT(cache.GetNumSessions() == 2);
+    EXPECT(Handshake(client_ctx, server_ctx, cache, 0, first));
+    EXPECT(Handshake(client_ctx, server_ctx, cache, 0, second));
+
+    SSL_SESSION_free(expired);
+    SSL_SESSION_free(first);
+    SSL_SESSION_free(second);
+    SSL_CTX_free(client_ctx);
+} ENDCASE
+
+STARTCASE(Test_Missing) {
+    WfdeTlsContextCache cache;
+    EXPECT_THROWS(cache.Get(test_dir / "missing.pem"));
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_TlsContext.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
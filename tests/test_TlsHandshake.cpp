@@ -0,0 +1,186 @@
+#include "war_tests.h"
+#include <future>
+#include <boost/asio/ssl.hpp>
+#include <warlib/WarThreadpool.h>
+#include <wfde/wfde.h>
+#include "../src/wfde/WfdeTlsHandshake.h"
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+const lest::test specification[] = {
+
+STARTCASE(Test_Post) {
+    WfdeTlsHandshakePool pool{2, 16};
+
+    atomic_int count{0};
+    promise<void> done;
+    for(int i = 0; i < 10; ++i) {
+        EXPECT(pool.Post([&](bool) {
+            if (++count == 10) {
+                done.set_value();
+            }
+        }));
+    }
+
+    done.get_future().wait();
+    EXPECT(count == 10);
+    EXPECT(pool.GetNumRejected() == 0);
+} ENDCASE
+
+STARTCASE(Test_QueueLimit) {
+    WfdeTlsHandshakePool pool{1, 4};
+
+    // Block the only worker
+    promise<void> release;
+    auto blocker = release.get_future().share();
+    promise<void> started;
+    EXPECT(pool.Post([&](bool) {
+        started.set_value();
+        blocker.wait();
+    }));
+    started.get_future().wait();
+    EXPECT(!pool.IsSaturated());
+
+    EXPECT(pool.Post([blocker](bool) { blocker.wait(); }));
+    EXPECT(pool.IsSaturated());
+    EXPECT(pool.Post([blocker](bool) { blocker.wait(); }));
+    EXPECT(pool.Post([blocker](bool) { blocker.wait(); }));
+    EXPECT(pool.GetQueueDepth() == 4);
+
+    EXPECT(!pool.Post([](bool) {}));
+    EXPECT(pool.GetNumRejected() == 1);
+    EXPECT(pool.GetPeakQueueDepth() == 4);
+
+    release.set_value();
+    for(int i = 0; (i < 1000) && pool.GetQueueDepth(); ++i) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    EXPECT(pool.GetQueueDepth() == 0);
+    EXPECT(!pool.IsSaturated());
+    EXPECT(pool.Post([](bool) {}));
+} ENDCASE
+
+STARTCASE(Test_WhenReady) {
+    WfdeTlsHandshakePool pool{1, 4};
+
+    atomic_int calls{0};
+    pool.WhenReady([&] { ++calls; });
+    EXPECT(calls == 1);
+
+    promise<void> release;
+    auto blocker = release.get_future().share();
+    EXPECT(pool.Post([blocker](bool) { blocker.wait(); }));
+    EXPECT(pool.Post([blocker](bool) { blocker.wait(); }));
+    EXPECT(pool.IsSaturated());
+
+    promise<void> ready;
+    pool.WhenReady([&] { ++calls; ready.set_value(); });
+    EXPECT(calls == 1);
+
+    release.set_value();
+    ready.get_future().wait();
+    EXPECT(calls == 2);
+} ENDCASE
+
+STARTCASE(Test_CancelQueued) {
+    promise<void> release;
+    auto blocker = release.get_future().share();
+    promise<void> started;
+    atomic_int cancelled{0};
+    thread releaser;
+
+    {
+        WfdeTlsHandshakePool pool{1, 8};
+        EXPECT(pool.Post([&](bool) {
+            started.set_value();
+            blocker.wait();
+        }));
+        started.get_future().wait();
+
+        for(int i = 0; i < 3; ++i) {
+            EXPECT(pool.Post([&](bool c) {
+                if (c) {
+                    ++cancelled;
+                }
+            }));
+        }
+
+        // Let the pool start shutting down while the worker is busy
+        releaser = thread([&] {
+            this_thread::sleep_for(chrono::milliseconds(100));
+            release.set_value();
+        });
+    }
+
+    releaser.join();
+    EXPECT(cancelled == 3);
+} ENDCASE
+
+STARTCASE(Test_Loopback) {
+    Threadpool tp{1};
+    auto& pipeline = tp.GetAnyPipeline();
+    auto& io = pipeline.GetIoService();
+
+    boost::asio::ssl::context server_ctx{boost::asio::ssl::context::tls_server};
+    server_ctx.use_certificate_chain_file(WFDE_TEST_CERT);
+    server_ctx.use_private_key_file(WFDE_TEST_CERT,
+                                    boost::asio::ssl::context::pem);
+
+    boost::asio::ip::tcp::acceptor acceptor{io,
+        {boost::asio::ip::address_v4::loopback(), 0}};
+    const auto endpoint = acceptor.local_endpoint();
+
+    // The server, with the handshake offloaded to the pool
+    promise<string> received;
+    boost::asio::spawn(io, [&](boost::asio::yield_context yield) {
+        try {
+            boost::asio::ip::tcp::socket socket{io};
+            acceptor.async_accept(socket, yield);
+
+            boost::asio::ssl::stream<boost::asio::ip::tcp::socket&>
+                stream{socket, server_ctx};
+            AsyncTlsServerHandshake(stream.native_handle(), socket,
+                                    pipeline, yield);
+
+            char data[5] = {};
+            boost::asio::async_read(stream, boost::asio::buffer(data), yield);
+            boost::asio::async_write(stream, boost::asio::buffer("pong", 4),
+                                     yield);
+            received.set_value({data, sizeof(data)});
+        } catch(...) {
+            received.set_exception(current_exception());
+        }
+    }, boost::asio::detached);
+
+    // A plain OpenSSL client, with blocking IO
+    boost::asio::io_context client_io;
+    boost::asio::ssl::context client_ctx{boost::asio::ssl::context::tls_client};
+    boost::asio::ssl::stream<boost::asio::ip::tcp::socket>
+        client{client_io, client_ctx};
+    client.next_layer().connect(endpoint);
+    client.handshake(boost::asio::ssl::stream_base::client);
+
+    boost::asio::write(client, boost::asio::buffer("hello", 5));
+    char reply[4] = {};
+    boost::asio::read(client, boost::asio::buffer(reply));
+
+    EXPECT(string(reply, sizeof(reply)) == "pong");
+    EXPECT(received.get_future().get() == "hello");
+
+    tp.Close();
+    tp.WaitUntilClosed();
+} ENDCASE
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_TlsHandshake.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
@@ -0,0 +1,226 @@
+#include "war_tests.h"
+#include <wfde/wfde.h>
+#include "../src/wfde/WfdeConfigurationPropertyTree.h"
+
+using namespace std;
+using namespace war;
+using namespace war::wfde;
+using namespace war::wfde::impl;
+
+const lest::test specification[] = {
+
+STARTCASE(Test_ParseSize) {
+    EXPECT(TransferOptions::ParseSize("0") == 0);
+    EXPECT(TransferOptions::ParseSize("4096") == 4096);
+    EXPECT(TransferOptions::ParseSize("4K") == 4096);
+    EXPECT(TransferOptions::ParseSize("4k") == 4096);
+    EXPECT(TransferOptions::ParseSize("2M") == 1024 * 1024 * 2);
+    EXPECT(TransferOptions::ParseSize("1G") == 1024 * 1024 * 1024);
+    EXPECT_THROWS_AS(TransferOptions::ParseSize(""), war::ExceptionParseError);
+    EXPECT_THROWS_AS(TransferOptions::ParseSize("K"), war::ExceptionParseError);
+    EXPECT_THROWS_AS(TransferOptions::ParseSize("4X"), war::ExceptionParseError);
+    EXPECT_THROWS_AS(TransferOptions::ParseSize("4KB"), war::ExceptionParseError);
+    EXPECT_THROWS_AS(TransferOptions::ParseSize("-1"), war::ExceptionParseError);
+    EXPECT_THROWS_AS(TransferOptions::ParseSize(" 1"), war::ExceptionParseError);
+    EXPECT(TransferOptions::ParseSize("18446744073709551615")
+        == numeric_limits<uint64_t>::max());
+    EXPECT_THROWS_AS(TransferOptions::ParseSize("18446744073709551616"),
+                     war::ExceptionParseError);
+    EXPECT(TransferOptions::ParseSize("17179869183G") == 17179869183ULL << 30);
+    EXPECT_THROWS_AS(TransferOptions::ParseSize("17179869184G"),
+                     war::ExceptionParseError);
+} ENDCASE
+
+STARTCASE(Test_LoadDefaults) {
+    const auto df_name = "Test_TransferOptions.data001";
+    {
+        std::ofstream data(df_name);
+        data << "Name test\n";
+    }
+
+    auto conf = WfdeConfigurationPropertyTree::CreateInstance(df_name);
+    const auto opts = TransferOptions::Load(*conf);
+    EXPECT(opts.zero_copy_send == true);
+    EXPECT(opts.zero_copy_receive == true);
+    EXPECT(opts.zero_copy_chunk_size == 1024 * 1024 * 4);
+    EXPECT(opts.kernel_tls == true);
+    EXPECT(opts.min_window == 1024 * 256);
+    EXPECT(opts.max_window == 1024 * 1024 * 8);
+    EXPECT(opts.read_ahead_windows == 2);
+    EXPECT(opts.shared_cache == true);
+    EXPECT(opts.write_back_window == 1024 * 1024 * 8);
+    EXPECT(opts.sync_before_reply == false);
+    EXPECT(opts.compressed_cache_dir.empty());
+    EXPECT(opts.compressed_min_requests == 2);
+    EXPECT(opts.UseCompressedVariant("/var/ftp/file.txt", 1024 * 1024) == false);
+} ENDCASE
+
+STARTCASE(Test_LoadOptions) {
+    const auto df_name = "Test_TransferOptions.data002";
+    {
+        std::ofstream data(df_name);
+        data << "Transfer {\n"
+             << "  ZeroCopySend 0\n"
+             << "  ZeroCopyReceive 0\n"
+             << "  ZeroCopyChunkSize 256K\n"
+             << "  KernelTls 0\n"
+             << "  MinWindow 64K\n"
+             << "  MaxWindow 1M\n"
+             << "  ReadAheadWindows 0\n"
+             << "  SharedCache 0\n"
+             << "  WriteBackWindow 0\n"
+             << "  SyncBeforeReply 1\n"
+             << "}\n";
+    }
+
+    auto conf = WfdeConfigurationPropertyTree::CreateInstance(df_name);
+    const auto opts = TransferOptions::Load(*conf);
+    EXPECT(opts.zero_copy_send == false);
+    EXPECT(opts.zero_copy_receive == false);
+    EXPECT(opts.zero_copy_chunk_size == 1024 * 256);
+    EXPECT(opts.kernel_tls == false);
+    EXPECT(opts.min_window == 1024 * 64);
+    EXPECT(opts.max_window == 1024 * 1024);
+    EXPECT(opts.read_ahead_windows == 0);
+    EXPECT(opts.shared_cache == false);
+    EXPECT(opts.write_back_window == 0);
+    EXPECT(opts.sync_before_reply == true);
+} ENDCASE
+
+STARTCASE(Test_LoadBadWindow) {
+    const auto df_name = "Test_TransferOptions.data003";
+    {
+        std::ofstream data(df_name);
+        data << "Transfer {\n"
+             << "  MinWindow 8M\n"
+             << "  MaxWindow 1M\n"
+             << "}\n";
+    }
+
+    auto conf = WfdeConfigurationPropertyTree::CreateInstance(df_name);
+    EXPECT_THROWS_AS(TransferOptions::Load(*conf), war::ExceptionParseError);
+} ENDCASE
+
+STARTCASE(Test_LoadBadNumbers) {
+    const auto df_name = "Test_TransferOptions.data008";
+    for(const auto& line : {"HashThreads two"s, "HashThreads -1"s,
+                            "ReadAheadWindows 2K"s, "MinWindow -1"s,
+                            "HashCache {\n MaxEntries 1x\n }"s}) {
+        {
+            std::ofstream data(df_name);
+            data << "Transfer {\n" << line << "\n}\n";
+        }
+
+        auto conf = WfdeConfigurationPropertyTree::CreateInstance(df_name);
+        EXPECT_THROWS_AS(TransferOptions::Load(*conf), war::ExceptionParseError);
+    }
+} ENDCASE
+
+STARTCASE(Test_Backends) {
+    const auto df_name = "Test_TransferOptions.data004";
+    {
+        std::ofstream data(df_name);
+        data << "Transfer {\n"
+             << "  Backend pread\n"
+             << "  BufferSize 512K\n"
+             << "  BackendOverrides {\n"
+             << "    nfs {\n"
+             << "      Path /mnt/nfs\n"
+             << "      Backend mmap\n"
+             << "    }\n"
+             << "    archive {\n"
+             << "      Path /mnt/nfs/archive\n"
+             << "      Backend direct\n"
+             << "    }\n"
+             << "  }\n"
+             << "}\n";
+    }
+
+    auto conf = WfdeConfigurationPropertyTree::CreateInstance(df_name);
+    const auto opts = TransferOptions::Load(*conf);
+    using B = TransferOptions::Backend;
+    EXPECT(opts.buffer_size == 1024 * 512);
+    EXPECT(opts.backend_overrides.size() == 2);
+    EXPECT(opts.GetBackend("/var/ftp/file.txt") == B::PREAD);
+    EXPECT(opts.GetBackend("/mnt/nfs/file.txt") == B::MMAP);
+    EXPECT(opts.GetBackend("/mnt/nfsx/file.txt") == B::PREAD);
+    EXPECT(opts.GetBackend("/mnt/nfs/archive/file.txt") == B::DIRECT);
+
+    EXPECT_THROWS_AS(TransferOptions::ParseBackend("io_uring"), war::ExceptionParseError);
+    EXPECT_THROWS_AS(TransferOptions::ParseBackend("mmap2"), war::ExceptionParseError);
+} ENDCASE
+
+STARTCASE(Test_DropBehind) {
+    const auto df_name = "Test_TransferOptions.data005";
+    {
+        std::ofstream data(df_name);
+        data << "Transfer {\n"
+             << "  DropBehindThreshold 1G\n"
+             << "  DropBehindPaths {\n"
+             << "    isos {\n"
+             << "      Path /var/ftp/isos\n"
+             << "    }\n"
+             << "  }\n"
+             << "}\n";
+    }
+
+    auto conf = WfdeConfigurationPropertyTree::CreateInstance(df_name);
+    const auto opts = TransferOptions::Load(*conf);
+    EXPECT(opts.drop_behind_threshold == 1024 * 1024 * 1024);
+    EXPECT(opts.drop_behind_paths.size() == 1);
+    EXPECT(opts.UseDropBehind("/var/ftp/file.txt", 1024) == false);
+    EXPECT(opts.UseDropBehind("/var/ftp/file.iso", 1024 * 1024 * 1024) == true);
+    EXPECT(opts.UseDropBehind("/var/ftp/isos/file.iso", 1024) == true);
+    EXPECT(opts.UseDropBehind("/var/ftp/isos2/file.iso", 1024) == false);
+
+    const TransferOptions defaults;
+    EXPECT(defaults.UseDropBehind("/var/ftp/file.iso", 1024 * 1024 * 1024) == false);
+} ENDCASE
+
+#ifdef WFDE_WITH_HASH
+STARTCASE(Test_HashCache) {
+    const auto df_name = "Test_TransferOptions.data006";
+    {
+        std::ofstream data(df_name);
+        data << "Transfer {\n"
+             << "  HashCache {\n"
+             << "    Path /var/cache/wfde/digests\n"
+             << "    MaxEntries 1000\n"
+             << "    Upload \"SHA-256, md5\"\n"
+             << "  }\n"
+             << "}\n";
+    }
+
+    auto conf = WfdeConfigurationPropertyTree::CreateInstance(df_name);
+    const auto opts = TransferOptions::Load(*conf);
+    EXPECT(opts.hash_cache_dir == "/var/cache/wfde/digests");
+    EXPECT(opts.hash_cache_size == 1000);
+    EXPECT(opts.upload_hashes.size() == 2);
+    EXPECT(opts.upload_hashes.at(0) == "SHA-256");
+    EXPECT(opts.upload_hashes.at(1) == "md5");
+
+    const auto bad_name = "Test_TransferOptions.data007";
+    {
+        std::ofstream data(bad_name);
+        data << "Transfer {\n"
+             << "  HashCache {\n"
+             << "    Upload SHA-3\n"
+             << "  }\n"
+             << "}\n";
+    }
+
+    auto bad_conf = WfdeConfigurationPropertyTree::CreateInstance(bad_name);
+    EXPECT_THROWS_AS(TransferOptions::Load(*bad_conf), war::ExceptionParseError);
+} ENDCASE
+#endif
+
+}; //lest
+
+int main( int argc, char * argv[] )
+{
+    log::LogEngine log;
+    log.AddHandler(log::LogToFile::Create("Test_TransferOptions.log", true, "file",
+        log::LL_TRACE4, log::LA_DEFAULT_ENABLE | log::LA_THREADS) );
+
+    return lest::run( specification, argc, argv );
+}
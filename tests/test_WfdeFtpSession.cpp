@@ -80,6 +80,30 @@ STARTCASE(Test_WfdeFtpSessionInput)
     EXPECT_THROWS_AS(sesi.FetchNextCommand(),
                       war::wfde::impl::WfdeFtpSessionInput::NoInputException);
 } ENDCASE
+
+STARTCASE(Test_HaveBufferedCommand)
+{
+    TestWfdeFtpSessionInput sesi;
+
+    EXPECT(!sesi.HaveBufferedCommand());
+    EXPECT(string(sesi.FetchNextCommand()) == "SYST");
+    EXPECT(!sesi.HaveBufferedCommand());
+    sesi.FetchNextCommand(); // RETR
+    sesi.FetchNextCommand(); // NLST
+    EXPECT(string(sesi.FetchNextCommand()) == "TEST IT");
+    EXPECT(!sesi.HaveBufferedCommand());
+
+    // The client pipelined the rest of the commands
+    EXPECT(string(sesi.FetchNextCommand()) == "TEST1");
+    EXPECT(sesi.HaveBufferedCommand());
+    sesi.FetchNextCommand(); // TEST2
+    sesi.FetchNextCommand(); // TEST3
+    sesi.FetchNextCommand(); // test1
+    EXPECT(string(sesi.FetchNextCommand()) == "test2");
+    EXPECT(sesi.HaveBufferedCommand());
+    EXPECT(string(sesi.FetchNextCommand()) == "test3");
+    EXPECT(!sesi.HaveBufferedCommand());
+} ENDCASE
 }; //lest
 
 int main( int argc, char * argv[] )